@@ -0,0 +1,29 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Web UI assets embedded in the binary
+//
+// assets.c is generated from the web-ui directory by mkassets.py at build
+// time. Every asset is stored gzipped, so it can be sent as-is to any client
+// that accepts "Content-Encoding: gzip", and plain for any that doesn't.
+//
+
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stddef.h>
+
+struct asset {
+  const char *uri;    // e.g. "/js/javascript.js"
+  const char *mime;   // Content-Type
+  const char *etag;   // Strong ETag, quoted, derived from the content
+  const char *data;   // Gzipped content
+  size_t len;         // Length of data
+  const char *plainEtag;  // The same, for the uncompressed content
+  const char *plain;
+  size_t plainLen;
+};
+
+extern const struct asset assets[];
+extern const int num_assets;
+
+#endif
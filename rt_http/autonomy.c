@@ -0,0 +1,111 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Autonomy
+//
+
+#include <stddef.h>
+#include <math.h>
+#include "autonomy.h"
+
+#define STEER_TOLERANCE (15 * M_PI / 180)   // Heading error it'll drive with
+
+// Steps of the maneuver autonomy makes to avoid an obstacle. Those without
+// a fixed duration take it from the autonomy's parameters.
+struct maneuverStep {
+  char* command;
+  int msec;
+  size_t msecParameter;   // Offset of the parameter in struct autonomy, or 0
+};
+
+static const struct maneuverStep avoidManeuver[] = {
+  {"000000000", 500, 0},                                    // idle
+  {"010000000", 0, offsetof(struct autonomy, reverseMsec)}, // reverse
+  {"000000000", 500, 0},                                    // idle
+  {"000000010", 500, 0},                                    // fire
+  {"000100000", 0, offsetof(struct autonomy, turnMsec)},    // right
+  {"000000000", 0, offsetof(struct autonomy, pauseMsec)},   // idle, then recheck
+};
+#define AVOID_STEPS (int) (sizeof(avoidManeuver) / sizeof(avoidManeuver[0]))
+
+// Start a step of the avoid maneuver
+static char *start_step(struct autonomy *a, uint64_t now, int step) {
+  const struct maneuverStep *s = &avoidManeuver[step];
+  int msec = s->msecParameter ? *(const int *) ((const char *) a + s->msecParameter) : s->msec;
+  a->step = step;
+  a->stepEnd = now + (uint64_t) msec * 1000;
+  return s->command;
+}
+
+// Carry on with the avoid maneuver, or start it if there's an obstacle.
+// Returns 1 if that's what's happening.
+static int avoid(struct autonomy *a, uint64_t now, int range, char **command,
+                 enum autonomy_decision *decision) {
+  *command = NULL;
+  if (a->step >= 0) {
+    if (now < a->stepEnd) {
+      *decision = AUTONOMY_WAIT;
+      return 1;
+    }
+    if (a->step + 1 < AVOID_STEPS) {
+      *command = start_step(a, now, a->step + 1);
+      *decision = AUTONOMY_STEP;
+      return 1;
+    }
+    a->step = -1;
+  }
+
+  // Check for forward obstacles, ignoring errors
+  if (range < a->avoidRange && range > a->minRange) {
+    *command = start_step(a, now, 0);
+    *decision = AUTONOMY_AVOID;
+    return 1;
+  }
+  return 0;
+}
+
+enum autonomy_decision autonomy_step(struct autonomy *a, uint64_t now, int range, char **command) {
+  enum autonomy_decision decision;
+  if (avoid(a, now, range, command, &decision)) {
+    return decision;
+  }
+  *command = "100000000";
+  return AUTONOMY_FORWARD;
+}
+
+enum autonomy_decision autonomy_steer(struct autonomy *a, uint64_t now, int range,
+                                      double heading, double bearing, char **command) {
+  enum autonomy_decision decision;
+
+  // Only back off as a last resort, if something's been in the way a while
+  if (a->step >= 0 ||
+      (a->blockedSince != 0 && now - a->blockedSince >= (uint64_t) a->pauseMsec * 1000)) {
+    a->blockedSince = 0;
+    if (avoid(a, now, range, command, &decision)) {
+      return decision;
+    }
+  }
+
+  double error = remainder(bearing - heading, 2 * M_PI);
+  if (error > STEER_TOLERANCE) {
+    *command = "000100000";
+    return AUTONOMY_TURN;
+  }
+  if (error < -STEER_TOLERANCE) {
+    *command = "001000000";
+    return AUTONOMY_TURN;
+  }
+
+  // Something the path goes through, so wait for the map to catch up with it
+  // and the planner to find a way round. The SRF02's cone is wide, so at the
+  // avoid range it's often just something beside the path.
+  if (range < a->avoidRange / 2 && range > a->minRange) {
+    if (a->blockedSince == 0) {
+      a->blockedSince = now > 0 ? now : 1;
+    }
+    *command = "000000000";
+    return AUTONOMY_BLOCKED;
+  }
+  a->blockedSince = 0;
+  *command = "100000000";
+  return AUTONOMY_FORWARD;
+}
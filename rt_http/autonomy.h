@@ -0,0 +1,53 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Autonomy
+//
+// Drives forward until the rangefinder sees something close, then backs off,
+// shoots it and turns away. Given a goal, it steers along the planner's path
+// instead, stopping for anything in the way until the planner finds a way
+// round, and only backing off if it doesn't. This only makes decisions: it's
+// given the time and the latest range, and says what command to send, so the
+// same code can drive the real tank or a simulated one.
+//
+
+#ifndef AUTONOMY_H
+#define AUTONOMY_H
+
+#include <stdint.h>
+
+struct autonomy {
+  int avoidRange;       // Obstacles nearer than this (cm) are avoided
+  int minRange;         // Ranges this short or shorter are errors
+  int reverseMsec;      // How long the avoid maneuver backs off for
+  int turnMsec;         // How long it turns right for
+  int pauseMsec;        // How long it waits before checking again
+
+  int step;             // Step of the avoid maneuver in progress, or -1
+  uint64_t stepEnd;     // When it finishes, in usec
+  uint64_t blockedSince;  // When steering was stopped by an obstacle, or 0
+};
+
+#define AUTONOMY_INIT {100, 10, 1000, 1500, 2000, -1, 0, 0}
+
+enum autonomy_decision {
+  AUTONOMY_WAIT,        // In the middle of a maneuver step
+  AUTONOMY_STEP,        // Next step of a maneuver
+  AUTONOMY_FORWARD,     // Nothing in the way
+  AUTONOMY_AVOID,       // Obstacle, starting the avoid maneuver
+  AUTONOMY_TURN,        // Turning towards a bearing
+  AUTONOMY_BLOCKED,     // Obstacle in the way of the bearing, waiting
+};
+
+// Decide what to do at time now (usec), given the latest range in cm. Sets
+// command to the command to send, or NULL if it hasn't changed.
+enum autonomy_decision autonomy_step(struct autonomy *a, uint64_t now, int range, char **command);
+
+// The same, but heading for a bearing rather than straight on: turns on the
+// spot until the tank's heading is within 15 degrees of it, then drives.
+// Both are radians clockwise from north. An obstacle within half the avoid
+// range stops it, and if it's still there after pauseMsec, it makes the
+// avoid maneuver.
+enum autonomy_decision autonomy_steer(struct autonomy *a, uint64_t now, int range,
+                                      double heading, double bearing, char **command);
+
+#endif
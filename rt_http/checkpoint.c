@@ -0,0 +1,40 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// State checkpoint for warm restarts
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "checkpoint.h"
+#include "log.h"
+
+#define CHECKPOINT_MAGIC 0x52544b31   // "RTK1"
+
+struct checkpoint *checkpoint_open(const char *path, int *valid) {
+  struct checkpoint *cp = MAP_FAILED;
+  int fd;
+
+  *valid = 0;
+  if ((fd = open(path, O_RDWR | O_CREAT, 0600)) >= 0) {
+    if (ftruncate(fd, sizeof(struct checkpoint)) == 0) {
+      cp = mmap(NULL, sizeof(struct checkpoint), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+  }
+  if (cp == MAP_FAILED) {
+    log_msg(LOG_WARN, "Can't map checkpoint file, warm restarts won't be possible");
+    cp = calloc(1, sizeof(struct checkpoint));
+  }
+
+  if (cp->magic == CHECKPOINT_MAGIC && cp->size == sizeof(struct checkpoint)) {
+    *valid = 1;
+  } else {
+    memset(cp, 0, sizeof(struct checkpoint));
+    cp->magic = CHECKPOINT_MAGIC;
+    cp->size = sizeof(struct checkpoint);
+  }
+  return cp;
+}
@@ -0,0 +1,44 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// State checkpoint for warm restarts
+//
+// The state that matters if rt_http dies (the commands being sent, whether
+// the tank has been started, the latest sensor readings) is kept in a small
+// file mapped into memory, so keeping it up to date is just a store to
+// memory, and it outlives the process. A restarted rt_http can read it back
+// and carry on where the old one left off, instead of starting the tank up
+// again from scratch.
+//
+// Each field has a single writer, and is written under the same mutex as the
+// variable it mirrors. There is no locking across fields, so whoever reads it
+// back must check each field makes sense on its own.
+//
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+struct checkpoint {
+  uint32_t magic;                   // CHECKPOINT_MAGIC if this is a checkpoint
+  uint32_t size;                    // sizeof(struct checkpoint) when written
+  int ignited;                      // Set once the ignition sequence has been sent
+  uint64_t lastFrameUsec;           // CLOCK_MONOTONIC time the last frame was sent
+  char userCommand[11];
+  unsigned long userCommandSession;
+  unsigned long userCommandSeq;
+  char autonomyCommand[11];
+  int range;
+  int bearing;
+  int pitch;
+  int roll;
+  unsigned long sensorSeq;
+};
+
+// Map the checkpoint file at path, creating it if necessary. valid is set if
+// it already held a checkpoint, which is left as it was for the caller to
+// read; otherwise it's cleared. If the file can't be mapped, a checkpoint in
+// ordinary memory is returned instead, so this never returns NULL.
+struct checkpoint *checkpoint_open(const char *path, int *valid);
+
+#endif
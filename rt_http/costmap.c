@@ -0,0 +1,203 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Costmap
+//
+
+#include <string.h>
+#include "costmap.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define COSTMAP_NEON
+const char *costmap_simd = "neon";
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define COSTMAP_SSE2
+const char *costmap_simd = "sse2";
+#else
+const char *costmap_simd = "none";
+#endif
+
+// Costs are unsigned bytes, so everything here saturates at 0 rather than
+// wrapping, as the vector instructions do
+static uint8_t subtract(uint8_t a, uint8_t b) {
+  return a > b ? a - b : 0;
+}
+
+static uint8_t max(uint8_t a, uint8_t b) {
+  return a > b ? a : b;
+}
+
+void costmap_build(struct costmap *costmap, const struct map *map, int column, int row) {
+  costmap->column = column;
+  costmap->row = row;
+  map_read(map, column, row, COSTMAP_CELLS, COSTMAP_CELLS, costmap->logOdds, COSTMAP_CELLS);
+  costmap_threshold(costmap);
+  costmap_inflate(costmap);
+  costmap->builds++;
+}
+
+
+// Decay
+
+void costmap_decay_scalar(int8_t *logOdds, size_t n, int step) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    int value = logOdds[i];
+    logOdds[i] = value > step ? value - step : value < -step ? value + step : 0;
+  }
+}
+
+// Positive values less the step, or 0, plus negative values plus the step,
+// or 0: only one of the two is ever non-zero
+void costmap_decay(int8_t *logOdds, size_t n, int step) {
+  size_t i = 0;
+#if defined(COSTMAP_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  __m128i steps = _mm_set1_epi8(step);
+  for (; i + 16 <= n; i += 16) {
+    __m128i value = _mm_loadu_si128((__m128i *) (logOdds + i));
+    __m128i down = _mm_subs_epi8(value, steps);
+    __m128i up = _mm_adds_epi8(value, steps);
+    down = _mm_and_si128(down, _mm_cmpgt_epi8(down, zero));
+    up = _mm_and_si128(up, _mm_cmplt_epi8(up, zero));
+    _mm_storeu_si128((__m128i *) (logOdds + i), _mm_or_si128(down, up));
+  }
+#elif defined(COSTMAP_NEON)
+  int8x16_t zero = vdupq_n_s8(0);
+  int8x16_t steps = vdupq_n_s8(step);
+  for (; i + 16 <= n; i += 16) {
+    int8x16_t value = vld1q_s8(logOdds + i);
+    int8x16_t down = vmaxq_s8(vqsubq_s8(value, steps), zero);
+    int8x16_t up = vminq_s8(vqaddq_s8(value, steps), zero);
+    vst1q_s8(logOdds + i, vorrq_s8(down, up));
+  }
+#endif
+  costmap_decay_scalar(logOdds + i, n - i, step);
+}
+
+
+// Threshold
+
+void costmap_threshold_scalar(struct costmap *costmap) {
+  int x, y;
+  for (y = 0; y < COSTMAP_CELLS; y++) {
+    const int8_t *in = &costmap->logOdds[y * COSTMAP_CELLS];
+    uint8_t *out = &costmap_cost(costmap, 0, y);
+    for (x = 0; x < COSTMAP_CELLS; x++) {
+      out[x] = in[x] >= COSTMAP_OCCUPIED ? COSTMAP_LETHAL : 0;
+    }
+  }
+}
+
+void costmap_threshold(struct costmap *costmap) {
+#if defined(COSTMAP_SSE2)
+  __m128i threshold = _mm_set1_epi8(COSTMAP_OCCUPIED - 1);
+  __m128i lethal = _mm_set1_epi8((char) COSTMAP_LETHAL);
+  int x, y;
+  for (y = 0; y < COSTMAP_CELLS; y++) {
+    const int8_t *in = &costmap->logOdds[y * COSTMAP_CELLS];
+    uint8_t *out = &costmap_cost(costmap, 0, y);
+    for (x = 0; x < COSTMAP_CELLS; x += 16) {
+      __m128i value = _mm_loadu_si128((const __m128i *) (in + x));
+      _mm_store_si128((__m128i *) (out + x), _mm_and_si128(_mm_cmpgt_epi8(value, threshold), lethal));
+    }
+  }
+#elif defined(COSTMAP_NEON)
+  int8x16_t threshold = vdupq_n_s8(COSTMAP_OCCUPIED);
+  uint8x16_t lethal = vdupq_n_u8(COSTMAP_LETHAL);
+  int x, y;
+  for (y = 0; y < COSTMAP_CELLS; y++) {
+    const int8_t *in = &costmap->logOdds[y * COSTMAP_CELLS];
+    uint8_t *out = &costmap_cost(costmap, 0, y);
+    for (x = 0; x < COSTMAP_CELLS; x += 16) {
+      vst1q_u8(out + x, vandq_u8(vcgeq_s8(vld1q_s8(in + x), threshold), lethal));
+    }
+  }
+#else
+  costmap_threshold_scalar(costmap);
+#endif
+}
+
+
+// Inflation
+//
+// Each pass makes every cell the most of its own cost and its neighbours'
+// less a step, so after n passes costs have spread n cells: a chamfer
+// distance transform, done as repeated dilation because every cell of a
+// pass can be worked out at once, unlike a raster scan. The padding is all
+// zeroes, which never raise anything.
+
+static void inflate_row_scalar(const uint8_t *in, uint8_t *out) {
+  const uint8_t *above = in + COSTMAP_STRIDE, *below = in - COSTMAP_STRIDE;
+  int x;
+  for (x = 0; x < COSTMAP_CELLS; x++) {
+    uint8_t straight = max(max(above[x], below[x]), max(in[x - 1], in[x + 1]));
+    uint8_t diagonal = max(max(above[x - 1], above[x + 1]), max(below[x - 1], below[x + 1]));
+    out[x] = max(in[x], max(subtract(straight, COSTMAP_STRAIGHT_STEP),
+                            subtract(diagonal, COSTMAP_DIAGONAL_STEP)));
+  }
+}
+
+#if defined(COSTMAP_SSE2)
+static void inflate_row(const uint8_t *in, uint8_t *out) {
+  const uint8_t *above = in + COSTMAP_STRIDE, *below = in - COSTMAP_STRIDE;
+  __m128i straightStep = _mm_set1_epi8(COSTMAP_STRAIGHT_STEP);
+  __m128i diagonalStep = _mm_set1_epi8(COSTMAP_DIAGONAL_STEP);
+  int x;
+  for (x = 0; x < COSTMAP_CELLS; x += 16) {
+#define LOAD(p) _mm_loadu_si128((const __m128i *) (p))
+    __m128i straight = _mm_max_epu8(_mm_max_epu8(LOAD(above + x), LOAD(below + x)),
+                                    _mm_max_epu8(LOAD(in + x - 1), LOAD(in + x + 1)));
+    __m128i diagonal = _mm_max_epu8(_mm_max_epu8(LOAD(above + x - 1), LOAD(above + x + 1)),
+                                    _mm_max_epu8(LOAD(below + x - 1), LOAD(below + x + 1)));
+    __m128i cost = _mm_max_epu8(_mm_subs_epu8(straight, straightStep),
+                                _mm_subs_epu8(diagonal, diagonalStep));
+    _mm_store_si128((__m128i *) (out + x), _mm_max_epu8(LOAD(in + x), cost));
+#undef LOAD
+  }
+}
+#elif defined(COSTMAP_NEON)
+static void inflate_row(const uint8_t *in, uint8_t *out) {
+  const uint8_t *above = in + COSTMAP_STRIDE, *below = in - COSTMAP_STRIDE;
+  uint8x16_t straightStep = vdupq_n_u8(COSTMAP_STRAIGHT_STEP);
+  uint8x16_t diagonalStep = vdupq_n_u8(COSTMAP_DIAGONAL_STEP);
+  int x;
+  for (x = 0; x < COSTMAP_CELLS; x += 16) {
+    uint8x16_t straight = vmaxq_u8(vmaxq_u8(vld1q_u8(above + x), vld1q_u8(below + x)),
+                                   vmaxq_u8(vld1q_u8(in + x - 1), vld1q_u8(in + x + 1)));
+    uint8x16_t diagonal = vmaxq_u8(vmaxq_u8(vld1q_u8(above + x - 1), vld1q_u8(above + x + 1)),
+                                   vmaxq_u8(vld1q_u8(below + x - 1), vld1q_u8(below + x + 1)));
+    uint8x16_t cost = vmaxq_u8(vqsubq_u8(straight, straightStep), vqsubq_u8(diagonal, diagonalStep));
+    vst1q_u8(out + x, vmaxq_u8(vld1q_u8(in + x), cost));
+  }
+}
+#else
+#define inflate_row inflate_row_scalar
+#endif
+
+// Run the passes back and forth between cost and scratch, ending in cost
+static void inflate(struct costmap *costmap, void (*row)(const uint8_t *, uint8_t *)) {
+  uint8_t *in = costmap->cost, *out = costmap->scratch, *swap;
+  int pass, y;
+
+  for (pass = 0; pass < COSTMAP_INFLATION_PASSES; pass++) {
+    for (y = 1; y <= COSTMAP_CELLS; y++) {
+      row(in + y * COSTMAP_STRIDE + COSTMAP_PAD, out + y * COSTMAP_STRIDE + COSTMAP_PAD);
+    }
+    swap = in;
+    in = out;
+    out = swap;
+  }
+  if (in != costmap->cost) {
+    memcpy(costmap->cost, in, sizeof(costmap->cost));
+  }
+}
+
+void costmap_inflate_scalar(struct costmap *costmap) {
+  inflate(costmap, inflate_row_scalar);
+}
+
+void costmap_inflate(struct costmap *costmap) {
+  inflate(costmap, inflate_row);
+}
@@ -0,0 +1,75 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Costmap
+//
+// What it would cost the tank to be in each cell of a window of the map
+// around it, for planning: lethal where the map is sure there's something,
+// falling off with distance from there, and 0 anywhere else, including where
+// the map doesn't know (so plans assume unknown space is free until seen).
+//
+// The kernels that make it work on whole rows at a time, so each has a
+// plain C version and SSE2 and NEON versions of it, picked at compile time.
+// The plain versions are the reference: the others must give exactly the
+// same bytes, which rt_bench checks as well as timing them.
+//
+
+#ifndef COSTMAP_H
+#define COSTMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "map.h"
+
+#define COSTMAP_CELLS 128               // Along each side of the window, 6.4m
+#define COSTMAP_PAD 16                  // Zeroes either side of each row
+#define COSTMAP_STRIDE (COSTMAP_CELLS + 2 * COSTMAP_PAD)
+
+// Costs. Inflation takes a step off for each cell away from something lethal,
+// a bit more diagonally, so within the tank's radius of it (5 cells) cost is
+// at least COSTMAP_INSCRIBED, and it's gone by 13 cells.
+#define COSTMAP_LETHAL 254
+#define COSTMAP_STRAIGHT_STEP 20
+#define COSTMAP_DIAGONAL_STEP 28
+#define COSTMAP_INSCRIBED (COSTMAP_LETHAL - 5 * COSTMAP_STRAIGHT_STEP)
+#define COSTMAP_INFLATION_PASSES 13
+
+// Log-odds at or above which a cell counts as an obstacle, p = 0.9
+#define COSTMAP_OCCUPIED 44
+
+// Must start out zeroed, e.g. from calloc()
+struct costmap {
+  int column, row;                      // Map cell of the south-west corner
+  unsigned long builds;                 // Times it's been built, to spot changes
+  int8_t logOdds[COSTMAP_CELLS * COSTMAP_CELLS];
+  // Costs, a row at a time from the south, with a row of zeroes above and
+  // below and COSTMAP_PAD either side, so the kernels never need bounds
+  // checks. Use costmap_cost() to read them.
+  uint8_t cost[(COSTMAP_CELLS + 2) * COSTMAP_STRIDE] __attribute__((aligned(16)));
+  uint8_t scratch[(COSTMAP_CELLS + 2) * COSTMAP_STRIDE] __attribute__((aligned(16)));
+};
+
+// Which kernels were compiled in: "sse2", "neon" or "none"
+extern const char *costmap_simd;
+
+// Rebuild a costmap from the map, with its south-west corner at map cell
+// column, row
+void costmap_build(struct costmap *costmap, const struct map *map, int column, int row);
+
+// Cost of window cell x, y (0 to COSTMAP_CELLS - 1)
+#define costmap_cost(costmap, x, y) \
+  ((costmap)->cost[((y) + 1) * COSTMAP_STRIDE + COSTMAP_PAD + (x)])
+
+// Move n log-odds step closer to 0 (unknown), so what hasn't been seen for a
+// while is forgotten
+void costmap_decay(int8_t *logOdds, size_t n, int step);
+void costmap_decay_scalar(int8_t *logOdds, size_t n, int step);
+
+// Turn a window of log-odds into lethal and free costs
+void costmap_threshold(struct costmap *costmap);
+void costmap_threshold_scalar(struct costmap *costmap);
+
+// Spread lethal costs out to the cells around them
+void costmap_inflate(struct costmap *costmap);
+void costmap_inflate_scalar(struct costmap *costmap);
+
+#endif
@@ -0,0 +1,215 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Rate-monotonic executive
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include "exec.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Most a degraded task's period is stretched by
+#define MAX_STRETCH 8
+
+// Runs on time before a degraded task's period is halved again
+#define RECOVER_RUNS 10
+
+// Most executives there can be
+#define MAX_EXECUTIVES 4
+
+struct executive {
+  const char *name;
+  struct task *tasks;
+  int numTasks;
+  long tickUsec;
+};
+
+static struct executive executives[MAX_EXECUTIVES];
+static int numExecutives;
+static __thread uint64_t tickStartUsec;
+
+static uint64_t now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t exec_now(void) {
+  return tickStartUsec;
+}
+
+// Time and run one task, then release its next instance
+static void run_task(struct task *t, uint64_t tick) {
+  uint64_t start = trace_begin();
+  uint64_t runUsec;
+
+  t->run();
+  runUsec = (trace_begin() - start) / 1000;
+  trace_end(t->name, start, runUsec > (uint64_t) t->budgetUsec);
+
+  __atomic_store_n(&t->runs, t->runs + 1, __ATOMIC_RELAXED);
+  if (runUsec > (uint64_t) t->budgetUsec) {
+    __atomic_store_n(&t->overruns, t->overruns + 1, __ATOMIC_RELAXED);
+  }
+  if (runUsec > t->maxRunUsec) {
+    __atomic_store_n(&t->maxRunUsec, runUsec, __ATOMIC_RELAXED);
+  }
+  if (++t->onTime >= RECOVER_RUNS && t->stretch > 1) {
+    __atomic_store_n(&t->stretch, t->stretch / 2, __ATOMIC_RELAXED);
+    t->onTime = 0;
+  }
+
+  // If we've fallen behind, start again from now rather than running a
+  // burst of instances to catch up
+  t->release += (uint64_t) t->periodTicks * t->stretch;
+  if (t->release <= tick) {
+    t->release = tick + (uint64_t) t->periodTicks * t->stretch;
+  }
+}
+
+// Give up on a task's current instance and lengthen its period
+static void miss_task(struct task *t, uint64_t tick) {
+  __atomic_store_n(&t->misses, t->misses + 1, __ATOMIC_RELAXED);
+  if (t->stretch < MAX_STRETCH) {
+    __atomic_store_n(&t->stretch, t->stretch * 2, __ATOMIC_RELAXED);
+    log_msg(LOG_WARN, "Task %s missed its deadline, period now %ld ticks",
+            (long) t->name, (long) t->periodTicks * t->stretch);
+  }
+  t->onTime = 0;
+  t->release = tick + (uint64_t) t->periodTicks * t->stretch;
+}
+
+// Add an executive to the list reported by exec_format()
+static void register_executive(struct task *tasks, int numTasks) {
+  int i = __atomic_load_n(&numExecutives, __ATOMIC_RELAXED);
+  int j;
+
+  for (j = 0; j < numTasks; j++) {
+    tasks[j].stretch = 1;
+  }
+  while (i < MAX_EXECUTIVES) {
+    if (__atomic_compare_exchange_n(&numExecutives, &i, i + 1, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      executives[i].tasks = tasks;
+      __atomic_store_n(&executives[i].numTasks, numTasks, __ATOMIC_RELEASE);
+      return;
+    }
+  }
+}
+
+static void *executive_thread(void *arg) {
+  struct executive *e = arg;
+  metrics_thread_init(e->name);
+  log_thread_init(e->name);
+  trace_thread_init(e->name);
+  exec_run(e->tasks, e->numTasks, e->tickUsec);
+  return NULL;
+}
+
+int exec_start(const char *name, struct task *tasks, int numTasks, long tickUsec) {
+  struct executive *e = malloc(sizeof(*e));
+  pthread_t thread;
+  int error;
+
+  e->name = name;
+  e->tasks = tasks;
+  e->numTasks = numTasks;
+  e->tickUsec = tickUsec;
+  if ((error = pthread_create(&thread, NULL, &executive_thread, e)) != 0) {
+    free(e);
+    return error;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+void exec_run(struct task *tasks, int numTasks, long tickUsec) {
+  // First tick straight away, then every tickUsec
+  struct itimerspec timer = {{0, tickUsec * 1000}, {0, 1}};
+  uint64_t firstTickUsec, tick = 0, expirations;
+  int fd, i;
+
+  register_executive(tasks, numTasks);
+
+  if ((fd = timerfd_create(CLOCK_MONOTONIC, 0)) < 0 ||
+      timerfd_settime(fd, 0, &timer, NULL) < 0) {
+    perror("timerfd");
+    exit(-1);
+  }
+  firstTickUsec = now_usec();
+
+  while (1) {
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      continue;
+    }
+    tick += expirations;
+    if (expirations > 1) {
+      // The first task didn't get to run on the ticks in between
+      __atomic_store_n(&tasks[0].misses, tasks[0].misses + expirations - 1, __ATOMIC_RELAXED);
+    }
+    tickStartUsec = firstTickUsec + (tick - 1) * tickUsec;
+    uint64_t tickEndUsec = tickStartUsec + tickUsec;
+
+    run_task(&tasks[0], tick);
+    for (i = 1; i < numTasks; i++) {
+      struct task *t = &tasks[i];
+      if (tick < t->release) {
+        continue;
+      }
+      if (now_usec() + t->budgetUsec <= tickEndUsec) {
+        run_task(t, tick);
+      } else if (tick >= t->release + (uint64_t) t->deadlineTicks * t->stretch) {
+        miss_task(t, tick);
+      }
+    }
+  }
+}
+
+// Print one family's HELP and TYPE lines and a value for every task
+static int format_family(char *buf, int len, const char *family, const char *help,
+                         const char *type, int field) {
+  int n = 0, e, i;
+  int count = __atomic_load_n(&numExecutives, __ATOMIC_RELAXED);
+
+  n += snprintf(buf + n, len > n ? len - n : 0, "# HELP %s %s\n# TYPE %s %s\n",
+                family, help, family, type);
+  for (e = 0; e < count && e < MAX_EXECUTIVES; e++) {
+    int numTasks = __atomic_load_n(&executives[e].numTasks, __ATOMIC_ACQUIRE);
+    for (i = 0; i < numTasks; i++) {
+      struct task *t = &executives[e].tasks[i];
+      unsigned long long value =
+          field == 0 ? __atomic_load_n(&t->runs, __ATOMIC_RELAXED) :
+          field == 1 ? __atomic_load_n(&t->overruns, __ATOMIC_RELAXED) :
+          field == 2 ? __atomic_load_n(&t->misses, __ATOMIC_RELAXED) :
+          field == 3 ? __atomic_load_n(&t->maxRunUsec, __ATOMIC_RELAXED) :
+                       (unsigned long long) __atomic_load_n(&t->stretch, __ATOMIC_RELAXED);
+      n += snprintf(buf + n, len > n ? len - n : 0, "%s{task=\"%s\"} %llu\n",
+                    family, t->name, value);
+    }
+  }
+  return n;
+}
+
+int exec_format(char *buf, int len) {
+  int n = 0;
+  if (__atomic_load_n(&numExecutives, __ATOMIC_RELAXED) == 0) {
+    return 0;
+  }
+  n += format_family(buf + n, len > n ? len - n : 0, "rt_task_runs_total",
+                     "Times each executive task has run", "counter", 0);
+  n += format_family(buf + n, len > n ? len - n : 0, "rt_task_overruns_total",
+                     "Runs that took longer than the task's budget", "counter", 1);
+  n += format_family(buf + n, len > n ? len - n : 0, "rt_task_deadline_misses_total",
+                     "Task instances that couldn't be run before their deadline", "counter", 2);
+  n += format_family(buf + n, len > n ? len - n : 0, "rt_task_max_run_microseconds",
+                     "Longest run of each task", "gauge", 3);
+  n += format_family(buf + n, len > n ? len - n : 0, "rt_task_period_stretch",
+                     "Factor each task's period is lengthened by while degraded", "gauge", 4);
+  return n;
+}
@@ -0,0 +1,59 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Rate-monotonic executive
+//
+// Runs a table of periodic tasks on one thread, woken by a timerfd once per
+// tick. There can be several executives, each with its own thread, table and
+// tick, so that something slow in one can't hold up another. Tasks are listed
+// highest priority first, which for rate-monotonic scheduling means shortest
+// period first. Each tick the first task always runs; the others run, in
+// order, only if their budget fits in what is left of the tick, and otherwise
+// wait for a later tick within their deadline.
+//
+// Every task run is timed. Running for longer than the budget is an overrun.
+// A task that can't be fitted in before its deadline misses that instance,
+// and has its period doubled (up to 8 times) so that the load sheds itself;
+// the period comes back down once the task is running on time again. A
+// missed tick counts as a deadline miss for the first task.
+//
+// Tasks never block, so anything slow (waiting for a sensor, a timed
+// maneuver) has to be broken into steps across several runs.
+//
+
+#ifndef EXEC_H
+#define EXEC_H
+
+#include <stdint.h>
+
+struct task {
+  const char *name;
+  void (*run)(void);
+  int periodTicks;          // Released every this many ticks
+  int deadlineTicks;        // Must have run within this many ticks of release
+  int budgetUsec;           // Longest it's expected to run for
+
+  // Executive's own state, start these at zero
+  int stretch;              // Period multiplier while degraded
+  int onTime;               // Runs on time since the last change of stretch
+  uint64_t release;         // Tick this instance was released on
+  uint64_t runs, overruns, misses;
+  uint64_t maxRunUsec;
+};
+
+// Run the tasks on the calling thread forever, with a tick every tickUsec
+void exec_run(struct task *tasks, int numTasks, long tickUsec);
+
+// Run the tasks on a new thread, with the given name for metrics, logs and
+// traces. Returns 0, or an error number if the thread couldn't be started.
+int exec_start(const char *name, struct task *tasks, int numTasks, long tickUsec);
+
+// Time the calling executive's current tick started, in microseconds. Tasks
+// should use this as "now" rather than reading a clock, so they all see the
+// same time.
+uint64_t exec_now(void);
+
+// Write every executive's task statistics in Prometheus text format to buf.
+// Returns the length they needed, as snprintf() does.
+int exec_format(char *buf, int len);
+
+#endif
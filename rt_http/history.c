@@ -0,0 +1,746 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Sensor history
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+
+#define INITIAL_SAMPLES 1024
+
+// The summaries of one segment, mapped from its companion file or, for the
+// segment being written and any whose companion couldn't be written, in
+// memory
+struct history_segment {
+  char *path;                           // Of the segment
+  int live;                             // Being written, so added to as it is
+  int loaded;                           // header and levels are filled in
+  struct history_file_header header;
+  struct history_summary *levels[NUM_HISTORY_CHANNELS][HISTORY_LEVELS];  // [0] unused
+  uint32_t capacity[NUM_HISTORY_CHANNELS];  // Samples there's room for, in memory
+  void *mapped;                         // Companion file, or NULL if in memory
+  size_t mappedSize;
+};
+
+const char* const history_channel_names[NUM_HISTORY_CHANNELS] = {
+  "range", "bearing", "pitch", "roll"
+};
+
+// The record type and value each channel's samples are in
+static const struct {
+  int type;
+  int index;
+} channel_values[NUM_HISTORY_CHANNELS] = {
+  {TELEMETRY_RANGE, 0}, {TELEMETRY_COMPASS, 0}, {TELEMETRY_COMPASS, 1}, {TELEMETRY_COMPASS, 2}
+};
+
+#define SAMPLE_TYPES ((1u << TELEMETRY_RANGE) | (1u << TELEMETRY_COMPASS))
+
+static struct history_segment *new_segment(const char *path) {
+  struct history_segment *segment = calloc(1, sizeof(*segment));
+  if (segment != NULL && (segment->path = strdup(path)) == NULL) {
+    free(segment);
+    segment = NULL;
+  }
+  return segment;
+}
+
+static void free_segment(struct history_segment *segment) {
+  int c, k;
+  if (segment->mapped != NULL) {
+    munmap(segment->mapped, segment->mappedSize);
+  } else {
+    for (c = 0; c < NUM_HISTORY_CHANNELS; c++) {
+      for (k = 1; k < HISTORY_LEVELS; k++) {
+        free(segment->levels[c][k]);
+      }
+    }
+  }
+  free(segment->path);
+  free(segment);
+}
+
+static int add_segment(struct history *history, struct history_segment *segment) {
+  struct history_segment **p = realloc(history->segments,
+                                       (history->numSegments + 1) * sizeof(*p));
+  if (p == NULL) {
+    return 0;
+  }
+  history->segments = p;
+  history->segments[history->numSegments++] = segment;
+  return 1;
+}
+
+static int find_segment(const struct history *history, const char *path) {
+  int i;
+  for (i = 0; i < history->numSegments; i++) {
+    if (strcmp(history->segments[i]->path, path) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// "telemetry-000001.sum" for "telemetry-000001.rtl"
+static void companion_path(char *path, size_t size, const char *segmentPath) {
+  size_t len = strlen(segmentPath);
+  if (len > 4 && strcmp(segmentPath + len - 4, ".rtl") == 0) {
+    len -= 4;
+  }
+  snprintf(path, size, "%.*s.sum", (int) len, segmentPath);
+}
+
+
+// Building summaries
+
+static void start_summaries(struct history_segment *segment,
+                            const struct telemetry_header *header) {
+  memset(&segment->header, 0, sizeof(segment->header));
+  segment->header.magic = HISTORY_MAGIC;
+  segment->header.headerSize = sizeof(struct history_file_header);
+  segment->header.summarySize = sizeof(struct history_summary);
+  segment->header.segment = header->segment;
+  segment->header.realtimeOffsetUsec = header->realtimeOffsetUsec;
+  segment->loaded = 1;
+}
+
+// Make room for twice as many samples of a channel, and the entries over
+// them. Returns 0 if it's full or there isn't the memory.
+static int grow(struct history_segment *segment, int channel) {
+  uint32_t capacity = segment->capacity[channel] == 0 ? INITIAL_SAMPLES :
+                      segment->capacity[channel] * 2;
+  uint32_t span = 1;
+  void *p;
+  int k;
+
+  if (segment->capacity[channel] >= HISTORY_MAX_SAMPLES) {
+    return 0;
+  }
+  if (capacity > HISTORY_MAX_SAMPLES) {
+    capacity = HISTORY_MAX_SAMPLES;
+  }
+  for (k = 1; k < HISTORY_LEVELS; k++) {
+    span *= HISTORY_FANOUT;
+    p = realloc(segment->levels[channel][k],
+                (capacity + span - 1) / span * sizeof(struct history_summary));
+    if (p == NULL) {
+      return 0;
+    }
+    segment->levels[channel][k] = p;
+  }
+  segment->capacity[channel] = capacity;
+  return 1;
+}
+
+// Add a sample to the last entry of each level, or a new one if it's full.
+// One earlier than the last is taken to be at the same time.
+static void add_sample(struct history_segment *segment, int channel, int64_t usec, int32_t value) {
+  struct history_file_header *header = &segment->header;
+  uint32_t n = header->counts[channel][0], span = 1, msec;
+  int k;
+
+  if (n == segment->capacity[channel] && !grow(segment, channel)) {
+    return;
+  }
+  if (header->baseUsec == 0) {
+    header->baseUsec = usec;
+  }
+  if (n > 0 && usec < header->lastUsec[channel]) {
+    usec = header->lastUsec[channel];
+  }
+  msec = usec > header->baseUsec ? (usec - header->baseUsec) / 1000 : 0;
+
+  for (k = 1; k < HISTORY_LEVELS; k++) {
+    struct history_summary *entry;
+    span *= HISTORY_FANOUT;
+    entry = &segment->levels[channel][k][n / span];
+    if (n % span == 0) {
+      entry->msec = msec;
+      entry->min = entry->max = value;
+      entry->count = 1;
+      entry->sum = value;
+      header->counts[channel][k]++;
+    } else {
+      if (value < entry->min) entry->min = value;
+      if (value > entry->max) entry->max = value;
+      entry->count++;
+      entry->sum += value;
+    }
+  }
+  if (n == 0) {
+    header->firstUsec[channel] = usec;
+  }
+  header->lastUsec[channel] = usec;
+  header->counts[channel][0] = n + 1;
+}
+
+static void add_records(struct history_segment *segment,
+                        const struct telemetry_record *records, int count) {
+  int i, c;
+  for (i = 0; i < count; i++) {
+    const struct telemetry_record *record = &records[i];
+    if (!(SAMPLE_TYPES & (1u << record->type)) || (record->flags & TELEMETRY_FAILED)) {
+      continue;
+    }
+    for (c = 0; c < NUM_HISTORY_CHANNELS; c++) {
+      if (channel_values[c].type == record->type) {
+        add_sample(segment, c, (int64_t) record->usec + segment->header.realtimeOffsetUsec,
+                   record->values[channel_values[c].index]);
+      }
+    }
+  }
+}
+
+// Summarise every block of an open segment, including one it was still
+// adding to when it was opened
+static void build_summaries(struct history_segment *segment, const struct telemetry_segment *s,
+                            struct telemetry_record *records) {
+  const struct telemetry_block *block;
+  size_t offset = 0;
+  int n;
+
+  start_summaries(segment, s->header);
+  while ((block = telemetry_next_block(s, &offset)) != NULL) {
+    if ((n = telemetry_decode_block(block, SAMPLE_TYPES, records)) > 0) {
+      add_records(segment, records, n);
+    }
+  }
+}
+
+
+// Companion files
+
+// Write a segment's summaries beside it. Returns 1 if it could.
+static int write_companion(const struct history_segment *segment) {
+  char path[512], temporary[520];
+  FILE *f;
+  int c, k, ok;
+
+  companion_path(path, sizeof(path), segment->path);
+  snprintf(temporary, sizeof(temporary), "%s.new", path);
+  if ((f = fopen(temporary, "wb")) == NULL) {
+    return 0;
+  }
+  ok = fwrite(&segment->header, sizeof(segment->header), 1, f) == 1;
+  for (c = 0; c < NUM_HISTORY_CHANNELS; c++) {
+    for (k = 1; k < HISTORY_LEVELS; k++) {
+      uint32_t count = segment->header.counts[c][k];
+      ok = ok && (count == 0 ||
+                  fwrite(segment->levels[c][k], sizeof(struct history_summary), count, f) == count);
+    }
+  }
+  ok = fclose(f) == 0 && ok;
+  // Only ever replace a companion with a whole one
+  if (!ok || rename(temporary, path) != 0) {
+    unlink(temporary);
+    return 0;
+  }
+  return 1;
+}
+
+// Map a segment's companion file, if it has one that's for this segment and
+// all there. Returns 1 if it did.
+static int map_companion(struct history_segment *segment, const struct telemetry_header *header) {
+  const struct history_file_header *mapped;
+  const struct history_summary *summaries;
+  struct stat st;
+  char path[512];
+  size_t size = sizeof(*mapped);
+  int fd, c, k;
+
+  companion_path(path, sizeof(path), segment->path);
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return 0;
+  }
+  mapped = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(*mapped)) {
+    mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return 0;
+  }
+  for (c = 0; c < NUM_HISTORY_CHANNELS; c++) {
+    for (k = 1; k < HISTORY_LEVELS; k++) {
+      size += (size_t) mapped->counts[c][k] * sizeof(struct history_summary);
+    }
+  }
+  if (mapped->magic != HISTORY_MAGIC || mapped->headerSize != sizeof(*mapped) ||
+      mapped->summarySize != sizeof(struct history_summary) ||
+      mapped->segment != header->segment ||
+      mapped->realtimeOffsetUsec != header->realtimeOffsetUsec || size != (size_t) st.st_size) {
+    munmap((void *) mapped, st.st_size);
+    return 0;
+  }
+
+  segment->header = *mapped;
+  summaries = (const struct history_summary *) (mapped + 1);
+  for (c = 0; c < NUM_HISTORY_CHANNELS; c++) {
+    for (k = 1; k < HISTORY_LEVELS; k++) {
+      segment->levels[c][k] = (struct history_summary *) summaries;
+      summaries += mapped->counts[c][k];
+    }
+  }
+  segment->mapped = (void *) mapped;
+  segment->mappedSize = st.st_size;
+  segment->loaded = 1;
+  return 1;
+}
+
+// Swap a segment's summaries in memory for its companion file, once it's
+// written, so they don't take up memory. Keeps them in memory if it can't.
+static void save_summaries(struct history_segment *segment) {
+  struct history_segment saved;
+  struct telemetry_header header;
+  int c, k;
+
+  if (!write_companion(segment)) {
+    return;
+  }
+  memset(&saved, 0, sizeof(saved));
+  saved.path = segment->path;
+  header.segment = segment->header.segment;
+  header.realtimeOffsetUsec = segment->header.realtimeOffsetUsec;
+  if (map_companion(&saved, &header)) {
+    for (c = 0; c < NUM_HISTORY_CHANNELS; c++) {
+      for (k = 1; k < HISTORY_LEVELS; k++) {
+        free(segment->levels[c][k]);
+        segment->levels[c][k] = saved.levels[c][k];
+      }
+      segment->capacity[c] = 0;
+    }
+    segment->mapped = saved.mapped;
+    segment->mappedSize = saved.mappedSize;
+  }
+}
+
+// Read a segment's summaries from its companion file, or build them from its
+// blocks and write that. A segment that can't be read has no samples.
+static struct history_segment *load_segment(const char *path, struct telemetry_record *records) {
+  struct history_segment *segment = new_segment(path);
+  struct telemetry_segment s;
+
+  if (segment == NULL) {
+    return NULL;
+  }
+  if (!telemetry_open(&s, path)) {
+    segment->loaded = 1;
+    return segment;
+  }
+  if (!map_companion(segment, s.header)) {
+    build_summaries(segment, &s, records);
+    save_summaries(segment);
+  }
+  telemetry_close(&s);
+  return segment;
+}
+
+
+// Adding to the history
+
+void history_init(struct history *history, const char *path) {
+  char **paths;
+  int numPaths, i;
+
+  memset(history, 0, sizeof(*history));
+  pthread_mutex_init(&history->lock, NULL);
+  pthread_mutex_init(&history->loading, NULL);
+  history->directory = strdup(path);
+  if ((numPaths = telemetry_find_segments(path, &paths)) <= 0) {
+    return;
+  }
+  for (i = 0; i < numPaths; i++) {
+    struct history_segment *segment = new_segment(paths[i]);
+    if (segment != NULL && !add_segment(history, segment)) {
+      free_segment(segment);
+    }
+  }
+  telemetry_free_paths(paths, numPaths);
+}
+
+void history_add_block(const struct telemetry_header *header,
+                       const struct telemetry_record *records, int count, void *arg) {
+  struct history *history = arg;
+  struct history_segment *segment = NULL;
+  char path[512], oldPath[512];
+  int i;
+
+  pthread_mutex_lock(&history->lock);
+  if (history->numSegments > 0) {
+    segment = history->segments[history->numSegments - 1];
+    if (!segment->live || segment->header.segment != header->segment) {
+      segment = NULL;
+    }
+  }
+
+  // A new segment: the last one is finished, so its summaries can go with
+  // it, and the telemetry writer has deleted the oldest, so they can go too
+  if (segment == NULL) {
+    if (history->numSegments > 0 && history->segments[history->numSegments - 1]->live) {
+      history->segments[history->numSegments - 1]->live = 0;
+      save_summaries(history->segments[history->numSegments - 1]);
+    }
+    if (header->segment > TELEMETRY_MAX_SEGMENTS) {
+      telemetry_segment_path(oldPath, sizeof(oldPath), history->directory,
+                             header->segment - TELEMETRY_MAX_SEGMENTS);
+      if ((i = find_segment(history, oldPath)) >= 0) {
+        free_segment(history->segments[i]);
+        memmove(&history->segments[i], &history->segments[i + 1],
+                (history->numSegments - i - 1) * sizeof(history->segments[0]));
+        history->numSegments--;
+      }
+      companion_path(path, sizeof(path), oldPath);
+      unlink(path);
+    }
+    telemetry_segment_path(path, sizeof(path), history->directory, header->segment);
+    if ((segment = new_segment(path)) != NULL) {
+      start_summaries(segment, header);
+      segment->live = 1;
+      if (!add_segment(history, segment)) {
+        free_segment(segment);
+        segment = NULL;
+      }
+    }
+  }
+
+  if (segment != NULL) {
+    add_records(segment, records, count);
+  }
+  pthread_mutex_unlock(&history->lock);
+}
+
+
+// Queries
+
+// Read or build the summaries of every segment that doesn't have them yet.
+// That can take a while, so it's done without holding the lock, which the
+// telemetry writer needs, and what's loaded is swapped in afterwards.
+static void load_segments(struct history *history, struct telemetry_record *records) {
+  char *path;
+  int i;
+
+  pthread_mutex_lock(&history->loading);
+  while (1) {
+    path = NULL;
+    pthread_mutex_lock(&history->lock);
+    for (i = 0; i < history->numSegments && path == NULL; i++) {
+      if (!history->segments[i]->loaded && !history->segments[i]->live) {
+        path = strdup(history->segments[i]->path);
+      }
+    }
+    pthread_mutex_unlock(&history->lock);
+    if (path == NULL) {
+      break;
+    }
+
+    struct history_segment *segment = load_segment(path, records);
+    pthread_mutex_lock(&history->lock);
+    if ((i = find_segment(history, path)) >= 0 && !history->segments[i]->loaded) {
+      if (segment != NULL) {
+        free_segment(history->segments[i]);
+        history->segments[i] = segment;
+      } else {
+        history->segments[i]->loaded = 1;
+      }
+    } else if (segment != NULL) {
+      free_segment(segment);
+    }
+    pthread_mutex_unlock(&history->lock);
+    free(path);
+  }
+  pthread_mutex_unlock(&history->loading);
+}
+
+static int64_t entry_usec(const struct history_segment *segment, int channel, int level,
+                          uint32_t i) {
+  return segment->header.baseUsec + (int64_t) segment->levels[channel][level][i].msec * 1000;
+}
+
+// First entry at a level starting after usec, or at it too if inclusive
+static uint32_t search(const struct history_segment *segment, int channel, int level,
+                       int64_t usec, int inclusive) {
+  uint32_t lo = 0, hi = segment->header.counts[channel][level];
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int64_t t = entry_usec(segment, channel, level, mid);
+    if (t < usec || (!inclusive && t == usec)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Entries of a segment at a level between from and to, as [*lo, *hi). A
+// summary that starts before from can still have samples after it, so
+// that's included.
+static uint32_t entries_between(const struct history_segment *segment, int channel, int level,
+                                int64_t from, int64_t to, uint32_t *lo, uint32_t *hi) {
+  *lo = search(segment, channel, level, from, 1);
+  *hi = search(segment, channel, level, to, 0);
+  if (*lo > 0 && (*lo == segment->header.counts[channel][level] ||
+                  entry_usec(segment, channel, level, *lo) > from)) {
+    (*lo)--;
+  }
+  return *hi > *lo ? *hi - *lo : 0;
+}
+
+struct bin {
+  int32_t min, max;
+  int64_t sum;
+  uint32_t count;
+};
+
+static void add_to_bin(struct bin *bin, int32_t min, int32_t max, int64_t sum, uint32_t count) {
+  if (bin->count == 0 || min < bin->min) bin->min = min;
+  if (bin->count == 0 || max > bin->max) bin->max = max;
+  bin->sum += sum;
+  bin->count += count;
+}
+
+struct query {
+  int channel;
+  int64_t from, to;                     // CLOCK_REALTIME
+  double binUsec;
+  int width;
+  struct bin *bins;
+};
+
+static int bin_for(const struct query *query, int64_t usec) {
+  int b = usec <= query->from || query->binUsec == 0 ? 0 :
+          (int) ((usec - query->from) / query->binUsec);
+  return b >= query->width ? query->width - 1 : b;
+}
+
+// Add a block's samples of the query's channel between from and to, and
+// after after, which leaves out those already in the summaries
+static void bin_block(const struct query *query, const struct telemetry_block *block,
+                      int64_t realtimeOffsetUsec, int64_t after, struct telemetry_record *records) {
+  int type = channel_values[query->channel].type, index = channel_values[query->channel].index;
+  int i, n;
+
+  if ((int64_t) block->lastUsec + realtimeOffsetUsec < query->from ||
+      (int64_t) block->firstUsec + realtimeOffsetUsec > query->to ||
+      (int64_t) block->lastUsec + realtimeOffsetUsec <= after ||
+      (n = telemetry_decode_block(block, 1u << type, records)) <= 0) {
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    int64_t usec = (int64_t) records[i].usec + realtimeOffsetUsec;
+    int32_t value = records[i].values[index];
+    if (records[i].type == type && !(records[i].flags & TELEMETRY_FAILED) &&
+        usec >= query->from && usec <= query->to && usec > after) {
+      add_to_bin(&query->bins[bin_for(query, usec)], value, value, value, 1);
+    }
+  }
+}
+
+// The time of the latest sample of a channel in a block
+static int64_t latest_in_block(const struct telemetry_block *block, int channel,
+                               int64_t realtimeOffsetUsec, struct telemetry_record *records) {
+  int type = channel_values[channel].type;
+  int64_t latest = 0;
+  int i, n = telemetry_decode_block(block, 1u << type, records);
+  for (i = 0; i < n; i++) {
+    int64_t usec = (int64_t) records[i].usec + realtimeOffsetUsec;
+    if (records[i].type == type && !(records[i].flags & TELEMETRY_FAILED) && usec > latest) {
+      latest = usec;
+    }
+  }
+  return latest;
+}
+
+// A segment whose blocks a query reads, copied out from under the lock
+struct to_read {
+  char *path;
+  int64_t realtimeOffsetUsec;
+};
+
+int history_query(struct history *history, enum history_channel channel,
+                  double *from, double *to, int width, struct history_point *points, int *level) {
+  struct telemetry_record *records = malloc(TELEMETRY_BLOCK_RECORDS * sizeof(*records));
+  struct bin *bins = calloc(width > 0 ? width : 1, sizeof(*bins));
+  struct to_read *toRead = NULL;
+  struct telemetry_segment live;
+  struct query query;
+  char *livePath = NULL;
+  int64_t startUsec = 0, latestUsec = 0, liveOffsetUsec = 0, liveLastUsec = 0;
+  uint32_t lo, hi, i, entries;
+  int c, k, b, s, numPoints = 0, numToRead = 0, haveLive = 0;
+
+  *level = 0;
+  if (width > HISTORY_MAX_WIDTH) {
+    width = HISTORY_MAX_WIDTH;
+  }
+  if (records == NULL || bins == NULL || width <= 0) {
+    free(records);
+    free(bins);
+    *from = *to = 0;
+    return 0;
+  }
+  load_segments(history, records);
+
+  // The samples of the segment being written that aren't summarised yet are
+  // in the block it's still adding to. Reading that, like reading any of the
+  // log, is done without holding the lock, which the telemetry writer needs.
+  pthread_mutex_lock(&history->lock);
+  if (history->numSegments > 0 && history->segments[history->numSegments - 1]->live) {
+    livePath = strdup(history->segments[history->numSegments - 1]->path);
+  }
+  pthread_mutex_unlock(&history->lock);
+  if (livePath != NULL && telemetry_open(&live, livePath)) {
+    haveLive = 1;
+    liveOffsetUsec = live.header->realtimeOffsetUsec;
+    if (live.pending != NULL) {
+      latestUsec = latest_in_block(live.pending, channel, liveOffsetUsec, records);
+    }
+  }
+
+  pthread_mutex_lock(&history->lock);
+  for (s = 0; s < history->numSegments; s++) {
+    const struct history_file_header *header = &history->segments[s]->header;
+    for (c = 0; c < NUM_HISTORY_CHANNELS; c++) {
+      if (header->counts[c][0] > 0 && (startUsec == 0 || header->firstUsec[c] < startUsec)) {
+        startUsec = header->firstUsec[c];
+      }
+    }
+    if (header->counts[channel][0] > 0 && header->lastUsec[channel] > latestUsec) {
+      latestUsec = header->lastUsec[channel];
+    }
+  }
+  if (startUsec == 0 || latestUsec < startUsec) {
+    startUsec = latestUsec;
+  }
+  if (latestUsec == 0) {
+    pthread_mutex_unlock(&history->lock);
+    if (haveLive) {
+      telemetry_close(&live);
+    }
+    free(livePath);
+    free(records);
+    free(bins);
+    *from = *to = 0;
+    return 0;
+  }
+
+  double latest = (latestUsec - startUsec) / 1e6;
+  if (*to <= 0 || *to > latest) {
+    *to = latest;
+  }
+  if (*from < 0) {
+    *from = latest + *from < 0 ? 0 : latest + *from;
+  }
+  if (*from > *to) {
+    *from = *to;
+  }
+  query.channel = channel;
+  query.from = startUsec + (int64_t) floor(*from * 1e6);
+  query.to = startUsec + (int64_t) ceil(*to * 1e6);
+  query.binUsec = (query.to - query.from) / (double) width;
+  query.width = width;
+  query.bins = bins;
+
+  // The finest level with no more than HISTORY_FANOUT entries a pixel, so
+  // there's still at least one a pixel wherever the samples are as dense as
+  // on average. No more than one level 1 entry a pixel means no more than
+  // HISTORY_FANOUT samples, so then they're read from the log.
+  for (k = 1; k < HISTORY_LEVELS; k++) {
+    entries = 0;
+    for (s = 0; s < history->numSegments; s++) {
+      entries += entries_between(history->segments[s], channel, k, query.from, query.to, &lo, &hi);
+    }
+    if (k == 1 && entries <= (uint32_t) width) {
+      k = 0;
+      break;
+    }
+    if (entries <= HISTORY_FANOUT * (uint32_t) width) {
+      break;
+    }
+  }
+  if (k == HISTORY_LEVELS) {
+    k = HISTORY_LEVELS - 1;
+  }
+  *level = k;
+
+  // Summaries are in memory, so they're merged here. For level 0, just note
+  // which segments to read; the one being written always is, as its pending
+  // block isn't in its header's times yet.
+  if (k == 0) {
+    toRead = malloc(history->numSegments * sizeof(*toRead));
+  }
+  for (s = 0; s < history->numSegments; s++) {
+    const struct history_segment *segment = history->segments[s];
+    if (k == 0) {
+      int isLive = haveLive && strcmp(segment->path, livePath) == 0;
+      if (toRead == NULL ||
+          (!isLive && (segment->header.counts[channel][0] == 0 ||
+                       segment->header.lastUsec[channel] < query.from ||
+                       segment->header.firstUsec[channel] > query.to))) {
+        continue;
+      }
+      if ((toRead[numToRead].path = strdup(segment->path)) != NULL) {
+        toRead[numToRead++].realtimeOffsetUsec = segment->header.realtimeOffsetUsec;
+      }
+    } else {
+      entries_between(segment, channel, k, query.from, query.to, &lo, &hi);
+      for (i = lo; i < hi; i++) {
+        const struct history_summary *entry = &segment->levels[channel][k][i];
+        b = bin_for(&query, entry_usec(segment, channel, k, i));
+        add_to_bin(&bins[b], entry->min, entry->max, entry->sum, entry->count);
+      }
+      // Anything in the pending block up to the summaries' last sample has
+      // been added to them since it was read
+      if (haveLive && strcmp(segment->path, livePath) == 0 &&
+          segment->header.counts[channel][0] > 0) {
+        liveLastUsec = segment->header.lastUsec[channel];
+      }
+    }
+  }
+  pthread_mutex_unlock(&history->lock);
+
+  if (k == 0) {
+    for (s = 0; s < numToRead; s++) {
+      struct telemetry_segment opened;
+      const struct telemetry_block *block;
+      size_t offset = 0;
+      int isLive = haveLive && strcmp(toRead[s].path, livePath) == 0;
+      if (isLive || telemetry_open(&opened, toRead[s].path)) {
+        while ((block = telemetry_next_block(isLive ? &live : &opened, &offset)) != NULL) {
+          bin_block(&query, block, toRead[s].realtimeOffsetUsec, 0, records);
+        }
+        if (!isLive) {
+          telemetry_close(&opened);
+        }
+      }
+      free(toRead[s].path);
+    }
+    free(toRead);
+  } else if (haveLive && live.pending != NULL) {
+    bin_block(&query, live.pending, liveOffsetUsec, liveLastUsec, records);
+  }
+  if (haveLive) {
+    telemetry_close(&live);
+  }
+  free(livePath);
+
+  for (b = 0; b < width; b++) {
+    if (bins[b].count > 0) {
+      points[numPoints].t = (query.from + b * query.binUsec - startUsec) / 1e6;
+      points[numPoints].min = bins[b].min;
+      points[numPoints].max = bins[b].max;
+      points[numPoints].mean = (double) bins[b].sum / bins[b].count;
+      numPoints++;
+    }
+  }
+  free(records);
+  free(bins);
+  return numPoints;
+}
@@ -0,0 +1,114 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Sensor history
+//
+// Graphs of the sensor readings in the telemetry log (telemetry.h), however
+// much of it there is, without anything having to read through all of it.
+// Over the samples of each channel is a pyramid of summaries: each entry at
+// level 1 is the min, max and sum of 16 samples, at level 2 of 16 level 1
+// entries, and so on. A query for a graph w pixels wide picks the finest
+// level with no more than 16 entries per pixel over the time asked for and
+// merges those, so it takes time in proportion to w however long the log is.
+//
+// The samples themselves, level 0, are only in the log: a query fine enough
+// to need them decodes the log's blocks for the time asked for. The summary
+// levels are kept with the log, in a companion file beside each segment
+// ("telemetry-000001.sum" for "telemetry-000001.rtl"), so they last as long
+// as the segment does and survive restarts. The summaries of the segment
+// being written are built in memory from each block as the telemetry writer
+// finishes it (history_add_block()), and written out when it moves on to the
+// next segment. A segment without a companion, such as one that was being
+// written when rt_http stopped, or one being replayed, has its summaries
+// built from its blocks the first time a query needs them, and the companion
+// written then.
+//
+// Samples that failed to be read aren't included, nor in the summaries are
+// any after the first HISTORY_MAX_SAMPLES of a channel in a segment, which
+// keeps the memory for the segment being written under a megabyte. Times
+// are CLOCK_REALTIME, so segments from before a reboot line up with those
+// after.
+//
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "telemetry.h"
+
+#define HISTORY_MAGIC 0x53485452        // "RTHS"
+#define HISTORY_FANOUT 16
+#define HISTORY_LEVELS 6                // Top entries cover 16^5 samples
+#define HISTORY_MAX_SAMPLES 100000      // Per channel per segment, hours of readings
+#define HISTORY_MAX_WIDTH 4096          // Points a query can ask for
+
+enum history_channel {
+  HISTORY_RANGE,                        // cm
+  HISTORY_BEARING,                      // Tenths of a degree
+  HISTORY_PITCH,
+  HISTORY_ROLL,
+  NUM_HISTORY_CHANNELS
+};
+
+extern const char* const history_channel_names[NUM_HISTORY_CHANNELS];
+
+struct history_summary {
+  uint32_t msec;                        // Of its first sample, after the segment's baseUsec
+  int32_t min, max;
+  uint32_t count;
+  int64_t sum;
+};
+
+// At the start of each companion file, followed by the summaries of each
+// channel at levels 1 and up, in that order
+struct history_file_header {
+  uint32_t magic;                       // HISTORY_MAGIC
+  uint16_t headerSize;                  // sizeof(struct history_file_header)
+  uint16_t summarySize;                 // sizeof(struct history_summary)
+  uint32_t segment;                     // Number of the segment it summarises
+  uint32_t reserved;
+  int64_t realtimeOffsetUsec;           // The segment's, to tell it from another numbered the same
+  int64_t baseUsec;                     // CLOCK_REALTIME that summaries' msec count from
+  int64_t firstUsec[NUM_HISTORY_CHANNELS];  // CLOCK_REALTIME of the first sample
+  int64_t lastUsec[NUM_HISTORY_CHANNELS];   // and of the last
+  uint32_t counts[NUM_HISTORY_CHANNELS][HISTORY_LEVELS];  // Summaries, [0] samples
+};
+
+struct history_segment;
+
+struct history {
+  pthread_mutex_t lock;                 // For everything here
+  pthread_mutex_t loading;              // Held while summaries are read or built
+  char *directory;                      // Where the segments are
+  struct history_segment **segments;    // Oldest first
+  int numSegments;
+};
+
+// A pixel's worth of a query
+struct history_point {
+  double t;                             // s since the first sample, at the pixel's start
+  int32_t min, max;
+  double mean;
+};
+
+// Start with the segments of a telemetry log, a directory of them or a
+// single segment file, as they are now. Their summaries are read, or built,
+// when a query first needs them.
+void history_init(struct history *history, const char *path);
+
+// Add a finished block of records from the segment being written. Made to be
+// passed to telemetry_set_block_hook(), with the history as arg, for a log
+// in the directory given to history_init().
+void history_add_block(const struct telemetry_header *segment,
+                       const struct telemetry_record *records, int count, void *arg);
+
+// Summarise a channel between from and to, in s since the first sample, into
+// at most width points, one per pixel that has any samples, in time order.
+// A from below 0 counts back from the latest sample and a to of 0 or less is
+// the latest sample, so 0 to 0 is the whole log and -600 to 0 the last ten
+// minutes. Sets *from and *to to the times used and *level to the level the
+// points came from. Returns the number of points.
+int history_query(struct history *history, enum history_channel channel,
+                  double *from, double *to, int width, struct history_point *points, int *level);
+
+#endif
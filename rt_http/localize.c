@@ -0,0 +1,763 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Localization
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "localize.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define LOCALIZE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LOCALIZE_SSE2
+#endif
+
+#define CELLS_PER_M (100.0f / LOCALIZE_CELL_CM)
+#define MAX_CELLS ((float) LOCALIZE_MAX_RANGE_CM / LOCALIZE_CELL_CM)
+#define SENSOR_OFFSET (0.25f * CELLS_PER_M)   // SRF02 in front of the middle, cells
+#define RAY_ANGLE 0.35f                       // Of the outer rays from the middle one
+#define CLEARANCE 5                           // Cells a particle needs around it
+#define OCCUPIED_PIXEL 84                     // Log-odds of 44 in rt_world's maps
+
+// Sensor model. Each measurement's log-likelihood is a Gaussian's, but never
+// less than at 3 standard deviations out, so one bad reading can't wipe out
+// the particles that are right.
+#define RANGE_SIGMA 15.0f                     // cm
+#define BEARING_SIGMA (10 * (float) M_PI / 180)
+#define MAX_SQUARED_ERROR 9.0f
+#define OFF_MAP_PENALTY 50.0f                 // Log weight lost stuck in a wall
+
+// Motion model: noise on each part of a move, in proportion to it
+#define TRANSLATION_NOISE 0.1
+#define ROTATION_NOISE 0.1
+#define MIN_TRANSLATION_NOISE 0.01            // m, whenever it moves
+#define MIN_ROTATION_NOISE 0.02               // rad
+
+static const float raySin[LOCALIZE_RAYS] = {-0.34289781f, 0.0f, 0.34289781f};   // sin(RAY_ANGLE)
+static const float rayCos[LOCALIZE_RAYS] = {0.93937271f, 1.0f, 0.93937271f};
+
+static double wrap(double angle) {
+  angle = fmod(angle, 2 * M_PI);
+  return angle < 0 ? angle + 2 * M_PI : angle;
+}
+
+static double difference(double a, double b) {
+  return remainder(a - b, 2 * M_PI);
+}
+
+// xorshift64*
+static uint32_t random32(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return (uint32_t) ((*state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static double random_uniform(uint64_t *state) {
+  return (random32(state) + 0.5) / 4294967296.0;
+}
+
+static double random_gaussian(uint64_t *state, double sigma) {
+  double u1 = random_uniform(state), u2 = random_uniform(state);
+  return sigma * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+
+// Maps
+
+int localize_map_create(struct localize_map *map, int width, int height,
+                        double originX, double originY) {
+  map->width = width;
+  map->height = height;
+  map->originX = originX;
+  map->originY = originY;
+  map->distance = malloc((size_t) width * height);
+  if (map->distance == NULL) {
+    return 0;
+  }
+  memset(map->distance, 255, (size_t) width * height);
+  return 1;
+}
+
+void localize_map_set(struct localize_map *map, double x, double y) {
+  int column = (int) floor((x - map->originX) * CELLS_PER_M);
+  int row = (int) floor((y - map->originY) * CELLS_PER_M);
+  if (column >= 0 && column < map->width && row >= 0 && row < map->height) {
+    map->distance[row * map->width + column] = 0;
+  }
+}
+
+// Chamfer distance transform, in thirds of a cell: a pass from the south-west
+// and one back from the north-east, with steps of 3 straight and 4 diagonally
+void localize_map_finish(struct localize_map *map) {
+  int w = map->width, h = map->height, x, y;
+  uint16_t *d = malloc((size_t) w * h * sizeof(uint16_t));
+
+  if (d == NULL) {
+    return;
+  }
+  for (x = 0; x < w * h; x++) {
+    d[x] = map->distance[x] == 0 ? 0 : UINT16_MAX / 2;
+  }
+#define RELAX(cx, cy, step) \
+  if ((cx) >= 0 && (cx) < w && (cy) >= 0 && (cy) < h && d[(cy) * w + (cx)] + (step) < d[y * w + x]) \
+    d[y * w + x] = d[(cy) * w + (cx)] + (step)
+  for (y = 0; y < h; y++) {
+    for (x = 0; x < w; x++) {
+      RELAX(x - 1, y, 3);
+      RELAX(x - 1, y - 1, 4);
+      RELAX(x, y - 1, 3);
+      RELAX(x + 1, y - 1, 4);
+    }
+  }
+  for (y = h - 1; y >= 0; y--) {
+    for (x = w - 1; x >= 0; x--) {
+      RELAX(x + 1, y, 3);
+      RELAX(x + 1, y + 1, 4);
+      RELAX(x, y + 1, 3);
+      RELAX(x - 1, y + 1, 4);
+    }
+  }
+#undef RELAX
+  for (x = 0; x < w * h; x++) {
+    map->distance[x] = d[x] / 3 > 255 ? 255 : d[x] / 3;
+  }
+  free(d);
+}
+
+int localize_map_load(struct localize_map *map, const char *path) {
+  char line[256];
+  int width = 0, height = 0, maxValue = 0, x, y;
+  double originX = 0, originY = 0;
+  FILE *f = fopen(path, "rb");
+
+  if (f == NULL) {
+    return 0;
+  }
+  // Header fields, any of them maybe followed by comments
+  int fields[3], numFields = 0;
+  if (fgets(line, sizeof(line), f) == NULL || strncmp(line, "P5", 2) != 0) {
+    fclose(f);
+    return 0;
+  }
+  while (numFields < 3 && fgets(line, sizeof(line), f) != NULL) {
+    if (line[0] == '#') {
+      sscanf(line, "# origin %lf %lf", &originX, &originY);
+      continue;
+    }
+    char *p = line, *end;
+    while (numFields < 3 && (fields[numFields] = (int) strtol(p, &end, 10), end != p)) {
+      numFields++;
+      p = end;
+    }
+  }
+  width = fields[0];
+  height = fields[1];
+  maxValue = fields[2];
+  if (numFields < 3 || width <= 0 || height <= 0 || maxValue != 255 ||
+      !localize_map_create(map, width, height, originX, originY)) {
+    fclose(f);
+    return 0;
+  }
+  for (y = height - 1; y >= 0; y--) {
+    for (x = 0; x < width; x++) {
+      int pixel = fgetc(f);
+      if (pixel == EOF) {
+        localize_map_destroy(map);
+        fclose(f);
+        return 0;
+      }
+      if (pixel <= OCCUPIED_PIXEL) {
+        map->distance[y * width + x] = 0;
+      }
+    }
+  }
+  fclose(f);
+  localize_map_finish(map);
+  return 1;
+}
+
+void localize_map_destroy(struct localize_map *map) {
+  free(map->distance);
+  map->distance = NULL;
+}
+
+
+// Raycasting. Each particle's rays start from where its SRF02 would be, in
+// cells from the map's corner, and step through the map by the distance to
+// the nearest occupied cell less one, at least one cell, until they hit one,
+// leave the map or go out of range.
+
+static float cast(const struct localize_map *map, float startX, float startY, float dx, float dy) {
+  float width = (float) map->width, height = (float) map->height;
+  float t = 0;
+
+  while (t < MAX_CELLS) {
+    float px = startX + t * dx, py = startY + t * dy;
+    if (!(px >= 0 && px < width && py >= 0 && py < height)) {
+      t = MAX_CELLS;
+      break;
+    }
+    float d = map->distance[(int) py * map->width + (int) px];
+    if (d == 0) {
+      break;
+    }
+    float step = d - 1;
+    t = t + (step > 1 ? step : 1);
+  }
+  return t < MAX_CELLS ? t : MAX_CELLS;
+}
+
+static void raycast_particle(const struct localize_map *map, float originX, float originY,
+                             float x, float y, float s, float c, float *expected) {
+  float startX = (x - originX) * CELLS_PER_M + SENSOR_OFFSET * s;
+  float startY = (y - originY) * CELLS_PER_M + SENSOR_OFFSET * c;
+  float nearest = MAX_CELLS;
+  int r;
+
+  for (r = 0; r < LOCALIZE_RAYS; r++) {
+    float dx = s * rayCos[r] + c * raySin[r];
+    float dy = c * rayCos[r] - s * raySin[r];
+    float t = cast(map, startX, startY, dx, dy);
+    nearest = t < nearest ? t : nearest;
+  }
+  *expected = nearest * LOCALIZE_CELL_CM;
+}
+
+void localize_raycast_scalar(const struct localize_map *map, const float *x, const float *y,
+                             const float *sinHeading, const float *cosHeading, float *expected, int n) {
+  float originX = (float) map->originX, originY = (float) map->originY;
+  int i;
+  for (i = 0; i < n; i++) {
+    raycast_particle(map, originX, originY, x[i], y[i], sinHeading[i], cosHeading[i], &expected[i]);
+  }
+}
+
+// Four rays at a time, one per lane, carrying on until they've all stopped.
+// The vector instructions can't look up cells, so that's done a lane at a
+// time, only for lanes still going.
+void localize_raycast(const struct localize_map *map, const float *x, const float *y,
+                      const float *sinHeading, const float *cosHeading, float *expected, int n) {
+  float originX = (float) map->originX, originY = (float) map->originY;
+  int i = 0, r, lane;
+#if defined(LOCALIZE_SSE2)
+  __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1), maxCells = _mm_set1_ps(MAX_CELLS);
+  __m128 width = _mm_set1_ps((float) map->width), height = _mm_set1_ps((float) map->height);
+  int32_t columns[4] __attribute__((aligned(16))), rows[4] __attribute__((aligned(16)));
+  float distances[4] __attribute__((aligned(16)));
+
+  for (; i + 4 <= n; i += 4) {
+    __m128 s = _mm_loadu_ps(&sinHeading[i]), c = _mm_loadu_ps(&cosHeading[i]);
+    __m128 startX = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&x[i]), _mm_set1_ps(originX)),
+                                          _mm_set1_ps(CELLS_PER_M)),
+                               _mm_mul_ps(_mm_set1_ps(SENSOR_OFFSET), s));
+    __m128 startY = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&y[i]), _mm_set1_ps(originY)),
+                                          _mm_set1_ps(CELLS_PER_M)),
+                               _mm_mul_ps(_mm_set1_ps(SENSOR_OFFSET), c));
+    __m128 nearest = maxCells;
+    for (r = 0; r < LOCALIZE_RAYS; r++) {
+      __m128 dx = _mm_add_ps(_mm_mul_ps(s, _mm_set1_ps(rayCos[r])), _mm_mul_ps(c, _mm_set1_ps(raySin[r])));
+      __m128 dy = _mm_sub_ps(_mm_mul_ps(c, _mm_set1_ps(rayCos[r])), _mm_mul_ps(s, _mm_set1_ps(raySin[r])));
+      __m128 t = zero;
+      __m128 active = _mm_cmplt_ps(t, maxCells);
+      int mask;
+      while ((mask = _mm_movemask_ps(active)) != 0) {
+        __m128 px = _mm_add_ps(startX, _mm_mul_ps(t, dx));
+        __m128 py = _mm_add_ps(startY, _mm_mul_ps(t, dy));
+        __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(px, zero), _mm_cmplt_ps(px, width)),
+                                   _mm_and_ps(_mm_cmpge_ps(py, zero), _mm_cmplt_ps(py, height)));
+        __m128 leaving = _mm_andnot_ps(inside, active);
+        t = _mm_or_ps(_mm_and_ps(leaving, maxCells), _mm_andnot_ps(leaving, t));
+        active = _mm_and_ps(active, inside);
+        mask = _mm_movemask_ps(active);
+
+        _mm_store_si128((__m128i *) columns, _mm_cvttps_epi32(px));
+        _mm_store_si128((__m128i *) rows, _mm_cvttps_epi32(py));
+        for (lane = 0; lane < 4; lane++) {
+          distances[lane] = (mask >> lane) & 1 ? map->distance[rows[lane] * map->width + columns[lane]] : 0;
+        }
+        __m128 d = _mm_load_ps(distances);
+        active = _mm_and_ps(active, _mm_cmpneq_ps(d, zero));
+        __m128 step = _mm_sub_ps(d, one);
+        step = _mm_or_ps(_mm_and_ps(_mm_cmpgt_ps(step, one), step), _mm_andnot_ps(_mm_cmpgt_ps(step, one), one));
+        t = _mm_add_ps(t, _mm_and_ps(active, step));
+        active = _mm_and_ps(active, _mm_cmplt_ps(t, maxCells));
+      }
+      t = _mm_min_ps(t, maxCells);
+      nearest = _mm_min_ps(t, nearest);
+    }
+    _mm_storeu_ps(&expected[i], _mm_mul_ps(nearest, _mm_set1_ps(LOCALIZE_CELL_CM)));
+  }
+#elif defined(LOCALIZE_NEON)
+  float32x4_t zero = vdupq_n_f32(0), one = vdupq_n_f32(1), maxCells = vdupq_n_f32(MAX_CELLS);
+  float32x4_t width = vdupq_n_f32((float) map->width), height = vdupq_n_f32((float) map->height);
+  int32_t columns[4], rows[4];
+  uint32_t lanes[4];
+  float distances[4];
+
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t s = vld1q_f32(&sinHeading[i]), c = vld1q_f32(&cosHeading[i]);
+    float32x4_t startX = vaddq_f32(vmulq_f32(vsubq_f32(vld1q_f32(&x[i]), vdupq_n_f32(originX)),
+                                             vdupq_n_f32(CELLS_PER_M)),
+                                   vmulq_f32(vdupq_n_f32(SENSOR_OFFSET), s));
+    float32x4_t startY = vaddq_f32(vmulq_f32(vsubq_f32(vld1q_f32(&y[i]), vdupq_n_f32(originY)),
+                                             vdupq_n_f32(CELLS_PER_M)),
+                                   vmulq_f32(vdupq_n_f32(SENSOR_OFFSET), c));
+    float32x4_t nearest = maxCells;
+    for (r = 0; r < LOCALIZE_RAYS; r++) {
+      float32x4_t dx = vaddq_f32(vmulq_f32(s, vdupq_n_f32(rayCos[r])), vmulq_f32(c, vdupq_n_f32(raySin[r])));
+      float32x4_t dy = vsubq_f32(vmulq_f32(c, vdupq_n_f32(rayCos[r])), vmulq_f32(s, vdupq_n_f32(raySin[r])));
+      float32x4_t t = zero;
+      uint32x4_t active = vcltq_f32(t, maxCells);
+      for (;;) {
+        uint32x2_t any = vpmax_u32(vget_low_u32(active), vget_high_u32(active));
+        if (vget_lane_u32(vpmax_u32(any, any), 0) == 0) {
+          break;
+        }
+        float32x4_t px = vaddq_f32(startX, vmulq_f32(t, dx));
+        float32x4_t py = vaddq_f32(startY, vmulq_f32(t, dy));
+        uint32x4_t inside = vandq_u32(vandq_u32(vcgeq_f32(px, zero), vcltq_f32(px, width)),
+                                      vandq_u32(vcgeq_f32(py, zero), vcltq_f32(py, height)));
+        uint32x4_t leaving = vbicq_u32(active, inside);
+        t = vbslq_f32(leaving, maxCells, t);
+        active = vandq_u32(active, inside);
+
+        vst1q_s32(columns, vcvtq_s32_f32(px));
+        vst1q_s32(rows, vcvtq_s32_f32(py));
+        vst1q_u32(lanes, active);
+        for (lane = 0; lane < 4; lane++) {
+          distances[lane] = lanes[lane] ? map->distance[rows[lane] * map->width + columns[lane]] : 0;
+        }
+        float32x4_t d = vld1q_f32(distances);
+        active = vandq_u32(active, vmvnq_u32(vceqq_f32(d, zero)));
+        float32x4_t step = vsubq_f32(d, one);
+        step = vbslq_f32(vcgtq_f32(step, one), step, one);
+        t = vaddq_f32(t, vreinterpretq_f32_u32(vandq_u32(active, vreinterpretq_u32_f32(step))));
+        active = vandq_u32(active, vcltq_f32(t, maxCells));
+      }
+      t = vbslq_f32(vcltq_f32(t, maxCells), t, maxCells);
+      nearest = vbslq_f32(vcltq_f32(t, nearest), t, nearest);
+    }
+    vst1q_f32(&expected[i], vmulq_f32(nearest, vdupq_n_f32(LOCALIZE_CELL_CM)));
+  }
+#endif
+  for (; i < n; i++) {
+    raycast_particle(map, originX, originY, x[i], y[i], sinHeading[i], cosHeading[i], &expected[i]);
+  }
+}
+
+
+// Weighing. Heading and bearing are both 0 to 2 pi, so their difference is
+// brought into -pi to pi by taking off the nearest multiple of 2 pi, found by
+// truncating, which is the same in every version.
+
+static float weigh_particle(float expected, float heading, float range, float bearing, float logWeight) {
+  if (range >= 0) {
+    float e = (expected - range) * (1 / RANGE_SIGMA);
+    float q = e * e;
+    logWeight = logWeight - 0.5f * (q < MAX_SQUARED_ERROR ? q : MAX_SQUARED_ERROR);
+  }
+  if (bearing >= 0) {
+    float e = heading - bearing;
+    float turns = (float) (int) (e * (float) (0.5 / M_PI) + 2.5f) - 2.0f;
+    e = (e - turns * (float) (2 * M_PI)) * (1 / BEARING_SIGMA);
+    float q = e * e;
+    logWeight = logWeight - 0.5f * (q < MAX_SQUARED_ERROR ? q : MAX_SQUARED_ERROR);
+  }
+  return logWeight;
+}
+
+void localize_weigh_scalar(const float *expected, const float *heading, float range, float bearing,
+                           float *logWeight, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    logWeight[i] = weigh_particle(expected[i], heading[i], range, bearing, logWeight[i]);
+  }
+}
+
+void localize_weigh(const float *expected, const float *heading, float range, float bearing,
+                    float *logWeight, int n) {
+  int i = 0;
+#if defined(LOCALIZE_SSE2)
+  __m128 half = _mm_set1_ps(0.5f), maxError = _mm_set1_ps(MAX_SQUARED_ERROR);
+  for (; i + 4 <= n; i += 4) {
+    __m128 lw = _mm_loadu_ps(&logWeight[i]);
+    if (range >= 0) {
+      __m128 e = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&expected[i]), _mm_set1_ps(range)),
+                            _mm_set1_ps(1 / RANGE_SIGMA));
+      lw = _mm_sub_ps(lw, _mm_mul_ps(half, _mm_min_ps(_mm_mul_ps(e, e), maxError)));
+    }
+    if (bearing >= 0) {
+      __m128 e = _mm_sub_ps(_mm_loadu_ps(&heading[i]), _mm_set1_ps(bearing));
+      __m128 turns = _mm_sub_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(
+                                  _mm_add_ps(_mm_mul_ps(e, _mm_set1_ps((float) (0.5 / M_PI))),
+                                             _mm_set1_ps(2.5f)))),
+                                _mm_set1_ps(2.0f));
+      e = _mm_mul_ps(_mm_sub_ps(e, _mm_mul_ps(turns, _mm_set1_ps((float) (2 * M_PI)))),
+                     _mm_set1_ps(1 / BEARING_SIGMA));
+      lw = _mm_sub_ps(lw, _mm_mul_ps(half, _mm_min_ps(_mm_mul_ps(e, e), maxError)));
+    }
+    _mm_storeu_ps(&logWeight[i], lw);
+  }
+#elif defined(LOCALIZE_NEON)
+  float32x4_t half = vdupq_n_f32(0.5f), maxError = vdupq_n_f32(MAX_SQUARED_ERROR);
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t lw = vld1q_f32(&logWeight[i]);
+    if (range >= 0) {
+      float32x4_t e = vmulq_f32(vsubq_f32(vld1q_f32(&expected[i]), vdupq_n_f32(range)),
+                                vdupq_n_f32(1 / RANGE_SIGMA));
+      float32x4_t q = vmulq_f32(e, e);
+      lw = vsubq_f32(lw, vmulq_f32(half, vbslq_f32(vcltq_f32(q, maxError), q, maxError)));
+    }
+    if (bearing >= 0) {
+      float32x4_t e = vsubq_f32(vld1q_f32(&heading[i]), vdupq_n_f32(bearing));
+      float32x4_t turns = vsubq_f32(vcvtq_f32_s32(vcvtq_s32_f32(
+                                      vaddq_f32(vmulq_f32(e, vdupq_n_f32((float) (0.5 / M_PI))),
+                                                vdupq_n_f32(2.5f)))),
+                                    vdupq_n_f32(2.0f));
+      e = vmulq_f32(vsubq_f32(e, vmulq_f32(turns, vdupq_n_f32((float) (2 * M_PI)))),
+                    vdupq_n_f32(1 / BEARING_SIGMA));
+      float32x4_t q = vmulq_f32(e, e);
+      lw = vsubq_f32(lw, vmulq_f32(half, vbslq_f32(vcltq_f32(q, maxError), q, maxError)));
+    }
+    vst1q_f32(&logWeight[i], lw);
+  }
+#endif
+  for (; i < n; i++) {
+    logWeight[i] = weigh_particle(expected[i], heading[i], range, bearing, logWeight[i]);
+  }
+}
+
+
+// Particles
+
+static void set_heading(struct localizer *l, int i, double heading) {
+  l->heading[i] = (float) heading;
+  l->sinHeading[i] = (float) sin(heading);
+  l->cosHeading[i] = (float) cos(heading);
+}
+
+// Whether a particle is somewhere the tank could be
+static int free_at(const struct localize_map *map, double x, double y) {
+  int column = (int) floor((x - map->originX) * CELLS_PER_M);
+  int row = (int) floor((y - map->originY) * CELLS_PER_M);
+  return column >= 0 && column < map->width && row >= 0 && row < map->height &&
+         map->distance[row * map->width + column] >= CLEARANCE;
+}
+
+// Move a chunk of particles, then weigh them
+static void update_chunk(struct localizer *l, int chunk) {
+  int first = chunk * LOCALIZE_CHUNK;
+  int n = first + LOCALIZE_CHUNK <= l->n ? LOCALIZE_CHUNK : l->n - first;
+  uint64_t *seed = &l->chunkSeeds[chunk];
+  int i;
+
+  if (l->trans != 0 || l->rot1 != 0 || l->rot2 != 0) {
+    double transSigma = TRANSLATION_NOISE * fabs(l->trans) + MIN_TRANSLATION_NOISE;
+    double rot1Sigma = ROTATION_NOISE * fabs(l->rot1) + MIN_ROTATION_NOISE;
+    double rot2Sigma = ROTATION_NOISE * fabs(l->rot2) + MIN_ROTATION_NOISE;
+    for (i = first; i < first + n; i++) {
+      double heading = l->heading[i] + l->rot1 + random_gaussian(seed, rot1Sigma);
+      double trans = l->trans + random_gaussian(seed, transSigma);
+      float x = l->x[i] + (float) (trans * sin(heading));
+      float y = l->y[i] + (float) (trans * cos(heading));
+      set_heading(l, i, wrap(heading + l->rot2 + random_gaussian(seed, rot2Sigma)));
+
+      // Like the tank, a particle that runs into something stops there,
+      // which is what keeps them right while odometry thinks it's moving
+      if (free_at(l->map, x, y)) {
+        l->x[i] = x;
+        l->y[i] = y;
+      } else if (!free_at(l->map, l->x[i], l->y[i])) {
+        l->logWeight[i] -= OFF_MAP_PENALTY;
+      }
+    }
+  }
+  if (l->range >= 0) {
+    localize_raycast(l->map, &l->x[first], &l->y[first], &l->sinHeading[first],
+                     &l->cosHeading[first], &l->expected[first], n);
+  }
+  localize_weigh(&l->expected[first], &l->heading[first], l->range, l->bearing,
+                 &l->logWeight[first], n);
+}
+
+// Take chunks until there are none left
+static void work(struct localizer *l) {
+  int chunk;
+  while ((chunk = __atomic_fetch_add(&l->nextChunk, 1, __ATOMIC_ACQ_REL)) < l->numChunks) {
+    update_chunk(l, chunk);
+    if (__atomic_add_fetch(&l->chunksDone, 1, __ATOMIC_ACQ_REL) == l->numChunks) {
+      pthread_mutex_lock(&l->lock);
+      pthread_cond_signal(&l->workDone);
+      pthread_mutex_unlock(&l->lock);
+    }
+  }
+}
+
+static void *worker_thread(void *arg) {
+  struct localizer *l = arg;
+  unsigned seen = 0;
+
+  pthread_mutex_lock(&l->lock);
+  for (;;) {
+    while (l->generation == seen && !l->stopping) {
+      pthread_cond_wait(&l->workReady, &l->lock);
+    }
+    if (l->stopping) {
+      break;
+    }
+    seen = l->generation;
+    pthread_mutex_unlock(&l->lock);
+    work(l);
+    pthread_mutex_lock(&l->lock);
+  }
+  pthread_mutex_unlock(&l->lock);
+  return NULL;
+}
+
+// Update every chunk, sharing them between the threads and this one
+static void update_all(struct localizer *l) {
+  pthread_mutex_lock(&l->lock);
+  __atomic_store_n(&l->chunksDone, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&l->nextChunk, 0, __ATOMIC_RELEASE);
+  l->generation++;
+  pthread_cond_broadcast(&l->workReady);
+  pthread_mutex_unlock(&l->lock);
+
+  work(l);
+
+  pthread_mutex_lock(&l->lock);
+  while (__atomic_load_n(&l->chunksDone, __ATOMIC_ACQUIRE) < l->numChunks) {
+    pthread_cond_wait(&l->workDone, &l->lock);
+  }
+  pthread_mutex_unlock(&l->lock);
+}
+
+struct localizer *localize_create(const struct localize_map *map, int n, int threads,
+                                  uint64_t seed) {
+  struct localizer *l = calloc(1, sizeof(*l));
+  float **arrays[] = {&l->x, &l->y, &l->heading, &l->sinHeading, &l->cosHeading, &l->logWeight,
+                      &l->expected, &l->spare[0], &l->spare[1], &l->spare[2], &l->spare[3],
+                      &l->spare[4]};
+  int i;
+
+  if (l == NULL) {
+    return NULL;
+  }
+  l->map = map;
+  l->n = (n + 3) / 4 * 4;
+  l->numChunks = (l->n + LOCALIZE_CHUNK - 1) / LOCALIZE_CHUNK;
+  l->seed = seed * 0x9e3779b97f4a7c15ULL + 1;
+  for (i = 0; i < (int) (sizeof(arrays) / sizeof(arrays[0])); i++) {
+    if (posix_memalign((void **) arrays[i], 16, l->n * sizeof(float)) != 0) {
+      *arrays[i] = NULL;
+      localize_destroy(l);
+      return NULL;
+    }
+    memset(*arrays[i], 0, l->n * sizeof(float));
+  }
+  if ((l->chunkSeeds = malloc(l->numChunks * sizeof(uint64_t))) == NULL) {
+    localize_destroy(l);
+    return NULL;
+  }
+  for (i = 0; i < l->numChunks; i++) {
+    l->chunkSeeds[i] = (seed + i + 1) * 0xbf58476d1ce4e5b9ULL + 1;
+  }
+
+  pthread_mutex_init(&l->lock, NULL);
+  pthread_cond_init(&l->workReady, NULL);
+  pthread_cond_init(&l->workDone, NULL);
+  threads = threads < 1 ? 1 : threads > LOCALIZE_MAX_THREADS ? LOCALIZE_MAX_THREADS : threads;
+  for (l->numThreads = 1; l->numThreads < threads; l->numThreads++) {
+    if (pthread_create(&l->threads[l->numThreads - 1], NULL, worker_thread, l) != 0) {
+      break;
+    }
+  }
+  localize_spread(l);
+  return l;
+}
+
+void localize_destroy(struct localizer *l) {
+  int i;
+
+  if (l == NULL) {
+    return;
+  }
+  if (l->numThreads > 0) {
+    pthread_mutex_lock(&l->lock);
+    l->stopping = 1;
+    pthread_cond_broadcast(&l->workReady);
+    pthread_mutex_unlock(&l->lock);
+    for (i = 0; i < l->numThreads - 1; i++) {
+      pthread_join(l->threads[i], NULL);
+    }
+  }
+  free(l->x);
+  free(l->y);
+  free(l->heading);
+  free(l->sinHeading);
+  free(l->cosHeading);
+  free(l->logWeight);
+  free(l->expected);
+  for (i = 0; i < 5; i++) {
+    free(l->spare[i]);
+  }
+  free(l->chunkSeeds);
+  free(l);
+}
+
+// Work out the estimate from the weights, and publish it
+static void publish(struct localizer *l, const double *weights, double total) {
+  struct localize_estimate e = {0};
+  double sinSum = 0, cosSum = 0, spread = 0;
+  int i;
+
+  for (i = 0; i < l->n; i++) {
+    e.x += weights[i] * l->x[i];
+    e.y += weights[i] * l->y[i];
+    sinSum += weights[i] * l->sinHeading[i];
+    cosSum += weights[i] * l->cosHeading[i];
+  }
+  e.x /= total;
+  e.y /= total;
+  e.heading = wrap(atan2(sinSum, cosSum));
+  for (i = 0; i < l->n; i++) {
+    spread += weights[i] * ((l->x[i] - e.x) * (l->x[i] - e.x) + (l->y[i] - e.y) * (l->y[i] - e.y));
+  }
+  e.spread = sqrt(spread / total);
+  e.updates = l->updates;
+
+  __atomic_store_n(&l->publishSeq, l->publishSeq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  l->published = e;
+  __atomic_store_n(&l->publishSeq, l->publishSeq + 1, __ATOMIC_RELEASE);
+}
+
+// Low variance resampling: one random offset, then n evenly spaced picks
+// along the cumulative weights, so a particle with k times the average
+// weight is copied k times, give or take one
+static void resample(struct localizer *l, const double *weights, double total) {
+  float **arrays[] = {&l->x, &l->y, &l->heading, &l->sinHeading, &l->cosHeading};
+  double step = total / l->n, pick = random_uniform(&l->seed) * step, cumulative = weights[0];
+  int i, j = 0, a;
+
+  for (i = 0; i < l->n; i++, pick += step) {
+    while (pick > cumulative && j < l->n - 1) {
+      cumulative += weights[++j];
+    }
+    for (a = 0; a < 5; a++) {
+      l->spare[a][i] = (*arrays[a])[j];
+    }
+  }
+  for (a = 0; a < 5; a++) {
+    float *swap = *arrays[a];
+    *arrays[a] = l->spare[a];
+    l->spare[a] = swap;
+  }
+  memset(l->logWeight, 0, l->n * sizeof(float));
+  l->resamples++;
+}
+
+// Normalise the weights, publish the estimate and resample if too few
+// particles are carrying most of the weight
+static void finish_update(struct localizer *l) {
+  double *weights = malloc(l->n * sizeof(double));
+  double total = 0, squares = 0;
+  float best = -INFINITY;
+  int i;
+
+  if (weights == NULL) {
+    return;
+  }
+  for (i = 0; i < l->n; i++) {
+    best = l->logWeight[i] > best ? l->logWeight[i] : best;
+  }
+  for (i = 0; i < l->n; i++) {
+    l->logWeight[i] -= best;
+    weights[i] = exp(l->logWeight[i]);
+    total += weights[i];
+    squares += weights[i] * weights[i];
+  }
+  publish(l, weights, total);
+  if (total * total / squares < l->n / 2) {
+    resample(l, weights, total);
+  }
+  free(weights);
+}
+
+void localize_place(struct localizer *l, double x, double y, double heading,
+                    double positionSigma, double headingSigma) {
+  int i;
+  for (i = 0; i < l->n; i++) {
+    l->x[i] = (float) (x + random_gaussian(&l->seed, positionSigma));
+    l->y[i] = (float) (y + random_gaussian(&l->seed, positionSigma));
+    set_heading(l, i, wrap(heading + random_gaussian(&l->seed, headingSigma)));
+    l->logWeight[i] = 0;
+  }
+  l->hasLast = 0;
+}
+
+void localize_spread(struct localizer *l) {
+  const struct localize_map *map = l->map;
+  int i, tries;
+  for (i = 0; i < l->n; i++) {
+    double x = 0, y = 0;
+    for (tries = 0; tries < 1000; tries++) {
+      x = map->originX + random_uniform(&l->seed) * map->width / CELLS_PER_M;
+      y = map->originY + random_uniform(&l->seed) * map->height / CELLS_PER_M;
+      if (free_at(map, x, y)) {
+        break;
+      }
+    }
+    l->x[i] = (float) x;
+    l->y[i] = (float) y;
+    set_heading(l, i, random_uniform(&l->seed) * 2 * M_PI);
+    l->logWeight[i] = 0;
+  }
+  l->hasLast = 0;
+}
+
+void localize_update(struct localizer *l, const struct pose *odometry, int range, double bearing) {
+  l->rot1 = l->trans = l->rot2 = 0;
+
+  // Odometry's move as a turn, a straight line and another turn, so it can
+  // be applied from each particle's heading rather than odometry's
+  if (l->hasLast) {
+    double dx = odometry->x - l->last.x, dy = odometry->y - l->last.y;
+    double turned = difference(odometry->heading, l->last.heading);
+    l->trans = hypot(dx, dy);
+    if (l->trans > 1e-4) {
+      l->rot1 = difference(atan2(dx, dy), l->last.heading);
+      if (fabs(l->rot1) > M_PI / 2) {
+        l->rot1 = difference(l->rot1, M_PI);
+        l->trans = -l->trans;
+      }
+    } else {
+      l->trans = 0;
+    }
+    l->rot2 = turned - l->rot1;
+  }
+  l->last = *odometry;
+  l->hasLast = 1;
+  l->range = range > 0 ? (float) range : -1;
+  l->bearing = bearing >= 0 ? (float) (wrap(bearing * M_PI / 180)) : -1;
+
+  update_all(l);
+  l->updates++;
+  finish_update(l);
+}
+
+void localize_read(struct localizer *l, struct localize_estimate *estimate) {
+  unsigned before, after;
+  do {
+    before = __atomic_load_n(&l->publishSeq, __ATOMIC_ACQUIRE);
+    *estimate = l->published;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&l->publishSeq, __ATOMIC_RELAXED);
+  } while (before != after || (before & 1));
+}
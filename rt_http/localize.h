@@ -0,0 +1,146 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Localization
+//
+// Works out where the tank is on a map made earlier, where odometry alone
+// would drift further and further out, with a particle filter: thousands of
+// guesses at the pose, each moved along with odometry plus some noise, then
+// weighted by how well the SRF02 range it would have read there and the
+// CMPS10 bearing agree with the real ones, and every so often resampled so
+// that the likely guesses multiply and the unlikely ones die out.
+//
+// Particles are kept as a structure of arrays, so that the work on them,
+// which is nearly all casting the SRF02's rays across the map and weighing
+// what they hit, is done four particles at a time with SSE2 or NEON. As for
+// the costmap, each kernel has a plain C version that the vector ones must
+// match exactly, which rt_bench checks, so build with -ffp-contract=off.
+// Particles are also split into chunks which a pool of threads share out,
+// each chunk with its own random numbers, so the results don't depend on the
+// number of threads.
+//
+// Rays are cast by sphere tracing: the map stores each cell's distance to
+// the nearest occupied one, which is how far a ray from there can safely
+// jump, so crossing open space takes a few steps rather than one per cell.
+//
+
+#ifndef LOCALIZE_H
+#define LOCALIZE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "odometry.h"
+
+#define LOCALIZE_CELL_CM 5              // As the occupancy grid's
+#define LOCALIZE_MAX_RANGE_CM 600       // SRF02's, beyond which it reads 0
+#define LOCALIZE_RAYS 3                 // Across the SRF02's cone
+#define LOCALIZE_CHUNK 256              // Particles, a multiple of 4
+#define LOCALIZE_MAX_THREADS 8
+
+// A map to localize against. distance is each cell's distance to the nearest
+// occupied cell, in cells, saturating at 255, so 0 is occupied.
+struct localize_map {
+  int width, height;                    // Cells
+  double originX, originY;              // m, of the south-west corner
+  uint8_t *distance;                    // Row by row from the south
+};
+
+// Where the particles say the tank is: the weighted mean, and how far they
+// are spread around it
+struct localize_estimate {
+  double x, y, heading;                 // m on the map, radians clockwise from north
+  double spread;                        // m, standard deviation of position
+  unsigned long updates;
+};
+
+struct localizer {
+  const struct localize_map *map;
+  int n;                                // Particles
+
+  // Particles, 16 byte aligned, and spares the same size to resample into
+  float *x, *y, *heading, *sinHeading, *cosHeading, *logWeight;
+  float *expected;                      // SRF02 range each would read, cm
+  float *spare[5];
+
+  // Random numbers, one stream per chunk
+  uint64_t *chunkSeeds;
+  int numChunks;
+  uint64_t seed;                        // For resampling
+
+  // What the threads are working on
+  double rot1, trans, rot2;             // Motion since the last update
+  float range, bearing;                 // Measurements, or < 0 for none
+
+  // Thread pool. The caller works too, so there are numThreads - 1 threads.
+  int numThreads;
+  pthread_t threads[LOCALIZE_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t workReady, workDone;
+  unsigned generation;                  // Incremented for each batch of work
+  int nextChunk, chunksDone;
+  int stopping;
+
+  struct pose last;                     // Odometry at the last update
+  int hasLast;
+
+  // Latest estimate, published under a sequence lock like odometry's
+  unsigned publishSeq;
+  struct localize_estimate published;
+
+  // Statistics
+  unsigned long updates;
+  unsigned long resamples;
+};
+
+// Read a map from a PGM image, as rt_world -m writes them: north up, dark
+// (occupied) pixels where the log-odds were at least the costmap's obstacle
+// threshold, with a "# origin x y" comment giving the south-west corner in m.
+// Returns 1 if it could.
+int localize_map_load(struct localize_map *map, const char *path);
+
+// Make an empty map of width x height cells, mark cells occupied with
+// localize_map_set(), then work out the distances with localize_map_finish()
+int localize_map_create(struct localize_map *map, int width, int height,
+                        double originX, double originY);
+void localize_map_set(struct localize_map *map, double x, double y);
+void localize_map_finish(struct localize_map *map);
+void localize_map_destroy(struct localize_map *map);
+
+// Make a localizer of n particles (rounded up to a multiple of 4), using
+// threads threads including the caller's. Returns NULL if there isn't the
+// memory. The particles start spread over all the free space on the map.
+struct localizer *localize_create(const struct localize_map *map, int n, int threads,
+                                  uint64_t seed);
+void localize_destroy(struct localizer *localizer);
+
+// Spread the particles around a pose on the map
+void localize_place(struct localizer *localizer, double x, double y, double heading,
+                    double positionSigma, double headingSigma);
+
+// Spread the particles over all the free space on the map, facing any way
+void localize_spread(struct localizer *localizer);
+
+// Move the particles on by how far odometry says the tank has moved since
+// the last update, and weigh them by an SRF02 range (cm, 0 for none) and a
+// CMPS10 bearing (degrees, < 0 for none). Publishes a new estimate.
+void localize_update(struct localizer *localizer, const struct pose *odometry,
+                     int range, double bearing);
+
+// Get the latest estimate, from any thread
+void localize_read(struct localizer *localizer, struct localize_estimate *estimate);
+
+// Kernels, on n particles. Range and bearing are cm and radians; a range < 0
+// or bearing < 0 isn't used.
+
+// Range the SRF02 would read from each particle, in expected
+void localize_raycast(const struct localize_map *map, const float *x, const float *y,
+                      const float *sinHeading, const float *cosHeading, float *expected, int n);
+void localize_raycast_scalar(const struct localize_map *map, const float *x, const float *y,
+                             const float *sinHeading, const float *cosHeading, float *expected, int n);
+
+// Add the log-likelihood of the measurements to each particle's log weight
+void localize_weigh(const float *expected, const float *heading, float range, float bearing,
+                    float *logWeight, int n);
+void localize_weigh_scalar(const float *expected, const float *heading, float range, float bearing,
+                           float *logWeight, int n);
+
+#endif
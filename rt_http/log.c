@@ -0,0 +1,161 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Asynchronous logging
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "log.h"
+#include "metrics.h"
+
+// Enough for the transmitter, sensor and autonomy threads plus all of
+// mongoose's workers. Threads beyond this can't log.
+#define MAX_THREADS 32
+
+// Messages each thread can have waiting to be written. Must be a power of 2.
+#define RING_SIZE 64
+
+// How often the writer wakes up to drain the rings
+#define WRITER_PERIOD_USEC 50000
+
+struct log_entry {
+  struct timespec time;
+  const char *fmt;          // Also identifies the message
+  long args[4];
+  int level;
+};
+
+// Single producer, single consumer ring. head is only written by the thread
+// that owns the ring, tail only by the writer thread.
+struct log_ring {
+  struct log_entry entries[RING_SIZE];
+  unsigned head;
+  char pad[60];             // Keep head and tail on separate cache lines
+  unsigned tail;
+  char name[16];
+};
+
+static struct log_ring *rings[MAX_THREADS];
+static int numRings;
+static __thread struct log_ring *myRing;
+static enum log_level minimumLevel = LOG_INFO;
+
+static const char *levelNames[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+// Claim a ring for the calling thread. This allocates, but only once per
+// thread, the first time it logs anything.
+static struct log_ring *claim_ring(const char *name) {
+  int i = __atomic_fetch_add(&numRings, 1, __ATOMIC_RELAXED);
+  struct log_ring *ring;
+
+  if (i >= MAX_THREADS || (ring = calloc(1, sizeof(*ring))) == NULL) {
+    return NULL;
+  }
+  strncpy(ring->name, name, sizeof(ring->name) - 1);
+  __atomic_store_n(&rings[i], ring, __ATOMIC_RELEASE);
+  myRing = ring;
+  return ring;
+}
+
+void log_thread_init(const char *name) {
+  if (myRing == NULL) {
+    claim_ring(name);
+  }
+}
+
+void log_record(enum log_level level, const char *fmt, long a, long b, long c, long d) {
+  struct log_ring *ring;
+  struct log_entry *entry;
+  unsigned head;
+
+  // Before claiming a ring, so threads that only log filtered out messages
+  // don't take one of the MAX_THREADS
+  if (level < minimumLevel) {
+    return;
+  }
+  ring = myRing != NULL ? myRing : claim_ring("http");
+  if (ring == NULL) {
+    metrics_inc(C_LOG_DROPPED);
+    return;
+  }
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+    metrics_inc(C_LOG_DROPPED);
+    return;
+  }
+
+  entry = &ring->entries[head & (RING_SIZE - 1)];
+  clock_gettime(CLOCK_REALTIME, &entry->time);
+  entry->fmt = fmt;
+  entry->level = level;
+  entry->args[0] = a;
+  entry->args[1] = b;
+  entry->args[2] = c;
+  entry->args[3] = d;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Format and write out one message
+static void write_entry(const struct log_entry *entry, const char *threadName) {
+  char timeString[32], message[256];
+  struct tm tm;
+  size_t len;
+
+  localtime_r(&entry->time.tv_sec, &tm);
+  strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", &tm);
+  snprintf(message, sizeof(message), entry->fmt,
+           entry->args[0], entry->args[1], entry->args[2], entry->args[3]);
+  len = strlen(message);
+  while (len > 0 && message[len - 1] == '\n') {
+    message[--len] = '\0';
+  }
+  printf("%s.%03ld %s [%s] %s\n", timeString, entry->time.tv_nsec / 1000000,
+         levelNames[entry->level], threadName, message);
+}
+
+// Writer thread: drain every ring, oldest entries first within each ring
+static void *writer_thread(void *arg) {
+  int i;
+  (void) arg;
+
+  // As low a priority as we can get, this must never compete with the
+  // transmitter
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+  while (1) {
+    int written = 0;
+    int count = __atomic_load_n(&numRings, __ATOMIC_RELAXED);
+    for (i = 0; i < count && i < MAX_THREADS; i++) {
+      struct log_ring *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+      if (ring == NULL) {
+        continue;
+      }
+      unsigned tail = ring->tail;
+      unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      while (tail != head) {
+        write_entry(&ring->entries[tail & (RING_SIZE - 1)], ring->name);
+        tail++;
+        written++;
+      }
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    if (written > 0) {
+      fflush(stdout);
+    }
+    usleep(WRITER_PERIOD_USEC);
+  }
+  return NULL;
+}
+
+void log_start(enum log_level minLevel) {
+  pthread_t thread;
+  minimumLevel = minLevel;
+  pthread_create(&thread, NULL, &writer_thread, NULL);
+  pthread_detach(thread);
+}
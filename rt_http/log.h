@@ -0,0 +1,46 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Asynchronous logging
+//
+// log_msg() never blocks and never formats anything. It copies a timestamp,
+// the level, the format string's address and up to four arguments into a
+// ring buffer belonging to the calling thread, and returns. A low priority
+// writer thread drains the rings, formats the messages and writes them to
+// stdout, so a slow reader at the other end of stdout can only ever hold up
+// the writer. If a ring is full the message is dropped and counted.
+//
+// Format strings must be string literals, since only their address is kept,
+// and arguments are passed as longs, so use %ld, %lx and so on. %s is only
+// safe for strings that never change, such as literals and argv, since they
+// are read when the message is written, not when it's logged.
+//
+
+#ifndef LOG_H
+#define LOG_H
+
+enum log_level { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+// Start the writer thread. Messages logged before this are kept until it runs.
+void log_start(enum log_level minLevel);
+
+// Name the calling thread's ring, used on every line it logs. Threads that
+// don't call this are named "http", which is what they will be: mongoose's.
+void log_thread_init(const char *name);
+
+// log_msg(level, format, args...), with up to four arguments
+#define log_msg(...) LOG_DISPATCH(LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define LOG_NARGS(...) LOG_NARGS_(__VA_ARGS__, 4, 3, 2, 1, 0, -1)
+#define LOG_NARGS_(level, fmt, a, b, c, d, n, ...) n
+#define LOG_DISPATCH(n) LOG_DISPATCH_(n)
+#define LOG_DISPATCH_(n) log_msg##n
+#define log_msg0(level, fmt) log_record(level, fmt, 0, 0, 0, 0)
+#define log_msg1(level, fmt, a) log_record(level, fmt, (long) (a), 0, 0, 0)
+#define log_msg2(level, fmt, a, b) log_record(level, fmt, (long) (a), (long) (b), 0, 0)
+#define log_msg3(level, fmt, a, b, c) \
+  log_record(level, fmt, (long) (a), (long) (b), (long) (c), 0)
+#define log_msg4(level, fmt, a, b, c, d) \
+  log_record(level, fmt, (long) (a), (long) (b), (long) (c), (long) (d))
+
+void log_record(enum log_level level, const char *fmt, long a, long b, long c, long d);
+
+#endif
@@ -0,0 +1,179 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Occupancy grid
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "map.h"
+
+// Get the tile a cell is in, allocating it if need be
+static struct map_tile *tile_for_update(struct map *map, int column, int row) {
+  int entry = (row / MAP_TILE_CELLS) * MAP_TILES + column / MAP_TILE_CELLS;
+  int i = map->tileNumbers[entry] - 1;
+
+  if (i < 0) {
+    if (map->numTiles < MAP_MAX_TILES) {
+      i = map->numTiles++;
+    } else {
+      // Reuse the tile updated longest ago. The counter wraps, so go by age.
+      uint32_t oldest = 0;
+      int j;
+      for (j = 0; j < MAP_MAX_TILES; j++) {
+        if (map->updates - map->tileUpdated[j] > oldest) {
+          oldest = map->updates - map->tileUpdated[j];
+          i = j;
+        }
+      }
+      if (i < 0) {
+        i = 0;
+      }
+      map->tileNumbers[map->tileOwners[i]] = 0;
+      map->evictions++;
+    }
+    memset(&map->tiles[i], 0, sizeof(struct map_tile));
+    map->tileNumbers[entry] = i + 1;
+    map->tileOwners[i] = entry;
+  }
+  map->tileUpdated[i] = map->updates;
+  return &map->tiles[i];
+}
+
+// Add evidence to a cell, saturating
+static void add_log_odds(int8_t *cell, int logOdds) {
+  int value = *cell + logOdds;
+  *cell = value > MAP_LOG_ODDS_MAX ? MAP_LOG_ODDS_MAX
+        : value < -MAP_LOG_ODDS_MAX ? -MAP_LOG_ODDS_MAX : value;
+}
+
+struct map *map_create(void) {
+  struct map *map = calloc(1, sizeof(struct map));
+  if (map == NULL) {
+    return NULL;
+  }
+  if (posix_memalign((void **) &map->tiles, sizeof(struct map_tile),
+                     MAP_MAX_TILES * sizeof(struct map_tile)) != 0) {
+    map->tiles = NULL;
+  }
+  map->tileNumbers = calloc(MAP_TILES * MAP_TILES, sizeof(uint16_t));
+  map->tileOwners = calloc(MAP_MAX_TILES, sizeof(uint16_t));
+  map->tileUpdated = calloc(MAP_MAX_TILES, sizeof(uint32_t));
+  if (map->tiles == NULL || map->tileNumbers == NULL || map->tileOwners == NULL ||
+      map->tileUpdated == NULL) {
+    map_destroy(map);
+    return NULL;
+  }
+  return map;
+}
+
+void map_destroy(struct map *map) {
+  if (map != NULL) {
+    free(map->tiles);
+    free(map->tileNumbers);
+    free(map->tileOwners);
+    free(map->tileUpdated);
+    free(map);
+  }
+}
+
+// Walk the cells the ray crosses from the rangefinder to the end of its
+// range, one cell at a time (Amanatides and Woo), freeing each and marking
+// the last occupied. The tile is only looked up again when the ray crosses
+// into another one.
+void map_update(struct map *map, double x, double y, double heading, int range) {
+  if (range <= 0) {
+    return;
+  }
+  map->updates++;
+
+  double dx = sin(heading), dy = cos(heading);
+  double startX = x * 100 / MAP_CELL_CM + MAP_CELLS / 2;      // In cells
+  double startY = y * 100 / MAP_CELL_CM + MAP_CELLS / 2;
+  double cells = (double) range / MAP_CELL_CM;
+  int column = (int) floor(startX), row = (int) floor(startY);
+  int endColumn = (int) floor(startX + dx * cells), endRow = (int) floor(startY + dy * cells);
+  int stepColumn = endColumn > column ? 1 : -1, stepRow = endRow > row ? 1 : -1;
+
+  // Ray length to the next column and row boundaries, and between them
+  double deltaColumn = dx != 0 ? fabs(1 / dx) : INFINITY;
+  double deltaRow = dy != 0 ? fabs(1 / dy) : INFINITY;
+  double nextColumn = dx != 0 ? (stepColumn > 0 ? column + 1 - startX : startX - column) * deltaColumn : INFINITY;
+  double nextRow = dy != 0 ? (stepRow > 0 ? row + 1 - startY : startY - row) * deltaRow : INFINITY;
+
+  struct map_tile *tile = NULL;
+  int tileColumn = -1, tileRow = -1;
+  int steps = abs(endColumn - column) + abs(endRow - row);
+
+  for (;;) {
+    if (column >= 0 && column < MAP_CELLS && row >= 0 && row < MAP_CELLS) {
+      if (column / MAP_TILE_CELLS != tileColumn || row / MAP_TILE_CELLS != tileRow) {
+        tileColumn = column / MAP_TILE_CELLS;
+        tileRow = row / MAP_TILE_CELLS;
+        tile = tile_for_update(map, column, row);
+      }
+      add_log_odds(&tile->cells[(row % MAP_TILE_CELLS) * MAP_TILE_CELLS + column % MAP_TILE_CELLS],
+                   steps > 0 ? MAP_LOG_ODDS_FREE : MAP_LOG_ODDS_OCCUPIED);
+    }
+    if (steps-- == 0) {
+      break;
+    }
+
+    // Rounding can make the ray look like it misses the end cell, so once
+    // it's level with it on one axis, only step along the other
+    if (row == endRow || (column != endColumn && nextColumn < nextRow)) {
+      column += stepColumn;
+      nextColumn += deltaColumn;
+    } else {
+      row += stepRow;
+      nextRow += deltaRow;
+    }
+  }
+}
+
+int map_cell(const struct map *map, int column, int row) {
+  if (column < 0 || column >= MAP_CELLS || row < 0 || row >= MAP_CELLS) {
+    return 0;
+  }
+  int i = map->tileNumbers[(row / MAP_TILE_CELLS) * MAP_TILES + column / MAP_TILE_CELLS] - 1;
+  if (i < 0) {
+    return 0;
+  }
+  return map->tiles[i].cells[(row % MAP_TILE_CELLS) * MAP_TILE_CELLS + column % MAP_TILE_CELLS];
+}
+
+// A tile row at a time, where the whole row is on the map
+void map_read(const struct map *map, int column, int row, int width, int height,
+              int8_t *cells, int stride) {
+  int x, y;
+  for (y = 0; y < height; y++) {
+    int8_t *out = cells + y * stride;
+    int mapRow = row + y;
+    for (x = 0; x < width; ) {
+      int mapColumn = column + x;
+      int run = MAP_TILE_CELLS - (mapColumn & (MAP_TILE_CELLS - 1));
+      run = run < width - x ? run : width - x;
+      if (mapColumn >= 0 && mapColumn + run <= MAP_CELLS && mapRow >= 0 && mapRow < MAP_CELLS) {
+        int i = map->tileNumbers[(mapRow / MAP_TILE_CELLS) * MAP_TILES + mapColumn / MAP_TILE_CELLS] - 1;
+        if (i >= 0) {
+          memcpy(out + x, &map->tiles[i].cells[(mapRow % MAP_TILE_CELLS) * MAP_TILE_CELLS +
+                                               mapColumn % MAP_TILE_CELLS], run);
+        } else {
+          memset(out + x, 0, run);
+        }
+      } else {
+        int j;
+        for (j = 0; j < run; j++) {
+          out[x + j] = map_cell(map, mapColumn + j, mapRow);
+        }
+      }
+      x += run;
+    }
+  }
+}
+
+int map_locate(double x, double y, int *column, int *row) {
+  *column = (int) floor(x * 100 / MAP_CELL_CM) + MAP_CELLS / 2;
+  *row = (int) floor(y * 100 / MAP_CELL_CM) + MAP_CELLS / 2;
+  return *column >= 0 && *column < MAP_CELLS && *row >= 0 && *row < MAP_CELLS;
+}
@@ -0,0 +1,71 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Occupancy grid
+//
+// A map of what's around the tank, built up from rangefinder readings. Each
+// cell holds the log-odds that it's occupied, as a signed byte: 0 is
+// unknown, positive occupied and negative free. A reading clears the cells
+// along the rangefinder's axis up to the range it read, and marks the cell
+// at the end occupied, so evidence adds up over repeated readings.
+//
+// Cells are kept in tiles of 8x8, one 64 byte cache line each, so walking a
+// ray mostly stays within a tile. Tiles are only allocated once something
+// is seen in them, from a fixed pool, so memory is bounded: when the pool
+// runs out, the tile that was updated longest ago is reused. A directory of
+// tile numbers covers the whole mapped area, about 51m square centred on
+// where the tank started.
+//
+
+#ifndef MAP_H
+#define MAP_H
+
+#include <stdint.h>
+
+#define MAP_CELL_CM 5                   // Size of a cell
+#define MAP_TILE_CELLS 8                // Cells along each side of a tile
+#define MAP_TILES 128                   // Tiles along each side of the map
+#define MAP_CELLS (MAP_TILES * MAP_TILE_CELLS)
+#define MAP_MAX_TILES 2048              // Allocated at once, 128kB of cells
+
+// Log-odds, in units of 1/20 nat: an occupied reading is about p = 0.7, a
+// free one p = 0.4, and cells saturate at p = 0.998 either way
+#define MAP_LOG_ODDS_OCCUPIED 17
+#define MAP_LOG_ODDS_FREE -8
+#define MAP_LOG_ODDS_MAX 120
+
+struct map_tile {
+  int8_t cells[MAP_TILE_CELLS * MAP_TILE_CELLS];    // Row by row
+} __attribute__((aligned(64)));
+
+struct map {
+  struct map_tile *tiles;               // Pool of MAP_MAX_TILES
+  uint16_t *tileNumbers;                // Directory, pool index + 1 or 0
+  uint16_t *tileOwners;                 // Directory entry each tile is in
+  uint32_t *tileUpdated;                // When each tile was last updated
+  int numTiles;
+  uint32_t updates;                     // Readings added
+  uint32_t evictions;                   // Tiles reused
+};
+
+// Make an empty map, or return NULL if there isn't the memory
+struct map *map_create(void);
+void map_destroy(struct map *map);
+
+// Add a reading of range cm from a rangefinder at x, y (m, from where the
+// tank started, +y north) pointing at heading (radians clockwise from north).
+// A range of 0 (nothing in range, or an error) is ignored.
+void map_update(struct map *map, double x, double y, double heading, int range);
+
+// Log-odds of the cell at column, row (0 to MAP_CELLS - 1, row 0 south),
+// or 0 if it's unknown or off the map
+int map_cell(const struct map *map, int column, int row);
+
+// Copy the log-odds of width x height cells, from column, row northwards,
+// into cells, a row of stride at a time
+void map_read(const struct map *map, int column, int row, int width, int height,
+              int8_t *cells, int stride);
+
+// The cell containing x, y (m). Returns 0 if it's off the map.
+int map_locate(double x, double y, int *column, int *row);
+
+#endif
@@ -0,0 +1,375 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Metrics, served in Prometheus text exposition format at /metrics
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include "metrics.h"
+#include "trace.h"
+
+// Enough for the transmitter, sensor and autonomy threads plus all of
+// mongoose's workers. Threads beyond this share the last slot.
+#define MAX_THREADS 32
+
+struct metric_info {
+  const char *family;   // Metric name
+  const char *labels;   // Label set for this series, or ""
+  const char *help;     // HELP text, printed once per family
+};
+
+static const struct metric_info counter_info[NUM_COUNTERS] = {
+  {"rt_frames_sent_total", "", "Opcode frames sent to the tank"},
+  {"rt_frame_intervals_total", "", "Intervals between consecutive frames measured"},
+  {"rt_frame_interval_microseconds_total", "", "Sum of intervals between consecutive frames"},
+  {"rt_frame_interval_squared_microseconds_total", "", "Sum of squared intervals between consecutive frames, for jitter"},
+  {"rt_command_changes_total", "", "Times the command being transmitted changed"},
+  {"rt_stale_commands_total", "", "Out-of-order set commands dropped as older than one already applied"},
+  {"rt_http_requests_total", "{type=\"set\"}", "HTTP requests handled, by type"},
+  {"rt_http_requests_total", "{type=\"batch\"}", ""},
+  {"rt_http_requests_total", "{type=\"get\"}", ""},
+  {"rt_http_requests_total", "{type=\"metrics\"}", ""},
+  {"rt_http_requests_total", "{type=\"trace\"}", ""},
+  {"rt_http_requests_total", "{type=\"file\"}", ""},
+  {"rt_http_requests_total", "{type=\"goal\"}", ""},
+  {"rt_http_requests_total", "{type=\"history\"}", ""},
+  {"rt_http_requests_total", "{type=\"other\"}", ""},
+  {"rt_sensor_reads_total", "{device=\"srf02\"}", "Sensor reads attempted, by device"},
+  {"rt_sensor_reads_total", "{device=\"cmps10\"}", ""},
+  {"rt_sensor_failures_total", "{device=\"srf02\"}", "Sensor reads failed, by device"},
+  {"rt_sensor_failures_total", "{device=\"cmps10\"}", ""},
+  {"rt_autonomy_decisions_total", "{decision=\"forward\"}", "Autonomy decisions, by outcome"},
+  {"rt_autonomy_decisions_total", "{decision=\"avoid\"}", ""},
+  {"rt_autonomy_decisions_total", "{decision=\"turn\"}", ""},
+  {"rt_autonomy_decisions_total", "{decision=\"blocked\"}", ""},
+  {"rt_mutex_wait_nanoseconds_total", "{mutex=\"userCommand\"}", "Time spent waiting for mutexes that were already locked"},
+  {"rt_mutex_wait_nanoseconds_total", "{mutex=\"autonomyCommand\"}", ""},
+  {"rt_mutex_wait_nanoseconds_total", "{mutex=\"sensorData\"}", ""},
+  {"rt_log_messages_dropped_total", "", "Log messages dropped because a thread's log ring was full"},
+  {"rt_map_updates_total", "", "Rangefinder readings added to the occupancy grid"},
+  {"rt_planner_searches_total", "", "Path searches started from scratch"},
+  {"rt_planner_expansions_total", "", "Nodes expanded by the path planner"},
+  {"rt_planner_cost_changes_total", "", "Costmap cells that changed under a plan"},
+  {"rt_localizer_updates_total", "", "Particle filter updates from sensor samples"},
+  {"rt_localizer_resamples_total", "", "Times the particles were resampled"},
+  {"rt_telemetry_records_total", "", "Records written to the telemetry log"},
+  {"rt_telemetry_dropped_total", "", "Telemetry records lost because a ring was full or a segment couldn't be made"},
+  {"rt_metrics_truncated_total", "", "Scrapes of /metrics cut short at a whole line because they didn't fit"},
+};
+
+static const struct metric_info gauge_info[NUM_GAUGES] = {
+  {"rt_frames_per_second", "", "Frames sent in the last whole second"},
+  {"rt_max_frame_interval_microseconds", "", "Longest interval between frames in the last whole second"},
+  {"rt_autonomy_enabled", "", "1 if the tank is under autonomous control"},
+  {"rt_range_centimetres", "", "Latest SRF02 range reading"},
+  {"rt_bearing_degrees", "", "Latest CMPS10 bearing reading"},
+  {"rt_recovery_gap_microseconds", "", "Time between the last run's last frame and this run's first command frame"},
+  {"rt_map_tiles", "", "Occupancy grid tiles allocated"},
+  {"rt_localizer_spread_cm", "", "Standard deviation of the particles' positions"},
+};
+
+// One thread's counters, padded to a cache line so that threads never write
+// to the same line as each other.
+struct thread_slot {
+  uint64_t counters[NUM_COUNTERS];
+  char name[16];
+} __attribute__((aligned(64)));
+
+static struct thread_slot slots[MAX_THREADS];
+static int numSlots;
+static int64_t gauges[NUM_GAUGES];
+static __thread struct thread_slot *mySlot;
+
+// Claim a slot for the calling thread
+static struct thread_slot *claim_slot(const char *name) {
+  int i = __atomic_fetch_add(&numSlots, 1, __ATOMIC_RELAXED);
+  if (i >= MAX_THREADS) {
+    i = MAX_THREADS - 1;
+  }
+  mySlot = &slots[i];
+  strncpy(mySlot->name, name, sizeof(mySlot->name) - 1);
+  return mySlot;
+}
+
+void metrics_thread_init(const char *name) {
+  claim_slot(name);
+}
+
+void metrics_add(enum counter c, uint64_t n) {
+  struct thread_slot *slot = mySlot != NULL ? mySlot : claim_slot("http");
+  uint64_t *p = &slot->counters[c];
+
+  if (slot == &slots[MAX_THREADS - 1]) {
+    // Overflow slot may have several writers
+    __atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+  } else {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+  }
+}
+
+void metrics_set(enum gauge g, int64_t value) {
+  __atomic_store_n(&gauges[g], value, __ATOMIC_RELAXED);
+}
+
+// Trace span names for contended locks, in the order of the wait counters
+static const char *const mutex_wait_span[] = {
+  "userCommandMutex wait", "autonomyCommandMutex wait", "sensorDataMutex wait"
+};
+
+// Parenthesised so that it isn't expanded by the LOCK_PROFILE macro
+void (metrics_mutex_lock)(pthread_mutex_t *mutex, enum counter waitCounter) {
+  uint64_t start;
+
+  if (pthread_mutex_trylock(mutex) == 0) {
+    return;
+  }
+  start = trace_begin();
+  pthread_mutex_lock(mutex);
+  metrics_add(waitCounter, trace_begin() - start);
+  trace_end(mutex_wait_span[waitCounter - C_MUTEX_WAIT_NS_USER_COMMAND], start, 0);
+}
+
+#ifdef LOCK_PROFILE
+// Upper bounds of the wait histogram buckets, in ns. The last is +Inf.
+static const uint64_t wait_bucket_le[LOCK_WAIT_BUCKETS - 1] = {
+  1000, 10000, 100000, 1000000, 10000000
+};
+
+// Every call site that has locked a mutex so far
+static struct lock_site *sites;
+
+// Mutexes the calling thread holds, innermost last, and where and when they
+// were locked. Nothing here locks more than one at a time, but allow a few.
+#define MAX_HELD 4
+static __thread struct {
+  pthread_mutex_t *mutex;
+  struct lock_site *site;
+  uint64_t since;
+} held[MAX_HELD];
+static __thread int numHeld;
+
+static void register_site(struct lock_site *site) {
+  if (__atomic_exchange_n(&site->registered, 1, __ATOMIC_RELAXED) == 0) {
+    site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&sites, &site->next, site, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+void metrics_site_lock(struct lock_site *site, pthread_mutex_t *mutex) {
+  uint64_t start = trace_begin(), now, wait;
+  int bucket, contended = 0;
+
+  if (pthread_mutex_trylock(mutex) != 0) {
+    pthread_mutex_lock(mutex);
+    contended = 1;
+  }
+  now = trace_begin();
+  wait = now - start;
+  if (contended) {
+    // As in the default build, the wait counter has every contended wait and
+    // nothing else, so it means the same either way
+    metrics_add(site->waitCounter, wait);
+    trace_end(mutex_wait_span[site->waitCounter - C_MUTEX_WAIT_NS_USER_COMMAND], start, 0);
+  }
+
+  register_site(site);
+  for (bucket = 0; bucket < LOCK_WAIT_BUCKETS - 1 && wait > wait_bucket_le[bucket]; bucket++);
+  __atomic_fetch_add(&site->acquisitions, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&site->waitNs, wait, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&site->waitBuckets[bucket], 1, __ATOMIC_RELAXED);
+
+  if (numHeld < MAX_HELD) {
+    held[numHeld].mutex = mutex;
+    held[numHeld].site = site;
+    held[numHeld].since = now;
+    numHeld++;
+  }
+}
+
+// Stop the clock on a held mutex, adding the time to its site
+static void release_held(pthread_mutex_t *mutex) {
+  int i;
+  for (i = numHeld - 1; i >= 0; i--) {
+    if (held[i].mutex == mutex) {
+      struct lock_site *site = held[i].site;
+      uint64_t hold = trace_begin() - held[i].since;
+      uint64_t max = __atomic_load_n(&site->maxHoldNs, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&site->holdNs, hold, __ATOMIC_RELAXED);
+      while (hold > max && !__atomic_compare_exchange_n(&site->maxHoldNs, &max, hold, 0,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+      for (; i < numHeld - 1; i++) {
+        held[i] = held[i + 1];
+      }
+      numHeld--;
+      return;
+    }
+  }
+}
+
+void metrics_mutex_unlock(pthread_mutex_t *mutex) {
+  release_held(mutex);
+  pthread_mutex_unlock(mutex);
+}
+
+// A condition wait releases the mutex, so it doesn't count as holding it.
+// Time held restarts once the wait returns with the mutex retaken.
+int metrics_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *deadline) {
+  struct lock_site *site = NULL;
+  int i, result;
+
+  for (i = numHeld - 1; i >= 0 && site == NULL; i--) {
+    if (held[i].mutex == mutex) {
+      site = held[i].site;
+    }
+  }
+  release_held(mutex);
+  result = pthread_cond_timedwait(cond, mutex, deadline);
+  if (site != NULL && numHeld < MAX_HELD) {
+    held[numHeld].mutex = mutex;
+    held[numHeld].site = site;
+    held[numHeld].since = trace_begin();
+    numHeld++;
+  }
+  return result;
+}
+
+// Print per-site lock profiles. The mutex label comes from the site's wait
+// counter, e.g. {mutex="sensorData"}, with the site added to it.
+static int format_lock_sites(char *buf, int len) {
+  struct lock_site *site, *first = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+  int n = 0, i;
+
+  if (first == NULL) {
+    return 0;
+  }
+#define SITE_LABELS(site) \
+  (int) strlen(counter_info[(site)->waitCounter].labels) - 1, \
+  counter_info[(site)->waitCounter].labels, (site)->file, (site)->line
+
+  n += snprintf(buf + n, len > n ? len - n : 0,
+                "# HELP rt_mutex_site_wait_nanoseconds Time waited to lock each mutex, by call site\n"
+                "# TYPE rt_mutex_site_wait_nanoseconds histogram\n");
+  for (site = first; site != NULL; site = site->next) {
+    uint64_t cumulative = 0;
+    for (i = 0; i < LOCK_WAIT_BUCKETS; i++) {
+      cumulative += __atomic_load_n(&site->waitBuckets[i], __ATOMIC_RELAXED);
+      if (i < LOCK_WAIT_BUCKETS - 1) {
+        n += snprintf(buf + n, len > n ? len - n : 0,
+                      "rt_mutex_site_wait_nanoseconds_bucket%.*s,site=\"%s:%d\",le=\"%llu\"} %llu\n",
+                      SITE_LABELS(site), (unsigned long long) wait_bucket_le[i],
+                      (unsigned long long) cumulative);
+      } else {
+        n += snprintf(buf + n, len > n ? len - n : 0,
+                      "rt_mutex_site_wait_nanoseconds_bucket%.*s,site=\"%s:%d\",le=\"+Inf\"} %llu\n",
+                      SITE_LABELS(site), (unsigned long long) cumulative);
+      }
+    }
+    n += snprintf(buf + n, len > n ? len - n : 0,
+                  "rt_mutex_site_wait_nanoseconds_sum%.*s,site=\"%s:%d\"} %llu\n"
+                  "rt_mutex_site_wait_nanoseconds_count%.*s,site=\"%s:%d\"} %llu\n",
+                  SITE_LABELS(site), (unsigned long long) __atomic_load_n(&site->waitNs, __ATOMIC_RELAXED),
+                  SITE_LABELS(site), (unsigned long long) __atomic_load_n(&site->acquisitions, __ATOMIC_RELAXED));
+  }
+
+  n += snprintf(buf + n, len > n ? len - n : 0,
+                "# HELP rt_mutex_site_hold_nanoseconds_total Time each mutex was held, by call site\n"
+                "# TYPE rt_mutex_site_hold_nanoseconds_total counter\n");
+  for (site = first; site != NULL; site = site->next) {
+    n += snprintf(buf + n, len > n ? len - n : 0,
+                  "rt_mutex_site_hold_nanoseconds_total%.*s,site=\"%s:%d\"} %llu\n",
+                  SITE_LABELS(site), (unsigned long long) __atomic_load_n(&site->holdNs, __ATOMIC_RELAXED));
+  }
+
+  n += snprintf(buf + n, len > n ? len - n : 0,
+                "# HELP rt_mutex_site_max_hold_nanoseconds Longest time each mutex was held, by call site\n"
+                "# TYPE rt_mutex_site_max_hold_nanoseconds gauge\n");
+  for (site = first; site != NULL; site = site->next) {
+    n += snprintf(buf + n, len > n ? len - n : 0,
+                  "rt_mutex_site_max_hold_nanoseconds%.*s,site=\"%s:%d\"} %llu\n",
+                  SITE_LABELS(site), (unsigned long long) __atomic_load_n(&site->maxHoldNs, __ATOMIC_RELAXED));
+  }
+#undef SITE_LABELS
+  return n;
+}
+#endif
+
+// Print CPU time, context switches and thread count for the whole process,
+// so the cost of each way of running things can be compared
+static int format_process(char *buf, int len) {
+  struct rusage usage;
+  struct dirent *entry;
+  DIR *dir;
+  int n = 0, threads = 0;
+
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    n += snprintf(buf + n, len > n ? len - n : 0,
+                  "# HELP rt_process_cpu_microseconds_total CPU time used by rt_http\n"
+                  "# TYPE rt_process_cpu_microseconds_total counter\n"
+                  "rt_process_cpu_microseconds_total{mode=\"user\"} %lld\n"
+                  "rt_process_cpu_microseconds_total{mode=\"system\"} %lld\n"
+                  "# HELP rt_context_switches_total Context switches by all of rt_http's threads\n"
+                  "# TYPE rt_context_switches_total counter\n"
+                  "rt_context_switches_total{type=\"voluntary\"} %ld\n"
+                  "rt_context_switches_total{type=\"involuntary\"} %ld\n",
+                  usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec,
+                  usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec,
+                  usage.ru_nvcsw, usage.ru_nivcsw);
+  }
+  if ((dir = opendir("/proc/self/task")) != NULL) {
+    while ((entry = readdir(dir)) != NULL) {
+      threads += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+    n += snprintf(buf + n, len > n ? len - n : 0,
+                  "# HELP rt_threads Threads in rt_http\n"
+                  "# TYPE rt_threads gauge\n"
+                  "rt_threads %d\n", threads);
+  }
+  return n;
+}
+
+// Print one metric, with its HELP and TYPE lines if it starts a new family
+static int format_metric(char *buf, int len, const struct metric_info *info,
+                         const struct metric_info *previous, const char *type,
+                         long long value) {
+  int n = 0;
+  if (previous == NULL || strcmp(previous->family, info->family) != 0) {
+    n += snprintf(buf + n, len > n ? len - n : 0, "# HELP %s %s\n# TYPE %s %s\n",
+                  info->family, info->help, info->family, type);
+  }
+  n += snprintf(buf + n, len > n ? len - n : 0, "%s%s %lld\n",
+                info->family, info->labels, value);
+  return n;
+}
+
+int metrics_format(char *buf, int len) {
+  int n = 0, i, t;
+  int threads = __atomic_load_n(&numSlots, __ATOMIC_RELAXED);
+
+  if (threads > MAX_THREADS) {
+    threads = MAX_THREADS;
+  }
+  for (i = 0; i < NUM_COUNTERS; i++) {
+    uint64_t total = 0;
+    for (t = 0; t < threads; t++) {
+      total += __atomic_load_n(&slots[t].counters[i], __ATOMIC_RELAXED);
+    }
+    n += format_metric(buf + n, len > n ? len - n : 0, &counter_info[i],
+                       i > 0 ? &counter_info[i - 1] : NULL, "counter",
+                       (long long) total);
+  }
+  for (i = 0; i < NUM_GAUGES; i++) {
+    n += format_metric(buf + n, len > n ? len - n : 0, &gauge_info[i], NULL,
+                       "gauge", (long long) __atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+  }
+  n += format_process(buf + n, len > n ? len - n : 0);
+#ifdef LOCK_PROFILE
+  n += format_lock_sites(buf + n, len > n ? len - n : 0);
+#endif
+  return n;
+}
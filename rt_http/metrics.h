@@ -0,0 +1,106 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Metrics, served in Prometheus text exposition format at /metrics
+//
+// Every thread that records metrics gets its own slot of counters, which only
+// it ever writes to, so recording is a plain (relaxed atomic) load and store
+// with no locking and no shared cache lines. A scrape just reads and sums all
+// the slots, so it can't hold up the transmitter thread.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Counters. Keep in sync with counter_info in metrics.c.
+enum counter {
+  C_FRAMES_SENT,
+  C_FRAME_INTERVALS, C_FRAME_INTERVAL_US, C_FRAME_INTERVAL_US_SQUARED,
+  C_COMMAND_CHANGES,
+  C_STALE_COMMANDS,
+  C_HTTP_SET, C_HTTP_BATCH, C_HTTP_GET, C_HTTP_METRICS, C_HTTP_TRACE, C_HTTP_FILE, C_HTTP_GOAL,
+  C_HTTP_HISTORY, C_HTTP_OTHER,
+  C_SENSOR_READS_SRF02, C_SENSOR_READS_CMPS10,
+  C_SENSOR_FAILURES_SRF02, C_SENSOR_FAILURES_CMPS10,
+  C_AUTONOMY_FORWARD, C_AUTONOMY_AVOID, C_AUTONOMY_TURN, C_AUTONOMY_BLOCKED,
+  C_MUTEX_WAIT_NS_USER_COMMAND, C_MUTEX_WAIT_NS_AUTONOMY_COMMAND,
+  C_MUTEX_WAIT_NS_SENSOR_DATA,
+  C_LOG_DROPPED,
+  C_MAP_UPDATES,
+  C_PLANNER_SEARCHES, C_PLANNER_EXPANSIONS, C_PLANNER_COST_CHANGES,
+  C_LOCALIZER_UPDATES, C_LOCALIZER_RESAMPLES,
+  C_TELEMETRY_RECORDS, C_TELEMETRY_DROPPED,
+  C_METRICS_TRUNCATED,
+  NUM_COUNTERS
+};
+
+// Gauges, each with a single writer. Keep in sync with gauge_info in metrics.c.
+enum gauge {
+  G_FRAMES_PER_SECOND,
+  G_MAX_FRAME_INTERVAL_US,
+  G_AUTONOMY_ENABLED,
+  G_RANGE,
+  G_BEARING,
+  G_RECOVERY_GAP_US,
+  G_MAP_TILES,
+  G_LOCALIZER_SPREAD_CM,
+  NUM_GAUGES
+};
+
+// Name the calling thread's counter slot. Threads that don't call this get
+// a slot named after the first thing they count, e.g. mongoose's workers.
+void metrics_thread_init(const char *name);
+
+// Add to one of the calling thread's counters
+void metrics_add(enum counter c, uint64_t n);
+#define metrics_inc(c) metrics_add((c), 1)
+
+// Set a gauge
+void metrics_set(enum gauge g, int64_t value);
+
+// Lock a mutex, adding any time spent waiting for it to a counter. An
+// uncontended lock costs no more than pthread_mutex_lock().
+void metrics_mutex_lock(pthread_mutex_t *mutex, enum counter waitCounter);
+
+#ifdef LOCK_PROFILE
+// Building with -DLOCK_PROFILE (make ADD=-DLOCK_PROFILE) also profiles every
+// place a mutex is locked: how often, a histogram of time waited, and time
+// held until metrics_mutex_unlock(). Each call site gets its own static
+// lock_site, so nothing is shared but the counters themselves.
+#define LOCK_WAIT_BUCKETS 6
+
+struct lock_site {
+  const char *file;
+  int line;
+  enum counter waitCounter;       // Identifies the mutex
+  int registered;
+  struct lock_site *next;
+  uint64_t acquisitions;
+  uint64_t waitNs;
+  uint64_t waitBuckets[LOCK_WAIT_BUCKETS];
+  uint64_t holdNs;
+  uint64_t maxHoldNs;
+};
+
+void metrics_site_lock(struct lock_site *site, pthread_mutex_t *mutex);
+void metrics_mutex_unlock(pthread_mutex_t *mutex);
+int metrics_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *deadline);
+
+#define metrics_mutex_lock(mutex, waitCounter) do { \
+    static struct lock_site site_ = {__FILE__, __LINE__, (waitCounter)}; \
+    metrics_site_lock(&site_, (mutex)); \
+  } while (0)
+#else
+#define metrics_mutex_unlock pthread_mutex_unlock
+#define metrics_cond_timedwait pthread_cond_timedwait
+#endif
+
+// Write all metrics in text exposition format to buf. Returns the length
+// they needed, as snprintf() does, so if that's len or more, buf only has as
+// much as fitted.
+int metrics_format(char *buf, int len);
+
+#endif
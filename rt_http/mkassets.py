@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+#
+# Raspberry Tank web UI asset bundler
+#
+# Walks the web-ui directory and writes out a C file containing every asset
+# as a pre-gzipped byte array and a plain one, for clients that don't accept
+# gzip, along with its MIME type and strong ETags (a hash of the content), so
+# that rt_http can serve the whole UI straight from memory. Run by the
+# Makefile; usage: mkassets.py <web-ui dir> > assets.c
+#
+
+import gzip
+import hashlib
+import os
+import sys
+
+# Files that are generated at runtime rather than being part of the UI
+SKIP = ['sensordata.txt']
+
+MIME_TYPES = {
+  '.html': 'text/html',
+  '.js':   'application/x-javascript',
+  '.png':  'image/png',
+  '.css':  'text/css',
+  '.txt':  'text/plain',
+}
+
+
+def main():
+  root = sys.argv[1]
+  assets = []
+  for dirpath, dirnames, filenames in os.walk(root):
+    dirnames.sort()
+    for name in sorted(filenames):
+      if name in SKIP:
+        continue
+      path = os.path.join(dirpath, name)
+      uri = '/' + os.path.relpath(path, root).replace(os.sep, '/')
+      with open(path, 'rb') as f:
+        data = f.read()
+      # mtime=0 keeps the output identical from build to build
+      gz = gzip.compress(data, compresslevel=9, mtime=0)
+      # The two copies are different representations, so need different tags
+      digest = hashlib.sha1(data).hexdigest()[:16]
+      etag = '"' + digest + '-gz"'
+      plainEtag = '"' + digest + '"'
+      mime = MIME_TYPES.get(os.path.splitext(name)[1], 'application/octet-stream')
+      assets.append((uri, mime, etag, gz, plainEtag, data))
+
+  out = sys.stdout
+  out.write('// Generated by mkassets.py from the web-ui directory. Do not edit.\n\n')
+  out.write('#include "assets.h"\n\n')
+  for i, (uri, mime, etag, gz, plainEtag, data) in enumerate(assets):
+    out.write('// %s (%d bytes gzipped, %d plain)\n' % (uri, len(gz), len(data)))
+    write_array(out, 'asset%d' % i, gz)
+    write_array(out, 'plain%d' % i, data)
+  out.write('const struct asset assets[] = {\n')
+  for i, (uri, mime, etag, gz, plainEtag, data) in enumerate(assets):
+    out.write('  {"%s", "%s", "%s", (const char *) asset%d, %d,\n'
+              '   "%s", (const char *) plain%d, %d},\n'
+              % (uri, mime, etag.replace('"', '\\"'), i, len(gz),
+                 plainEtag.replace('"', '\\"'), i, len(data)))
+  out.write('};\n\n')
+  out.write('const int num_assets = %d;\n' % len(assets))
+
+
+# An empty file still gets a byte, as C has no empty arrays
+def write_array(out, name, data):
+  out.write('static const unsigned char %s[] = {\n' % name)
+  for j in range(0, len(data), 16):
+    out.write('  ' + ''.join('%d,' % b for b in data[j:j + 16]) + '\n')
+  if not data:
+    out.write('  0\n')
+  out.write('};\n\n')
+
+
+if __name__ == '__main__':
+  main()
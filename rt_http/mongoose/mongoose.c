@@ -208,6 +208,10 @@ struct pollfd {
 #include <dlfcn.h>
 #endif
 #include <pthread.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#endif
 #if defined(__MACH__)
 #define SSL_LIB   "libssl.dylib"
 #define CRYPTO_LIB  "libcrypto.dylib"
@@ -248,6 +252,7 @@ typedef int SOCKET;
 #define MAX_CGI_ENVIR_VARS 64
 #define MG_BUF_LEN 8192
 #define MAX_REQUEST_SIZE 16384
+#define MAX_MMAP_SIZE (64 * 1024 * 1024)
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
 #ifdef _WIN32
@@ -412,8 +417,11 @@ struct file {
   int64_t size;
   FILE *fp;
   const char *membuf;   // Non-NULL if file data is in memory
+  const char *etag;     // For in-memory files: strong ETag, or NULL
+  const char *mime;     // For in-memory files: Content-Type, or NULL
+  const char *encoding; // For in-memory files: Content-Encoding, or NULL
 };
-#define STRUCT_FILE_INITIALIZER {0, 0, 0, NULL, NULL}
+#define STRUCT_FILE_INITIALIZER {0, 0, 0, NULL, NULL, NULL, NULL, NULL}
 
 // Describes listening socket, or socket which was accept()-ed by the master
 // thread and queued for future handling by the worker thread.
@@ -433,6 +441,7 @@ enum {
   GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
   EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
   NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, REQUEST_TIMEOUT,
+  REQUEST_SIZE,
   NUM_OPTIONS
 };
 
@@ -461,6 +470,7 @@ static const char *config_options[] = {
   "w", "url_rewrite_patterns", NULL,
   "x", "hide_files_patterns", NULL,
   "z", "request_timeout_ms", "30000",
+  "M", "max_request_size", "16384",
   NULL
 };
 #define ENTRIES_PER_CONFIG_OPTION 3
@@ -484,6 +494,12 @@ struct mg_context {
   volatile int sq_tail;      // Tail of the socket queue
   pthread_cond_t sq_full;    // Signaled when socket is produced
   pthread_cond_t sq_empty;   // Signaled when socket is consumed
+
+  char *conn_pool;           // One slab holding all connection objects
+  size_t conn_slot_size;     // sizeof(struct mg_connection) + request buffer
+  int conn_pool_size;        // Number of slots in conn_pool
+  struct mg_connection **conn_free; // Stack of unused slots, protected by mutex
+  int num_conn_free;         // Number of entries on conn_free
 };
 
 struct mg_connection {
@@ -520,6 +536,10 @@ static int is_file_in_memory(struct mg_connection *conn, const char *path,
     // NOTE: override filep->size only on success. Otherwise, it might break
     // constructs like if (!mg_stat() || !mg_fopen()) ...
     filep->size = size;
+    if (conn->ctx->callbacks.open_file_headers != NULL) {
+      conn->ctx->callbacks.open_file_headers(conn, path, &filep->etag,
+                                             &filep->mime, &filep->encoding);
+    }
   }
   return filep->membuf != NULL;
 }
@@ -2685,18 +2705,96 @@ static void handle_directory_request(struct mg_connection *conn,
   conn->status_code = 200;
 }
 
+#if defined(__linux__)
+// Send len bytes of the file straight from the page cache to the socket,
+// without copying them through user space. Returns the number of bytes sent,
+// or -1 if sendfile() can't be used for this file at all and nothing was sent.
+static int64_t send_file_data_sendfile(struct mg_connection *conn,
+                                       struct file *filep,
+                                       int64_t offset, int64_t len) {
+  off_t off = (off_t) offset;
+  int64_t sent = 0;
+  ssize_t n;
+
+  while (sent < len && conn->ctx->stop_flag == 0) {
+    n = sendfile(conn->client.sock, fileno(filep->fp), &off,
+                 (size_t) (len - sent > INT_MAX ? INT_MAX : len - sent));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+      return -1;
+    } else if (n <= 0) {
+      break;
+    }
+    sent += n;
+  }
+
+  return sent;
+}
+
+// Map the requested part of the file and write it out from the mapping.
+// Used where sendfile() can't be, and saves the copy into a stack buffer.
+// Returns the number of bytes sent, or -1 if the file can't be mapped. A
+// failed write counts as 0 sent, not -1, so the caller doesn't go on to
+// send the file again with fread() after part of it went out.
+static int64_t send_file_data_mmap(struct mg_connection *conn,
+                                   struct file *filep,
+                                   int64_t offset, int64_t len) {
+  int64_t page_offset = offset & ~((int64_t) sysconf(_SC_PAGESIZE) - 1);
+  size_t map_len = (size_t) (len + offset - page_offset);
+  int64_t sent;
+  char *p;
+
+  // Don't eat into the address space of a 32-bit board with huge mappings
+  if (map_len > MAX_MMAP_SIZE) {
+    return -1;
+  }
+  if ((p = (char *) mmap(NULL, map_len, PROT_READ, MAP_PRIVATE,
+                         fileno(filep->fp), (off_t) page_offset)) ==
+      MAP_FAILED) {
+    return -1;
+  }
+  sent = mg_write(conn, p + (offset - page_offset), (size_t) len);
+  munmap(p, map_len);
+
+  return sent < 0 ? 0 : sent;
+}
+#endif // __linux__
+
 // Send len bytes from the opened file to the client.
 static void send_file_data(struct mg_connection *conn, struct file *filep,
                            int64_t offset, int64_t len) {
   char buf[MG_BUF_LEN];
   int to_read, num_read, num_written;
+#if defined(__linux__)
+  int64_t sent;
+#endif
 
   if (len > 0 && filep->membuf != NULL && filep->size > 0) {
     if (len > filep->size - offset) {
       len = filep->size - offset;
     }
-    mg_write(conn, filep->membuf + offset, (size_t) len);
+    // Already in memory, so it goes to the socket without any copying
+    conn->num_bytes_sent += mg_write(conn, filep->membuf + offset,
+                                     (size_t) len);
   } else if (len > 0 && filep->fp != NULL) {
+    if (filep->size > 0 && len > filep->size - offset) {
+      len = filep->size - offset;
+    }
+#if defined(__linux__)
+    // Zero-copy paths, unless the data has to go through SSL or throttling
+    if (conn->ssl == NULL && conn->throttle <= 0 &&
+        (sent = send_file_data_sendfile(conn, filep, offset, len)) >= 0) {
+      conn->num_bytes_sent += sent;
+      return;
+    }
+    if (conn->ssl == NULL &&
+        (sent = send_file_data_mmap(conn, filep, offset, len)) >= 0) {
+      conn->num_bytes_sent += sent;
+      return;
+    }
+#endif
+
     fseeko(filep->fp, offset, SEEK_SET);
     while (len > 0) {
       // Calculate how much to read from the file in the buffer
@@ -2732,8 +2830,12 @@ static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
 
 static void construct_etag(char *buf, size_t buf_len,
                            const struct file *filep) {
-  snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"",
-           (unsigned long) filep->modification_time, filep->size);
+  if (filep->etag != NULL) {
+    snprintf(buf, buf_len, "%s", filep->etag);
+  } else {
+    snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"",
+             (unsigned long) filep->modification_time, filep->size);
+  }
 }
 
 static void fclose_on_exec(struct file *filep) {
@@ -2746,7 +2848,7 @@ static void fclose_on_exec(struct file *filep) {
 
 static void handle_file_request(struct mg_connection *conn, const char *path,
                                 struct file *filep) {
-  char date[64], lm[64], etag[64], range[64];
+  char date[64], lm[64], etag[64], range[64], encoding[64];
   const char *msg = "OK", *hdr;
   time_t curtime = time(NULL);
   int64_t cl, r1, r2;
@@ -2756,7 +2858,7 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
   get_mime_type(conn->ctx, path, &mime_vec);
   cl = filep->size;
   conn->status_code = 200;
-  range[0] = '\0';
+  range[0] = encoding[0] = '\0';
 
   if (!mg_fopen(conn, path, "rb", filep)) {
     send_http_error(conn, 500, http_500_error,
@@ -2786,6 +2888,17 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
   gmt_time_string(lm, sizeof(lm), &filep->modification_time);
   construct_etag(etag, sizeof(etag), filep);
 
+  // In-memory files may override the type and carry pre-compressed data
+  if (filep->mime != NULL) {
+    mime_vec.ptr = filep->mime;
+    mime_vec.len = strlen(filep->mime);
+  }
+  if (filep->encoding != NULL) {
+    mg_snprintf(conn, encoding, sizeof(encoding),
+                "Content-Encoding: %s\r\n"
+                "Vary: Accept-Encoding\r\n", filep->encoding);
+  }
+
   (void) mg_printf(conn,
       "HTTP/1.1 %d %s\r\n"
       "Date: %s\r\n"
@@ -2795,9 +2908,9 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
       "Content-Length: %" INT64_FMT "\r\n"
       "Connection: %s\r\n"
       "Accept-Ranges: bytes\r\n"
-      "%s\r\n",
+      "%s%s\r\n",
       conn->status_code, msg, date, lm, etag, (int) mime_vec.len,
-      mime_vec.ptr, cl, suggest_connection_header(conn), range);
+      mime_vec.ptr, cl, suggest_connection_header(conn), range, encoding);
 
   if (strcmp(conn->request_info.request_method, "HEAD") != 0) {
     send_file_data(conn, filep, r1, cl);
@@ -2942,6 +3055,10 @@ static int is_not_modified(const struct mg_connection *conn,
   const char *ims = mg_get_header(conn, "If-Modified-Since");
   const char *inm = mg_get_header(conn, "If-None-Match");
   construct_etag(etag, sizeof(etag), filep);
+  // A strong ETag identifies the content exactly, so it alone decides
+  if (filep->etag != NULL) {
+    return inm != NULL && !strcmp(etag, inm);
+  }
   return (inm != NULL && !mg_strcasecmp(etag, inm)) ||
     (ims != NULL && filep->modification_time <= parse_date_string(ims));
 }
@@ -4868,18 +4985,75 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
   return !ctx->stop_flag;
 }
 
+// Connection objects are allocated once, in a single slab, when the server
+// starts. Each slot is a struct mg_connection immediately followed by its
+// request buffer. Workers already kept one connection object each for their
+// whole lifetime, so this doesn't save any per-request allocation; it just
+// takes the memory in one allocation, sized by max_request_size, up front.
+static int create_connection_pool(struct mg_context *ctx, int size,
+                                  int buf_size) {
+  struct mg_connection *conn;
+  int i;
+
+  ctx->conn_slot_size = sizeof(*conn) + buf_size;
+  // Keep every slot aligned the same way as a malloc()-ed block would be
+  ctx->conn_slot_size = (ctx->conn_slot_size + sizeof(double) - 1) &
+    ~(sizeof(double) - 1);
+  if ((ctx->conn_pool = (char *) calloc(size, ctx->conn_slot_size)) == NULL ||
+      (ctx->conn_free = (struct mg_connection **)
+       calloc(size, sizeof(ctx->conn_free[0]))) == NULL) {
+    return 0;
+  }
+
+  for (i = 0; i < size; i++) {
+    conn = (struct mg_connection *) (ctx->conn_pool + i * ctx->conn_slot_size);
+    conn->buf_size = buf_size;
+    conn->buf = (char *) (conn + 1);
+    conn->ctx = ctx;
+    conn->request_info.user_data = ctx->user_data;
+    ctx->conn_free[i] = conn;
+  }
+  ctx->conn_pool_size = ctx->num_conn_free = size;
+
+  return 1;
+}
+
+static struct mg_connection *get_pooled_connection(struct mg_context *ctx) {
+  struct mg_connection *conn = NULL;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (ctx->num_conn_free > 0) {
+    conn = ctx->conn_free[--ctx->num_conn_free];
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  return conn;
+}
+
+static void put_pooled_connection(struct mg_context *ctx,
+                                  struct mg_connection *conn) {
+  // Wipe everything but the fixed slot layout, so the next user of this
+  // slot starts from the same state as a freshly allocated connection.
+  memset(conn, 0, sizeof(*conn));
+  conn->buf_size = (int) (ctx->conn_slot_size - sizeof(*conn));
+  conn->buf = (char *) (conn + 1);
+  conn->ctx = ctx;
+  conn->request_info.user_data = ctx->user_data;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  assert(ctx->num_conn_free < ctx->conn_pool_size);
+  ctx->conn_free[ctx->num_conn_free++] = conn;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
 static void *worker_thread(void *thread_func_param) {
   struct mg_context *ctx = thread_func_param;
   struct mg_connection *conn;
 
-  conn = (struct mg_connection *) calloc(1, sizeof(*conn) + MAX_REQUEST_SIZE);
+  conn = get_pooled_connection(ctx);
   if (conn == NULL) {
-    cry(fc(ctx), "%s", "Cannot create new connection struct, OOM");
+    cry(fc(ctx), "%s", "Connection pool exhausted");
   } else {
-    conn->buf_size = MAX_REQUEST_SIZE;
-    conn->buf = (char *) (conn + 1);
-    conn->ctx = ctx;
-    conn->request_info.user_data = ctx->user_data;
 
     // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
     // sq_empty condvar to wake up the master waiting in produce_socket()
@@ -4906,7 +5080,7 @@ static void *worker_thread(void *thread_func_param) {
 
       close_connection(conn);
     }
-    free(conn);
+    put_pooled_connection(ctx, conn);
   }
 
   // Signal master that we're done with connection and exiting
@@ -5068,6 +5242,10 @@ static void free_context(struct mg_context *ctx) {
   }
 #endif // !NO_SSL
 
+  // Deallocate connection pool
+  free(ctx->conn_free);
+  free(ctx->conn_pool);
+
   // Deallocate context itself
   free(ctx);
 }
@@ -5151,6 +5329,17 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
     return NULL;
   }
 
+  // Every worker thread owns one connection object for its lifetime, so the
+  // pool needs exactly as many slots as there are workers.
+  if (atoi(ctx->config[REQUEST_SIZE]) < 256 ||
+      !create_connection_pool(ctx, atoi(ctx->config[NUM_THREADS]),
+                              atoi(ctx->config[REQUEST_SIZE]))) {
+    cry(fc(ctx), "Cannot create connection pool, max_request_size: %s",
+        ctx->config[REQUEST_SIZE]);
+    free_context(ctx);
+    return NULL;
+  }
+
 #if !defined(_WIN32) && !defined(__SYMBIAN32__)
   // Ignore SIGPIPE signal, so if browser cancels the request, it
   // won't kill the whole process.
@@ -67,6 +67,9 @@ struct mg_callbacks {
                              const char *path, size_t *data_len);
   void (*init_lua)(struct mg_connection *, void *lua_context);
   void (*upload)(struct mg_connection *, const char *file_name);
+  void (*open_file_headers)(const struct mg_connection *, const char *path,
+                            const char **etag, const char **content_type,
+                            const char **content_encoding);
 };
 
 // Start web server.
@@ -0,0 +1,186 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Odometry
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "odometry.h"
+#include "opcodes.h"
+
+// How wrong things can be, as standard deviations
+#define SPEED_ERROR 0.1                 // Of the calibrated speed
+#define TURN_ERROR 0.1                  // Of the calibrated turn rate
+#define HEADING_DRIFT 0.02              // rad per root second, turning or not
+#define COMPASS_ERROR (5 * M_PI / 180)  // rad, the motors upset it a bit
+#define UNKNOWN_HEADING M_PI            // rad, until the first bearing
+
+// Angle in (-pi, pi]
+static double wrap(double angle) {
+  angle = fmod(angle, 2 * M_PI);
+  if (angle > M_PI) {
+    angle -= 2 * M_PI;
+  } else if (angle <= -M_PI) {
+    angle += 2 * M_PI;
+  }
+  return angle;
+}
+
+void odometry_init(struct odometry *odometry, const struct odometry_calibration *calibration) {
+  memset(odometry, 0, sizeof(*odometry));
+  odometry->calibration = *calibration;
+  odometry->pose.covariance[2][2] = UNKNOWN_HEADING * UNKNOWN_HEADING;
+  odometry->published = odometry->pose;
+}
+
+int odometry_load_calibration(const char *path, struct odometry_calibration *calibration) {
+  char name[32];
+  double value;
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) {
+    return 0;
+  }
+  while (fscanf(f, "%31s %lf", name, &value) == 2) {
+    if (strcmp(name, "forward") == 0) {
+      calibration->forwardSpeed = value;
+    } else if (strcmp(name, "reverse") == 0) {
+      calibration->reverseSpeed = value;
+    } else if (strcmp(name, "left") == 0) {
+      calibration->leftRate = value;
+    } else if (strcmp(name, "right") == 0) {
+      calibration->rightRate = value;
+    }
+  }
+  fclose(f);
+  return 1;
+}
+
+enum motion odometry_motion(int opCode, int *reversing) {
+  int base = opCode & ~DELTA_MASK;
+
+  if (base == FORWARD) {
+    *reversing = 0;
+    return MOTION_FORWARD;
+  }
+  if (base == REVERSE) {
+    *reversing = 1;
+  }
+  if (base == LEFT || base == RIGHT) {
+    return base == LEFT ? MOTION_LEFT : MOTION_RIGHT;
+  }
+  return *reversing ? MOTION_REVERSE : MOTION_IDLE;
+}
+
+// The bearing is packed with a sequence number into one word, so it can be
+// handed over with a single atomic store
+void odometry_compass(struct odometry *odometry, double bearing) {
+  uint64_t old = __atomic_load_n(&odometry->compass, __ATOMIC_RELAXED);
+  uint32_t hundredths = (uint32_t) lround(fmod(fmod(bearing, 360) + 360, 360) * 100);
+  __atomic_store_n(&odometry->compass, (((old >> 32) + 1) << 32) | hundredths, __ATOMIC_RELEASE);
+}
+
+// Kalman filter update of the heading with a compass bearing. The position
+// is corrected too, as far as its error is correlated with the heading's.
+static void correct_heading(struct pose *pose, double bearing) {
+  double (*p)[3] = pose->covariance;
+  double r = COMPASS_ERROR * COMPASS_ERROR;
+  int i, j;
+
+  if (!pose->headingKnown) {
+    pose->heading = bearing;
+    for (i = 0; i < 3; i++) {
+      p[i][2] = p[2][i] = 0;
+    }
+    p[2][2] = r;
+    pose->headingKnown = 1;
+    return;
+  }
+
+  double innovation = wrap(bearing - pose->heading);
+  double s = p[2][2] + r;
+  double k[3] = {p[0][2] / s, p[1][2] / s, p[2][2] / s};
+  double row[3] = {p[2][0], p[2][1], p[2][2]};
+
+  pose->x += k[0] * innovation;
+  pose->y += k[1] * innovation;
+  pose->heading = fmod(pose->heading + k[2] * innovation + 2 * M_PI, 2 * M_PI);
+  for (i = 0; i < 3; i++) {
+    for (j = 0; j < 3; j++) {
+      p[i][j] -= k[i] * row[j];
+    }
+  }
+}
+
+void odometry_frame(struct odometry *odometry, int opCode, double dt, uint64_t usec) {
+  const struct odometry_calibration *c = &odometry->calibration;
+  struct pose *pose = &odometry->pose;
+  double (*p)[3] = pose->covariance;
+  double speed = 0, rate = 0;
+  int i, j;
+
+  pose->motion = odometry_motion(opCode, &odometry->reversing);
+  if (pose->motion == MOTION_FORWARD) {
+    speed = c->forwardSpeed;
+  } else if (odometry->reversing) {
+    speed = -c->reverseSpeed;
+  }
+  if (pose->motion == MOTION_LEFT) {
+    rate = -c->leftRate;
+  } else if (pose->motion == MOTION_RIGHT) {
+    rate = c->rightRate;
+  }
+
+  // Predict. Moving along the heading makes position error depend on
+  // heading error, through the Jacobian f = d(x, y) / d heading.
+  double sinHeading = sin(pose->heading), cosHeading = cos(pose->heading);
+  double distance = speed * dt;
+  double f[2] = {distance * cosHeading, -distance * sinHeading};
+  pose->x += distance * sinHeading;
+  pose->y += distance * cosHeading;
+  pose->heading = fmod(pose->heading + rate * dt + 2 * M_PI, 2 * M_PI);
+
+  // P = F P F' + Q, where F is the identity plus f in the heading column
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < 3; j++) {
+      p[i][j] += f[i] * p[2][j];
+    }
+  }
+  for (i = 0; i < 3; i++) {
+    for (j = 0; j < 2; j++) {
+      p[i][j] += p[i][2] * f[j];
+    }
+  }
+  double alongTrack = SPEED_ERROR * distance;
+  double turn = TURN_ERROR * rate * dt;
+  p[0][0] += alongTrack * alongTrack * sinHeading * sinHeading;
+  p[0][1] += alongTrack * alongTrack * sinHeading * cosHeading;
+  p[1][0] = p[0][1];
+  p[1][1] += alongTrack * alongTrack * cosHeading * cosHeading;
+  p[2][2] += turn * turn + HEADING_DRIFT * HEADING_DRIFT * dt;
+
+  // Correct
+  uint64_t compass = __atomic_load_n(&odometry->compass, __ATOMIC_ACQUIRE);
+  if ((uint32_t) (compass >> 32) != odometry->compassSeq) {
+    odometry->compassSeq = (uint32_t) (compass >> 32);
+    correct_heading(pose, (uint32_t) compass / 100.0 * M_PI / 180);
+  }
+  pose->usec = usec;
+
+  // Publish
+  __atomic_store_n(&odometry->publishSeq, odometry->publishSeq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  odometry->published = *pose;
+  __atomic_store_n(&odometry->publishSeq, odometry->publishSeq + 1, __ATOMIC_RELEASE);
+}
+
+void odometry_read(struct odometry *odometry, struct pose *pose) {
+  unsigned before, after;
+  do {
+    before = __atomic_load_n(&odometry->publishSeq, __ATOMIC_ACQUIRE);
+    *pose = odometry->published;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&odometry->publishSeq, __ATOMIC_RELAXED);
+  } while (before != after || (before & 1));
+}
@@ -0,0 +1,88 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Odometry
+//
+// Dead reckoning: where the tank is, worked out from the frames the
+// transmitter actually sends (each moving it forward, back or round for a
+// frame's worth of time at its calibrated speed) and corrected by the
+// CMPS10's bearing whenever there's a new one. The estimate is a 2D pose
+// with its covariance, kept by an extended Kalman filter that does a fixed
+// amount of work per frame.
+//
+// The transmitter is the only thread that updates the pose. It publishes a
+// copy after every frame under a sequence lock, so the mapper, autonomy and
+// the HTTP server can read it without ever holding the transmitter up, and
+// the compass hands over its bearings through a single atomic word.
+//
+
+#ifndef ODOMETRY_H
+#define ODOMETRY_H
+
+#include <stdint.h>
+
+// How fast the tank goes for each base opcode. rt_calibrate works these out
+// from logged runs.
+struct odometry_calibration {
+  double forwardSpeed;            // m/s
+  double reverseSpeed;            // m/s
+  double leftRate;                // rad/s
+  double rightRate;               // rad/s
+};
+
+// Measured from a Heng Long 1:16 Leopard 2
+#define ODOMETRY_CALIBRATION_INIT {0.35, 0.25, 0.6, 0.9}
+
+// What the tank does with a base opcode
+enum motion {
+  MOTION_IDLE,
+  MOTION_FORWARD,
+  MOTION_REVERSE,
+  MOTION_LEFT,
+  MOTION_RIGHT,
+};
+
+struct pose {
+  double x, y;                    // m from where the tank started, +y north
+  double heading;                 // Radians clockwise from north, 0 to 2 pi
+  double covariance[3][3];        // Of x, y and heading
+  int headingKnown;               // Set once there's been a compass bearing
+  enum motion motion;             // In the last frame
+  uint64_t usec;                  // When the last frame was sent
+};
+
+struct odometry {
+  struct odometry_calibration calibration;
+  struct pose pose;               // Only touched by the thread sending frames
+  int reversing;                  // REVERSE carries on until a FORWARD
+  uint64_t compass;               // Latest bearing, see odometry_compass()
+  uint32_t compassSeq;            // Sequence number of the last one used
+  unsigned publishSeq;            // Odd while published is being written
+  struct pose published;
+};
+
+// Start at 0, 0, heading unknown until the first compass bearing
+void odometry_init(struct odometry *odometry, const struct odometry_calibration *calibration);
+
+// Read a calibration written by rt_calibrate, of lines like "forward 0.35".
+// Anything not in the file keeps its value. Returns 1 if the file was read.
+int odometry_load_calibration(const char *path, struct odometry_calibration *calibration);
+
+// What a base opcode makes the tank do, given whether it was reversing,
+// which is updated: like the real tank, once it's reversing it carries on
+// until told to go forward, even while it turns. Turning takes precedence,
+// so MOTION_REVERSE is only straight back.
+enum motion odometry_motion(int opCode, int *reversing);
+
+// Hand over a new CMPS10 bearing, in degrees, from any one thread
+void odometry_compass(struct odometry *odometry, double bearing);
+
+// Move the pose on by a frame of opCode that took dt seconds and finished
+// at usec, correct it with the latest compass bearing if there's a new one,
+// and publish it. Only one thread may call this.
+void odometry_frame(struct odometry *odometry, int opCode, double dt, uint64_t usec);
+
+// Get the latest published pose. Any thread can call this, and it never
+// blocks the thread calling odometry_frame().
+void odometry_read(struct odometry *odometry, struct pose *pose);
+
+#endif
@@ -0,0 +1,96 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Heng Long opcodes
+//
+
+#include "opcodes.h"
+
+// HENG LONG TANK OPCODES:
+// We don't yet fully understand how the opcodes we send to the tank work. Specifically,
+// we don't understand how to control the speed and direction of the main motors
+// properly, but we do understand how to control just about everything else. Therefore
+// we have ended up with a system of "base opcodes" - premade codes for the stuff we
+// don't understand, but we know works - and "delta opcodes" - the bits we can "and" on
+// top of the base opcodes to trigger the extra functions that we do understand.
+// More info: raspberrytank.ianrenton.com/day-30-cracking-the-code-third-time-luckier/
+
+// BASE OPCODES
+const int IDLE =         0x1003c;
+const int FORWARD =      0x0803c;
+const int REVERSE =      0x1803c; // Must be cancelled by a "forward", idle is not enough
+const int LEFT =         0x10010; // Slower than I would like
+const int RIGHT =        0x10064;
+
+// DELTA OPCODES
+const int MG_LED =       0x0001;
+const int IGNITION =     0x0002;
+const int FIRE =         0x0080;
+const int TURRET_ELEV =  0x0100;
+const int TURRET_LEFT =  0x0200;
+const int TURRET_RIGHT = 0x0400;
+const int RECOIL =       0x0800;
+const int MG_SOUND =     0x1000;
+
+
+// Takes a command from the web UI or autonomy (like "001000010" for "turn left and 
+// fire") and builds a Heng Long format binary opcode to send to the tank.
+int buildOpCode(char* cmd) {
+
+  int opCode = 0;
+  
+  // The first four characters represent the motion of the tank. These are used to
+  // select the "base opcode" (the bit we use without properly understanding it).
+  // Because we use this "base opcode" fudge we can only select at most one of these
+  // directions.
+  // 0000 = idle  1000 = forwards   0100 = reverse   0010 = left    0001 = right
+  if (cmd[0] == '1') {
+    opCode = FORWARD;
+  } else if (cmd[1] == '1') {
+    opCode = REVERSE;
+  } else if (cmd[2] == '1') {
+    opCode = LEFT;
+  } else if (cmd[3] == '1') {
+    opCode = RIGHT;
+  } else {
+    opCode = IDLE;
+  }
+  
+  // Now we check the other characters in the string to see what they're demanding
+  // anything. These are the features in the opcode that we do understand - we can
+  // just set certain bits high to achieve what we want (the "delta opcode"s). This
+  // means we can have several of these active at once if we want.
+  // char 4 = turret left   char 5 = turret right   char 6 = turret elevate
+  // char 7 = fire          char 8 = ignition
+  if (cmd[4] == '1') {
+    opCode = opCode | TURRET_LEFT;
+  }
+  if (cmd[5] == '1') {
+    opCode = opCode | TURRET_RIGHT;
+  }
+  if (cmd[6] == '1') {
+    opCode = opCode | TURRET_ELEV;
+  }
+  if (cmd[7] == '1') {
+    opCode = opCode | FIRE;
+  }
+  if (cmd[8] == '1') {
+    opCode = opCode | IGNITION;
+  }
+  
+  return opCode;
+} // buildOpCode
+
+
+// Calculates the CRC of a Heng Long opcode
+int CRC(int data)
+{
+  int c;
+  c = 0;
+  c ^= data & 0x03;
+  c ^= (data >> 2) & 0x0F;
+  c ^= (data >> 6) & 0x0F;
+  c ^= (data >> 10) & 0x0F;
+  c ^= (data >> 14) & 0x0F;
+  c ^= (data >> 18) & 0x0F;
+  return c;
+} // CRC
@@ -0,0 +1,42 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Heng Long opcodes
+//
+
+#ifndef OPCODES_H
+#define OPCODES_H
+
+// Each frame is a 500us start pulse, 32 Manchester-coded
+// bits of 500us and a 3333us gap, so the tank sees one command every 19.833ms.
+#define FRAME_USEC 19833
+
+// Base opcodes select the motion, and delta opcodes are ORed on top of them to
+// turn on the other functions. See opcodes.c for what we know about them.
+
+// BASE OPCODES
+extern const int IDLE;
+extern const int FORWARD;
+extern const int REVERSE;      // Must be cancelled by a "forward", idle is not enough
+extern const int LEFT;         // Slower than I would like
+extern const int RIGHT;
+
+// DELTA OPCODES
+extern const int MG_LED;
+extern const int IGNITION;
+extern const int FIRE;
+extern const int TURRET_ELEV;
+extern const int TURRET_LEFT;
+extern const int TURRET_RIGHT;
+extern const int RECOIL;
+extern const int MG_SOUND;
+
+// All the delta opcodes, so that what's left is the base opcode
+#define DELTA_MASK (0x0001 | 0x0002 | 0x0080 | 0x0100 | 0x0200 | 0x0400 | 0x0800 | 0x1000)
+
+// Build an opcode from a command like "1000000000"
+int buildOpCode(char* cmd);
+
+// Calculates the CRC of an opcode
+int CRC(int data);
+
+#endif
@@ -0,0 +1,355 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Path planner
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "planner.h"
+
+#define INFINITE 0x3fffffffu            // Never reached by a real cost
+#define STRAIGHT 10                     // Step costs on free cells
+#define DIAGONAL 14
+#define COST_SCALE 64                   // Cost that doubles a step's cost
+
+static const int neighbourX[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+static const int neighbourY[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+static const uint32_t neighbourStep[8] = {STRAIGHT, DIAGONAL, STRAIGHT, DIAGONAL,
+                                          STRAIGHT, DIAGONAL, STRAIGHT, DIAGONAL};
+
+static uint32_t add(uint32_t a, uint32_t b) {
+  return a >= INFINITE || b >= INFINITE || a + b >= INFINITE ? INFINITE : a + b;
+}
+
+static uint32_t min(uint32_t a, uint32_t b) {
+  return a < b ? a : b;
+}
+
+// Cost of stepping from one cell into another, which is impassable if the
+// tank would touch something there. Odometry drifts, so the tank can find
+// itself in such a cell, and it can always get out by going downhill.
+static uint32_t step_cost(const struct planner *p, int from, int to, uint32_t step) {
+  uint8_t cost = p->cost[to];
+  if (cost >= COSTMAP_LETHAL || (cost >= COSTMAP_INSCRIBED && cost >= p->cost[from])) {
+    return INFINITE;
+  }
+  return step * (COST_SCALE + cost) / COST_SCALE;
+}
+
+// Octile distance, which never overestimates since no step costs less
+static uint32_t heuristic(int a, int b) {
+  int dx = abs(a % COSTMAP_CELLS - b % COSTMAP_CELLS);
+  int dy = abs(a / COSTMAP_CELLS - b / COSTMAP_CELLS);
+  return dx > dy ? STRAIGHT * dx + (DIAGONAL - STRAIGHT) * dy
+                 : STRAIGHT * dy + (DIAGONAL - STRAIGHT) * dx;
+}
+
+static int neighbour(int node, int i) {
+  int x = node % COSTMAP_CELLS + neighbourX[i], y = node / COSTMAP_CELLS + neighbourY[i];
+  return x >= 0 && x < COSTMAP_CELLS && y >= 0 && y < COSTMAP_CELLS ? y * COSTMAP_CELLS + x : -1;
+}
+
+
+// Open list
+
+static int less(const struct planner_heap_entry *a, const struct planner_heap_entry *b) {
+  return a->key1 < b->key1 || (a->key1 == b->key1 && a->key2 < b->key2);
+}
+
+static void heap_place(struct planner *p, int i, struct planner_heap_entry entry) {
+  p->heap[i] = entry;
+  p->nodes[entry.node].heapIndex = i;
+}
+
+static void sift_up(struct planner *p, int i) {
+  struct planner_heap_entry entry = p->heap[i];
+  while (i > 0 && less(&entry, &p->heap[(i - 1) / 2])) {
+    heap_place(p, i, p->heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  heap_place(p, i, entry);
+}
+
+static void sift_down(struct planner *p, int i) {
+  struct planner_heap_entry entry = p->heap[i];
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= p->heapSize) {
+      break;
+    }
+    if (child + 1 < p->heapSize && less(&p->heap[child + 1], &p->heap[child])) {
+      child++;
+    }
+    if (!less(&p->heap[child], &entry)) {
+      break;
+    }
+    heap_place(p, i, p->heap[child]);
+    i = child;
+  }
+  heap_place(p, i, entry);
+}
+
+// Add a node, or change its key if it's already there
+static void heap_set(struct planner *p, int node, uint32_t key1, uint32_t key2) {
+  int i = p->nodes[node].heapIndex;
+  if (i < 0) {
+    i = p->heapSize++;
+  }
+  heap_place(p, i, (struct planner_heap_entry) {key1, key2, node});
+  sift_up(p, i);
+  sift_down(p, p->nodes[node].heapIndex);
+}
+
+static void heap_remove(struct planner *p, int node) {
+  int i = p->nodes[node].heapIndex;
+  p->nodes[node].heapIndex = -1;
+  if (--p->heapSize > i) {
+    heap_place(p, i, p->heap[p->heapSize]);
+    sift_up(p, i);
+    sift_down(p, p->nodes[p->heap[p->heapSize].node].heapIndex);
+  }
+}
+
+
+// D* Lite
+
+static void calculate_key(const struct planner *p, int node, uint32_t *key1, uint32_t *key2) {
+  *key2 = min(p->nodes[node].g, p->nodes[node].rhs);
+  *key1 = add(add(*key2, heuristic(p->start, node)), p->km);
+}
+
+static void update_vertex(struct planner *p, int node) {
+  struct planner_node *n = &p->nodes[node];
+  int i;
+
+  if (node != p->goal) {
+    n->rhs = INFINITE;
+    for (i = 0; i < 8; i++) {
+      int next = neighbour(node, i);
+      if (next >= 0) {
+        n->rhs = min(n->rhs, add(step_cost(p, node, next, neighbourStep[i]), p->nodes[next].g));
+      }
+    }
+  }
+  if (n->g != n->rhs) {
+    uint32_t key1, key2;
+    calculate_key(p, node, &key1, &key2);
+    heap_set(p, node, key1, key2);
+  } else if (n->heapIndex >= 0) {
+    heap_remove(p, node);
+  }
+}
+
+// Expand nodes until the start's cost is right, or the budget runs out.
+// Returns 1 if it's right.
+static int compute_shortest_path(struct planner *p, int budget) {
+  struct planner_node *start = &p->nodes[p->start];
+  struct planner_heap_entry startKey;
+  int i;
+
+  for (;;) {
+    calculate_key(p, p->start, &startKey.key1, &startKey.key2);
+    if (p->heapSize == 0 || (!less(&p->heap[0], &startKey) && start->rhs == start->g)) {
+      return 1;
+    }
+    if (budget-- == 0) {
+      return 0;
+    }
+    p->expansions++;
+
+    struct planner_heap_entry top = p->heap[0];
+    struct planner_node *n = &p->nodes[top.node];
+    uint32_t key1, key2;
+    calculate_key(p, top.node, &key1, &key2);
+    if (top.key1 < key1 || (top.key1 == key1 && top.key2 < key2)) {
+      heap_set(p, top.node, key1, key2);
+    } else if (n->g > n->rhs) {
+      n->g = n->rhs;
+      heap_remove(p, top.node);
+      for (i = 0; i < 8; i++) {
+        int next = neighbour(top.node, i);
+        if (next >= 0) {
+          update_vertex(p, next);
+        }
+      }
+    } else {
+      n->g = INFINITE;
+      update_vertex(p, top.node);
+      for (i = 0; i < 8; i++) {
+        int next = neighbour(top.node, i);
+        if (next >= 0) {
+          update_vertex(p, next);
+        }
+      }
+    }
+  }
+}
+
+// Forget everything and start a search from the goal
+static void reset(struct planner *p, const struct costmap *costmap, int goal, int start) {
+  int i;
+
+  for (i = 0; i < PLANNER_NODES; i++) {
+    p->nodes[i] = (struct planner_node) {INFINITE, INFINITE, -1};
+    p->cost[i] = costmap_cost(costmap, i % COSTMAP_CELLS, i / COSTMAP_CELLS);
+  }
+  p->heapSize = 0;
+  p->column = costmap->column;
+  p->row = costmap->row;
+  p->builds = costmap->builds;
+  p->goal = goal;
+  p->start = p->last = start;
+  p->km = 0;
+  p->planned = 1;
+  p->searches++;
+  p->nodes[goal].rhs = 0;
+  heap_set(p, goal, heuristic(start, goal), 0);
+}
+
+// Bring the costs up to date with the costmap, and update the nodes that
+// changed and those next to them, since it's the steps between them that
+// cost differently.
+// A change spreads over a lot of cells, each next to the others, so nodes are
+// gathered up first to update each only once. Mostly whole rows are the
+// same, so those are skipped in one go.
+static void update_costs(struct planner *p, const struct costmap *costmap) {
+  int x, y, i, numAffected = 0;
+
+  for (y = 0; y < COSTMAP_CELLS; y++) {
+    const uint8_t *costs = &costmap_cost(costmap, 0, y);
+    uint8_t *old = &p->cost[y * COSTMAP_CELLS];
+    if (memcmp(costs, old, COSTMAP_CELLS) == 0) {
+      continue;
+    }
+    for (x = 0; x < COSTMAP_CELLS; x++) {
+      if (costs[x] == old[x]) {
+        continue;
+      }
+      int node = y * COSTMAP_CELLS + x;
+      old[x] = costs[x];
+      p->costChanges++;
+      for (i = -1; i < 8; i++) {
+        int next = i < 0 ? node : neighbour(node, i);
+        if (next >= 0 && !p->affected[next]) {
+          p->affected[next] = 1;
+          p->affectedNodes[numAffected++] = next;
+        }
+      }
+    }
+  }
+  for (i = 0; i < numAffected; i++) {
+    p->affected[p->affectedNodes[i]] = 0;
+    update_vertex(p, p->affectedNodes[i]);
+  }
+  p->builds = costmap->builds;
+}
+
+// Metres from the map's origin to the centre of a window cell
+static void cell_centre(const struct planner *p, int node, double *x, double *y) {
+  *x = (p->column + node % COSTMAP_CELLS - MAP_CELLS / 2 + 0.5) * MAP_CELL_CM / 100.0;
+  *y = (p->row + node / COSTMAP_CELLS - MAP_CELLS / 2 + 0.5) * MAP_CELL_CM / 100.0;
+}
+
+static int clamp(int value, int low, int high) {
+  return value < low ? low : value > high ? high : value;
+}
+
+int planner_window(int *column, int *row, double x, double y, int hasGoal,
+                   double goalX, double goalY, int goalChanged) {
+  int tankColumn, tankRow, goalColumn, goalRow;
+  int low = PLANNER_WINDOW_MARGIN, high = COSTMAP_CELLS - 1 - PLANNER_WINDOW_MARGIN;
+
+  map_locate(x, y, &tankColumn, &tankRow);
+  if (!goalChanged && tankColumn - *column >= low && tankColumn - *column <= high &&
+      tankRow - *row >= low && tankRow - *row <= high) {
+    return 0;
+  }
+
+  // Halfway to the goal, but not so far the tank's near the edge
+  int centreColumn = tankColumn, centreRow = tankRow;
+  if (hasGoal) {
+    map_locate(goalX, goalY, &goalColumn, &goalRow);
+    centreColumn = (tankColumn + goalColumn) / 2;
+    centreRow = (tankRow + goalRow) / 2;
+  }
+  int newColumn = clamp(centreColumn - COSTMAP_CELLS / 2, tankColumn - high, tankColumn - low);
+  int newRow = clamp(centreRow - COSTMAP_CELLS / 2, tankRow - high, tankRow - low);
+  if (newColumn == *column && newRow == *row) {
+    return 0;
+  }
+  *column = newColumn;
+  *row = newRow;
+  return 1;
+}
+
+enum planner_status planner_steer(struct planner *p, const struct costmap *costmap,
+                                  double x, double y, double goalX, double goalY,
+                                  double *bearing) {
+  int tankColumn, tankRow, goalColumn, goalRow, i, step;
+
+  if (hypot(goalX - x, goalY - y) < PLANNER_ARRIVAL) {
+    return PLANNER_ARRIVED;
+  }
+  map_locate(x, y, &tankColumn, &tankRow);
+  map_locate(goalX, goalY, &goalColumn, &goalRow);
+  tankColumn -= costmap->column;
+  tankRow -= costmap->row;
+  if (tankColumn < 0 || tankColumn >= COSTMAP_CELLS || tankRow < 0 || tankRow >= COSTMAP_CELLS) {
+    return PLANNER_NO_PATH;
+  }
+  int start = tankRow * COSTMAP_CELLS + tankColumn;
+  int goal = clamp(goalRow - costmap->row, 0, COSTMAP_CELLS - 1) * COSTMAP_CELLS +
+             clamp(goalColumn - costmap->column, 0, COSTMAP_CELLS - 1);
+
+  if (!p->planned || p->column != costmap->column || p->row != costmap->row || p->goal != goal) {
+    reset(p, costmap, goal, start);
+  } else {
+    if (start != p->start) {
+      p->km = add(p->km, heuristic(p->last, start));
+      p->last = p->start = start;
+    }
+    if (costmap->builds != p->builds) {
+      update_costs(p, costmap);
+    }
+  }
+  // Until the search is done, the path it had before the changes is the best
+  // there is, if there was one
+  int done = compute_shortest_path(p, PLANNER_MAX_EXPANSIONS);
+  if (p->nodes[start].rhs >= INFINITE) {
+    return done ? PLANNER_NO_PATH : PLANNER_SEARCHING;
+  }
+
+  // Follow the path a little way, to the cell to steer for. The start's rhs
+  // is its cheapest step plus the g beyond, so the next cell is the one that
+  // gives it, and so on.
+  int node = start;
+  for (step = 0; step < PLANNER_LOOKAHEAD && node != goal; step++) {
+    int best = -1;
+    uint32_t bestCost = INFINITE;
+    for (i = 0; i < 8; i++) {
+      int next = neighbour(node, i);
+      if (next >= 0) {
+        uint32_t cost = add(step_cost(p, node, next, neighbourStep[i]), p->nodes[next].g);
+        if (cost < bestCost) {
+          best = next;
+          bestCost = cost;
+        }
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    node = best;
+  }
+
+  double targetX, targetY;
+  cell_centre(p, node, &targetX, &targetY);
+  if (node == goal && goalColumn - costmap->column == node % COSTMAP_CELLS &&
+      goalRow - costmap->row == node / COSTMAP_CELLS) {
+    targetX = goalX;
+    targetY = goalY;
+  }
+  *bearing = fmod(atan2(targetX - x, targetY - y) + 2 * M_PI, 2 * M_PI);
+  return PLANNER_FOLLOWING;
+}
@@ -0,0 +1,86 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Path planner
+//
+// Plans the cheapest way to a goal across the costmap with D* Lite (Koenig
+// and Likhachev, 2002). It searches back from the goal, so when the tank
+// moves or some costs change, only the part of the search they affect is
+// done again, rather than all of it.
+//
+// Each cell is a node of 12 bytes (cost so far, its one-step lookahead and
+// where it is in the open list), in one array, and the open list is a binary
+// heap that nodes know their place in, so a node's key can be changed or
+// the node taken out without searching for it. A call does at most
+// PLANNER_MAX_EXPANSIONS expansions, so it fits in an autonomy tick; if
+// that's not enough the search carries on where it left off next time, and
+// meanwhile the tank follows what's left of the last path.
+//
+// The costmap window moves to keep the tank well inside it, and that means
+// planning again from scratch, so it only moves when it has to.
+//
+
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <stdint.h>
+#include "costmap.h"
+
+#define PLANNER_NODES (COSTMAP_CELLS * COSTMAP_CELLS)
+#define PLANNER_MAX_EXPANSIONS 300      // Per call, a few ms on a Pi
+#define PLANNER_WINDOW_MARGIN 24        // Cells the tank is kept from the edge
+#define PLANNER_LOOKAHEAD 6             // Cells along the path it steers for
+#define PLANNER_ARRIVAL 0.3             // m from the goal that counts as there
+
+struct planner_node {
+  uint32_t g;                           // Cost from here to the goal
+  uint32_t rhs;                         // The same, from the neighbours' g
+  int32_t heapIndex;                    // In the open list, or -1
+};
+
+struct planner_heap_entry {
+  uint32_t key1, key2;
+  int32_t node;
+};
+
+struct planner {
+  struct planner_node nodes[PLANNER_NODES];
+  struct planner_heap_entry heap[PLANNER_NODES];
+  int heapSize;
+  uint8_t cost[PLANNER_NODES];          // The costs g and rhs are for
+  int column, row;                      // Costmap window they're for
+  unsigned long builds;                 // Costmap build they're from
+  uint8_t affected[PLANNER_NODES];      // Nodes to update for a cost change
+  int32_t affectedNodes[PLANNER_NODES];
+  int goal, start, last;                // Nodes, last is the start at the last km
+  uint32_t km;                          // How far the start has moved, in heuristic
+  int planned;                          // Set once a search has been started
+
+  // Statistics
+  unsigned long searches;               // From scratch
+  unsigned long expansions;
+  unsigned long costChanges;            // Cells whose cost changed under a plan
+};
+
+enum planner_status {
+  PLANNER_SEARCHING,                    // No path yet, try again next tick
+  PLANNER_NO_PATH,
+  PLANNER_FOLLOWING,                    // Steer for the bearing
+  PLANNER_ARRIVED,
+};
+
+// Whether the costmap window should move so the tank at x, y (m) is well
+// inside it and the goal as near it as can be. Updates column and row,
+// the map cell of its south-west corner, and returns 1 if they changed.
+// Always moves it if the goal has changed.
+int planner_window(int *column, int *row, double x, double y, int hasGoal,
+                   double goalX, double goalY, int goalChanged);
+
+// Plan from the tank at x, y to the goal (m), across the latest costmap,
+// carrying on from the last plan as far as possible. If it's following a
+// path, sets bearing to the one to steer for (radians clockwise from north).
+// A goal outside the window is planned for where the window is nearest to it.
+enum planner_status planner_steer(struct planner *planner, const struct costmap *costmap,
+                                  double x, double y, double goalX, double goalY,
+                                  double *bearing);
+
+#endif
@@ -0,0 +1,348 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Kernel benchmarks
+//
+// Checks that the vector versions of rt_http's number-crunching kernels give
+// exactly the same results as the plain C versions they're meant to match,
+// on random data, then times both, in cells (or whatever the kernel works
+// on) per second. Then checks that telemetry blocks decode to what was
+// encoded, on a made-up drive, and times that too. Exits with 1 if anything
+// differs.
+//
+// Usage: rt_bench [-t seconds per kernel] [-s seed]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "costmap.h"
+#include "localize.h"
+#include "telemetry.h"
+
+#define CHECKS 20                 // Random inputs each kernel is checked on
+#define PARTICLES 4096
+#define ROOM_CELLS 200            // Of the map particles are in, 10m square
+#define DRIVE_RECORDS (1 << 18)   // Of telemetry, about 80 minutes' worth
+
+// A kernel run both ways, on inputs made by prepare()
+struct kernel {
+  const char *name;
+  void (*prepare)(uint64_t *seed);
+  void (*scalar)(void);
+  void (*vector)(void);
+  const void *output;
+  size_t outputSize;
+  long cells;                     // Per run
+};
+
+// Function declarations
+int check(const struct kernel *kernel, uint64_t seed);
+double rate(const struct kernel *kernel, void (*run)(void), double seconds, uint64_t seed);
+int codec(double seconds, uint64_t seed);
+void make_drive(struct telemetry_record *records, int n, uint64_t *seed);
+double seconds_now();
+uint32_t random32(uint64_t *state);
+
+// Inputs and outputs
+static int8_t tiles[MAP_MAX_TILES * sizeof(struct map_tile)];
+static struct costmap costmap;
+static struct localize_map room;
+static float particleX[PARTICLES], particleY[PARTICLES], particleHeading[PARTICLES];
+static float particleSin[PARTICLES], particleCos[PARTICLES];
+static float expected[PARTICLES], logWeight[PARTICLES];
+
+// Decay of the whole tile pool, by one step, as rt_http does
+void prepare_decay(uint64_t *seed) {
+  size_t i;
+  for (i = 0; i < sizeof(tiles); i++) {
+    tiles[i] = (int8_t) ((int) (random32(seed) % (2 * MAP_LOG_ODDS_MAX + 1)) - MAP_LOG_ODDS_MAX);
+  }
+}
+void decay_scalar() { costmap_decay_scalar(tiles, sizeof(tiles), 1); }
+void decay_vector() { costmap_decay(tiles, sizeof(tiles), 1); }
+
+// Log-odds of a well explored window, about 1 in 20 cells occupied
+void prepare_threshold(uint64_t *seed) {
+  int i;
+  for (i = 0; i < COSTMAP_CELLS * COSTMAP_CELLS; i++) {
+    uint32_t r = random32(seed);
+    costmap.logOdds[i] = (int8_t) (r % 20 == 0 ? (int) (COSTMAP_OCCUPIED + r / 20 % 40) : -(int) (r / 20 % 64));
+  }
+}
+void threshold_scalar() { costmap_threshold_scalar(&costmap); }
+void threshold_vector() { costmap_threshold(&costmap); }
+
+// Inflating that
+void prepare_inflate(uint64_t *seed) {
+  prepare_threshold(seed);
+  costmap_threshold_scalar(&costmap);
+}
+void inflate_scalar() { costmap_inflate_scalar(&costmap); }
+void inflate_vector() { costmap_inflate(&costmap); }
+
+// Particles around a walled room with a few boxes in it, facing any way
+void prepare_raycast(uint64_t *seed) {
+  int i, j;
+  localize_map_destroy(&room);
+  localize_map_create(&room, ROOM_CELLS, ROOM_CELLS, -5, -5);
+  for (i = 0; i < ROOM_CELLS; i++) {
+    localize_map_set(&room, -5 + i * 0.05, -5);
+    localize_map_set(&room, -5 + i * 0.05, 4.95);
+    localize_map_set(&room, -5, -5 + i * 0.05);
+    localize_map_set(&room, 4.95, -5 + i * 0.05);
+  }
+  for (i = 0; i < 8; i++) {
+    double x = -4 + (random32(seed) % 700) / 100.0, y = -4 + (random32(seed) % 700) / 100.0;
+    for (j = 0; j < 10; j++) {
+      localize_map_set(&room, x + j * 0.05, y);
+      localize_map_set(&room, x, y + j * 0.05);
+    }
+  }
+  localize_map_finish(&room);
+  for (i = 0; i < PARTICLES; i++) {
+    particleX[i] = -4.5f + (random32(seed) % 9000) / 1000.0f;
+    particleY[i] = -4.5f + (random32(seed) % 9000) / 1000.0f;
+    particleHeading[i] = (random32(seed) % 62832) / 10000.0f;
+    particleSin[i] = sinf(particleHeading[i]);
+    particleCos[i] = cosf(particleHeading[i]);
+  }
+}
+void raycast_scalar() {
+  localize_raycast_scalar(&room, particleX, particleY, particleSin, particleCos, expected, PARTICLES);
+}
+void raycast_vector() {
+  localize_raycast(&room, particleX, particleY, particleSin, particleCos, expected, PARTICLES);
+}
+
+// Weighing those ranges against a measurement
+void prepare_weigh(uint64_t *seed) {
+  int i;
+  prepare_raycast(seed);
+  localize_raycast_scalar(&room, particleX, particleY, particleSin, particleCos, expected, PARTICLES);
+  for (i = 0; i < PARTICLES; i++) {
+    logWeight[i] = -(random32(seed) % 1000) / 100.0f;
+  }
+}
+void weigh_scalar() { localize_weigh_scalar(expected, particleHeading, 150, 2.5f, logWeight, PARTICLES); }
+void weigh_vector() { localize_weigh(expected, particleHeading, 150, 2.5f, logWeight, PARTICLES); }
+
+static const struct kernel kernels[] = {
+  {"decay", prepare_decay, decay_scalar, decay_vector, tiles, sizeof(tiles), sizeof(tiles)},
+  {"threshold", prepare_threshold, threshold_scalar, threshold_vector,
+   costmap.cost, sizeof(costmap.cost), COSTMAP_CELLS * COSTMAP_CELLS},
+  {"inflate", prepare_inflate, inflate_scalar, inflate_vector,
+   costmap.cost, sizeof(costmap.cost), COSTMAP_CELLS * COSTMAP_CELLS},
+  {"raycast", prepare_raycast, raycast_scalar, raycast_vector, expected, sizeof(expected), PARTICLES},
+  {"weigh", prepare_weigh, weigh_scalar, weigh_vector, logWeight, sizeof(logWeight), PARTICLES},
+};
+#define NUM_KERNELS (int) (sizeof(kernels) / sizeof(kernels[0]))
+
+// Main
+int main(int argc, char **argv) {
+  double seconds = 1;
+  uint64_t seed = 1;
+  int opt, i, failed = 0;
+
+  while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+    switch (opt) {
+      case 't': seconds = atof(optarg); break;
+      case 's': seed = strtoull(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "Usage: %s [-t seconds per kernel] [-s seed]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  printf("Vector kernels: %s\n\n", costmap_simd);
+  printf("%-10s %8s %16s %16s %8s\n", "kernel", "check", "scalar cells/s", "vector cells/s", "speedup");
+  for (i = 0; i < NUM_KERNELS; i++) {
+    const struct kernel *kernel = &kernels[i];
+    int ok = check(kernel, seed);
+    double scalar = rate(kernel, kernel->scalar, seconds, seed);
+    double vector = rate(kernel, kernel->vector, seconds, seed);
+    printf("%-10s %8s %16.3g %16.3g %7.1fx\n", kernel->name, ok ? "ok" : "DIFFERS",
+           scalar, vector, vector / scalar);
+    failed |= !ok;
+  }
+  failed |= !codec(seconds, seed);
+  return failed;
+} // main
+
+
+// Run both versions of a kernel on the same random inputs, and compare
+int check(const struct kernel *kernel, uint64_t seed) {
+  unsigned char *expected = malloc(kernel->outputSize);
+  int i, ok = 1;
+
+  for (i = 0; i < CHECKS && ok; i++) {
+    uint64_t state = (seed + i) * 0x9e3779b97f4a7c15ULL + 1;
+    kernel->prepare(&state);
+    kernel->scalar();
+    memcpy(expected, kernel->output, kernel->outputSize);
+
+    state = (seed + i) * 0x9e3779b97f4a7c15ULL + 1;
+    kernel->prepare(&state);
+    kernel->vector();
+    ok = memcmp(expected, kernel->output, kernel->outputSize) == 0;
+  }
+  free(expected);
+  return ok;
+}
+
+// Cells per second one version of a kernel gets through. Its inputs are made
+// once; decay eventually turns them all to 0, which doesn't change its speed.
+double rate(const struct kernel *kernel, void (*run)(void), double seconds, uint64_t seed) {
+  uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+  long runs = 0;
+  double start;
+
+  kernel->prepare(&state);
+  start = seconds_now();
+  do {
+    run();
+    runs++;
+  } while (seconds_now() - start < seconds);
+  return runs * kernel->cells / (seconds_now() - start);
+}
+
+// Encode a made-up drive's telemetry into blocks as the writer would, check
+// it all decodes back the same, and time both ways in MB/s of records
+int codec(double seconds, uint64_t seed) {
+  struct telemetry_record *records = malloc(DRIVE_RECORDS * sizeof(struct telemetry_record));
+  struct telemetry_record *decoded = malloc(DRIVE_RECORDS * sizeof(struct telemetry_record));
+  uint8_t *blocks = malloc(DRIVE_RECORDS / TELEMETRY_BLOCK_RECORDS * TELEMETRY_MAX_BLOCK_BYTES * 2);
+  int starts[DRIVE_RECORDS / 64], counts[DRIVE_RECORDS / 64];
+  size_t offsets[DRIVE_RECORDS / 64 + 1];
+  int numBlocks = 0, i, n, ok = 1, ranges = 0;
+  uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+  double start, encodeRate, decodeRate, rangeRate;
+  long runs;
+
+  make_drive(records, DRIVE_RECORDS, &state);
+
+  // Blocks end where the writer would end them
+  offsets[0] = 0;
+  for (i = 0; i < DRIVE_RECORDS; i += counts[numBlocks++]) {
+    for (n = 1; i + n < DRIVE_RECORDS && n < TELEMETRY_BLOCK_RECORDS &&
+                records[i + n].usec < records[i].usec + TELEMETRY_BLOCK_USEC; n++);
+    starts[numBlocks] = i;
+    counts[numBlocks] = n;
+    offsets[numBlocks + 1] = offsets[numBlocks] +
+                             telemetry_encode_block(&records[i], n, blocks + offsets[numBlocks]);
+  }
+  for (i = 0; i < numBlocks && ok; i++) {
+    const struct telemetry_block *block = (const struct telemetry_block *) (blocks + offsets[i]);
+    ok = telemetry_decode_block(block, ~0u, &decoded[starts[i]]) == counts[i];
+  }
+  ok = ok && memcmp(records, decoded, DRIVE_RECORDS * sizeof(struct telemetry_record)) == 0;
+
+  start = seconds_now();
+  runs = 0;
+  do {
+    for (i = 0; i < numBlocks; i++) {
+      telemetry_encode_block(&records[starts[i]], counts[i], blocks + offsets[i]);
+    }
+    runs++;
+  } while (seconds_now() - start < seconds);
+  encodeRate = runs * (double) sizeof(records[0]) * DRIVE_RECORDS / (seconds_now() - start) / 1e6;
+
+  start = seconds_now();
+  runs = 0;
+  do {
+    for (i = 0; i < numBlocks; i++) {
+      telemetry_decode_block((const struct telemetry_block *) (blocks + offsets[i]), ~0u,
+                             &decoded[starts[i]]);
+    }
+    runs++;
+  } while (seconds_now() - start < seconds);
+  decodeRate = runs * (double) sizeof(records[0]) * DRIVE_RECORDS / (seconds_now() - start) / 1e6;
+
+  // Just the range samples, skipping the other types' columns
+  start = seconds_now();
+  runs = 0;
+  do {
+    for (i = 0, ranges = 0; i < numBlocks; i++) {
+      ranges += telemetry_decode_block((const struct telemetry_block *) (blocks + offsets[i]),
+                                       1u << TELEMETRY_RANGE, decoded);
+    }
+    runs++;
+  } while (seconds_now() - start < seconds);
+  rangeRate = runs * (double) sizeof(records[0]) * ranges / (seconds_now() - start) / 1e6;
+
+  printf("\n%-10s %8s %16s %16s %16s %16s\n", "telemetry", "check", "bytes/record",
+         "encode MB/s", "decode MB/s", "range MB/s");
+  printf("%-10s %8s %9.2f (%4.1fx) %16.0f %16.0f %16.0f\n", "", ok ? "ok" : "DIFFERS",
+         (double) offsets[numBlocks] / DRIVE_RECORDS,
+         (double) sizeof(records[0]) * DRIVE_RECORDS / offsets[numBlocks],
+         encodeRate, decodeRate, rangeRate);
+  free(records);
+  free(decoded);
+  free(blocks);
+  return ok;
+}
+
+// Add a record to a made-up drive, if there's room
+static void add_record(struct telemetry_record *records, int *i, int n, uint64_t usec,
+                       int type, int source, int32_t a, int32_t b, int32_t c) {
+  if (*i < n) {
+    struct telemetry_record *record = &records[(*i)++];
+    memset(record, 0, sizeof(*record));
+    record->usec = usec;
+    record->type = type;
+    record->source = source;
+    record->values[0] = a;
+    record->values[1] = b;
+    record->values[2] = c;
+  }
+}
+
+// Telemetry like rt_http's on a drive: a frame every 19833us give or take a
+// bit of jitter, a new command every few seconds, and range and compass
+// samples wandering about. The opcodes are made up.
+void make_drive(struct telemetry_record *records, int n, uint64_t *seed) {
+  static const int32_t opcodes[] = {0x0fe0f3c0, 0x0fe4f3c0, 0x0fc0f3c0, 0x0fe0e3c0};
+  uint64_t usec = 1000000000, nextRange = usec, nextCompass = usec, nextCommand = usec;
+  int32_t opcode = opcodes[0], range = 150, bearing = 900, seq = 0;
+  int i = 0;
+
+  while (i < n) {
+    usec += 19833 + (int) (random32(seed) % 61) - 30;
+    if (usec >= nextCommand) {
+      opcode = opcodes[random32(seed) % 4];
+      add_record(records, &i, n, usec, TELEMETRY_COMMAND, TELEMETRY_USER,
+                 random32(seed) % 1024, 12345, ++seq);
+      nextCommand = usec + 2000000 + random32(seed) % 8000000;
+    }
+    if (usec >= nextRange) {
+      range += (int) (random32(seed) % 21) - 10;
+      range = range < 0 ? 0 : range > 600 ? 600 : range;
+      add_record(records, &i, n, usec, TELEMETRY_RANGE, 0, range, 0, 0);
+      nextRange = usec + 4 * 5 * 19833;
+    }
+    if (usec >= nextCompass) {
+      bearing = (bearing + (int) (random32(seed) % 11) - 5 + 3600) % 3600;
+      add_record(records, &i, n, usec, TELEMETRY_COMPASS, 0, bearing,
+                 (int) (random32(seed) % 5) - 2, (int) (random32(seed) % 5) - 2);
+      nextCompass = usec + 8 * 5 * 19833;
+    }
+    add_record(records, &i, n, usec, TELEMETRY_FRAME, 0, opcode, 0, 0);
+  }
+}
+
+double seconds_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// xorshift64*, so inputs come out the same on every machine
+uint32_t random32(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return (uint32_t) ((*state * 0x2545f4914f6cdd1dULL) >> 32);
+}
@@ -0,0 +1,197 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Odometry calibration
+//
+// Works out how fast the tank goes for each base opcode from logged runs
+// (rt_http -l, or rt_world -v), for odometry to use. There's nothing to say
+// where the tank really was, so this goes by its sensors: turn rates from how
+// fast the compass bearing changes while turning, and speeds from how fast
+// the range changes while driving straight at something.
+//
+// The SRF02 reads the nearest thing in its cone, which only closes at the
+// full speed when the tank is heading straight for it, and not at all when
+// it's stuck against it, so speeds are taken from the 90th percentile of the
+// readings rather than the median that's used for turn rates.
+//
+// Usage: rt_calibrate log.csv... > /etc/rt_http.odometry
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "opcodes.h"
+#include "odometry.h"
+
+#define MAX_LINE 1024
+#define MAX_SAMPLES 100000
+#define MIN_SAMPLES 5
+#define MAX_BEARING_CHANGE 2      // Degrees, between ranges still heading the same way
+
+// Readings of one kind of motion
+struct samples {
+  double values[MAX_SAMPLES];
+  int n;
+};
+
+// The last change in a sensor reading
+struct reading {
+  double time;
+  int value;
+  int bearing;                    // When it was taken
+  long run;                       // Stretch of the same motion it was in
+};
+
+// Function declarations
+int read_log(const char* fileName, struct samples* samples);
+int column_index(char* header, const char* name);
+void add_sample(struct samples* samples, double value);
+double percentile(struct samples* samples, double p);
+int compare_doubles(const void* a, const void* b);
+
+// Main
+int main(int argc, char **argv) {
+  static struct samples samples[MOTION_RIGHT + 1];
+  struct odometry_calibration calibration = ODOMETRY_CALIBRATION_INIT;
+  double* values[] = {NULL, &calibration.forwardSpeed, &calibration.reverseSpeed,
+                      &calibration.leftRate, &calibration.rightRate};
+  const char* names[] = {"idle", "forward", "reverse", "left", "right"};
+  int i;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s log.csv... > /etc/rt_http.odometry\n", argv[0]);
+    return 1;
+  }
+  for (i = 1; i < argc; i++) {
+    if (!read_log(argv[i], samples)) {
+      return 1;
+    }
+  }
+
+  for (i = MOTION_FORWARD; i <= MOTION_RIGHT; i++) {
+    int speed = i == MOTION_FORWARD || i == MOTION_REVERSE;
+    if (samples[i].n < MIN_SAMPLES) {
+      fprintf(stderr, "%s: only %d readings, keeping %g\n", names[i], samples[i].n, *values[i]);
+    } else {
+      *values[i] = percentile(&samples[i], speed ? 0.9 : 0.5);
+      fprintf(stderr, "%s: %g %s from %d readings\n", names[i], *values[i],
+              speed ? "m/s" : "rad/s", samples[i].n);
+    }
+    printf("%s %.4f\n", names[i], *values[i]);
+  }
+  return 0;
+} // main
+
+
+// Read a log, adding a sample whenever a bearing or range changes during the
+// same stretch of motion as its last change. Logs of several runs one after
+// another, each with its own header, are fine.
+int read_log(const char* fileName, struct samples* samples) {
+  char line[MAX_LINE];
+  int timeColumn = -1, bearingColumn = -1, rangeColumn = -1, commandColumn = -1;
+  struct reading lastBearing = {0}, lastRange = {0};
+  int previousBearing = -1, previousRange = -1;
+  int reversing = 0;
+  enum motion motion = MOTION_IDLE;
+  long run = 0;
+  FILE* f = fopen(fileName, "r");
+
+  if (f == NULL) {
+    fprintf(stderr, "Can't open %s\n", fileName);
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* fields[16];
+    int numFields = 0;
+    char* field;
+
+    if (strncmp(line, "time", 4) == 0) {
+      timeColumn = column_index(line, "time");
+      bearingColumn = column_index(line, "bearing");
+      rangeColumn = column_index(line, "range");
+      commandColumn = column_index(line, "command");
+      previousBearing = previousRange = -1;
+      reversing = 0;
+      run++;
+      continue;
+    }
+    for (field = strtok(line, ",\r\n"); field != NULL && numFields < 16; field = strtok(NULL, ",\r\n")) {
+      fields[numFields++] = field;
+    }
+    if (timeColumn < 0 || bearingColumn < 0 || rangeColumn < 0 || commandColumn < 0 ||
+        timeColumn >= numFields || bearingColumn >= numFields || rangeColumn >= numFields ||
+        commandColumn >= numFields || strlen(fields[commandColumn]) < 9) {
+      fprintf(stderr, "%s: needs time, bearing, range and command columns\n", fileName);
+      fclose(f);
+      return 0;
+    }
+
+    double time = atof(fields[timeColumn]);
+    int bearing = atoi(fields[bearingColumn]);
+    int range = atoi(fields[rangeColumn]);
+    enum motion newMotion = odometry_motion(buildOpCode(fields[commandColumn]), &reversing);
+    if (newMotion != motion) {
+      motion = newMotion;
+      run++;
+    }
+
+    if (bearing != previousBearing && previousBearing >= 0) {
+      if (lastBearing.run == run && (motion == MOTION_LEFT || motion == MOTION_RIGHT)) {
+        double turned = fmod(bearing - lastBearing.value + 540, 360) - 180;
+        if (motion == MOTION_LEFT) {
+          turned = -turned;
+        }
+        add_sample(&samples[motion], turned * M_PI / 180 / (time - lastBearing.time));
+      }
+      lastBearing = (struct reading) {time, bearing, bearing, run};
+    }
+    if (range != previousRange && previousRange >= 0) {
+      if (lastRange.run == run && range > 0 && lastRange.value > 0 &&
+          abs(bearing - lastRange.bearing) <= MAX_BEARING_CHANGE &&
+          (motion == MOTION_FORWARD || motion == MOTION_REVERSE)) {
+        double closed = (lastRange.value - range) / 100.0;
+        if (motion == MOTION_REVERSE) {
+          closed = -closed;
+        }
+        add_sample(&samples[motion], closed / (time - lastRange.time));
+      }
+      lastRange = (struct reading) {time, range, bearing, run};
+    }
+    previousBearing = bearing;
+    previousRange = range;
+  }
+  fclose(f);
+  return 1;
+}
+
+// Which comma separated column of a header has a name, or -1
+int column_index(char* header, const char* name) {
+  char copy[MAX_LINE];
+  char* field;
+  int i = 0;
+
+  strncpy(copy, header, sizeof(copy) - 1);
+  copy[sizeof(copy) - 1] = 0;
+  for (field = strtok(copy, ",\r\n"); field != NULL; field = strtok(NULL, ",\r\n"), i++) {
+    if (strcmp(field, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void add_sample(struct samples* samples, double value) {
+  if (samples->n < MAX_SAMPLES) {
+    samples->values[samples->n++] = value;
+  }
+}
+
+double percentile(struct samples* samples, double p) {
+  qsort(samples->values, samples->n, sizeof(double), compare_doubles);
+  return samples->values[(int) (p * (samples->n - 1))];
+}
+
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a, y = *(const double*) b;
+  return x < y ? -1 : x > y;
+}
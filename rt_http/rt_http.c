@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <linux/i2c-dev.h>
@@ -29,7 +30,24 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
+#include <math.h>
 #include "mongoose.h"
+#include "assets.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+#include "exec.h"
+#include "checkpoint.h"
+#include "opcodes.h"
+#include "autonomy.h"
+#include "map.h"
+#include "costmap.h"
+#include "odometry.h"
+#include "planner.h"
+#include "localize.h"
+#include "telemetry.h"
+#include "history.h"
 
 // I/O access
 int  mem_fd;
@@ -48,77 +66,248 @@ volatile unsigned *gpio;
 #define GPIO_SET *(gpio+7)  // sets   bits which are 1, ignores bits which are 0
 #define GPIO_CLR *(gpio+10) // clears bits which are 1, ignores bits which are 0
 
+// Directory the web UI is served from. Assets compiled into the binary are
+// served from memory, anything else (e.g. sensordata.txt) from disk here.
+#define WEB_ROOT "/var/www"
+
+// Everything but the transmitter runs on a slower reactor, which ticks every
+// 5 frames. Its tasks' periods are in reactor ticks. The sensors take it in
+// turns on the I2C bus: the SRF02 needs at least 66ms between being told to
+// range and being read, so it alternates between the two.
+#define REACTOR_USEC (5 * FRAME_USEC)
+#define AUTONOMY_PERIOD 1
+#define RANGEFINDER_PERIOD 4
+#define COMPASS_PERIOD 8
+#define TELEMETRY_PERIOD 8
+#define COSTMAP_PERIOD 8
+
+// Each costmap run, everything in the map gets this much less certain, so
+// something that hasn't been seen for a couple of minutes is forgotten
+#define MAP_DECAY_STEP 1
+
+// Real-time priority of the transmitter thread, when it can be had
+#define TRANSMITTER_PRIORITY 50
+
+// Where state is checkpointed for warm restarts ("rt_http -w"). A warm
+// restart skips ignition if the last frame was sent recently enough for the
+// tank to still be running, and carries on with the last command if it was
+// very recent, minus anything one-shot like firing. Otherwise it idles.
+#define CHECKPOINT_FILE "/var/run/rt_http.state"
+#define WARM_RESTART_MSEC 30000
+#define RESUME_COMMAND_MSEC 2000
+
+// Odometry calibration, as written by rt_calibrate, if there is one
+#define ODOMETRY_FILE "/etc/rt_http.odometry"
+
+// How far in front of the middle of the tank the SRF02 is, in m
+#define RANGEFINDER_OFFSET 0.25
+
+// Where the telemetry log's segments go (see telemetry.h)
+#define TELEMETRY_DIR "/var/log/rt_http"
+
+// A /metrics response starts with room for this much and grows to fit, up to
+// the limit, past which it's cut at the last whole line
+#define METRICS_INITIAL_BYTES 16384
+#define METRICS_MAX_BYTES (1 << 20)
+
+// Map to localize against, if there is one (see localize.h), and with how
+// many particles and threads; the transmitter has a core to itself
+#define LOCALIZE_MAP_FILE "/etc/rt_http.map"
+#define LOCALIZE_PARTICLES 2000
+#define LOCALIZE_THREADS 3
+
+// Limits on long-polled sensor data requests. Each one parked holds one of
+// mongoose's 20 worker threads, so leave plenty free for commands.
+#define MAX_LONG_POLLS 10
+#define DEFAULT_LONG_POLL_MSEC 10000
+#define MAX_LONG_POLL_MSEC 25000
+
+// Limits on timed command batches
+#define MAX_BATCH_STEPS 32
+#define MAX_STEP_MSEC 60000
+
 // GPIO pin that connects to the Heng Long main board
 // (Pin 7 is the top right pin on the Pi's GPIO, next to the yellow video-out)
 #define PIN 7
 
-// HENG LONG TANK OPCODES:
-// We don't yet fully understand how the opcodes we send to the tank work. Specifically,
-// we don't understand how to control the speed and direction of the main motors
-// properly, but we do understand how to control just about everything else. Therefore
-// we have ended up with a system of "base opcodes" - premade codes for the stuff we
-// don't understand, but we know works - and "delta opcodes" - the bits we can "and" on
-// top of the base opcodes to trigger the extra functions that we do understand.
-// More info: raspberrytank.ianrenton.com/day-30-cracking-the-code-third-time-luckier/
-
-// BASE OPCODES
-const int IDLE =         0x1003c;
-const int FORWARD =      0x0803c;
-const int REVERSE =      0x1803c; // Must be cancelled by a "forward", idle is not enough
-const int LEFT =         0x10010; // Slower than I would like
-const int RIGHT =        0x10064;
-
-// DELTA OPCODES
-const int MG_LED =       0x0001;
-const int IGNITION =     0x0002;
-const int FIRE =         0x0080;
-const int TURRET_ELEV =  0x0100;
-const int TURRET_LEFT =  0x0200;
-const int TURRET_RIGHT = 0x0400;
-const int RECOIL =       0x0800;
-const int MG_SOUND =     0x1000;
-
 ///////////////////////////////////
 
 // Mutexes
 pthread_mutex_t userCommandMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t autonomyCommandMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t sensorDataMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sensorDataCond = PTHREAD_COND_INITIALIZER; // Signalled on each new sample
+
+// A timed sequence of commands, executed by the transmitter a frame at a time
+struct batch {
+  char commands[MAX_BATCH_STEPS][11];
+  int frames[MAX_BATCH_STEPS];      // How many frames to send each command for
+  int numSteps;
+  int currentStep;
+  int framesSent;                   // Frames sent so far of the current step
+};
 
 // Mutex-controlled variables
 char* userCommand;
+struct batch userBatch;           // Overrides userCommand while it has steps left
+unsigned long userCommandSession; // Client session that sent userCommand
+unsigned long userCommandSeq;     // Its sequence number within that session
 char* autonomyCommand;
+int goalSet;                      // Where autonomy is to drive to ("?goal=x,y"),
+double goalX, goalY;              // in m, like the pose. Under autonomyCommandMutex.
+unsigned long goalSeq;            // Incremented every time it's set
 int range;
 int bearing;
 int pitch;
 int roll;
+unsigned long sensorSeq;   // Incremented every time a new sample is published
+int numLongPolls;          // Requests currently waiting for a new sample
+
+// Copy of the state above that survives a crash, updated whenever it changes
+struct checkpoint* state;
+
+// What the rangefinder has seen, and what that costs to drive through
+// around the tank, only used on the reactor thread
+struct map* map;
+struct costmap costmap;
+struct planner planner;
+
+// Where the tank is, updated by the transmitter and read by anything
+struct odometry odometry;
+
+// Where it is on the stored map, if there is one, updated by its own thread
+// and read by anything
+struct localize_map localizeMap;
+struct localizer* localizer;
+
+// Summaries of the sensor samples in the telemetry log, for graphing (see
+// history.h)
+struct history history;
+
+// Run log for rt_calibrate ("rt_http -l file"), only used on the reactor thread
+FILE* runLog;
+
+// Telemetry log being played back instead of reading the sensors
+// ("rt_http -r path"), and how fast: 1 as recorded, 0 as fast as it'll go
+const char* replayPath;
+double replaySpeed = 1;
 
 // Function declarations
 void setup_io();
-int buildOpCode(char* cmd);
+int warmRestart(uint64_t now);
+void makeSafe(char* cmd);
+uint64_t monotonicUsec();
 void sendOpCode(int code);
-void sendBit(int bit);
-int CRC(int data);
+void sendFrame(int code);
+void sleepUntil(struct timespec* edge, long usec);
+void count_frame();
 void* launch_server();
 static int http_callback(struct mg_connection *conn);
-void* launch_sensors();
-void* launch_autonomy();
+static int handle_request(struct mg_connection *conn);
+int setUserCommand(const char* cmd, const char* query);
+int setUserBatch(const char* query, int* totalFrames);
+int isNewerCommand(const char* query);
+int nextBatchCommand(char* cmd);
+int setGoal(const char* query, double* x, double* y);
+void sendMetrics(struct mg_connection *conn);
+void sendHistory(struct mg_connection *conn, const char* query);
+static const struct asset* find_asset(const char *uri);
+static const char* asset_callback(const struct mg_connection *conn, const char *path, size_t *data_len);
+static void asset_headers_callback(const struct mg_connection *conn, const char *path,
+                                   const char **etag, const char **content_type,
+                                   const char **content_encoding);
+void transmit_task();
+int i2cBus();
+void logSensorError(char* message, char** lastMessage);
+void rangefinder_task();
+void publishRange(int tmpRange, int failed);
+void compass_task();
+void publishCompass(int bearingTenths, int tmpPitch, int tmpRoll, int failed);
+void autonomy_task();
+void telemetry_task();
+void costmap_task();
+void run_log_task();
+void* localize_thread();
+void* replay_thread();
+int replayRecord(const struct telemetry_record* record, void* arg);
 void* autonomySendCommand(char* cmd);
 
+// Executive task tables, highest priority first. The transmitter has a thread
+// to itself; its budget is the frame plus a little for waking up late.
+struct task transmitterTasks[] = {
+  {.name = "transmitter", .run = transmit_task, .periodTicks = 1, .deadlineTicks = 1,
+   .budgetUsec = FRAME_USEC - 2833},
+};
+
+// The sensors and autonomy share the reactor thread, as state machines that
+// each do a step of their work per run and never block.
+struct task reactorTasks[] = {
+  {.name = "autonomy", .run = autonomy_task, .periodTicks = AUTONOMY_PERIOD,
+   .deadlineTicks = AUTONOMY_PERIOD, .budgetUsec = 4000},
+  {.name = "rangefinder", .run = rangefinder_task, .periodTicks = RANGEFINDER_PERIOD,
+   .deadlineTicks = RANGEFINDER_PERIOD, .budgetUsec = 1500},
+  {.name = "compass", .run = compass_task, .periodTicks = COMPASS_PERIOD,
+   .deadlineTicks = COMPASS_PERIOD, .budgetUsec = 1500},
+  {.name = "telemetry", .run = telemetry_task, .periodTicks = TELEMETRY_PERIOD,
+   .deadlineTicks = TELEMETRY_PERIOD, .budgetUsec = 2000},
+  {.name = "costmap", .run = costmap_task, .periodTicks = COSTMAP_PERIOD,
+   .deadlineTicks = COSTMAP_PERIOD, .budgetUsec = 5000},
+  {.name = "runlog", .run = run_log_task, .periodTicks = 1, .deadlineTicks = 1,
+   .budgetUsec = 500},
+};
+#define NUM_TASKS(t) (sizeof(t) / sizeof(t[0]))
+
 // Main
 int main(int argc, char **argv) { 
 
   printf("\nRaspberry Tank HTTP Remote Control script\nIan Renton, April 2014\nhttp://raspberrytank.ianrenton.com\n\n");
 
-  int g,rep,i;
+  int g,rep,i,opt;
   char inchar;
+  uint64_t startUsec = monotonicUsec();
+  int warm = 0;
+  const char* runLogFile = NULL;
+  while ((opt = getopt(argc, argv, "wl:r:x")) != -1) {
+    switch (opt) {
+      case 'w': warm = 1; break;
+      case 'l': runLogFile = optarg; break;
+      case 'r': replayPath = optarg; break;
+      case 'x': replaySpeed = 0; break;
+      default:
+        fprintf(stderr, "Usage: %s [-w] [-l run log file] [-r telemetry to replay [-x]]\n", argv[0]);
+        return 1;
+    }
+  }
   userCommand = malloc(sizeof(char)*11);
   autonomyCommand = malloc(sizeof(char)*11);
-  char* copiedCommand = malloc(sizeof(char)*11);
+  strcpy(userCommand, "0000000000");
+  strcpy(autonomyCommand, "0000000000");
+  history_init(&history, replayPath != NULL ? replayPath : TELEMETRY_DIR);
+
+  metrics_thread_init("transmitter");
+  log_thread_init("transmitter");
+  trace_thread_init("transmitter");
+  log_start(LOG_INFO);
 
   // Set up gpio pointer for direct register access
   setup_io();
 
+  // Pick up where the last run left off if asked to and we can, otherwise
+  // start the tank from scratch
+  int validCheckpoint;
+  state = checkpoint_open(CHECKPOINT_FILE, &validCheckpoint);
+  if (!warm || !validCheckpoint || !warmRestart(startUsec)) {
+    if (warm) {
+      log_msg(LOG_WARN, "Can't warm restart, starting from scratch");
+    }
+    uint64_t lastFrameUsec = state->lastFrameUsec;
+    memset(&state->ignited, 0, sizeof(*state) - offsetof(struct checkpoint, ignited));
+    state->lastFrameUsec = lastFrameUsec;   // Kept to measure the recovery gap
+    strcpy(state->userCommand, userCommand);
+    strcpy(state->autonomyCommand, autonomyCommand);
+    warm = 0;
+  }
+
   // Switch the relevant GPIO pin to output mode
   INP_GPIO(PIN); // must use INP_GPIO before we can use OUT_GPIO
   OUT_GPIO(PIN);
@@ -128,104 +317,207 @@ int main(int argc, char **argv) {
   GPIO_SET = 1<<PIN;
   
   // Send the idle and ignition codes
-  printf("Waiting for ignition...\n");
-  for (i=0; i<40; i++) 
-  {
-    sendOpCode(buildOpCode("0000000000")); // idle
-  }
-  for (i=0; i<10; i++) 
-  {
-    sendOpCode(buildOpCode("0000000010")); // ignition
-  }
-  for (i=0; i<300; i++) 
-  {
-    sendOpCode(buildOpCode("0000000000")); // idle
+  if (!warm) {
+    log_msg(LOG_INFO, "Waiting for ignition...");
+    for (i=0; i<40; i++) 
+    {
+      sendOpCode(buildOpCode("0000000000")); // idle
+    }
+    for (i=0; i<10; i++) 
+    {
+      sendOpCode(buildOpCode("0000000010")); // ignition
+    }
+    for (i=0; i<300; i++) 
+    {
+      sendOpCode(buildOpCode("0000000000")); // idle
+    }
+    log_msg(LOG_INFO, "Ignition sequence finished.");
+    state->ignited = 1;
   }
-  printf("Ignition sequence finished.\n");
   
   // Launch HTTP server
   pthread_t httpThread; 
   int httpThreadExitCode = pthread_create( &httpThread, NULL, &launch_server, (void*) NULL);
   
-  // Launch sensor polling thread
-  pthread_t sensorThread; 
-  int sensorThreadExitCode = pthread_create( &sensorThread, NULL, &launch_sensors, (void*) NULL);
-  
-  // Launch autonomy thread
-  pthread_t autonomyThread; 
-  int autonomyThreadExitCode = pthread_create( &autonomyThread, NULL, &launch_autonomy, (void*) NULL);
-  
-  // Loop, sending movement commands indefinitely
-  while(1) {
-    pthread_mutex_lock( &userCommandMutex );
-    strcpy(&copiedCommand[0], &userCommand[0]);
-    pthread_mutex_unlock( &userCommandMutex );
-
-    if (copiedCommand[9] == '1') {
-      // Autonomy requested, so obey autonomy's commands not the user commands.
-      pthread_mutex_lock( &autonomyCommandMutex );
-      strcpy(&copiedCommand[0], &autonomyCommand[0]);
-      pthread_mutex_unlock( &autonomyCommandMutex );
+  // Launch sensor polling, mapping and autonomy
+  if ((map = map_create()) == NULL) {
+    log_msg(LOG_WARN, "Not enough memory for the map");
+  }
+  struct odometry_calibration calibration = ODOMETRY_CALIBRATION_INIT;
+  if (odometry_load_calibration(ODOMETRY_FILE, &calibration)) {
+    log_msg(LOG_INFO, "Odometry calibration read from " ODOMETRY_FILE);
+  }
+  odometry_init(&odometry, &calibration);
+  if (localize_map_load(&localizeMap, LOCALIZE_MAP_FILE)) {
+    pthread_t localizeThread;
+    localizer = localize_create(&localizeMap, LOCALIZE_PARTICLES, LOCALIZE_THREADS, startUsec);
+    if (localizer == NULL || pthread_create(&localizeThread, NULL, &localize_thread, NULL) != 0) {
+      log_msg(LOG_WARN, "Couldn't start localizing");
+      localize_destroy(localizer);
+      localizer = NULL;
+    } else {
+      log_msg(LOG_INFO, "Localizing against " LOCALIZE_MAP_FILE ", %ld by %ld cells",
+              localizeMap.width, localizeMap.height);
     }
-    
-    sendOpCode(buildOpCode(copiedCommand));
+  }
+  if (runLogFile != NULL) {
+    if ((runLog = fopen(runLogFile, "w")) == NULL) {
+      log_msg(LOG_WARN, "Can't write run log %s", runLogFile);
+    } else {
+      fprintf(runLog, "time,x,y,heading,bearing,range,command\n");
+    }
+  }
+  // Log telemetry, or play an old log back in place of the sensors
+  if (replayPath != NULL) {
+    pthread_t replayThread;
+    if (pthread_create(&replayThread, NULL, &replay_thread, NULL) != 0) {
+      log_msg(LOG_ERROR, "Couldn't start replaying %s", replayPath);
+      replayPath = NULL;
+    }
+  } else {
+    telemetry_set_block_hook(history_add_block, &history);
+    if (!telemetry_start(TELEMETRY_DIR)) {
+      log_msg(LOG_WARN, "Can't write telemetry to " TELEMETRY_DIR);
+    }
+  }
+  if (exec_start("reactor", reactorTasks, NUM_TASKS(reactorTasks), REACTOR_USEC) != 0) {
+    log_msg(LOG_ERROR, "Couldn't start sensor polling and autonomy");
   }
   
+  // Frames must go out on time whatever else the Pi is doing. This comes last
+  // because new threads inherit it, and only the transmitter should have it.
+  struct sched_param param = { .sched_priority = TRANSMITTER_PRIORITY };
+  if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+    log_msg(LOG_WARN, "Couldn't get real-time priority for the transmitter");
+  }
+
+  // Send movement commands indefinitely
+  log_msg(LOG_INFO, "Starting transmitter");
+  exec_run(transmitterTasks, NUM_TASKS(transmitterTasks), FRAME_USEC);
+  
   return 0;
 } // main
 
 
-// Takes a command from the web UI or autonomy (like "001000010" for "turn left and 
-// fire") and builds a Heng Long format binary opcode to send to the tank.
-int buildOpCode(char* cmd) {
+// Send the current command, from the web UI or autonomy, for one frame
+void transmit_task() {
+  static char copiedCommand[11];
+  static int lastOpCode = -1;
 
-  int opCode = 0;
-  
-  // The first four characters represent the motion of the tank. These are used to
-  // select the "base opcode" (the bit we use without properly understanding it).
-  // Because we use this "base opcode" fudge we can only select at most one of these
-  // directions.
-  // 0000 = idle  1000 = forwards   0100 = reverse   0010 = left    0001 = right
-  if (cmd[0] == '1') {
-    opCode = FORWARD;
-  } else if (cmd[1] == '1') {
-    opCode = REVERSE;
-  } else if (cmd[2] == '1') {
-    opCode = LEFT;
-  } else if (cmd[3] == '1') {
-    opCode = RIGHT;
-  } else {
-    opCode = IDLE;
+  metrics_mutex_lock( &userCommandMutex, C_MUTEX_WAIT_NS_USER_COMMAND );
+  if (!nextBatchCommand(copiedCommand)) {
+    strcpy(&copiedCommand[0], &userCommand[0]);
+  }
+  metrics_mutex_unlock( &userCommandMutex );
+
+  metrics_set(G_AUTONOMY_ENABLED, copiedCommand[9] == '1');
+  if (copiedCommand[9] == '1') {
+    // Autonomy requested, so obey autonomy's commands not the user commands.
+    metrics_mutex_lock( &autonomyCommandMutex, C_MUTEX_WAIT_NS_AUTONOMY_COMMAND );
+    strcpy(&copiedCommand[0], &autonomyCommand[0]);
+    metrics_mutex_unlock( &autonomyCommandMutex );
   }
   
-  // Now we check the other characters in the string to see what they're demanding
-  // anything. These are the features in the opcode that we do understand - we can
-  // just set certain bits high to achieve what we want (the "delta opcode"s). This
-  // means we can have several of these active at once if we want.
-  // char 4 = turret left   char 5 = turret right   char 6 = turret elevate
-  // char 7 = fire          char 8 = ignition
-  if (cmd[4] == '1') {
-    opCode = opCode | TURRET_LEFT;
+  int opCode = buildOpCode(copiedCommand);
+  if (opCode != lastOpCode) {
+    metrics_inc(C_COMMAND_CHANGES);
+    lastOpCode = opCode;
   }
-  if (cmd[5] == '1') {
-    opCode = opCode | TURRET_RIGHT;
+  sendFrame(opCode);
+  count_frame();
+  telemetry_record(TELEMETRY_FRAME, 0, 0, opCode, 0, 0);
+
+  // The first frame of this run measures how long the tank went without one
+  uint64_t now = monotonicUsec();
+  static int firstFrame = 1;
+  odometry_frame(&odometry, opCode, firstFrame ? FRAME_USEC / 1e6 : (now - state->lastFrameUsec) / 1e6, now);
+  if (firstFrame && state->lastFrameUsec != 0) {
+    metrics_set(G_RECOVERY_GAP_US, now - state->lastFrameUsec);
+    log_msg(LOG_INFO, "First command frame %ldms after the last run's last frame",
+            (long) ((now - state->lastFrameUsec) / 1000));
   }
-  if (cmd[6] == '1') {
-    opCode = opCode | TURRET_ELEV;
+  firstFrame = 0;
+  state->lastFrameUsec = now;
+}
+
+
+// Restore the state saved by the last run, if it's recent enough that the
+// tank will still be running. Returns 1 if it was, 0 if we need to start
+// from scratch.
+int warmRestart(uint64_t now) {
+  uint64_t gapMsec = (now - state->lastFrameUsec) / 1000;
+
+  if (!state->ignited || state->lastFrameUsec == 0 || now < state->lastFrameUsec ||
+      gapMsec > WARM_RESTART_MSEC) {
+    return 0;
   }
-  if (cmd[7] == '1') {
-    opCode = opCode | FIRE;
+
+  // Commands are validated separately, as a crash could have interrupted
+  // writing one
+  if (gapMsec <= RESUME_COMMAND_MSEC && strspn(state->userCommand, "01") == 10) {
+    strcpy(userCommand, state->userCommand);
+    makeSafe(userCommand);
   }
-  if (cmd[8] == '1') {
-    opCode = opCode | IGNITION;
+  if (gapMsec <= RESUME_COMMAND_MSEC && strspn(state->autonomyCommand, "01") >= 9) {
+    strncpy(autonomyCommand, state->autonomyCommand, 9);
+    makeSafe(autonomyCommand);
   }
-  
-  return opCode;
-} // buildOpCode
+  strcpy(state->userCommand, userCommand);
+  strcpy(state->autonomyCommand, autonomyCommand);
+  userCommandSession = state->userCommandSession;
+  userCommandSeq = state->userCommandSeq;
+  range = state->range;
+  bearing = state->bearing;
+  pitch = state->pitch;
+  roll = state->roll;
+  sensorSeq = state->sensorSeq;
+
+  // The log is formatted later, by when userCommand may have changed, so it
+  // gets the command's bits as telemetry records them, not the string
+  log_msg(LOG_INFO, "Warm restart %ldms after the last frame, resuming command %03lx",
+          (long) gapMsec, (long) telemetry_command_bits(userCommand));
+  return 1;
+}
+
+// Clear the parts of a command that shouldn't be repeated after a restart
+void makeSafe(char* cmd) {
+  cmd[7] = '0';     // fire
+  cmd[8] = '0';     // ignition
+}
+
+// Current CLOCK_MONOTONIC time, which carries on across restarts
+uint64_t monotonicUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 
-// Sends one individual opcode to the main tank controller
+
+
+// Sends one individual opcode to the main tank controller, followed by the
+// gap before the next one
 void sendOpCode(int code) {
+  uint64_t frameStart = trace_begin();
+
+  sendFrame(code);
+  
+  // Force a 4ms gap between messages
+  usleep(3333);
+
+  count_frame();
+  trace_end("frame", frameStart, code);
+} // sendCode
+
+// Sends the start pulse and bits of an opcode, leaving the line idle
+// afterwards. Each edge is timed from the start of the frame, not the
+// previous edge, so that sleep overshoot doesn't add up over the frame.
+// Half-bits at the same level as the one before don't need an edge of their
+// own, so the line is only touched, and the thread only sleeps, where the
+// level changes: 51 to 63 wakeups a frame, 56 on average, rather than 65.
+void sendFrame(int code) {
+  struct timespec edge;
+
   // Build up the header bytes and CRC
   int fullCode = 0;
   fullCode |= CRC(code) << 2;
@@ -233,56 +525,98 @@ void sendOpCode(int code) {
   fullCode |= 0xFE000000;
   
   // Send the initial high pulse
+  clock_gettime(CLOCK_MONOTONIC, &edge);
   GPIO_CLR = 1<<PIN;
-  usleep(500);
+  int high = 1;
+  long heldUsec = 500;
   
-  // Send the code itself, bit by bit using Manchester coding
-  int i;
+  // Send the code itself, bit by bit using Manchester coding: a 1 is high
+  // then low, a 0 low then high, 250us each
+  int i, half;
   for (i=0; i<32; i++) {
     int bit = (fullCode>>(31-i)) & 0x1;
-    sendBit(bit);
+    for (half=0; half<2; half++) {
+      int wantHigh = (bit == 1) == (half == 0);
+      if (wantHigh != high) {
+        sleepUntil(&edge, heldUsec);
+        if (wantHigh) {
+          GPIO_CLR = 1<<PIN;
+        } else {
+          GPIO_SET = 1<<PIN;
+        }
+        high = wantHigh;
+        heldUsec = 0;
+      }
+      heldUsec += 250;
+    }
   }
   
-  // Force a 4ms gap between messages
+  sleepUntil(&edge, heldUsec);
   GPIO_SET = 1<<PIN;
-  usleep(3333);
-} // sendCode
+} // sendFrame
+
+// Advances edge by usec and sleeps until then
+void sleepUntil(struct timespec* edge, long usec) {
+  edge->tv_nsec += usec * 1000;
+  if (edge->tv_nsec >= 1000000000L) {
+    edge->tv_sec++;
+    edge->tv_nsec -= 1000000000L;
+  }
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, edge, NULL);
+}
+
+// Count a sent frame, and once a second update the frame rate gauge.
+// Only ever called from the transmitter thread.
+// The time between frames is recorded too, so that jitter can be worked out
+// from the sum and sum of squares of the intervals.
+void count_frame() {
+  static time_t currentSecond;
+  static int framesThisSecond;
+  static struct timespec lastFrame;
+  static long maxIntervalThisSecond;
+  struct timespec nowSpec;
+  time_t now = time(NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &nowSpec);
+  if (lastFrame.tv_sec != 0) {
+    long interval = (nowSpec.tv_sec - lastFrame.tv_sec) * 1000000L +
+                    (nowSpec.tv_nsec - lastFrame.tv_nsec) / 1000;
+    metrics_inc(C_FRAME_INTERVALS);
+    metrics_add(C_FRAME_INTERVAL_US, interval);
+    metrics_add(C_FRAME_INTERVAL_US_SQUARED, (uint64_t) interval * interval);
+    if (interval > maxIntervalThisSecond) {
+      maxIntervalThisSecond = interval;
+    }
+  }
+  lastFrame = nowSpec;
+
+  metrics_inc(C_FRAMES_SENT);
+  if (now != currentSecond) {
+    metrics_set(G_FRAMES_PER_SECOND, framesThisSecond);
+    metrics_set(G_MAX_FRAME_INTERVAL_US, maxIntervalThisSecond);
+    currentSecond = now;
+    framesThisSecond = 0;
+    maxIntervalThisSecond = 0;
+  }
+  framesThisSecond++;
+}
 
-// Calculates the CRC of a Heng Long opcode
-int CRC(int data)
-{
-  int c;
-  c = 0;
-  c ^= data & 0x03;
-  c ^= (data >> 2) & 0x0F;
-  c ^= (data >> 6) & 0x0F;
-  c ^= (data >> 10) & 0x0F;
-  c ^= (data >> 14) & 0x0F;
-  c ^= (data >> 18) & 0x0F;
-  return c;
-} // CRC
 
 // Sends one individual bit using Manchester coding
 // 1 = high-low, 0 = low-high. CLR and SET do the opposite of what you think
 // due to the transistor circuit
-void sendBit(int bit) {
-  if (bit == 1) {
-    GPIO_CLR = 1<<PIN;
-    usleep(250);
-    GPIO_SET = 1<<PIN;
-    usleep(250);
-  } else {
-    GPIO_SET = 1<<PIN;
-    usleep(250);
-    GPIO_CLR = 1<<PIN;
-    usleep(250);
-  }
-} // sendBit
 
 
 // Set up a memory region to access GPIO
 void setup_io() {
 
+#ifdef SIMULATE_GPIO
+   // Built with "make sim": no tank attached, so the GPIO registers are just
+   // some memory. Timing is unaffected, so the whole program can be exercised
+   // and load tested on any Linux machine.
+   gpio = (volatile unsigned *)calloc(BLOCK_SIZE, 1);
+#else
+
    /* open /dev/mem */
    if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
       printf("can't open /dev/mem \n");
@@ -318,6 +652,7 @@ void setup_io() {
 
    // Always use volatile pointer!
    gpio = (volatile unsigned *)gpio_map;
+#endif
    
 } // setup_io
 
@@ -327,220 +662,993 @@ void* launch_server() {
   struct mg_context *ctx;
   struct mg_callbacks callbacks;
 
-  const char *options[] = {"listening_ports", "3000", NULL};
+  // Control requests are tiny ("GET /?set0000000000" plus browser headers),
+  // so 2KB per connection is plenty. Mongoose preallocates one connection per
+  // worker thread, so this caps the server's buffer memory at 20 x 2KB.
+  const char *options[] = {"listening_ports", "3000",
+                           "num_threads", "20",
+                           "max_request_size", "2048",
+                           "document_root", WEB_ROOT,
+                           "enable_directory_listing", "no",
+                           NULL};
   memset(&callbacks, 0, sizeof(callbacks));
   callbacks.begin_request = http_callback;
+  callbacks.open_file = asset_callback;
+  callbacks.open_file_headers = asset_headers_callback;
   
-  printf("Starting HTTP Server on port 3000\n");
+  log_msg(LOG_INFO, "Starting HTTP Server on port 3000");
 
   ctx = mg_start(&callbacks, NULL, options);
-  getchar();  // Wait until user hits "enter".  This will never happen when this
-              // code runs on the tank at startup
+  // Wait until user hits "enter".  This will never happen when this code runs
+  // on the tank at startup, where there may be no stdin at all, so in that
+  // case just keep serving.
+  int c;
+  while ((c = getchar()) != '\n') {
+    if (c == EOF) {
+      pause();
+    }
+  }
   mg_stop(ctx);
 }
 
-// HTTP server callback
+// HTTP server callback. Traces the whole of handling each request, which
+// includes waiting for any mutexes and long-polling.
 static int http_callback(struct mg_connection *conn) {
+  uint64_t start = trace_begin();
+  int handled = handle_request(conn);
+  trace_end("http_callback", start, handled);
+  return handled;
+}
+
+static int handle_request(struct mg_connection *conn) {
 
   const struct mg_request_info *request_info = mg_get_request_info(conn);
 
-  char* tempCommand = malloc(sizeof(char)*14);
+  // Metrics requested, so return them all in Prometheus text format
+  if (strcmp(request_info->uri, "/metrics") == 0) {
+    metrics_inc(C_HTTP_METRICS);
+    sendMetrics(conn);
+    return 1;
+  }
+
+  // Trace requested, so return recent spans from every thread in Chrome's
+  // trace event format. The length isn't known up front, so close afterwards.
+  if (strcmp(request_info->uri, "/trace") == 0) {
+    metrics_inc(C_HTTP_TRACE);
+    mg_printf(conn, "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Connection: close\r\n"
+            "\r\n");
+    trace_write_json(conn);
+    return 1;
+  }
+
+  // No query, so this is a request for part of the web UI. Mongoose serves
+  // that itself, from memory via asset_callback() where possible.
+  if (request_info->query_string == NULL) {
+    metrics_inc(C_HTTP_FILE);
+    char indexUri[64];
+    snprintf(indexUri, sizeof(indexUri), "%s/index.html", request_info->uri);
+    if (find_asset(indexUri) != NULL) {
+      // Directory without the trailing slash, so relative links would break
+      mg_printf(conn, "HTTP/1.1 301 Moved Permanently\r\n"
+              "Location: %s/\r\n\r\n", request_info->uri);
+      return 1;
+    }
+    return 0;
+  }
+
+  char tempCommand[14];
   strncpy(&tempCommand[0], &request_info->query_string[0], 13);
   tempCommand[13] = 0;
   //printf("Received command from HTTP: %.*s\n", 13, tempCommand);
 
   // Set received, so send it over to the control thread
   if ((tempCommand[0] == 's') && (tempCommand[1] == 'e') && (tempCommand[2] == 't')) {
-    pthread_mutex_lock( &userCommandMutex );
-    strncpy(&userCommand[0], &tempCommand[3], 10);
-    pthread_mutex_unlock( &userCommandMutex );
+    metrics_inc(C_HTTP_SET);
+    const char* result = setUserCommand(&tempCommand[3], request_info->query_string) ? "applied" : "stale";
     //printf("Set motion command: %.*s\n", 10, userCommand);
 
-    // Send an HTTP header back to the client
+    // Tell the client whether its command was used
     mg_printf(conn, "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/plain\r\n\r\n");
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %d\r\n"
+            "\r\n"
+            "%s",
+            (int) strlen(result), result);
+  }
+
+  // Batch received, so hand the whole sequence to the control thread
+  else if (strncmp(tempCommand, "batch=", 6) == 0) {
+    metrics_inc(C_HTTP_BATCH);
+    char response[64];
+    int totalFrames = 0;
+    int result = setUserBatch(request_info->query_string, &totalFrames);
+    int contentLength = snprintf(response, sizeof(response), "%s %d",
+          result > 0 ? "applied" : (result == 0 ? "stale" : "invalid"), totalFrames);
+    mg_printf(conn, "HTTP/1.1 %s\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %d\r\n"
+            "\r\n"
+            "%s",
+            result < 0 ? "400 Bad Request" : "200 OK", contentLength, response);
+  }
+
+  // Goal received, so autonomy drives there: "goal=x,y" in m from where the
+  // tank started, +y north, or just "goal" to forget it
+  else if (strncmp(tempCommand, "goal", 4) == 0) {
+    metrics_inc(C_HTTP_GOAL);
+    char response[64];
+    double x, y;
+    int result = setGoal(request_info->query_string, &x, &y);
+    int contentLength = result > 0 ? snprintf(response, sizeof(response), "goal %.2f %.2f", x, y)
+                                   : snprintf(response, sizeof(response), "%s", result == 0 ? "cleared" : "invalid");
+    mg_printf(conn, "HTTP/1.1 %s\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %d\r\n"
+            "\r\n"
+            "%s",
+            result < 0 ? "400 Bad Request" : "200 OK", contentLength, response);
+  }
+
+  // History requested, so summarise a sensor's samples for a graph:
+  // "history=<channel>&width=<pixels>", optionally with "&from=<s>&to=<s>"
+  // (see history_query())
+  else if (strncmp(tempCommand, "history=", 8) == 0) {
+    metrics_inc(C_HTTP_HISTORY);
+    sendHistory(conn, request_info->query_string);
   }
 
   // Get received, so return sensor data
   else if ((tempCommand[0] == 'g') && (tempCommand[1] == 'e') && (tempCommand[2] == 't')) {
+    metrics_inc(C_HTTP_GET);
+    // With "&since=<seq>", wait until there is a sample newer than that one
+    char sinceString[16], timeoutString[16];
+    const char* query = request_info->query_string;
+    int longPoll = mg_get_var(query, strlen(query), "since", sinceString, sizeof(sinceString)) > 0;
+    unsigned long since = longPoll ? strtoul(sinceString, NULL, 10) : 0;
+    long timeoutMsec = DEFAULT_LONG_POLL_MSEC;
+    if (mg_get_var(query, strlen(query), "timeout", timeoutString, sizeof(timeoutString)) > 0) {
+      timeoutMsec = strtol(timeoutString, NULL, 10);
+    }
+    if (timeoutMsec < 0 || timeoutMsec > MAX_LONG_POLL_MSEC) {
+      timeoutMsec = MAX_LONG_POLL_MSEC;
+    }
+
     // Get data from the variables while the mutex is locked
-    pthread_mutex_lock( &sensorDataMutex );
+    metrics_mutex_lock( &sensorDataMutex, C_MUTEX_WAIT_NS_SENSOR_DATA );
+    if (longPoll && sensorSeq <= since && numLongPolls < MAX_LONG_POLLS) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += timeoutMsec / 1000;
+      deadline.tv_nsec += (timeoutMsec % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      numLongPolls++;
+      while (sensorSeq <= since &&
+             metrics_cond_timedwait(&sensorDataCond, &sensorDataMutex, &deadline) == 0);
+      numLongPolls--;
+    }
     int tmpRange = range;
     int tmpBearing = bearing;
     int tmpPitch = pitch;
     int tmpRoll = roll;
-    pthread_mutex_unlock( &sensorDataMutex );
-    printf("Sensor data acquired.\n");
-
-    // Prepare the response
-    char response[100];
+    unsigned long tmpSeq = sensorSeq;
+    metrics_mutex_unlock( &sensorDataMutex );
+    struct pose pose;
+    odometry_read(&odometry, &pose);
+
+    // Prepare the response, with where the tank is on the stored map if
+    // it's localizing
+    char response[224];
     int contentLength = snprintf(response, sizeof(response),
-          "Range: %d   Bearing: %d   Pitch: %d   Roll: %d",
-          tmpRange, tmpBearing, tmpPitch, tmpRoll);
+          "Range: %d   Bearing: %d   Pitch: %d   Roll: %d   X: %.2f   Y: %.2f   Heading: %d",
+          tmpRange, tmpBearing, tmpPitch, tmpRoll, pose.x, pose.y,
+          (int) (pose.heading * 180 / M_PI));
+    if (localizer != NULL) {
+      struct localize_estimate estimate;
+      localize_read(localizer, &estimate);
+      contentLength += snprintf(response + contentLength, sizeof(response) - contentLength,
+            "   MapX: %.2f   MapY: %.2f   MapHeading: %d   MapSpread: %.2f",
+            estimate.x, estimate.y, (int) (estimate.heading * 180 / M_PI), estimate.spread);
+    }
 
     //printf("Sending HTTP response: %s\n", response);
 
-    // Send an HTTP response back to the client
+    // Send an HTTP response back to the client. The sequence number is what to
+    // pass as "since" next time. If it's no higher than that, we timed out.
     mg_printf(conn, "HTTP/1.1 200 OK\r\n"
             "Content-Type: text/plain\r\n"
             "Content-Length: %d\r\n"
+            "X-Sample-Seq: %lu\r\n"
             "\r\n"
             "%s",
-            contentLength, response);
+            contentLength, tmpSeq, response);
     
   }
+  else {
+    metrics_inc(C_HTTP_OTHER);
+  }
   //printf("Finished responding to HTTP request.\n");
 
   return 1;  // Mark as processed
 }
 
 
-// Launch sensor polling thread
-void* launch_sensors() {
-  printf("Starting sensor polling\n");
-  while(1) {
-    int fd;                           // File description
-    char *fileName = "/dev/i2c-0";    // Name of the port we will be using
-    int addressSRF = 0x70;            // Address of the SRF02 shifted right one bit
-    int addressCMPS = 0x60;           // Address of CMPS10 shifted right one bit
-    unsigned char buf[10];            // Buffer for data being read/ written on the i2c bus
-    int tmpRange = 0;                 // Temp variable to store range
-    int tmpBearing = 0;               // Temp variable to store bearing
-    int tmpPitch = 0;                 // Temp variable to store pitch
-    int tmpRoll = 0;                  // Temp variable to store roll
-    char* message;                    // Char array to write an error message to
-  
-    if ((fd = open(fileName, O_RDWR)) < 0) {          // Open port for reading and writing
-      message = "Failed to open i2c port";
+// Respond with every metric and executive task statistic. There are more with
+// LOCK_PROFILE, and more as lock sites are first used, so the buffer grows
+// until they fit. A partial line would make a scraper reject the lot, so if
+// they still don't at METRICS_MAX_BYTES, they're cut at the last whole line.
+void sendMetrics(struct mg_connection *conn) {
+  int size = METRICS_INITIAL_BYTES, contentLength;
+  char* response = NULL;
+
+  while (1) {
+    char* grown = realloc(response, size);
+    if (grown == NULL) {
+      free(response);
+      mg_printf(conn, "HTTP/1.1 503 Service Unavailable\r\n"
+              "Content-Length: 0\r\n"
+              "\r\n");
+      return;
     }
-  
-    //
-    // RANGEFINDER
-    //
+    response = grown;
+    contentLength = metrics_format(response, size);
+    contentLength += exec_format(response + (contentLength < size ? contentLength : size),
+                                 contentLength < size ? size - contentLength : 0);
+    if (contentLength < size || size == METRICS_MAX_BYTES) {
+      break;
+    }
+    // Leave room for counters that get longer before the next try
+    size = contentLength + 1024 < METRICS_MAX_BYTES ? contentLength + 1024 : METRICS_MAX_BYTES;
+  }
+  if (contentLength >= size) {
+    metrics_inc(C_METRICS_TRUNCATED);
+    contentLength = size - 1;
+    while (contentLength > 0 && response[contentLength - 1] != '\n') {
+      contentLength--;
+    }
+  }
+
+  mg_printf(conn, "HTTP/1.1 200 OK\r\n"
+          "Content-Type: text/plain; version=0.0.4\r\n"
+          "Content-Length: %d\r\n"
+          "\r\n", contentLength);
+  mg_write(conn, response, contentLength);
+  free(response);
+}
+
 
-    // Initial pause for safety
-    usleep(50000);
+// Respond to a history query with JSON: the times used, the summary level the
+// points came from and a [t, min, max, mean] for each pixel with samples
+void sendHistory(struct mg_connection *conn, const char* query) {
+  char channelString[16], widthString[16], fromString[24], toString[24];
+  size_t queryLen = strlen(query);
+  int channel = 0, width, level, numPoints, i;
+  double from = 0, to = 0;
 
-    if (ioctl(fd, I2C_SLAVE, addressSRF) < 0) {         // Set the port options and set the address of the device we wish to speak to
-      message = "Unable to get bus access to talk to slave";
+  mg_get_var(query, queryLen, "history", channelString, sizeof(channelString));
+  while (channel < NUM_HISTORY_CHANNELS && strcmp(channelString, history_channel_names[channel]) != 0) {
+    channel++;
+  }
+  width = mg_get_var(query, queryLen, "width", widthString, sizeof(widthString)) > 0 ?
+          atoi(widthString) : 0;
+  if (channel == NUM_HISTORY_CHANNELS || width <= 0 || width > HISTORY_MAX_WIDTH) {
+    mg_printf(conn, "HTTP/1.1 400 Bad Request\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: 7\r\n"
+            "\r\n"
+            "invalid");
+    return;
+  }
+  if (mg_get_var(query, queryLen, "from", fromString, sizeof(fromString)) > 0) {
+    from = atof(fromString);
+  }
+  if (mg_get_var(query, queryLen, "to", toString, sizeof(toString)) > 0) {
+    to = atof(toString);
+  }
+
+  // About 50 characters a point at most
+  struct history_point* points = malloc(width * sizeof(struct history_point));
+  char* response = malloc(width * 56 + 128);
+  if (points == NULL || response == NULL) {
+    free(points);
+    free(response);
+    mg_printf(conn, "HTTP/1.1 503 Service Unavailable\r\n"
+            "Content-Length: 0\r\n"
+            "\r\n");
+    return;
+  }
+  uint64_t start = trace_begin();
+  numPoints = history_query(&history, channel, &from, &to, width, points, &level);
+  int contentLength = sprintf(response, "{\"channel\":\"%s\",\"from\":%.3f,\"to\":%.3f,"
+                              "\"level\":%d,\"points\":[", history_channel_names[channel], from, to, level);
+  for (i = 0; i < numPoints; i++) {
+    contentLength += sprintf(response + contentLength, "%s[%.3f,%d,%d,%.1f]", i == 0 ? "" : ",",
+                             points[i].t, points[i].min, points[i].max, points[i].mean);
+  }
+  contentLength += sprintf(response + contentLength, "]}\n");
+  trace_end("history query", start, numPoints);
+
+  mg_printf(conn, "HTTP/1.1 200 OK\r\n"
+          "Content-Type: application/json\r\n"
+          "Content-Length: %d\r\n"
+          "\r\n", contentLength);
+  mg_write(conn, response, contentLength);
+  free(points);
+  free(response);
+}
+
+
+// Set or clear autonomy's goal from a goal query. Returns 1 if it was set,
+// to x, y, 0 if it was cleared or -1 if it's invalid.
+int setGoal(const char* query, double* x, double* y) {
+  char goalString[32], *end;
+  int result = 0;
+
+  if (mg_get_var(query, strlen(query), "goal", goalString, sizeof(goalString)) > 0) {
+    *x = strtod(goalString, &end);
+    if (end == goalString || *end != ',') {
+      return -1;
     }
-  
+    *y = strtod(end + 1, &end);
+    if (*end != 0 || !isfinite(*x) || !isfinite(*y)) {
+      return -1;
+    }
+    result = 1;
+  }
+
+  metrics_mutex_lock( &autonomyCommandMutex, C_MUTEX_WAIT_NS_AUTONOMY_COMMAND );
+  goalSet = result;
+  if (result) {
+    goalX = *x;
+    goalY = *y;
+    goalSeq++;
+  }
+  metrics_mutex_unlock( &autonomyCommandMutex );
+  if (result) {
+    log_msg(LOG_INFO, "Goal set to %ldcm, %ldcm", lround(*x * 100), lround(*y * 100));
+  }
+  return result;
+}
+
+// Clients may add "&sid=<session>&seq=<n>" to set and batch queries, in which
+// case the command is only used if it is newer than the last one from that
+// session; requests can overtake each other on the way here, and an old
+// "forward" must never undo a newer "stop". A new session ID takes over from
+// the old one. Commands without a sequence number are always used.
+// Must be called with userCommandMutex locked. Returns 1 if the command should
+// be used, and records it as the latest; 0 if it is stale.
+int isNewerCommand(const char* query) {
+  char sidString[16], seqString[16];
+  size_t queryLen = strlen(query);
+  unsigned long sid, seq;
+
+  if (mg_get_var(query, queryLen, "sid", sidString, sizeof(sidString)) <= 0 ||
+      mg_get_var(query, queryLen, "seq", seqString, sizeof(seqString)) <= 0) {
+    return 1;
+  }
+  sid = strtoul(sidString, NULL, 10);
+  seq = strtoul(seqString, NULL, 10);
+  if (sid == userCommandSession && seq <= userCommandSeq) {
+    metrics_inc(C_STALE_COMMANDS);
+    return 0;
+  }
+  userCommandSession = sid;
+  userCommandSeq = seq;
+  state->userCommandSession = sid;
+  state->userCommandSeq = seq;
+  return 1;
+}
+
+// Set the user command from a "set" query. Any batch still running is
+// abandoned. Returns 1 if the command was used, 0 if it was stale and dropped.
+int setUserCommand(const char* cmd, const char* query) {
+  int applied;
+
+  metrics_mutex_lock( &userCommandMutex, C_MUTEX_WAIT_NS_USER_COMMAND );
+  if ((applied = isNewerCommand(query))) {
+    strncpy(&userCommand[0], &cmd[0], 10);
+    strcpy(state->userCommand, userCommand);
+    userBatch.numSteps = 0;
+    telemetry_record(TELEMETRY_COMMAND, TELEMETRY_USER, 0, telemetry_command_bits(userCommand),
+                     (int32_t) userCommandSession, (int32_t) userCommandSeq);
+  }
+  metrics_mutex_unlock( &userCommandMutex );
+
+  return applied;
+}
+
+// Set a timed batch of commands from a query like
+// "batch=1000000000:400,0000000000:100" (forward for 400ms, then idle for
+// 100ms). Each duration is turned into a whole number of frames, and the
+// transmitter sends each command for exactly that many frames, so network
+// jitter doesn't change the maneuver. Afterwards the tank idles. Any newer set
+// or batch command abandons it. Returns 1 if the batch was used, 0 if it was
+// stale, -1 if it couldn't be parsed. totalFrames is set to its length.
+int setUserBatch(const char* query, int* totalFrames) {
+  struct batch batch;
+  char spec[MAX_BATCH_STEPS * 18];
+  char* step;
+  char* saveptr;
+  int applied;
+
+  memset(&batch, 0, sizeof(batch));
+  *totalFrames = 0;
+  if (mg_get_var(query, strlen(query), "batch", spec, sizeof(spec)) <= 0) {
+    return -1;
+  }
+  for (step = strtok_r(spec, ",", &saveptr); step != NULL; step = strtok_r(NULL, ",", &saveptr)) {
+    char* colon = strchr(step, ':');
+    long msec = colon != NULL ? strtol(colon + 1, NULL, 10) : -1;
+    if (batch.numSteps == MAX_BATCH_STEPS || colon == NULL || colon - step != 10 ||
+        strspn(step, "01") != 10 || msec < 0 || msec > MAX_STEP_MSEC) {
+      return -1;
+    }
+    strncpy(batch.commands[batch.numSteps], step, 10);
+    batch.frames[batch.numSteps] = (int) ((msec * 1000 + FRAME_USEC / 2) / FRAME_USEC);
+    *totalFrames += batch.frames[batch.numSteps];
+    batch.numSteps++;
+  }
+  if (batch.numSteps == 0) {
+    return -1;
+  }
+
+  metrics_mutex_lock( &userCommandMutex, C_MUTEX_WAIT_NS_USER_COMMAND );
+  if ((applied = isNewerCommand(query))) {
+    userBatch = batch;
+    strcpy(&userCommand[0], "0000000000");
+    strcpy(state->userCommand, userCommand);
+  }
+  metrics_mutex_unlock( &userCommandMutex );
+
+  return applied;
+}
+
+// Called by the transmitter once per frame, with userCommandMutex locked. If a
+// batch is running, copies the command for this frame into cmd and returns 1.
+int nextBatchCommand(char* cmd) {
+  while (userBatch.currentStep < userBatch.numSteps &&
+         userBatch.framesSent == userBatch.frames[userBatch.currentStep]) {
+    userBatch.currentStep++;
+    userBatch.framesSent = 0;
+  }
+  if (userBatch.currentStep >= userBatch.numSteps) {
+    // Back to the user command, which is logged as the step after the last
+    if (userBatch.numSteps > 0) {
+      telemetry_record(TELEMETRY_COMMAND, TELEMETRY_BATCH, 0, telemetry_command_bits(userCommand),
+                       0, userBatch.numSteps);
+    }
+    userBatch.numSteps = 0;
+    return 0;
+  }
+  strcpy(cmd, userBatch.commands[userBatch.currentStep]);
+  if (userBatch.framesSent == 0) {
+    telemetry_record(TELEMETRY_COMMAND, TELEMETRY_BATCH, 0, telemetry_command_bits(cmd),
+                     userBatch.frames[userBatch.currentStep], userBatch.currentStep);
+  }
+  userBatch.framesSent++;
+  return 1;
+}
+
+
+// Find the embedded web UI asset for a URI, or NULL if there isn't one
+static const struct asset* find_asset(const char *uri) {
+  int i;
+  for (i = 0; i < num_assets; i++) {
+    if (strcmp(assets[i].uri, uri) == 0) {
+      return &assets[i];
+    }
+  }
+  return NULL;
+}
+
+// Find the embedded asset for a path that mongoose has built from the document
+// root and the URI, e.g. "/var/www/js/javascript.js". Directories map to their
+// index.html, as mongoose can't stat directories that only exist in memory.
+static const struct asset* find_asset_for_path(const char *path) {
+  char uri[64];
+  size_t rootLen = strlen(WEB_ROOT);
+
+  if (strncmp(path, WEB_ROOT, rootLen) != 0) {
+    return NULL;
+  }
+  path += rootLen;
+  snprintf(uri, sizeof(uri), "%s%s", path,
+          (path[0] == '\0' || path[strlen(path) - 1] == '/') ? "index.html" : "");
+  return find_asset(uri);
+}
+
+// Whether a client takes gzipped responses
+static int accepts_gzip(const struct mg_connection *conn) {
+  const char *acceptEncoding = mg_get_header(conn, "Accept-Encoding");
+  return acceptEncoding != NULL && strstr(acceptEncoding, "gzip") != NULL;
+}
+
+// Mongoose open_file callback, serves the web UI from memory: gzipped to
+// clients that take that, plain to the rest, so /var/www isn't needed.
+static const char* asset_callback(const struct mg_connection *conn, const char *path, size_t *data_len) {
+  const struct asset *asset = find_asset_for_path(path);
+
+  if (asset == NULL) {
+    return NULL;
+  }
+  if (accepts_gzip(conn)) {
+    *data_len = asset->len;
+    return asset->data;
+  }
+  *data_len = asset->plainLen;
+  return asset->plain;
+}
+
+// Mongoose open_file_headers callback, describes an asset served from memory
+// in the same form asset_callback() chose
+static void asset_headers_callback(const struct mg_connection *conn, const char *path,
+                                   const char **etag, const char **content_type,
+                                   const char **content_encoding) {
+  const struct asset *asset = find_asset_for_path(path);
+  if (asset != NULL) {
+    *content_type = asset->mime;
+    if (accepts_gzip(conn)) {
+      *etag = asset->etag;
+      *content_encoding = "gzip";
+    } else {
+      *etag = asset->plainEtag;
+    }
+  }
+}
+
+
+// Open the I2C bus, or return the already open one. Returns -1 on failure,
+// and tries again next time.
+int i2cBus() {
+  static int fd = -1;
+  if (fd < 0) {
+    fd = open("/dev/i2c-0", O_RDWR);          // Open port for reading and writing
+  }
+  return fd;
+}
+
+// Errors are the same every time if a device is missing, so only log changes
+void logSensorError(char* message, char** lastMessage) {
+  if (message != *lastMessage && message != NULL) {
+    log_msg(LOG_WARN, message);
+  }
+  *lastMessage = message;
+}
+
+// Tell the SRF02 to range, and on the next run read the result back
+void rangefinder_task() {
+  static int ranging = 0;             // Set once a ranging has been started
+  static char* lastMessage[2];        // Last error starting and reading a ranging
+  int fd;                             // File description
+  int addressSRF = 0x70;              // Address of the SRF02 shifted right one bit
+  unsigned char buf[10];              // Buffer for data being read/ written on the i2c bus
+  char* message = NULL;               // Char array to write an error message to
+  int failed = 0;                     // Set if the device has failed
+  uint64_t spanStart = trace_begin();
+
+  if (replayPath != NULL) {
+    return;
+  }
+  fd = i2cBus();
+
+  if (fd < 0) {
+    message = "Failed to open i2c port";
+  }
+
+  if (ioctl(fd, I2C_SLAVE, addressSRF) < 0) {         // Set the port options and set the address of the device we wish to speak to
+    message = "Unable to get bus access to talk to slave";
+    failed = 1;
+  }
+
+  if (!ranging) {
     buf[0] = 0;                         // Commands for performing a ranging
     buf[1] = 81;
   
     if ((write(fd, buf, 2)) != 2) {               // Write commands to the i2c port
       message = "Error writing to i2c slave\n";
+      failed = 1;
     }
+    trace_end("srf02 ranging", spanStart, failed);
+    logSensorError(message, &lastMessage[0]);
+    ranging = 1;                        // Ping comes back before the next run
+    return;
+  }
+  ranging = 0;
+  metrics_inc(C_SENSOR_READS_SRF02);
   
-    usleep(750000);                       // This sleep waits for the ping to come back
-  
-    buf[0] = 0;                         // This is the register we wish to read from
+  buf[0] = 0;                         // This is the register we wish to read from
   
-    if ((write(fd, buf, 1)) != 1) {               // Send the register to read from
-      message = "Error writing to i2c slave\n";
-    }
+  if ((write(fd, buf, 1)) != 1) {               // Send the register to read from
+    message = "Error writing to i2c slave\n";
+    failed = 1;
+  }
   
-    if (read(fd, buf, 4) != 4) {                // Read back data into buf[]
-      message = "Unable to read from slave\n";
-    } else {
-      tmpRange = (buf[2] <<8) + buf[3];     // Calculate range as a word value
-    }
+  int tmpRange = 0;                   // Temp variable to store range
+  if (read(fd, buf, 4) != 4) {                // Read back data into buf[]
+    message = "Unable to read from slave\n";
+    failed = 1;
+  } else {
+    tmpRange = (buf[2] <<8) + buf[3];     // Calculate range as a word value
+  }
+  trace_end("srf02 read", spanStart, failed);
+  if (failed) {
+    metrics_inc(C_SENSOR_FAILURES_SRF02);
+  }
+  logSensorError(message, &lastMessage[1]);
+  publishRange(tmpRange, failed);
+}
 
-    //
-    // COMPASS
-    //
+// Make a range reading, from the SRF02 or a replay, the latest one and add it
+// to the map
+void publishRange(int tmpRange, int failed) {
+  telemetry_record(TELEMETRY_RANGE, 0, failed ? TELEMETRY_FAILED : 0, tmpRange, 0, 0);
+  metrics_mutex_lock( &sensorDataMutex, C_MUTEX_WAIT_NS_SENSOR_DATA );
+  range = tmpRange;
+  sensorSeq++;
+  state->range = range;
+  state->sensorSeq = sensorSeq;
+  pthread_cond_broadcast( &sensorDataCond );
+  metrics_mutex_unlock( &sensorDataMutex );
+  metrics_set(G_RANGE, tmpRange);
+
+  // Add it to the map, from where the SRF02 is now. The ranging took place
+  // since the last run, so the tank can't have moved far.
+  struct pose pose;
+  odometry_read(&odometry, &pose);
+  if (!failed && map != NULL && pose.headingKnown) {
+    uint64_t mapStart = trace_begin();
+    map_update(map, pose.x + RANGEFINDER_OFFSET * sin(pose.heading),
+               pose.y + RANGEFINDER_OFFSET * cos(pose.heading), pose.heading, tmpRange);
+    trace_end("map update", mapStart, tmpRange);
+    metrics_inc(C_MAP_UPDATES);
+    metrics_set(G_MAP_TILES, map->numTiles);
+  }
+}
 
-    // Initial pause for safety
-    usleep(50000);
+// Read bearing, pitch and roll from the CMPS10
+void compass_task() {
+  static char* lastMessage = NULL;
+  int fd;                             // File description
+  int addressCMPS = 0x60;             // Address of CMPS10 shifted right one bit
+  unsigned char buf[10];              // Buffer for data being read/ written on the i2c bus
+  int tmpBearingTenths = 0;           // Temp variable to store bearing, in tenths of a degree
+  int tmpPitch = 0;                   // Temp variable to store pitch
+  int tmpRoll = 0;                    // Temp variable to store roll
+  char* message = NULL;               // Char array to write an error message to
+  int failed = 0;                     // Set if the device has failed
+  uint64_t spanStart = trace_begin();
+
+  if (replayPath != NULL) {
+    return;
+  }
+  fd = i2cBus();
+  metrics_inc(C_SENSOR_READS_CMPS10);
+  if (fd < 0) {
+    message = "Failed to open i2c port";
+  }
 
-    if (ioctl(fd, I2C_SLAVE, addressCMPS) < 0) {          // Set the port options and set the address of the device we wish to speak to
-      message = "Unable to get bus access to talk to slave";
-    }
+  if (ioctl(fd, I2C_SLAVE, addressCMPS) < 0) {          // Set the port options and set the address of the device we wish to speak to
+    message = "Unable to get bus access to talk to slave";
+    failed = 1;
+  }
   
-    buf[0] = 0;                         // this is the register we wish to read from
+  buf[0] = 0;                         // this is the register we wish to read from
   
-    if ((write(fd, buf, 1)) != 1) {               // Send register to read from
-      message = "Error writing to i2c slave\n";
-    }
+  if ((write(fd, buf, 1)) != 1) {               // Send register to read from
+    message = "Error writing to i2c slave\n";
+    failed = 1;
+  }
   
-    if (read(fd, buf, 6) != 6) {                // Read back data into buf[]
-      message = "Unable to read from slave\n";
-    }
-    else {
-      tmpBearing = ((buf[2]<<8) + buf[3]) / 10;
-      tmpPitch = buf[4];
-      if (tmpPitch > 127) tmpPitch = tmpPitch-256;
-      tmpRoll = buf[5];
-      if (tmpRoll > 127) tmpRoll = tmpRoll-256;
-    }
+  if (read(fd, buf, 6) != 6) {                // Read back data into buf[]
+    message = "Unable to read from slave\n";
+    failed = 1;
+  }
+  else {
+    tmpBearingTenths = (buf[2]<<8) + buf[3];
+    tmpPitch = buf[4];
+    if (tmpPitch > 127) tmpPitch = tmpPitch-256;
+    tmpRoll = buf[5];
+    if (tmpRoll > 127) tmpRoll = tmpRoll-256;
+  }
+  trace_end("cmps10 read", spanStart, failed);
+  if (failed) {
+    metrics_inc(C_SENSOR_FAILURES_CMPS10);
+  }
+  logSensorError(message, &lastMessage);
+  publishCompass(tmpBearingTenths, tmpPitch, tmpRoll, failed);
+}
 
-    // Output to file
-    FILE* f = fopen("/var/www/sensordata.txt", "w");
-    fprintf(f, "Range: %d&nbsp;&nbsp;&nbsp;&nbsp;Bearing: %d&nbsp;&nbsp;&nbsp;&nbsp;Pitch: %d&nbsp;&nbsp;&nbsp;&nbsp;Roll: %d \n", tmpRange, tmpBearing, tmpPitch, tmpRoll);
+// Make a compass reading, from the CMPS10 or a replay, the latest one, and
+// correct odometry with it
+void publishCompass(int bearingTenths, int tmpPitch, int tmpRoll, int failed) {
+  int tmpBearing = bearingTenths / 10;
+
+  if (!failed) {
+    odometry_compass(&odometry, bearingTenths / 10.0);
+  }
+  telemetry_record(TELEMETRY_COMPASS, 0, failed ? TELEMETRY_FAILED : 0, bearingTenths, tmpPitch, tmpRoll);
+  metrics_mutex_lock( &sensorDataMutex, C_MUTEX_WAIT_NS_SENSOR_DATA );
+  bearing = tmpBearing;
+  pitch = tmpPitch;
+  roll = tmpRoll;
+  sensorSeq++;
+  state->bearing = bearing;
+  state->pitch = pitch;
+  state->roll = roll;
+  state->sensorSeq = sensorSeq;
+  pthread_cond_broadcast( &sensorDataCond );
+  metrics_mutex_unlock( &sensorDataMutex );
+  metrics_set(G_BEARING, tmpBearing);
+}
+
+// Write the latest sensor readings to a file, for anything that still polls it,
+// and pass on how the telemetry log is doing
+void telemetry_task() {
+  static struct telemetry_stats last;
+  struct telemetry_stats stats;
+  telemetry_get_stats(&stats);
+  metrics_add(C_TELEMETRY_RECORDS, stats.written - last.written);
+  metrics_add(C_TELEMETRY_DROPPED, stats.dropped - last.dropped);
+  if (stats.segmentFailures != last.segmentFailures) {
+    log_msg(LOG_WARN, "Can't make a telemetry segment in " TELEMETRY_DIR);
+  }
+  last = stats;
+
+  metrics_mutex_lock( &sensorDataMutex, C_MUTEX_WAIT_NS_SENSOR_DATA );
+  int tmpRange = range;
+  int tmpBearing = bearing;
+  int tmpPitch = pitch;
+  int tmpRoll = roll;
+  metrics_mutex_unlock( &sensorDataMutex );
+  struct pose pose;
+  odometry_read(&odometry, &pose);
+
+  FILE* f = fopen(WEB_ROOT "/sensordata.txt", "w");
+  if (f != NULL) {
+    fprintf(f, "Range: %d&nbsp;&nbsp;&nbsp;&nbsp;Bearing: %d&nbsp;&nbsp;&nbsp;&nbsp;Pitch: %d&nbsp;&nbsp;&nbsp;&nbsp;Roll: %d&nbsp;&nbsp;&nbsp;&nbsp;X: %.2f&nbsp;&nbsp;&nbsp;&nbsp;Y: %.2f \n", tmpRange, tmpBearing, tmpPitch, tmpRoll, pose.x, pose.y);
     fclose(f);
+  }
+}
 
-    pthread_mutex_lock( &sensorDataMutex );
-    range = tmpRange;
-    bearing = tmpBearing;
-    pitch = tmpPitch;
-    roll = tmpRoll;
-    pthread_mutex_unlock( &sensorDataMutex );
+// Forget a little of the map, and work out the costmap of the window around
+// the tank. The window only moves when the tank gets near its edge or the
+// goal changes, since the planner has to start again when it does.
+void costmap_task() {
+  static unsigned long lastGoalSeq;
+  struct pose pose;
+  int column = costmap.column, row = costmap.row;
 
+  if (map == NULL) {
+    return;
   }
+  uint64_t spanStart = trace_begin();
+  odometry_read(&odometry, &pose);
+  metrics_mutex_lock( &autonomyCommandMutex, C_MUTEX_WAIT_NS_AUTONOMY_COMMAND );
+  int tmpGoalSet = goalSet;
+  double tmpGoalX = goalX, tmpGoalY = goalY;
+  unsigned long tmpGoalSeq = goalSeq;
+  metrics_mutex_unlock( &autonomyCommandMutex );
+
+  planner_window(&column, &row, pose.x, pose.y, tmpGoalSet, tmpGoalX, tmpGoalY,
+                 tmpGoalSeq != lastGoalSeq);
+  lastGoalSeq = tmpGoalSeq;
+  costmap_decay(map->tiles[0].cells, map->numTiles * sizeof(struct map_tile), MAP_DECAY_STEP);
+  costmap_build(&costmap, map, column, row);
+  trace_end("costmap", spanStart, map->numTiles);
 }
 
+// Log where odometry thinks the tank is, what the sensors say and how the
+// tank is being told to move, for rt_calibrate, in the same format as
+// rt_world's tracks
+void run_log_task() {
+  static const char* motionCommands[] = {
+    "0000000000", "1000000000", "0100000000", "0010000000", "0001000000"
+  };
+  struct pose pose;
+
+  if (runLog == NULL) {
+    return;
+  }
+  odometry_read(&odometry, &pose);
+  metrics_mutex_lock( &sensorDataMutex, C_MUTEX_WAIT_NS_SENSOR_DATA );
+  int tmpRange = range;
+  int tmpBearing = bearing;
+  metrics_mutex_unlock( &sensorDataMutex );
+
+  fprintf(runLog, "%.3f,%.3f,%.3f,%d,%d,%d,%s\n", pose.usec / 1e6, pose.x, pose.y,
+          (int) (pose.heading * 180 / M_PI), tmpBearing, tmpRange, motionCommands[pose.motion]);
+  fflush(runLog);   // So a crash doesn't lose the end of the run
+}
 
-// Launch autonomy thread
-void* launch_autonomy() {
+// Play a telemetry log back, then leave the tank idle
+void* replay_thread() {
+  char** paths;
+  int numPaths;
+  long replayed;
+
+  metrics_thread_init("replay");
+  log_thread_init("replay");
+  trace_thread_init("replay");
+  if ((numPaths = telemetry_find_segments(replayPath, &paths)) <= 0) {
+    log_msg(LOG_ERROR, "No telemetry to replay in %s", replayPath);
+    return NULL;
+  }
+  log_msg(LOG_INFO, "Replaying %ld telemetry segments from %s", numPaths, replayPath);
+  replayed = telemetry_replay(paths, numPaths, replaySpeed, replayRecord, NULL);
+  log_msg(LOG_INFO, "Replay finished after %ld records", replayed);
+  telemetry_free_paths(paths, numPaths);
+
+  metrics_mutex_lock( &userCommandMutex, C_MUTEX_WAIT_NS_USER_COMMAND );
+  strcpy(userCommand, "0000000000");
+  strcpy(state->userCommand, userCommand);
+  userBatch.numSteps = 0;
+  metrics_mutex_unlock( &userCommandMutex );
+  return NULL;
+}
 
-  printf("Starting autonomy\n");
-  //printf("Autonomy: Driving forward.\n");
-  while(1) {
-    // Get data from the variables while the mutex is locked
-    pthread_mutex_lock( &sensorDataMutex );
+// Feed a record from a telemetry log back in as if it had just happened:
+// sensor samples as if the sensors had read them, and the user's commands as
+// if they'd just been sent. Frames and autonomy's commands aren't replayed,
+// since the transmitter and autonomy work them out again from the rest.
+int replayRecord(const struct telemetry_record* record, void* arg) {
+  char command[11];
+  (void) arg;
+
+  switch (record->type) {
+    case TELEMETRY_RANGE:
+      publishRange(record->values[0], record->flags & TELEMETRY_FAILED);
+      break;
+    case TELEMETRY_COMPASS:
+      publishCompass(record->values[0], record->values[1], record->values[2],
+                     record->flags & TELEMETRY_FAILED);
+      break;
+    case TELEMETRY_COMMAND:
+      if (record->source != TELEMETRY_AUTONOMY) {
+        telemetry_command_string(record->values[0], command);
+        metrics_mutex_lock( &userCommandMutex, C_MUTEX_WAIT_NS_USER_COMMAND );
+        strcpy(userCommand, command);
+        strcpy(state->userCommand, userCommand);
+        userBatch.numSteps = 0;
+        metrics_mutex_unlock( &userCommandMutex );
+      }
+      break;
+  }
+  return 0;
+}
+
+// Localize against the stored map at every new sensor sample. An update is
+// a few ms of work even shared between cores, too much for the reactor, so
+// it has a thread of its own and never holds anything else up.
+void* localize_thread() {
+  unsigned long seenSeq = 0;
+
+  metrics_thread_init("localizer");
+  log_thread_init("localizer");
+  trace_thread_init("localizer");
+  for (;;) {
+    metrics_mutex_lock( &sensorDataMutex, C_MUTEX_WAIT_NS_SENSOR_DATA );
+    while (sensorSeq == seenSeq) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec++;
+      metrics_cond_timedwait(&sensorDataCond, &sensorDataMutex, &deadline);
+    }
+    seenSeq = sensorSeq;
     int tmpRange = range;
     int tmpBearing = bearing;
-    int tmpPitch = pitch;
-    int tmpRoll = roll;
-    pthread_mutex_unlock( &sensorDataMutex );
-
-    // Check for forward obstacles.  Ranges <10 are errors, so ignore them.
-    if ((tmpRange < 100) && (tmpRange > 10)) {
-      //printf("Autonomy: Forward obstacle detected.\n");
-      autonomySendCommand("000000000"); // idle
-      usleep(500000);
-      //printf("Autonomy: Reversing...\n");
-      autonomySendCommand("010000000"); // reverse
-      usleep(1000000);
-      autonomySendCommand("000000000"); // idle
-      usleep(500000);
-      //printf("Autonomy: Shooting...\n");
-      autonomySendCommand("000000010"); // fire
-      usleep(500000);
-      autonomySendCommand("000000000"); // idle
-      //printf("Autonomy: Turning...\n");
-      autonomySendCommand("000100000"); // right
-      usleep(1500000);
-      autonomySendCommand("000000000"); // idle
-      //printf("Autonomy: Recheck Pause...\n");
-      usleep(2000000);
-      //printf("Autonomy: Recheck Pause complete.\n");
-      //printf("Autonomy: Driving forward.\n");
-    }
-    else
-    {
-      autonomySendCommand("100000000");
+    metrics_mutex_unlock( &sensorDataMutex );
+    struct pose pose;
+    odometry_read(&odometry, &pose);
+
+    // Until there's been a bearing, the one there is means nothing
+    unsigned long resamples = localizer->resamples;
+    uint64_t localizeStart = trace_begin();
+    localize_update(localizer, &pose, tmpRange, pose.headingKnown ? tmpBearing : -1);
+    trace_end("localize", localizeStart, localizer->n);
+    metrics_inc(C_LOCALIZER_UPDATES);
+    metrics_add(C_LOCALIZER_RESAMPLES, localizer->resamples - resamples);
+
+    struct localize_estimate estimate;
+    localize_read(localizer, &estimate);
+    metrics_set(G_LOCALIZER_SPREAD_CM, lround(estimate.spread * 100));
+  }
+  return NULL;
+}
+
+
+// Drive autonomously, if autonomy is switched on: to the goal if there is
+// one, otherwise wherever there's nothing in the way
+void autonomy_task() {
+  static struct autonomy autonomy = AUTONOMY_INIT;
+  static enum planner_status lastStatus = PLANNER_FOLLOWING;
+  char* command;
+
+  // Get data from the variables while the mutex is locked
+  metrics_mutex_lock( &sensorDataMutex, C_MUTEX_WAIT_NS_SENSOR_DATA );
+  int tmpRange = range;
+  metrics_mutex_unlock( &sensorDataMutex );
+  metrics_mutex_lock( &autonomyCommandMutex, C_MUTEX_WAIT_NS_AUTONOMY_COMMAND );
+  int tmpGoalSet = goalSet;
+  double tmpGoalX = goalX, tmpGoalY = goalY;
+  metrics_mutex_unlock( &autonomyCommandMutex );
+  struct pose pose;
+  odometry_read(&odometry, &pose);
+
+  // Plan, if there's a goal and enough known to plan with
+  enum planner_status status = PLANNER_NO_PATH;
+  double targetBearing = 0;
+  int planning = tmpGoalSet && map != NULL && pose.headingKnown;
+  if (planning) {
+    unsigned long searches = planner.searches, expansions = planner.expansions;
+    unsigned long costChanges = planner.costChanges;
+    uint64_t planStart = trace_begin();
+    status = planner_steer(&planner, &costmap, pose.x, pose.y, tmpGoalX, tmpGoalY, &targetBearing);
+    trace_end("plan", planStart, (int) (planner.expansions - expansions));
+    metrics_add(C_PLANNER_SEARCHES, planner.searches - searches);
+    metrics_add(C_PLANNER_EXPANSIONS, planner.expansions - expansions);
+    metrics_add(C_PLANNER_COST_CHANGES, planner.costChanges - costChanges);
+
+    if (status == PLANNER_ARRIVED) {
+      log_msg(LOG_INFO, "Reached the goal at %ldcm, %ldcm", lround(tmpGoalX * 100), lround(tmpGoalY * 100));
+      metrics_mutex_lock( &autonomyCommandMutex, C_MUTEX_WAIT_NS_AUTONOMY_COMMAND );
+      goalSet = 0;
+      metrics_mutex_unlock( &autonomyCommandMutex );
+    } else if (status == PLANNER_NO_PATH && lastStatus != PLANNER_NO_PATH) {
+      log_msg(LOG_WARN, "No path to the goal at %ldcm, %ldcm", lround(tmpGoalX * 100),
+              lround(tmpGoalY * 100));
     }
+    lastStatus = status;
+  }
 
-    // Don't need to run that fast, sensor polling is pretty slow anyway.
-    usleep(100000);
+  // Without a path, wander as before in case one turns up, but keep still
+  // while the planner's still looking
+  enum autonomy_decision decision = AUTONOMY_WAIT;
+  uint64_t decisionStart = trace_begin();
+  if (!planning || status == PLANNER_NO_PATH) {
+    decision = autonomy_step(&autonomy, exec_now(), tmpRange, &command);
+  } else if (status == PLANNER_FOLLOWING) {
+    decision = autonomy_steer(&autonomy, exec_now(), tmpRange, pose.heading, targetBearing, &command);
+  } else {
+    autonomy.step = -1;
+    command = "000000000";
+  }
+  switch (decision) {
+    case AUTONOMY_FORWARD:
+      metrics_inc(C_AUTONOMY_FORWARD);
+      trace_end("autonomy forward", decisionStart, tmpRange);
+      break;
+    case AUTONOMY_AVOID:
+      metrics_inc(C_AUTONOMY_AVOID);
+      trace_end("autonomy avoid", decisionStart, tmpRange);
+      break;
+    case AUTONOMY_TURN:
+      metrics_inc(C_AUTONOMY_TURN);
+      trace_end("autonomy turn", decisionStart, (int) (targetBearing * 180 / M_PI));
+      break;
+    case AUTONOMY_BLOCKED:
+      metrics_inc(C_AUTONOMY_BLOCKED);
+      trace_end("autonomy blocked", decisionStart, tmpRange);
+      break;
+    default:
+      break;
+  }
+  if (command != NULL) {
+    autonomySendCommand(command);
   }
 }
 
-// Send a command from autonomy to the main control thread
+// Send a command from autonomy to the transmitter
 void* autonomySendCommand(char* cmd) {
-  pthread_mutex_lock( &autonomyCommandMutex );
+  metrics_mutex_lock( &autonomyCommandMutex, C_MUTEX_WAIT_NS_AUTONOMY_COMMAND );
+  if (strncmp(autonomyCommand, cmd, 9) != 0) {
+    telemetry_record(TELEMETRY_COMMAND, TELEMETRY_AUTONOMY, 0, telemetry_command_bits(cmd), 0, 0);
+  }
   strncpy(&autonomyCommand[0], &cmd[0], 9);
   autonomyCommand[10] = 0;
-  pthread_mutex_unlock( &autonomyCommandMutex );
+  strcpy(state->autonomyCommand, autonomyCommand);
+  metrics_mutex_unlock( &autonomyCommandMutex );
 }
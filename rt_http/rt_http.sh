@@ -2,7 +2,12 @@
 
 cd "$(dirname "$0")"
 
-until ./rt_http; do
+# Restarts after a crash are warm: the tank is still running, so rt_http picks
+# up where it left off instead of starting it up again. The tank gets no
+# commands until then, so only pause long enough not to spin if it keeps dying.
+OPTS=""
+until ./rt_http $OPTS; do
   echo "Raspberry Tank control code crashed, restarting..."
-  sleep 1
+  OPTS="-w"
+  sleep 0.1
 done
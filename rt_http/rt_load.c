@@ -0,0 +1,368 @@
+//
+// Raspberry Tank HTTP Remote Control load tester
+//
+// Runs a number of concurrent clients against rt_http, each sending ?set and
+// ?get requests at a fixed rate, then reports throughput, latency percentiles
+// and how steady the transmitter's frame timing stayed while under load (from
+// rt_http's /metrics). Every ?set it sends is idle, but it's meant to be run
+// against "make sim" builds rather than a real tank.
+//
+// Usage: rt_load [-h host] [-p port] [-c clients] [-r requests/s per client]
+//                [-d seconds] [-g fraction of requests that are gets] [-k]
+// -k uses HTTP keep-alive, otherwise every request gets a new connection.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Options
+const char* host = "127.0.0.1";
+int port = 3000;
+int numClients = 10;
+double rate = 20;
+int duration = 10;
+double getFraction = 0.5;
+int keepAlive = 0;
+
+struct sockaddr_in serverAddress;
+
+// What each client thread measured
+struct client {
+  pthread_t thread;
+  int id;
+  uint32_t* latencies;      // Microseconds, one per successful request
+  int numLatencies;
+  int maxLatencies;
+  int errors;
+  int connections;
+};
+
+// Counters scraped from the server's /metrics
+struct server_stats {
+  double frames, intervals, sum, sumSquares, maxInterval;
+  double cpuUsec, contextSwitches;
+};
+
+// Function declarations
+void* run_client(void* arg);
+int open_connection();
+int http_request(struct client* client, int* sock, const char* path, char* body, int bodyLen);
+int try_http_request(int* sock, const char* path, char* body, int bodyLen);
+int scrape_metrics(struct server_stats* stats);
+double metric_value(const char* metrics, const char* name);
+long long now_usec();
+int compare_latencies(const void* a, const void* b);
+
+// Main
+int main(int argc, char **argv) {
+  int opt, i;
+  struct hostent* he;
+
+  while ((opt = getopt(argc, argv, "h:p:c:r:d:g:k")) != -1) {
+    switch (opt) {
+      case 'h': host = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'c': numClients = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'g': getFraction = atof(optarg); break;
+      case 'k': keepAlive = 1; break;
+      default:
+        fprintf(stderr, "Usage: %s [-h host] [-p port] [-c clients] [-r rate] [-d seconds] [-g get fraction] [-k]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (numClients < 1 || rate <= 0 || duration < 1) {
+    fprintf(stderr, "Clients, rate and duration must all be positive\n");
+    return 1;
+  }
+
+  if ((he = gethostbyname(host)) == NULL) {
+    fprintf(stderr, "Can't resolve %s\n", host);
+    return 1;
+  }
+  memset(&serverAddress, 0, sizeof(serverAddress));
+  serverAddress.sin_family = AF_INET;
+  serverAddress.sin_port = htons(port);
+  memcpy(&serverAddress.sin_addr, he->h_addr_list[0], sizeof(serverAddress.sin_addr));
+
+  struct server_stats before, after, sample;
+  if (!scrape_metrics(&before)) {
+    fprintf(stderr, "Can't read http://%s:%d/metrics, is rt_http running?\n", host, port);
+    return 1;
+  }
+
+  printf("%d clients, %.1f requests/s each, %s, %.0f%% gets, for %ds\n",
+         numClients, rate, keepAlive ? "keep-alive" : "new connection per request",
+         getFraction * 100, duration);
+
+  struct client* clients = calloc(numClients, sizeof(struct client));
+  long long start = now_usec();
+  for (i = 0; i < numClients; i++) {
+    clients[i].id = i;
+    clients[i].maxLatencies = (int) (rate * duration) + 16;
+    clients[i].latencies = malloc(clients[i].maxLatencies * sizeof(uint32_t));
+    pthread_create(&clients[i].thread, NULL, &run_client, &clients[i]);
+  }
+
+  // Sample the worst frame interval once a second while the load is on
+  double worstInterval = 0;
+  while (now_usec() - start < duration * 1000000LL) {
+    sleep(1);
+    if (scrape_metrics(&sample) && sample.maxInterval > worstInterval) {
+      worstInterval = sample.maxInterval;
+    }
+  }
+
+  int total = 0, errors = 0, connections = 0;
+  for (i = 0; i < numClients; i++) {
+    pthread_join(clients[i].thread, NULL);
+    total += clients[i].numLatencies;
+    errors += clients[i].errors;
+    connections += clients[i].connections;
+  }
+  double elapsed = (now_usec() - start) / 1e6;
+
+  scrape_metrics(&after);
+
+  // Merge and sort everyone's latencies for the percentiles
+  uint32_t* all = malloc((total + 1) * sizeof(uint32_t));
+  int n = 0;
+  for (i = 0; i < numClients; i++) {
+    memcpy(&all[n], clients[i].latencies, clients[i].numLatencies * sizeof(uint32_t));
+    n += clients[i].numLatencies;
+  }
+  qsort(all, total, sizeof(uint32_t), compare_latencies);
+
+  printf("\nRequests:     %d ok, %d errors, %d connections\n", total, errors, connections);
+  printf("Throughput:   %.1f requests/s\n", total / elapsed);
+  if (total > 0) {
+    printf("Latency:      p50 %.2fms   p99 %.2fms   p999 %.2fms   max %.2fms\n",
+           all[(int) (total * 0.5)] / 1000.0, all[(int) (total * 0.99)] / 1000.0,
+           all[(int) (total * 0.999)] / 1000.0, all[total - 1] / 1000.0);
+  }
+
+  double intervals = after.intervals - before.intervals;
+  if (intervals > 0) {
+    double mean = (after.sum - before.sum) / intervals;
+    double variance = (after.sumSquares - before.sumSquares) / intervals - mean * mean;
+    printf("Transmitter:  %.1f frames/s   interval mean %.0fus   jitter (stddev) %.0fus   worst %.0fus\n",
+           (after.frames - before.frames) / elapsed, mean, variance > 0 ? sqrt(variance) : 0, worstInterval);
+  }
+  printf("Server:       CPU %.1f%%   %.0f context switches/s\n",
+         (after.cpuUsec - before.cpuUsec) / elapsed / 1e4,
+         (after.contextSwitches - before.contextSwitches) / elapsed);
+
+  return 0;
+} // main
+
+
+// One client: send requests at the configured rate until time is up
+void* run_client(void* arg) {
+  struct client* client = (struct client*) arg;
+  unsigned int seed = client->id + 1;
+  long long start = now_usec();
+  long long period = (long long) (1000000 / rate);
+  long long end = start + duration * 1000000LL;
+  int sock = -1;
+  int seq = 0;
+  char path[128], body[256];
+
+  while (1) {
+    // Keep to the schedule, but if we've fallen behind just send straight away
+    long long next = start + seq * period;
+    long long now = now_usec();
+    if (next >= end) {
+      break;
+    } else if (next > now) {
+      usleep(next - now);
+    }
+    seq++;
+
+    if ((double) rand_r(&seed) / RAND_MAX < getFraction) {
+      snprintf(path, sizeof(path), "/?get");
+    } else {
+      snprintf(path, sizeof(path), "/?set0000000000&sid=%d&seq=%d", client->id + 1, seq);
+    }
+
+    long long sent = now_usec();
+    if (http_request(client, &sock, path, body, sizeof(body)) < 0) {
+      client->errors++;
+    } else if (client->numLatencies < client->maxLatencies) {
+      client->latencies[client->numLatencies++] = (uint32_t) (now_usec() - sent);
+    }
+  }
+
+  if (sock >= 0) {
+    close(sock);
+  }
+  return NULL;
+}
+
+// Connect to rt_http, returning the socket or -1
+int open_connection() {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  if (sock < 0) {
+    return -1;
+  }
+  if (connect(sock, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) != 0) {
+    close(sock);
+    return -1;
+  }
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return sock;
+}
+
+// Send a GET on *sock, or on a new connection if it is -1, and read the
+// response into body. A kept-alive connection may have been closed by the
+// server since the last request, in which case this retries once on a new
+// one, as browsers do. Returns the body length, or -1 on error.
+int http_request(struct client* client, int* sock, const char* path, char* body, int bodyLen) {
+  int n, reused = *sock >= 0;
+
+  if (!reused) {
+    if ((*sock = open_connection()) < 0) {
+      return -1;
+    }
+    client->connections++;
+  }
+  if ((n = try_http_request(sock, path, body, bodyLen)) < 0 && reused) {
+    if ((*sock = open_connection()) < 0) {
+      return -1;
+    }
+    client->connections++;
+    n = try_http_request(sock, path, body, bodyLen);
+  }
+  return n;
+}
+
+// Send a GET on an open connection and read the response into body. Closes
+// the socket and sets it to -1 afterwards unless the connection is being kept
+// alive. Returns the body length, or -1 on error.
+int try_http_request(int* sock, const char* path, char* body, int bodyLen) {
+  char buf[2048];
+  int n, len = 0, headerLen = 0, contentLength = -1, serverCloses = !keepAlive;
+  char* p;
+
+  n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+               path, host, keepAlive ? "keep-alive" : "close");
+  if (send(*sock, buf, n, MSG_NOSIGNAL) != n) {
+    goto fail;
+  }
+
+  // Read until we have the headers and all of the body
+  while (1) {
+    if (len == sizeof(buf) - 1) {
+      goto fail;
+    }
+    n = recv(*sock, buf + len, sizeof(buf) - 1 - len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      goto fail;
+    }
+    len += n;
+    buf[len] = '\0';
+    if (headerLen == 0 && (p = strstr(buf, "\r\n\r\n")) != NULL) {
+      headerLen = p + 4 - buf;
+      if (strncmp(buf, "HTTP/1.1 200", 12) != 0) {
+        goto fail;
+      }
+      if ((p = strstr(buf, "Content-Length: ")) != NULL && p < buf + headerLen) {
+        contentLength = atoi(p + 16);
+      }
+      if (strstr(buf, "Connection: close") != NULL) {
+        serverCloses = 1;
+      }
+    }
+    if (n == 0 || (headerLen > 0 && contentLength >= 0 && len - headerLen >= contentLength)) {
+      break;
+    }
+  }
+  if (headerLen == 0) {
+    goto fail;
+  }
+
+  n = len - headerLen < bodyLen - 1 ? len - headerLen : bodyLen - 1;
+  memcpy(body, buf + headerLen, n);
+  body[n] = '\0';
+  if (serverCloses || contentLength < 0) {
+    close(*sock);
+    *sock = -1;
+  }
+  return n;
+
+fail:
+  close(*sock);
+  *sock = -1;
+  return -1;
+}
+
+// Read the transmitter's frame timing and the server's CPU counters from
+// /metrics
+int scrape_metrics(struct server_stats* stats) {
+  static char body[32768];
+  char buf[256];
+  int sock;
+
+  // Metrics are bigger than any other response, so read them on their own
+  // connection, to the end
+  if ((sock = open_connection()) < 0) {
+    return 0;
+  }
+  snprintf(buf, sizeof(buf), "GET /metrics HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", host);
+  send(sock, buf, strlen(buf), MSG_NOSIGNAL);
+  int len = 0, n;
+  while (len < (int) sizeof(body) - 1 && (n = recv(sock, body + len, sizeof(body) - 1 - len, 0)) > 0) {
+    len += n;
+  }
+  body[len] = '\0';
+  close(sock);
+
+  stats->frames = metric_value(body, "rt_frames_sent_total");
+  stats->intervals = metric_value(body, "rt_frame_intervals_total");
+  stats->sum = metric_value(body, "rt_frame_interval_microseconds_total");
+  stats->sumSquares = metric_value(body, "rt_frame_interval_squared_microseconds_total");
+  stats->maxInterval = metric_value(body, "rt_max_frame_interval_microseconds");
+  stats->cpuUsec = metric_value(body, "rt_process_cpu_microseconds_total{mode=\"user\"}") +
+                   metric_value(body, "rt_process_cpu_microseconds_total{mode=\"system\"}");
+  stats->contextSwitches = metric_value(body, "rt_context_switches_total{type=\"voluntary\"}") +
+                           metric_value(body, "rt_context_switches_total{type=\"involuntary\"}");
+  return strstr(body, "rt_frames_sent_total") != NULL;
+}
+
+// Find "name value" at the start of a line in Prometheus text format
+double metric_value(const char* metrics, const char* name) {
+  size_t nameLen = strlen(name);
+  const char* p = metrics;
+  while ((p = strstr(p, name)) != NULL) {
+    if ((p == metrics || p[-1] == '\n') && p[nameLen] == ' ') {
+      return atof(p + nameLen + 1);
+    }
+    p += nameLen;
+  }
+  return 0;
+}
+
+long long now_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int compare_latencies(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+  return x < y ? -1 : x > y;
+}
@@ -0,0 +1,619 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Telemetry queries
+//
+// Answers questions about rt_http's telemetry log (telemetry.h), such as how
+// often the range was under a metre while driving forward, in one pass over
+// it without having to turn it into anything else first. Blocks are decoded
+// by a thread per core, only the types of record the query needs, while the
+// main thread goes through them in order working out the answer.
+//
+// Usage: rt_query [-w condition]... [-a after] [-b before] [-j threads] [-J]
+//                 aggregate... log
+//
+//   log   A segment file, or a directory of them (/var/log/rt_http)
+//   -w    Only count when a condition holds: a field, one of < <= = != >= >,
+//         and a number, or for motion a name, e.g. "range<100" or
+//         "motion=forward". Given more than once, they must all hold.
+//   -a    Only records after this time, in seconds since 1970 (date +%s)
+//   -b    Only records before this time
+//   -j    Threads decoding blocks (default one per core)
+//   -J    Answer in JSON rather than CSV
+//
+// Fields are the latest readings as of each record: range (cm), bearing
+// (degrees), pitch and roll from the sensors, ignoring failed readings, and
+// motion (idle, forward, reverse, left or right) from the last frame sent.
+// A condition on a field that hasn't been read yet doesn't hold.
+//
+// Aggregates:
+//
+//   count:field               Readings of field taken while the conditions
+//                             held, and in all
+//   histogram:field:width     Those readings, in buckets width wide
+//   percentiles:field[:p,...] Of those readings, by default the 50th, 90th
+//                             and 99th
+//   time                      Seconds the conditions held, and in all
+//   time:field                Seconds the conditions held at each value of
+//                             field, e.g. time:motion
+//
+// e.g. rt_query -w "range<100" -w motion=forward count:range time /var/log/rt_http
+//
+// CSV answers are a line per number: the aggregate as given, what the number
+// is ("matching", "all", a bucket, percentile or value) and the number. JSON
+// answers are an object of those for each aggregate.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "telemetry.h"
+#include "odometry.h"
+
+#define MAX_CONDITIONS 16
+#define MAX_AGGREGATES 16
+#define MAX_PERCENTILES 16
+#define MAX_THREADS 64
+#define SLOTS_PER_THREAD 4        // Decoded blocks waiting for the main thread
+#define MAX_GAP_USEC 5000000      // Longer between records, such as between runs, isn't counted
+
+// What a field is read from, and scaled by into the units queries use
+struct field {
+  const char *name;
+  int type;
+  int index;                      // Of the record's values
+  double scale;
+};
+
+static const struct field fields[] = {
+  {"range",   TELEMETRY_RANGE,   0, 1},
+  {"bearing", TELEMETRY_COMPASS, 0, 0.1},
+  {"pitch",   TELEMETRY_COMPASS, 1, 1},
+  {"roll",    TELEMETRY_COMPASS, 2, 1},
+  {"motion",  TELEMETRY_FRAME,   0, 1},     // enum motion, from the opcode
+};
+#define NUM_FIELDS (int) (sizeof(fields) / sizeof(fields[0]))
+#define MOTION_FIELD 4
+
+static const char *const motion_names[] = {"idle", "forward", "reverse", "left", "right"};
+#define NUM_MOTIONS (int) (sizeof(motion_names) / sizeof(motion_names[0]))
+
+enum comparison { LT, LE, EQ, NE, GE, GT };
+
+struct condition {
+  int field;
+  enum comparison comparison;
+  double value;
+};
+
+// How much of each value of a field there's been, readings or seconds, so
+// percentiles come out exact in one pass. Fields are small whole numbers.
+struct tally {
+  int32_t min;                    // Value of counts[0]
+  int size;
+  double *counts;
+  double total;
+};
+
+enum aggregate_kind { COUNT, HISTOGRAM, PERCENTILES, TIME };
+
+struct aggregate {
+  const char *name;               // As given
+  enum aggregate_kind kind;
+  int field;                      // -1 for plain time
+  double width;                   // Of histogram buckets
+  double percentiles[MAX_PERCENTILES];
+  int numPercentiles;
+  struct tally matching;
+  double all;
+};
+
+// A block to decode, and the offset from its segment's clock to real time
+struct block_ref {
+  const struct telemetry_block *block;
+  int64_t realtimeOffsetUsec;
+};
+
+// Decoded blocks, in slots taken in turn, so blocks can be decoded out of
+// order but handed over in order
+struct slot {
+  struct telemetry_record records[TELEMETRY_BLOCK_RECORDS];
+  int count;
+  long ready;                     // Number of the block in it, once decoded
+};
+
+struct decoder {
+  struct block_ref *blocks;
+  long numBlocks;
+  unsigned types;
+  struct slot *slots;
+  int numSlots;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  long next;                      // Block for the next thread to decode
+  long consumed;                  // Blocks the main thread is finished with
+  int failed;
+};
+
+// The latest reading of each field
+struct state {
+  int32_t values[NUM_FIELDS];
+  int known[NUM_FIELDS];
+};
+
+// Function declarations
+int parse_condition(const char *s, struct condition *condition);
+int parse_aggregate(const char *s, struct aggregate *aggregate);
+int find_field(const char *name, size_t length);
+void *decode_thread(void *arg);
+int holds(const struct condition *conditions, int numConditions, const struct state *state);
+void tally_add(struct tally *tally, int32_t value, double amount);
+void print_aggregate(const struct aggregate *aggregate, int json, int first);
+void print_value(const struct aggregate *aggregate, const char *key, double value, int json, int *first);
+double seconds_now();
+
+// Main
+int main(int argc, char **argv) {
+  struct condition conditions[MAX_CONDITIONS];
+  struct aggregate aggregates[MAX_AGGREGATES];
+  int numConditions = 0, numAggregates = 0, numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int json = 0, opt, i, j;
+  double after = -INFINITY, before = INFINITY;
+  const char *usage = "Usage: %s [-w condition]... [-a after] [-b before] [-j threads] [-J] "
+                      "aggregate... log\n";
+
+  while ((opt = getopt(argc, argv, "w:a:b:j:J")) != -1) {
+    switch (opt) {
+      case 'w':
+        if (numConditions == MAX_CONDITIONS || !parse_condition(optarg, &conditions[numConditions++])) {
+          fprintf(stderr, "Can't make sense of condition %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'a': after = atof(optarg); break;
+      case 'b': before = atof(optarg); break;
+      case 'j': numThreads = atoi(optarg); break;
+      case 'J': json = 1; break;
+      default:
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    fprintf(stderr, usage, argv[0]);
+    return 1;
+  }
+  for (i = optind; i < argc - 1; i++) {
+    if (numAggregates == MAX_AGGREGATES || !parse_aggregate(argv[i], &aggregates[numAggregates++])) {
+      fprintf(stderr, "Can't make sense of aggregate %s\n", argv[i]);
+      return 1;
+    }
+  }
+  numThreads = numThreads < 1 ? 1 : numThreads > MAX_THREADS ? MAX_THREADS : numThreads;
+
+  // Only the types of record something needs are decoded, and frames at
+  // least, to time things by
+  struct decoder decoder;
+  memset(&decoder, 0, sizeof(decoder));
+  decoder.types = 1u << TELEMETRY_FRAME;
+  for (i = 0; i < numConditions; i++) {
+    decoder.types |= 1u << fields[conditions[i].field].type;
+  }
+  for (i = 0; i < numAggregates; i++) {
+    if (aggregates[i].field >= 0) {
+      decoder.types |= 1u << fields[aggregates[i].field].type;
+    }
+  }
+
+  // Find the blocks in the time asked for from their headers
+  char **paths;
+  int numPaths = telemetry_find_segments(argv[argc - 1], &paths);
+  if (numPaths < 0) {
+    fprintf(stderr, "Can't read %s\n", argv[argc - 1]);
+    return 1;
+  }
+  struct telemetry_segment *segments = calloc(numPaths, sizeof(struct telemetry_segment));
+  long size = 0;
+  for (i = 0; i < numPaths; i++) {
+    const struct telemetry_block *block;
+    size_t offset = 0;
+    if (!telemetry_open(&segments[i], paths[i])) {
+      fprintf(stderr, "%s isn't a telemetry segment\n", paths[i]);
+      return 1;
+    }
+    while ((block = telemetry_next_block(&segments[i], &offset)) != NULL) {
+      int64_t realtimeOffsetUsec = segments[i].header->realtimeOffsetUsec;
+      if ((block->lastUsec + realtimeOffsetUsec) / 1e6 < after ||
+          (block->firstUsec + realtimeOffsetUsec) / 1e6 > before) {
+        continue;
+      }
+      if (decoder.numBlocks == size) {
+        size = size == 0 ? 1024 : size * 2;
+        decoder.blocks = realloc(decoder.blocks, size * sizeof(struct block_ref));
+      }
+      decoder.blocks[decoder.numBlocks].block = block;
+      decoder.blocks[decoder.numBlocks++].realtimeOffsetUsec = realtimeOffsetUsec;
+    }
+  }
+
+  // Start decoding
+  pthread_t threads[MAX_THREADS];
+  decoder.numSlots = numThreads * SLOTS_PER_THREAD;
+  decoder.slots = malloc(decoder.numSlots * sizeof(struct slot));
+  if (decoder.slots == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    return 1;
+  }
+  for (i = 0; i < decoder.numSlots; i++) {
+    decoder.slots[i].ready = -1;
+  }
+  pthread_mutex_init(&decoder.lock, NULL);
+  pthread_cond_init(&decoder.changed, NULL);
+  for (i = 0; i < numThreads; i++) {
+    pthread_create(&threads[i], NULL, &decode_thread, &decoder);
+  }
+
+  // Go through the records in order as they come
+  struct state state;
+  uint64_t lastUsec = 0;
+  long b, numRecords = 0;
+  int started = 0, reversing;
+  double start = seconds_now();
+  memset(&state, 0, sizeof(state));
+  for (b = 0; b < decoder.numBlocks && !decoder.failed; b++) {
+    struct slot *slot = &decoder.slots[b % decoder.numSlots];
+    int64_t realtimeOffsetUsec = decoder.blocks[b].realtimeOffsetUsec;
+
+    pthread_mutex_lock(&decoder.lock);
+    while (slot->ready != b && !decoder.failed) {
+      pthread_cond_wait(&decoder.changed, &decoder.lock);
+    }
+    pthread_mutex_unlock(&decoder.lock);
+    if (decoder.failed) {
+      break;
+    }
+
+    for (i = 0; i < slot->count; i++) {
+      const struct telemetry_record *record = &slot->records[i];
+      double when = (record->usec + realtimeOffsetUsec) / 1e6;
+      if (when < after || when > before) {
+        continue;
+      }
+      numRecords++;
+
+      // The time since the last record went by in the state it left
+      if (started && record->usec >= lastUsec && record->usec - lastUsec <= MAX_GAP_USEC) {
+        double dt = (record->usec - lastUsec) / 1e6;
+        int matching = holds(conditions, numConditions, &state);
+        for (j = 0; j < numAggregates; j++) {
+          struct aggregate *aggregate = &aggregates[j];
+          if (aggregate->kind != TIME) {
+            continue;
+          }
+          aggregate->all += dt;
+          if (matching && aggregate->field < 0) {
+            aggregate->matching.total += dt;
+          } else if (matching && state.known[aggregate->field]) {
+            tally_add(&aggregate->matching, state.values[aggregate->field], dt);
+          }
+        }
+      }
+      lastUsec = record->usec;
+      started = 1;
+
+      // Take in any new readings, and count them
+      if (record->flags & TELEMETRY_FAILED) {
+        continue;
+      }
+      for (j = 0; j < NUM_FIELDS; j++) {
+        if (fields[j].type == record->type) {
+          state.values[j] = j == MOTION_FIELD ? (int32_t) odometry_motion(record->values[0], &reversing)
+                                              : record->values[fields[j].index];
+          state.known[j] = 1;
+        }
+      }
+      int matching = -1;
+      for (j = 0; j < numAggregates; j++) {
+        struct aggregate *aggregate = &aggregates[j];
+        if (aggregate->kind == TIME || fields[aggregate->field].type != record->type) {
+          continue;
+        }
+        if (matching < 0) {
+          matching = holds(conditions, numConditions, &state);
+        }
+        aggregate->all++;
+        if (matching) {
+          tally_add(&aggregate->matching, state.values[aggregate->field], 1);
+        }
+      }
+    }
+
+    // Hand the slot back
+    pthread_mutex_lock(&decoder.lock);
+    decoder.consumed = b + 1;
+    pthread_cond_broadcast(&decoder.changed);
+    pthread_mutex_unlock(&decoder.lock);
+  }
+  double seconds = seconds_now() - start;
+  for (i = 0; i < numThreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (decoder.failed) {
+    fprintf(stderr, "A block in %s is corrupt\n", argv[argc - 1]);
+    return 1;
+  }
+  fprintf(stderr, "%ld blocks, %ld records in %.3fs (%.0f MB/s of records) with %d threads\n",
+          decoder.numBlocks, numRecords, seconds,
+          numRecords * sizeof(struct telemetry_record) / seconds / 1e6, numThreads);
+
+  // Answer
+  if (json) {
+    printf("{");
+  } else {
+    printf("aggregate,key,value\n");
+  }
+  for (i = 0; i < numAggregates; i++) {
+    print_aggregate(&aggregates[i], json, i == 0);
+  }
+  if (json) {
+    printf("\n}\n");
+  }
+
+  for (i = 0; i < numPaths; i++) {
+    telemetry_close(&segments[i]);
+  }
+  telemetry_free_paths(paths, numPaths);
+  return 0;
+} // main
+
+
+// Decoding thread: take the next block, wait for its slot to be free, and
+// decode it into that
+void *decode_thread(void *arg) {
+  struct decoder *decoder = arg;
+
+  while (1) {
+    pthread_mutex_lock(&decoder->lock);
+    long b = decoder->next++;
+    while (b < decoder->numBlocks && b >= decoder->consumed + decoder->numSlots && !decoder->failed) {
+      pthread_cond_wait(&decoder->changed, &decoder->lock);
+    }
+    pthread_mutex_unlock(&decoder->lock);
+    if (b >= decoder->numBlocks || decoder->failed) {
+      return NULL;
+    }
+
+    struct slot *slot = &decoder->slots[b % decoder->numSlots];
+    slot->count = telemetry_decode_block(decoder->blocks[b].block, decoder->types, slot->records);
+
+    pthread_mutex_lock(&decoder->lock);
+    if (slot->count < 0) {
+      decoder->failed = 1;
+    }
+    slot->ready = b;
+    pthread_cond_broadcast(&decoder->changed);
+    pthread_mutex_unlock(&decoder->lock);
+  }
+}
+
+// The field named by the first length characters of name, or -1
+int find_field(const char *name, size_t length) {
+  int i;
+  for (i = 0; i < NUM_FIELDS; i++) {
+    if (strlen(fields[i].name) == length && strncmp(name, fields[i].name, length) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// "range<100", "motion=forward" and so on. Returns 1 if it makes sense.
+int parse_condition(const char *s, struct condition *condition) {
+  static const char *const operators[] = {"<=", ">=", "!=", "<", "=", ">"};
+  static const enum comparison comparisons[] = {LE, GE, NE, LT, EQ, GT};
+  size_t length = strcspn(s, "<>=!");
+  const char *value = s + length;
+  char *end;
+  int i;
+
+  if ((condition->field = find_field(s, length)) < 0) {
+    return 0;
+  }
+  for (i = 0; i < 6 && strncmp(value, operators[i], strlen(operators[i])) != 0; i++);
+  if (i == 6) {
+    return 0;
+  }
+  condition->comparison = comparisons[i];
+  value += strlen(operators[i]);
+
+  if (condition->field == MOTION_FIELD) {
+    for (i = 0; i < NUM_MOTIONS && strcmp(value, motion_names[i]) != 0; i++);
+    condition->value = i;
+    return i < NUM_MOTIONS;
+  }
+  condition->value = strtod(value, &end);
+  return end != value && *end == '\0';
+}
+
+// "count:range", "percentiles:range:50,99" and so on. Returns 1 if it makes
+// sense.
+int parse_aggregate(const char *s, struct aggregate *aggregate) {
+  static const char *const kinds[] = {"count", "histogram", "percentiles", "time"};
+  const char *field = strchr(s, ':'), *rest = NULL;
+  size_t length;
+  int i;
+
+  memset(aggregate, 0, sizeof(*aggregate));
+  aggregate->name = s;
+  length = field != NULL ? (size_t) (field - s) : strlen(s);
+  for (i = 0; i < 4 && (strlen(kinds[i]) != length || strncmp(s, kinds[i], length) != 0); i++);
+  if (i == 4) {
+    return 0;
+  }
+  aggregate->kind = i;
+  aggregate->field = -1;
+  if (field == NULL) {
+    return aggregate->kind == TIME;
+  }
+  field++;
+  rest = strchr(field, ':');
+  length = rest != NULL ? (size_t) (rest - field) : strlen(field);
+  if ((aggregate->field = find_field(field, length)) < 0) {
+    return 0;
+  }
+
+  switch (aggregate->kind) {
+    case HISTOGRAM:
+      aggregate->width = rest != NULL ? atof(rest + 1) : 0;
+      return aggregate->width > 0;
+    case PERCENTILES:
+      if (rest == NULL) {
+        aggregate->percentiles[0] = 50;
+        aggregate->percentiles[1] = 90;
+        aggregate->percentiles[2] = 99;
+        aggregate->numPercentiles = 3;
+        return 1;
+      }
+      while (rest != NULL && aggregate->numPercentiles < MAX_PERCENTILES) {
+        double p = atof(rest + 1);
+        if (p < 0 || p > 100) {
+          return 0;
+        }
+        aggregate->percentiles[aggregate->numPercentiles++] = p;
+        rest = strchr(rest + 1, ',');
+      }
+      return 1;
+    default:
+      return rest == NULL;
+  }
+}
+
+// Whether all the conditions hold
+int holds(const struct condition *conditions, int numConditions, const struct state *state) {
+  int i;
+  for (i = 0; i < numConditions; i++) {
+    const struct condition *c = &conditions[i];
+    double value = state->values[c->field] * fields[c->field].scale;
+    int ok;
+    if (!state->known[c->field]) {
+      return 0;
+    }
+    switch (c->comparison) {
+      case LT: ok = value < c->value; break;
+      case LE: ok = value <= c->value; break;
+      case EQ: ok = value == c->value; break;
+      case NE: ok = value != c->value; break;
+      case GE: ok = value >= c->value; break;
+      default: ok = value > c->value; break;
+    }
+    if (!ok) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Add an amount of a value, growing the tally to take it if need be
+void tally_add(struct tally *tally, int32_t value, double amount) {
+  if (tally->size == 0 || value < tally->min || value >= tally->min + tally->size) {
+    int32_t min = tally->size == 0 || value < tally->min ? value : tally->min;
+    int32_t max = tally->size == 0 || value >= tally->min + tally->size ? value : tally->min + tally->size - 1;
+    int size = (int) (max - min + 1), room = size * 2;
+    double *counts = calloc(room, sizeof(double));
+    // Leave room on the side it grew, for the next one
+    if (tally->size != 0 && value < tally->min) {
+      min -= room - size;
+    }
+    if (tally->size != 0) {
+      memcpy(counts + (tally->min - min), tally->counts, tally->size * sizeof(double));
+    }
+    free(tally->counts);
+    tally->counts = counts;
+    tally->min = min;
+    tally->size = room;
+  }
+  tally->counts[value - tally->min] += amount;
+  tally->total += amount;
+}
+
+void print_aggregate(const struct aggregate *aggregate, int json, int first) {
+  const struct tally *tally = &aggregate->matching;
+  double scale = aggregate->field >= 0 ? fields[aggregate->field].scale : 1;
+  int firstValue = 1, i, j;
+  char key[32];
+
+  if (json) {
+    printf("%s\n  \"%s\": {", first ? "" : ",", aggregate->name);
+  }
+  switch (aggregate->kind) {
+    case HISTOGRAM:
+      for (i = 0; i < tally->size; ) {
+        double bucket = floor((tally->min + i) * scale / aggregate->width) * aggregate->width;
+        double count = 0;
+        for (; i < tally->size &&
+               floor((tally->min + i) * scale / aggregate->width) * aggregate->width == bucket; i++) {
+          count += tally->counts[i];
+        }
+        if (count > 0) {
+          snprintf(key, sizeof(key), "%g", bucket);
+          print_value(aggregate, key, count, json, &firstValue);
+        }
+      }
+      break;
+
+    case PERCENTILES:
+      for (j = 0; j < aggregate->numPercentiles && tally->total > 0; j++) {
+        // The lowest reading with at least that many at or below it
+        double target = aggregate->percentiles[j] / 100 * tally->total, sum = 0;
+        for (i = 0; i < tally->size - 1; i++) {
+          sum += tally->counts[i];
+          if (tally->counts[i] > 0 && sum >= target) {
+            break;
+          }
+        }
+        snprintf(key, sizeof(key), "%g", aggregate->percentiles[j]);
+        print_value(aggregate, key, (tally->min + i) * scale, json, &firstValue);
+      }
+      break;
+
+    case TIME:
+      if (aggregate->field >= 0) {
+        for (i = 0; i < tally->size; i++) {
+          if (tally->counts[i] == 0) {
+            continue;
+          }
+          if (aggregate->field == MOTION_FIELD && tally->min + i >= 0 && tally->min + i < NUM_MOTIONS) {
+            snprintf(key, sizeof(key), "%s", motion_names[tally->min + i]);
+          } else {
+            snprintf(key, sizeof(key), "%g", (tally->min + i) * scale);
+          }
+          print_value(aggregate, key, tally->counts[i], json, &firstValue);
+        }
+      }
+      // Fall through
+    default:
+      print_value(aggregate, "matching", tally->total, json, &firstValue);
+      print_value(aggregate, "all", aggregate->all, json, &firstValue);
+  }
+  if (json) {
+    printf("}");
+  }
+}
+
+void print_value(const struct aggregate *aggregate, const char *key, double value, int json, int *first) {
+  if (json) {
+    printf("%s\"%s\": %.10g", *first ? "" : ", ", key, value);
+  } else {
+    printf("%s,%s,%.10g\n", aggregate->name, key, value);
+  }
+  *first = 0;
+}
+
+double seconds_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
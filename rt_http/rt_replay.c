@@ -0,0 +1,96 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Telemetry log dumper
+//
+// Streams the records of rt_http's telemetry log (telemetry.h) out as CSV,
+// one line per record, as fast as they can be read or at the rate they were
+// recorded, for looking at a run offline or feeding it to something else as
+// if it were live. To play a log back through rt_http itself, with its
+// sensor readings and commands standing in for the real ones, use
+// "rt_http -r" instead.
+//
+// Usage: rt_replay [-s speed] [-t type]... log...
+//
+//   log  A segment file, or a directory of them (/var/log/rt_http)
+//   -s   1 to stream at the rate it was recorded, 2 for twice that and so
+//        on (default 0, as fast as possible)
+//   -t   Only records of this type: range, compass, frame or command
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "telemetry.h"
+
+// Function declarations
+int print_record(const struct telemetry_record* record, void* arg);
+
+// Main
+int main(int argc, char **argv) {
+  double speed = 0;
+  unsigned types = 0;
+  int opt, i, j;
+
+  while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+    switch (opt) {
+      case 's': speed = atof(optarg); break;
+      case 't':
+        for (j = 1; j < NUM_TELEMETRY_TYPES && strcmp(optarg, telemetry_type_names[j]) != 0; j++);
+        if (j == NUM_TELEMETRY_TYPES) {
+          fprintf(stderr, "Unknown record type %s\n", optarg);
+          return 1;
+        }
+        types |= 1u << j;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-s speed] [-t type]... log...\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind == argc) {
+    fprintf(stderr, "Usage: %s [-s speed] [-t type]... log...\n", argv[0]);
+    return 1;
+  }
+  if (types == 0) {
+    types = ~0u;
+  }
+
+  printf("time,type,source,failed,command,value1,value2,value3\n");
+  for (i = optind; i < argc; i++) {
+    char** paths;
+    int numPaths = telemetry_find_segments(argv[i], &paths);
+    if (numPaths < 0) {
+      fprintf(stderr, "Can't read %s\n", argv[i]);
+      return 1;
+    }
+    long replayed = telemetry_replay(paths, numPaths, speed, print_record, &types);
+    telemetry_free_paths(paths, numPaths);
+    if (replayed < 0) {
+      fprintf(stderr, "%s isn't all telemetry segments\n", argv[i]);
+      return 1;
+    }
+  }
+  return 0;
+} // main
+
+
+// A line for a record, if it's of a type that's wanted. Commands are given
+// as a command string as well as their bits.
+int print_record(const struct telemetry_record* record, void* arg) {
+  unsigned types = *(unsigned*) arg;
+  char command[11] = "";
+
+  if (record->type >= NUM_TELEMETRY_TYPES || !(types & (1u << record->type))) {
+    return 0;
+  }
+  if (record->type == TELEMETRY_COMMAND) {
+    telemetry_command_string(record->values[0], command);
+  }
+  printf("%.6f,%s,%s,%d,%s,%d,%d,%d\n", record->usec / 1e6, telemetry_type_names[record->type],
+         record->type == TELEMETRY_COMMAND && record->source < 3 ?
+           telemetry_source_names[record->source] : "",
+         record->flags & TELEMETRY_FAILED, command,
+         record->values[0], record->values[1], record->values[2]);
+  return ferror(stdout) != 0;
+}
@@ -0,0 +1,1125 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// World simulator
+//
+// Closed-loop test of autonomy without a tank or a room. A simulated tank
+// moves according to the opcodes the transmitter would send it, in a world
+// of polygons, and simulated SRF02 and CMPS10 readings of that world are fed
+// back to the real autonomy code (autonomy.c), on the same schedule as
+// rt_http runs its tasks.
+//
+// Time is virtual, so it runs as fast as the CPU allows, and everything is
+// deterministic: a scenario's world and sensor noise are generated from a
+// seed, and the same seed always gives the same run. That makes it possible
+// to check a change to autonomy against thousands of scenarios and compare
+// the results.
+//
+// Scenarios are independent, so they're shared out between threads, each
+// with its own queue of them. A thread that runs out steals half of what's
+// left in someone else's queue, so a few slow scenarios (big rooms, lots of
+// boxes) at the end of one queue don't leave the other threads idle. Results
+// are kept per scenario and added up in order afterwards, so the output is
+// the same whatever the number of threads.
+//
+// Usage: rt_world [-n scenarios] [-s seed] [-t seconds] [-f world file] [-v]
+//                 [-j threads] [-p name=values]... [-e cm] [-d probability]
+//                 [-c degrees] [-m map file] [-g] [-l particles]
+//
+//   -n  Number of scenarios (default 1000, or 1 with -f)
+//   -s  Seed of the first scenario; the rest follow on from it (default 1)
+//   -t  Virtual seconds to run each scenario for (default 120)
+//   -f  Run the world in this file instead, see worlds/room.txt
+//   -v  Print the tank's track and what its sensors read, a line per frame,
+//       as CSV
+//   -j  Number of threads (default one per CPU)
+//   -p  Sweep an autonomy parameter, running every scenario with each
+//       combination of values. name is range (avoid range, cm), reverse,
+//       turn or pause (maneuver times, ms); values are min:max:step or a
+//       list like 500,1000,1500.
+//   -e  Standard deviation of the noise on SRF02 ranges, in cm (default 0)
+//   -d  Probability of an SRF02 ranging getting no echo (default 0)
+//   -c  Standard deviation of the noise on CMPS10 bearings, in degrees
+//       (default 0)
+//   -m  Build an occupancy grid (map.c) from the rangefinder in every run,
+//       and write the first run's to this file as a PGM image
+//   -g  Drive to the goal along the planner's path (planner.c), as rt_http
+//       does when given one, rather than wandering. The map is built from
+//       where odometry thinks the tank is, like rt_http's.
+//   -l  Localize (localize.c) with this many particles against a map of the
+//       world made beforehand, at every SRF02 reading, and compare how far
+//       out that and odometry are. Each run's localizer gets an equal share
+//       of the CPUs left over from the runs themselves.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "opcodes.h"
+#include "autonomy.h"
+#include "map.h"
+#include "costmap.h"
+#include "odometry.h"
+#include "planner.h"
+#include "localize.h"
+
+// Task schedule, as in rt_http.c: the reactor ticks every 5 frames, running
+// autonomy every tick and the rangefinder every 4, alternating between
+// starting a ranging and reading it back.
+#define REACTOR_FRAMES 5
+#define RANGEFINDER_TICKS 4
+#define COMPASS_TICKS 8
+#define COSTMAP_TICKS 8
+#define MAP_DECAY_STEP 1
+
+// Tank, measured from a Heng Long 1:16 Leopard 2. Odometry is calibrated
+// with the same speeds, so its errors are down to the compass and collisions.
+#define TANK_RADIUS 0.25          // m, from the centre to the corners
+#define FORWARD_SPEED 0.35        // m/s
+#define REVERSE_SPEED 0.25        // m/s
+#define LEFT_RATE 0.6             // rad/s, left is slower than right
+#define RIGHT_RATE 0.9            // rad/s
+
+// SRF02: a cone about 55 degrees wide, ranging from 16cm to 6m. Anything
+// further away reads as 0, which autonomy ignores like any other error.
+#define SONAR_HALF_ANGLE 0.48     // rad
+#define SONAR_RAYS 11
+#define SONAR_MIN_CM 16
+#define SONAR_MAX_CM 600
+
+// Coverage is the share of the free floor the tank's centre has been over,
+// on a grid of cells this size or bigger
+#define COVERAGE_CELL 0.25        // m
+#define MAX_CELLS 64              // Per side
+
+// The goal counts as reached when the tank's centre is this close to it
+#define GOAL_RADIUS 0.5           // m
+#define GOAL_MIN_DISTANCE 1.5     // m from the start, in generated worlds
+
+// Limits on worlds
+#define MAX_WALLS 256
+#define MAX_POLYGONS 64
+#define MAX_LINE 1024
+#define LOCALIZE_MARGIN 0.5       // m of map around the world
+
+// Limits on sweeps
+#define MAX_SWEEPS 4
+#define MAX_VALUES 64
+#define MAX_PARAM_SETS 4096
+#define MAX_THREADS 64
+
+// One side of a polygon
+struct wall {
+  double x1, y1, x2, y2;
+};
+
+// The first polygon is the room, the rest are things in it
+struct polygon {
+  int firstWall, numWalls;
+};
+
+struct world {
+  struct wall walls[MAX_WALLS];
+  int numWalls;
+  struct polygon polygons[MAX_POLYGONS];
+  int numPolygons;
+  double startX, startY, startHeading;
+  int hasGoal;
+  double goalX, goalY;
+
+  // Coverage grid, worked out by finish_world()
+  double gridX, gridY, cellSize;
+  int columns, rows;
+  unsigned char freeCell[MAX_CELLS * MAX_CELLS];
+  int freeCells;
+};
+
+// Heading is clockwise from north (+y) in radians
+struct tank {
+  double x, y, heading;
+  int reversing;                  // REVERSE carries on until a FORWARD
+};
+
+// Sensor noise
+struct noise {
+  double rangeSigma;              // cm
+  double dropout;                 // Probability of no echo
+  double bearingSigma;            // degrees
+};
+
+struct result {
+  int collisions;                 // Times the tank ran into something
+  int collidedFrames;             // Frames spent pushing against something
+  int avoids;                     // Avoid maneuvers started
+  double distance;                // m travelled
+  double coverage;                // Share of the free floor visited
+  double goalTime;                // s until the goal was reached, or -1
+  int mapUpdates;                 // Readings added to the map
+  double mapUsec;                 // Time spent adding them
+  int mapTiles;                   // Tiles it ended up with
+  double odometryError;           // m between odometry and the truth at the end
+  int plans;                      // Planner calls
+  unsigned long searches;         // Made from scratch
+  unsigned long expansions;
+  double planUsec;                // Time spent planning
+  int maxExpansions;              // Most in one call
+  int localizeUpdates;
+  double localizeUsec;            // Time spent on them
+  double localizeError;           // m between the localizer and the truth at the end
+  double localizeMaxError;        // The most it was out at any update
+};
+
+// An autonomy parameter that can be swept
+struct parameter {
+  const char* name;
+  size_t offset;
+};
+
+static const struct parameter parameters[] = {
+  {"range", offsetof(struct autonomy, avoidRange)},
+  {"reverse", offsetof(struct autonomy, reverseMsec)},
+  {"turn", offsetof(struct autonomy, turnMsec)},
+  {"pause", offsetof(struct autonomy, pauseMsec)},
+};
+#define NUM_PARAMETERS (int) (sizeof(parameters) / sizeof(parameters[0]))
+
+struct sweep {
+  size_t offset;
+  int values[MAX_VALUES];
+  int numValues;
+};
+
+// A thread's queue of jobs. Jobs are numbered, and a queue is always a run
+// of consecutive ones, so it's just the range [head, tail). The owner takes
+// from the head and thieves take from the tail.
+struct worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int head, tail;
+  int steals;
+};
+
+// Function declarations
+int parse_sweep(struct sweep* sweep, const char* arg);
+void* worker_thread(void* arg);
+int take_job(struct worker* self);
+int steal_jobs(struct worker* self);
+void run_job(int job);
+void generate_world(struct world* world, uint64_t seed);
+int load_world(struct world* world, const char* fileName);
+void add_polygon(struct world* world, const double* points, int numPoints);
+void finish_world(struct world* world);
+int inside_polygon(const struct world* world, const struct polygon* polygon, double x, double y);
+void run_scenario(const struct world* world, const struct autonomy* params,
+                  const struct noise* noise, uint64_t noiseSeed, struct map* map,
+                  struct planner* planner, struct result* result);
+struct localizer* create_localizer(const struct world* world, struct localize_map* map);
+void plan(const struct odometry* odometry, const struct world* world, struct planner* planner,
+          const struct costmap* costmap, struct autonomy* autonomy, uint64_t now, int range,
+          char** command, struct result* result);
+double usec_since(const struct timespec* start);
+int write_map(const struct map* map, const char* fileName);
+void move_tank(struct tank* tank, int opCode, double dt);
+int collides(const struct world* world, double x, double y);
+int sonar_range(const struct world* world, const struct tank* tank);
+double ray_distance(const struct world* world, double x, double y, double angle);
+double random_uniform(uint64_t* state, double min, double max);
+double random_gaussian(uint64_t* state, double sigma);
+
+// What the workers share, set up by main and read-only while they run
+static struct world fileWorld;
+static const char* fileName = NULL;
+static struct autonomy* paramSets;
+static int numParamSets = 1;
+static int numScenarios = 1000;
+static uint64_t firstSeed = 1;
+static double seconds = 120;
+static int verbose = 0;
+static const char* mapFileName = NULL;
+static int navigate = 0;
+static int particles = 0;
+static int localizeThreads = 1;
+static struct noise noise = {0, 0, 0};
+static struct result* results;      // Per parameter set, per scenario
+static struct worker workers[MAX_THREADS];
+static int numWorkers;
+
+// Main
+int main(int argc, char **argv) {
+  int opt, i, j;
+  int scenariosGiven = 0;
+  struct sweep sweeps[MAX_SWEEPS];
+  int numSweeps = 0;
+
+  numWorkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "n:s:t:f:vj:p:e:d:c:m:gl:")) != -1) {
+    switch (opt) {
+      case 'n': numScenarios = atoi(optarg); scenariosGiven = 1; break;
+      case 's': firstSeed = strtoull(optarg, NULL, 10); break;
+      case 't': seconds = atof(optarg); break;
+      case 'f': fileName = optarg; break;
+      case 'v': verbose = 1; break;
+      case 'j': numWorkers = atoi(optarg); break;
+      case 'p':
+        if (numSweeps == MAX_SWEEPS || !parse_sweep(&sweeps[numSweeps++], optarg)) {
+          fprintf(stderr, "Bad sweep %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'e': noise.rangeSigma = atof(optarg); break;
+      case 'd': noise.dropout = atof(optarg); break;
+      case 'c': noise.bearingSigma = atof(optarg); break;
+      case 'm': mapFileName = optarg; break;
+      case 'g': navigate = 1; break;
+      case 'l': particles = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-n scenarios] [-s seed] [-t seconds] [-f world file] [-v]\n"
+                        "       [-j threads] [-p name=min:max:step|name=v1,v2...]... [-e cm]\n"
+                        "       [-d probability] [-c degrees] [-m map file] [-g] [-l particles]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (fileName != NULL) {
+    if (!load_world(&fileWorld, fileName)) {
+      return 1;
+    }
+    if (!scenariosGiven) {
+      numScenarios = 1;
+    }
+  }
+
+  // Every combination of the swept values, the last sweep varying fastest
+  for (i = 0; i < numSweeps; i++) {
+    numParamSets *= sweeps[i].numValues;
+    if (numParamSets > MAX_PARAM_SETS) {
+      fprintf(stderr, "More than %d parameter sets\n", MAX_PARAM_SETS);
+      return 1;
+    }
+  }
+  paramSets = malloc(numParamSets * sizeof(*paramSets));
+  for (i = 0; i < numParamSets; i++) {
+    struct autonomy initial = AUTONOMY_INIT;
+    int index = i;
+    for (j = numSweeps - 1; j >= 0; j--) {
+      *(int*) ((char*) &initial + sweeps[j].offset) = sweeps[j].values[index % sweeps[j].numValues];
+      index /= sweeps[j].numValues;
+    }
+    paramSets[i] = initial;
+  }
+
+  // Share the jobs out in runs, one per thread, and let them steal the rest.
+  // Tracks have to come out in order, so they're done on one thread.
+  int numJobs = numParamSets * numScenarios;
+  results = calloc(numJobs, sizeof(*results));
+  if (verbose || numWorkers < 1) {
+    numWorkers = 1;
+  }
+  if (numWorkers > MAX_THREADS) {
+    numWorkers = MAX_THREADS;
+  }
+  if (numWorkers > numJobs) {
+    numWorkers = numJobs > 0 ? numJobs : 1;
+  }
+  localizeThreads = (int) sysconf(_SC_NPROCESSORS_ONLN) / numWorkers;
+  localizeThreads = localizeThreads < 1 ? 1 : localizeThreads;
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  for (i = 0; i < numWorkers; i++) {
+    pthread_mutex_init(&workers[i].lock, NULL);
+    workers[i].head = (int) ((long) numJobs * i / numWorkers);
+    workers[i].tail = (int) ((long) numJobs * (i + 1) / numWorkers);
+  }
+  for (i = 1; i < numWorkers; i++) {
+    pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+  }
+  worker_thread(&workers[0]);
+  int steals = workers[0].steals;
+  for (i = 1; i < numWorkers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    steals += workers[i].steals;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+
+  if (verbose) {
+    return 0;
+  }
+
+  // With one parameter set, a line per scenario and a total; with a sweep, a
+  // line per parameter set
+  if (numParamSets > 1) {
+    printf("%5s %7s %5s %5s  %8s %10s %8s %8s %8s\n", "range", "reverse", "turn", "pause",
+           "collided", "collisions", "covered", "reached", "to goal");
+  }
+  for (i = 0; i < numParamSets; i++) {
+    struct result total = {0};
+    int collided = 0, reached = 0;
+    for (j = 0; j < numScenarios; j++) {
+      const struct result* result = &results[i * numScenarios + j];
+      if (numParamSets == 1) {
+        printf("scenario %llu: %d collisions, %d frames collided, %d avoids, %.1fm travelled, "
+               "%.0f%% covered, odometry %.2fm out, ", (unsigned long long) (firstSeed + j),
+               result->collisions, result->collidedFrames, result->avoids, result->distance,
+               result->coverage * 100, result->odometryError);
+        if (result->goalTime >= 0) {
+          printf("goal at %.1fs\n", result->goalTime);
+        } else {
+          printf("goal not reached\n");
+        }
+      }
+      total.collisions += result->collisions;
+      total.collidedFrames += result->collidedFrames;
+      total.avoids += result->avoids;
+      total.distance += result->distance;
+      total.coverage += result->coverage;
+      total.odometryError += result->odometryError;
+      collided += result->collisions > 0;
+      if (result->goalTime >= 0) {
+        total.goalTime += result->goalTime;
+        reached++;
+      }
+    }
+    if (numParamSets == 1) {
+      printf("\n%d scenarios of %.0fs: %d with collisions, %d collisions, %d avoids, %.1fm travelled, "
+             "%.0f%% covered, odometry %.2fm out, %d reached the goal", numScenarios, seconds,
+             collided, total.collisions, total.avoids, total.distance, total.coverage * 100 / numScenarios,
+             total.odometryError / numScenarios, reached);
+      if (reached > 0) {
+        printf(" in %.1fs on average", total.goalTime / reached);
+      }
+      printf("\n");
+    } else {
+      printf("%5d %7d %5d %5d  %7.1f%% %10.2f %7.1f%% %7.1f%% %7.1fs\n", paramSets[i].avoidRange,
+             paramSets[i].reverseMsec, paramSets[i].turnMsec, paramSets[i].pauseMsec,
+             100.0 * collided / numScenarios, (double) total.collisions / numScenarios,
+             total.coverage * 100 / numScenarios, 100.0 * reached / numScenarios,
+             reached > 0 ? total.goalTime / reached : 0);
+    }
+  }
+
+  // Timing goes to stderr, so that stdout can be compared between runs
+  fprintf(stderr, "%d runs on %d threads in %.2fs, %d steals\n", numJobs, numWorkers,
+          (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9, steals);
+  if (mapFileName != NULL) {
+    long mapUpdates = 0;
+    double mapUsec = 0;
+    int maxTiles = 0;
+    for (i = 0; i < numJobs; i++) {
+      mapUpdates += results[i].mapUpdates;
+      mapUsec += results[i].mapUsec;
+      maxTiles = results[i].mapTiles > maxTiles ? results[i].mapTiles : maxTiles;
+    }
+    fprintf(stderr, "%ld map updates, %.2fus each, at most %d tiles\n", mapUpdates,
+            mapUpdates > 0 ? mapUsec / mapUpdates : 0, maxTiles);
+  }
+  if (navigate) {
+    long plans = 0;
+    unsigned long searches = 0, expansions = 0;
+    double planUsec = 0;
+    int maxExpansions = 0;
+    for (i = 0; i < numJobs; i++) {
+      plans += results[i].plans;
+      searches += results[i].searches;
+      expansions += results[i].expansions;
+      planUsec += results[i].planUsec;
+      maxExpansions = results[i].maxExpansions > maxExpansions ? results[i].maxExpansions : maxExpansions;
+    }
+    fprintf(stderr, "%ld plans, %lu searches from scratch, %.1f expansions and %.1fus each, "
+            "at most %d expansions\n", plans, searches, plans > 0 ? (double) expansions / plans : 0,
+            plans > 0 ? planUsec / plans : 0, maxExpansions);
+  }
+  if (particles > 0) {
+    long updates = 0;
+    double localizeUsec = 0, localizeError = 0, maxError = 0, odometryError = 0;
+    for (i = 0; i < numJobs; i++) {
+      updates += results[i].localizeUpdates;
+      localizeUsec += results[i].localizeUsec;
+      localizeError += results[i].localizeError;
+      odometryError += results[i].odometryError;
+      maxError = results[i].localizeMaxError > maxError ? results[i].localizeMaxError : maxError;
+    }
+    fprintf(stderr, "%ld localizer updates of %d particles on %d threads, %.0fus each, "
+            "%.3g particles/s; localizer %.2fm out at the end on average (at most %.2fm "
+            "on the way), odometry %.2fm\n", updates, particles, localizeThreads,
+            updates > 0 ? localizeUsec / updates : 0,
+            localizeUsec > 0 ? (double) updates * particles / localizeUsec * 1e6 : 0,
+            numJobs > 0 ? localizeError / numJobs : 0, maxError,
+            numJobs > 0 ? odometryError / numJobs : 0);
+  }
+  return 0;
+} // main
+
+
+// Parse name=min:max:step or name=v1,v2,... into a sweep. Returns 1 if it
+// made sense.
+int parse_sweep(struct sweep* sweep, const char* arg) {
+  const char* equals = strchr(arg, '=');
+  int i, min, max, step;
+
+  if (equals == NULL) {
+    return 0;
+  }
+  for (i = 0; i < NUM_PARAMETERS; i++) {
+    if (strlen(parameters[i].name) == (size_t) (equals - arg) &&
+        strncmp(arg, parameters[i].name, equals - arg) == 0) {
+      break;
+    }
+  }
+  if (i == NUM_PARAMETERS) {
+    return 0;
+  }
+  sweep->offset = parameters[i].offset;
+  sweep->numValues = 0;
+
+  if (sscanf(equals + 1, "%d:%d:%d", &min, &max, &step) == 3) {
+    if (step <= 0 || max < min) {
+      return 0;
+    }
+    for (i = min; i <= max && sweep->numValues < MAX_VALUES; i += step) {
+      sweep->values[sweep->numValues++] = i;
+    }
+  } else {
+    const char* p = equals + 1;
+    char* end;
+    while (sweep->numValues < MAX_VALUES) {
+      sweep->values[sweep->numValues++] = (int) strtol(p, &end, 10);
+      if (end == p || (*end != ',' && *end != '\0')) {
+        return 0;
+      }
+      if (*end == '\0') {
+        break;
+      }
+      p = end + 1;
+    }
+  }
+  return sweep->numValues > 0;
+}
+
+
+// Run jobs from this thread's queue, then from other threads' queues, until
+// there are none left anywhere. Jobs are never added, so once a thread can't
+// find one it's done.
+void* worker_thread(void* arg) {
+  struct worker* self = arg;
+  int job;
+
+  while ((job = take_job(self)) >= 0 || (job = steal_jobs(self)) >= 0) {
+    run_job(job);
+  }
+  return NULL;
+}
+
+// Take the job at the head of this thread's queue, or -1 if it's empty
+int take_job(struct worker* self) {
+  int job = -1;
+  pthread_mutex_lock(&self->lock);
+  if (self->head < self->tail) {
+    job = self->head++;
+  }
+  pthread_mutex_unlock(&self->lock);
+  return job;
+}
+
+// Steal the back half of the first non-empty queue after this thread's, run
+// the first of them and queue the rest here. Returns -1 if there's nothing
+// left to steal. Only one lock is held at a time, so thieves can't deadlock.
+int steal_jobs(struct worker* self) {
+  int i;
+  for (i = 1; i < numWorkers; i++) {
+    struct worker* victim = &workers[(self - workers + i) % numWorkers];
+    int first, last;
+
+    pthread_mutex_lock(&victim->lock);
+    last = victim->tail;
+    first = last - (victim->tail - victim->head + 1) / 2;
+    victim->tail = first;
+    pthread_mutex_unlock(&victim->lock);
+
+    if (first < last) {
+      pthread_mutex_lock(&self->lock);
+      self->head = first + 1;
+      self->tail = last;
+      self->steals++;
+      pthread_mutex_unlock(&self->lock);
+      return first;
+    }
+  }
+  return -1;
+}
+
+// Run scenario job % numScenarios with parameter set job / numScenarios. The
+// noise depends only on the scenario, so every parameter set sees the same.
+void run_job(int job) {
+  int paramSet = job / numScenarios;
+  uint64_t scenarioSeed = firstSeed + job % numScenarios;
+  struct world generated;
+  const struct world* world = &fileWorld;
+  struct map* map = NULL;
+  struct planner* planner = NULL;
+
+  if (fileName == NULL) {
+    generate_world(&generated, scenarioSeed);
+    world = &generated;
+  }
+  if ((mapFileName != NULL || navigate) && (map = map_create()) == NULL) {
+    fprintf(stderr, "Not enough memory for a map\n");
+    exit(1);
+  }
+  if (navigate && (planner = calloc(1, sizeof(*planner))) == NULL) {
+    fprintf(stderr, "Not enough memory for a planner\n");
+    exit(1);
+  }
+  run_scenario(world, &paramSets[paramSet], &noise, scenarioSeed * 0xbf58476d1ce4e5b9ULL + 1,
+               map, planner, &results[job]);
+  if (mapFileName != NULL && job == 0 && !write_map(map, mapFileName)) {
+    fprintf(stderr, "Can't write %s\n", mapFileName);
+  }
+  map_destroy(map);
+  free(planner);
+}
+
+
+// Make a random rectangular room with some boxes in it, put the tank
+// somewhere clear in it facing a random way, and pick a goal well away from
+// it
+void generate_world(struct world* world, uint64_t seed) {
+  uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+  double width = random_uniform(&state, 3, 8);
+  double height = random_uniform(&state, 3, 8);
+  int numBoxes = (int) random_uniform(&state, 0, 8);
+  int i;
+
+  world->numWalls = 0;
+  world->numPolygons = 0;
+  double room[] = {0, 0, width, 0, width, height, 0, height};
+  add_polygon(world, room, 4);
+
+  for (i = 0; i < numBoxes; i++) {
+    double w = random_uniform(&state, 0.2, 1.0);
+    double h = random_uniform(&state, 0.2, 1.0);
+    double x = random_uniform(&state, 0, width - w);
+    double y = random_uniform(&state, 0, height - h);
+    double box[] = {x, y, x + w, y, x + w, y + h, x, y + h};
+    add_polygon(world, box, 4);
+  }
+
+  do {
+    world->startX = random_uniform(&state, TANK_RADIUS, width - TANK_RADIUS);
+    world->startY = random_uniform(&state, TANK_RADIUS, height - TANK_RADIUS);
+  } while (collides(world, world->startX, world->startY));
+  world->startHeading = random_uniform(&state, 0, 2 * M_PI);
+
+  // The smallest room always has somewhere far enough away, but a box might
+  // be on it, so give up on the distance after a while
+  for (i = 0; ; i++) {
+    world->goalX = random_uniform(&state, TANK_RADIUS, width - TANK_RADIUS);
+    world->goalY = random_uniform(&state, TANK_RADIUS, height - TANK_RADIUS);
+    if (!collides(world, world->goalX, world->goalY) &&
+        (i >= 100 || hypot(world->goalX - world->startX, world->goalY - world->startY) >= GOAL_MIN_DISTANCE)) {
+      break;
+    }
+  }
+  world->hasGoal = 1;
+  finish_world(world);
+}
+
+// Read a world from a file of lines like
+//   poly x1 y1 x2 y2 x3 y3 ...    a closed polygon, in metres; the first is
+//                                 the room and the rest are in it
+//   tank x y heading              where the tank starts, heading in degrees
+//   goal x y                      somewhere for it to get to (optional)
+// Blank lines and lines starting with # are ignored. Returns 1 if it was read.
+int load_world(struct world* world, const char* fileName) {
+  char line[MAX_LINE];
+  double points[MAX_WALLS * 2];
+  int lineNumber = 0;
+  FILE* f = fopen(fileName, "r");
+
+  if (f == NULL) {
+    fprintf(stderr, "Can't open %s\n", fileName);
+    return 0;
+  }
+  world->numWalls = 0;
+  world->numPolygons = 0;
+  world->hasGoal = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* token = strtok(line, " \t\r\n");
+    int n = 0;
+    lineNumber++;
+    if (token == NULL || token[0] == '#') {
+      continue;
+    }
+    while (n < MAX_WALLS * 2 && (token = strtok(NULL, " \t\r\n")) != NULL) {
+      points[n++] = atof(token);
+    }
+    if (strcmp(line, "poly") == 0 && n >= 6 && n % 2 == 0) {
+      add_polygon(world, points, n / 2);
+    } else if (strcmp(line, "tank") == 0 && n == 3) {
+      world->startX = points[0];
+      world->startY = points[1];
+      world->startHeading = points[2] * M_PI / 180;
+    } else if (strcmp(line, "goal") == 0 && n == 2) {
+      world->goalX = points[0];
+      world->goalY = points[1];
+      world->hasGoal = 1;
+    } else {
+      fprintf(stderr, "%s:%d: expected poly, tank or goal\n", fileName, lineNumber);
+      fclose(f);
+      return 0;
+    }
+  }
+  fclose(f);
+  if (world->numPolygons == 0) {
+    fprintf(stderr, "%s: no room\n", fileName);
+    return 0;
+  }
+  finish_world(world);
+  return 1;
+}
+
+// Add the sides of a closed polygon to the world
+void add_polygon(struct world* world, const double* points, int numPoints) {
+  int i;
+  if (world->numPolygons == MAX_POLYGONS) {
+    return;
+  }
+  struct polygon* polygon = &world->polygons[world->numPolygons++];
+  polygon->firstWall = world->numWalls;
+  for (i = 0; i < numPoints && world->numWalls < MAX_WALLS; i++) {
+    int j = (i + 1) % numPoints;
+    struct wall* wall = &world->walls[world->numWalls++];
+    wall->x1 = points[i * 2];
+    wall->y1 = points[i * 2 + 1];
+    wall->x2 = points[j * 2];
+    wall->y2 = points[j * 2 + 1];
+  }
+  polygon->numWalls = world->numWalls - polygon->firstWall;
+}
+
+// Lay the coverage grid over the room, and work out which cells the tank
+// could be in: inside the room, outside everything in it, and not touching
+// anything
+void finish_world(struct world* world) {
+  const struct polygon* room = &world->polygons[0];
+  double maxX = -INFINITY, maxY = -INFINITY;
+  int i, column, row;
+
+  world->gridX = INFINITY;
+  world->gridY = INFINITY;
+  for (i = room->firstWall; i < room->firstWall + room->numWalls; i++) {
+    world->gridX = fmin(world->gridX, world->walls[i].x1);
+    world->gridY = fmin(world->gridY, world->walls[i].y1);
+    maxX = fmax(maxX, world->walls[i].x1);
+    maxY = fmax(maxY, world->walls[i].y1);
+  }
+  world->cellSize = fmax(COVERAGE_CELL, fmax(maxX - world->gridX, maxY - world->gridY) / MAX_CELLS);
+  world->columns = (int) ceil((maxX - world->gridX) / world->cellSize);
+  world->rows = (int) ceil((maxY - world->gridY) / world->cellSize);
+
+  world->freeCells = 0;
+  for (row = 0; row < world->rows; row++) {
+    for (column = 0; column < world->columns; column++) {
+      double x = world->gridX + (column + 0.5) * world->cellSize;
+      double y = world->gridY + (row + 0.5) * world->cellSize;
+      int free = inside_polygon(world, room, x, y) && !collides(world, x, y);
+      for (i = 1; free && i < world->numPolygons; i++) {
+        free = !inside_polygon(world, &world->polygons[i], x, y);
+      }
+      world->freeCell[row * MAX_CELLS + column] = free;
+      world->freeCells += free;
+    }
+  }
+}
+
+// Whether x, y is inside a polygon, by counting the sides a ray to the right
+// of it crosses
+int inside_polygon(const struct world* world, const struct polygon* polygon, double x, double y) {
+  int i, inside = 0;
+  for (i = polygon->firstWall; i < polygon->firstWall + polygon->numWalls; i++) {
+    const struct wall* w = &world->walls[i];
+    if ((w->y1 > y) != (w->y2 > y) && x < w->x1 + (y - w->y1) * (w->x2 - w->x1) / (w->y2 - w->y1)) {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+
+// Run one scenario with autonomy switched on, frame by frame on a virtual
+// clock, in the same order rt_http's tasks would run in
+void run_scenario(const struct world* world, const struct autonomy* params,
+                  const struct noise* noise, uint64_t noiseSeed, struct map* map,
+                  struct planner* planner, struct result* result) {
+  struct tank tank = {world->startX, world->startY, world->startHeading, 0};
+  struct autonomy autonomy = *params;
+  struct odometry_calibration calibration = {FORWARD_SPEED, REVERSE_SPEED, LEFT_RATE, RIGHT_RATE};
+  struct odometry odometry;
+  char autonomyCommand[11] = "0000000001";
+  unsigned char visited[MAX_CELLS * MAX_CELLS] = {0};
+  int visitedCells = 0;
+  int range = 0, pendingRange = 0, bearing = 0;
+  int ranging = 0, wasColliding = 0;
+  long frames = (long) (seconds * 1000000 / FRAME_USEC);
+  long frame;
+  struct costmap* costmap = NULL;
+  struct localize_map localizeMap;
+  struct localizer* localizer = NULL;
+
+  if (planner != NULL && world->hasGoal) {
+    costmap = calloc(1, sizeof(*costmap));
+  }
+  if (particles > 0) {
+    localizer = create_localizer(world, &localizeMap);
+  }
+  result->goalTime = -1;
+  odometry_init(&odometry, &calibration);
+  if (verbose) {
+    printf("time,x,y,heading,bearing,range,command\n");
+  }
+  for (frame = 0; frame < frames; frame++) {
+    uint64_t now = (uint64_t) frame * FRAME_USEC;
+
+    // Transmitter
+    int opCode = buildOpCode(autonomyCommand);
+    double x = tank.x, y = tank.y;
+    move_tank(&tank, opCode, FRAME_USEC / 1e6);
+    odometry_frame(&odometry, opCode, FRAME_USEC / 1e6, now);
+    if (collides(world, tank.x, tank.y)) {
+      tank.x = x;
+      tank.y = y;
+      result->collidedFrames++;
+      result->collisions += !wasColliding;
+      wasColliding = 1;
+    } else {
+      result->distance += hypot(tank.x - x, tank.y - y);
+      wasColliding = 0;
+    }
+
+    // Where it's been, and whether it's got there
+    int column = (int) floor((tank.x - world->gridX) / world->cellSize);
+    int row = (int) floor((tank.y - world->gridY) / world->cellSize);
+    if (column >= 0 && column < world->columns && row >= 0 && row < world->rows) {
+      int cell = row * MAX_CELLS + column;
+      if (!visited[cell] && world->freeCell[cell]) {
+        visited[cell] = 1;
+        visitedCells++;
+      }
+    }
+    if (world->hasGoal && result->goalTime < 0 &&
+        hypot(tank.x - world->goalX, tank.y - world->goalY) < GOAL_RADIUS) {
+      result->goalTime = now / 1e6;
+    }
+
+    // Reactor
+    if (frame % REACTOR_FRAMES == 0) {
+      long tick = frame / REACTOR_FRAMES;
+      char* command;
+
+      if (tick % COMPASS_TICKS == 0) {
+        double degrees = tank.heading * 180 / M_PI + random_gaussian(&noiseSeed, noise->bearingSigma);
+        bearing = ((int) floor(degrees) % 360 + 360) % 360;
+        odometry_compass(&odometry, bearing);
+      }
+      if (tick % RANGEFINDER_TICKS == 0) {
+        // The range is measured when the ranging starts, and seen when read
+        if (!ranging) {
+          pendingRange = sonar_range(world, &tank);
+          if (pendingRange != 0) {
+            pendingRange += (int) lround(random_gaussian(&noiseSeed, noise->rangeSigma));
+            pendingRange = pendingRange < SONAR_MIN_CM ? SONAR_MIN_CM : pendingRange;
+          }
+          if (noise->dropout > 0 && random_uniform(&noiseSeed, 0, 1) < noise->dropout) {
+            pendingRange = 0;
+          }
+          // Mapped from where the SRF02 really is, but facing which way the
+          // compass thinks, or when navigating, from where odometry thinks
+          // it is as rt_http does
+          if (map != NULL) {
+            struct timespec mapStart;
+            clock_gettime(CLOCK_MONOTONIC, &mapStart);
+            if (costmap != NULL) {
+              const struct pose* pose = &odometry.pose;
+              if (pose->headingKnown) {
+                map_update(map, pose->x + TANK_RADIUS * sin(pose->heading),
+                           pose->y + TANK_RADIUS * cos(pose->heading), pose->heading, pendingRange);
+              }
+            } else {
+              map_update(map, tank.x + TANK_RADIUS * sin(tank.heading) - world->startX,
+                         tank.y + TANK_RADIUS * cos(tank.heading) - world->startY,
+                         bearing * M_PI / 180, pendingRange);
+            }
+            result->mapUpdates += pendingRange != 0;
+            result->mapUsec += usec_since(&mapStart);
+          }
+        } else {
+          range = pendingRange;
+          if (localizer != NULL) {
+            struct timespec localizeStart;
+            struct localize_estimate estimate;
+            clock_gettime(CLOCK_MONOTONIC, &localizeStart);
+            localize_update(localizer, &odometry.pose, range, bearing);
+            result->localizeUsec += usec_since(&localizeStart);
+            result->localizeUpdates++;
+            localize_read(localizer, &estimate);
+            result->localizeError = hypot(estimate.x - (tank.x - world->startX),
+                                          estimate.y - (tank.y - world->startY));
+            result->localizeMaxError = fmax(result->localizeMaxError, result->localizeError);
+          }
+        }
+        ranging = !ranging;
+      }
+      if (costmap != NULL && tick % COSTMAP_TICKS == 0) {
+        int column = costmap->column, row = costmap->row;
+        planner_window(&column, &row, odometry.pose.x, odometry.pose.y, 1,
+                       world->goalX - world->startX, world->goalY - world->startY, tick == 0);
+        costmap_decay(map->tiles[0].cells, map->numTiles * sizeof(struct map_tile), MAP_DECAY_STEP);
+        costmap_build(costmap, map, column, row);
+      }
+      if (costmap != NULL) {
+        plan(&odometry, world, planner, costmap, &autonomy, now, range, &command, result);
+      } else if (autonomy_step(&autonomy, now, range, &command) == AUTONOMY_AVOID) {
+        result->avoids++;
+      }
+      if (command != NULL) {
+        strncpy(autonomyCommand, command, 9);
+      }
+    }
+
+    if (verbose) {
+      printf("%.3f,%.3f,%.3f,%d,%d,%d,%s\n", now / 1e6, tank.x, tank.y,
+             (int) (tank.heading * 180 / M_PI) % 360, bearing, range, autonomyCommand);
+    }
+  }
+  result->coverage = world->freeCells > 0 ? (double) visitedCells / world->freeCells : 0;
+  result->odometryError = hypot(odometry.pose.x - (tank.x - world->startX),
+                                odometry.pose.y - (tank.y - world->startY));
+  if (map != NULL) {
+    result->mapTiles = map->numTiles;
+  }
+  free(costmap);
+  if (localizer != NULL) {
+    localize_destroy(localizer);
+    localize_map_destroy(&localizeMap);
+  }
+}
+
+// Draw the world's walls into a map, in odometry's coordinates, with the
+// tank starting at 0, 0, and make a localizer that knows where it starts
+struct localizer* create_localizer(const struct world* world, struct localize_map* map) {
+  double cell = LOCALIZE_CELL_CM / 100.0;
+  double width = world->columns * world->cellSize + 2 * LOCALIZE_MARGIN;
+  double height = world->rows * world->cellSize + 2 * LOCALIZE_MARGIN;
+  struct localizer* localizer;
+  int i;
+
+  if (!localize_map_create(map, (int) ceil(width / cell), (int) ceil(height / cell),
+                           world->gridX - LOCALIZE_MARGIN - world->startX,
+                           world->gridY - LOCALIZE_MARGIN - world->startY)) {
+    fprintf(stderr, "Not enough memory for a localizer map\n");
+    exit(1);
+  }
+  for (i = 0; i < world->numWalls; i++) {
+    const struct wall* w = &world->walls[i];
+    int steps = (int) ceil(hypot(w->x2 - w->x1, w->y2 - w->y1) / (cell / 2));
+    int step;
+    for (step = 0; step <= steps; step++) {
+      localize_map_set(map, w->x1 + (w->x2 - w->x1) * step / steps - world->startX,
+                       w->y1 + (w->y2 - w->y1) * step / steps - world->startY);
+    }
+  }
+  localize_map_finish(map);
+  if ((localizer = localize_create(map, particles, localizeThreads, 1)) == NULL) {
+    fprintf(stderr, "Not enough memory for %d particles\n", particles);
+    exit(1);
+  }
+  localize_place(localizer, 0, 0, world->startHeading, 0.1, 0.1);
+  return localizer;
+}
+
+// Steer for the goal along the planner's path as rt_http's autonomy does:
+// wandering while there's no path, in case one turns up, and keeping still
+// while it's searching or once it's there
+void plan(const struct odometry* odometry, const struct world* world, struct planner* planner,
+          const struct costmap* costmap, struct autonomy* autonomy, uint64_t now, int range,
+          char** command, struct result* result) {
+  const struct pose* pose = &odometry->pose;
+  unsigned long searches = planner->searches, expansions = planner->expansions;
+  struct timespec planStart;
+  double bearing;
+
+  *command = "000000000";
+  if (!pose->headingKnown) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &planStart);
+  enum planner_status status = planner_steer(planner, costmap, pose->x, pose->y,
+                                             world->goalX - world->startX,
+                                             world->goalY - world->startY, &bearing);
+  int expanded = (int) (planner->expansions - expansions);
+  result->plans++;
+  result->searches += planner->searches - searches;
+  result->expansions += expanded;
+  result->planUsec += usec_since(&planStart);
+  result->maxExpansions = expanded > result->maxExpansions ? expanded : result->maxExpansions;
+
+  if (status == PLANNER_FOLLOWING) {
+    if (autonomy_steer(autonomy, now, range, pose->heading, bearing, command) == AUTONOMY_AVOID) {
+      result->avoids++;
+    }
+  } else if (status == PLANNER_NO_PATH) {
+    if (autonomy_step(autonomy, now, range, command) == AUTONOMY_AVOID) {
+      result->avoids++;
+    }
+  } else {
+    autonomy->step = -1;
+  }
+}
+
+double usec_since(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+// Write the part of a map that's been seen as a PGM image, north up: black is
+// occupied, white free and grey unknown. A comment gives where its south-west
+// corner is, for localize_map_load().
+int write_map(const struct map* map, const char* fileName) {
+  int minColumn = MAP_CELLS, maxColumn = -1, minRow = MAP_CELLS, maxRow = -1;
+  int column, row;
+
+  for (row = 0; row < MAP_CELLS; row++) {
+    for (column = 0; column < MAP_CELLS; column++) {
+      if (map_cell(map, column, row) != 0) {
+        minColumn = column < minColumn ? column : minColumn;
+        maxColumn = column > maxColumn ? column : maxColumn;
+        minRow = row < minRow ? row : minRow;
+        maxRow = row > maxRow ? row : maxRow;
+      }
+    }
+  }
+  if (maxColumn < 0) {
+    minColumn = maxColumn = minRow = maxRow = MAP_CELLS / 2;
+  }
+
+  FILE* f = fopen(fileName, "wb");
+  if (f == NULL) {
+    return 0;
+  }
+  fprintf(f, "P5\n# origin %.2f %.2f\n%d %d\n255\n", (minColumn - MAP_CELLS / 2) * MAP_CELL_CM / 100.0,
+          (minRow - MAP_CELLS / 2) * MAP_CELL_CM / 100.0, maxColumn - minColumn + 1, maxRow - minRow + 1);
+  for (row = maxRow; row >= minRow; row--) {
+    for (column = minColumn; column <= maxColumn; column++) {
+      fputc(128 - map_cell(map, column, row), f);
+    }
+  }
+  return fclose(f) == 0;
+}
+
+// Move the tank as the base opcode says for one frame. Like the real tank,
+// once it's reversing it carries on until told to go forward.
+void move_tank(struct tank* tank, int opCode, double dt) {
+  int base = opCode & ~DELTA_MASK;
+  double speed = 0;
+
+  if (base == FORWARD) {
+    tank->reversing = 0;
+    speed = FORWARD_SPEED;
+  } else if (base == REVERSE) {
+    tank->reversing = 1;
+  } else if (base == LEFT) {
+    tank->heading -= LEFT_RATE * dt;
+  } else if (base == RIGHT) {
+    tank->heading += RIGHT_RATE * dt;
+  }
+  if (tank->reversing) {
+    speed = -REVERSE_SPEED;
+  }
+  tank->heading = fmod(tank->heading + 2 * M_PI, 2 * M_PI);
+  tank->x += speed * sin(tank->heading) * dt;
+  tank->y += speed * cos(tank->heading) * dt;
+}
+
+// Whether the tank would overlap any wall with its centre at x, y
+int collides(const struct world* world, double x, double y) {
+  int i;
+  for (i = 0; i < world->numWalls; i++) {
+    const struct wall* w = &world->walls[i];
+    double dx = w->x2 - w->x1, dy = w->y2 - w->y1;
+    double lengthSquared = dx * dx + dy * dy;
+    double t = lengthSquared > 0 ? ((x - w->x1) * dx + (y - w->y1) * dy) / lengthSquared : 0;
+    t = t < 0 ? 0 : t > 1 ? 1 : t;
+    if (hypot(w->x1 + t * dx - x, w->y1 + t * dy - y) < TANK_RADIUS) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// What the SRF02 on the front of the tank would read, in cm: the nearest
+// thing anywhere in its cone
+int sonar_range(const struct world* world, const struct tank* tank) {
+  double frontX = tank->x + TANK_RADIUS * sin(tank->heading);
+  double frontY = tank->y + TANK_RADIUS * cos(tank->heading);
+  double nearest = INFINITY;
+  int i;
+
+  for (i = 0; i < SONAR_RAYS; i++) {
+    double angle = tank->heading - SONAR_HALF_ANGLE + 2 * SONAR_HALF_ANGLE * i / (SONAR_RAYS - 1);
+    double d = ray_distance(world, frontX, frontY, angle);
+    if (d < nearest) {
+      nearest = d;
+    }
+  }
+  int cm = (int) (nearest * 100);
+  if (cm > SONAR_MAX_CM) {
+    return 0;
+  }
+  return cm < SONAR_MIN_CM ? SONAR_MIN_CM : cm;
+}
+
+// Distance along a ray from x, y to the nearest wall it hits, or infinity
+double ray_distance(const struct world* world, double x, double y, double angle) {
+  double rx = sin(angle), ry = cos(angle);
+  double nearest = INFINITY;
+  int i;
+
+  for (i = 0; i < world->numWalls; i++) {
+    const struct wall* w = &world->walls[i];
+    double sx = w->x2 - w->x1, sy = w->y2 - w->y1;
+    double denominator = rx * sy - ry * sx;
+    if (fabs(denominator) < 1e-12) {
+      continue;
+    }
+    double t = ((w->x1 - x) * sy - (w->y1 - y) * sx) / denominator;   // Along the ray
+    double u = ((w->x1 - x) * ry - (w->y1 - y) * rx) / denominator;   // Along the wall
+    if (t >= 0 && u >= 0 && u <= 1 && t < nearest) {
+      nearest = t;
+    }
+  }
+  return nearest;
+}
+
+// Uniform random number in [min, max), from a xorshift64* generator, so that
+// scenarios come out the same on every machine
+double random_uniform(uint64_t* state, double min, double max) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return min + (max - min) * ((*state * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+// Normally distributed random number with mean 0, by Box-Muller. Without any
+// spread it doesn't use up any of the sequence.
+double random_gaussian(uint64_t* state, double sigma) {
+  if (sigma == 0) {
+    return 0;
+  }
+  double u = random_uniform(state, 0, 1);
+  double v = random_uniform(state, 0, 1);
+  return sigma * sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v);
+}
@@ -0,0 +1,813 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Telemetry log
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "telemetry.h"
+
+// As for log.c: enough rings for every thread, each enough for a couple of
+// drains' worth of frames. RING_SIZE must be a power of 2.
+#define MAX_THREADS 32
+#define RING_SIZE 256
+
+// How often the writer wakes up to drain the rings
+#define WRITER_PERIOD_USEC 100000
+
+// Gaps in a replay longer than this are skipped
+#define MAX_REPLAY_GAP_USEC 5000000
+
+// Columns of each type of record in a block
+#define NUM_COLUMNS 6                   // Time, flags, source, three values
+
+enum column_encoding {
+  COLUMN_CONSTANT,                      // One value for every record
+  COLUMN_DELTA,                         // Changes from the last value
+  COLUMN_DELTA_OF_DELTA,                // Changes in the change, for times
+};
+
+const char* const telemetry_type_names[NUM_TELEMETRY_TYPES] = {
+  "none", "range", "compass", "frame", "command"
+};
+const char* const telemetry_source_names[3] = {"user", "batch", "autonomy"};
+
+// Single producer, single consumer ring, as log.c's
+struct telemetry_ring {
+  struct telemetry_record records[RING_SIZE];
+  unsigned head;
+  char pad[60];
+  unsigned tail;
+};
+
+static struct telemetry_ring *rings[MAX_THREADS];
+static int numRings;
+static __thread struct telemetry_ring *myRing;
+static int running;
+static struct telemetry_stats stats;         // Updated atomically
+
+// Only touched by the writer thread
+static char *segmentDirectory;
+static struct telemetry_header *segment;    // Mapped, NULL if there isn't one
+static uint8_t *segmentBlocks;
+static uint32_t nextSegment;
+static struct telemetry_record batch[MAX_THREADS * RING_SIZE];
+static struct telemetry_record block[TELEMETRY_BLOCK_RECORDS];  // Being added to
+static int blockCount;
+static uint64_t encoded[TELEMETRY_MAX_BLOCK_BYTES / 8 + 1];
+static void (*blockHook)(const struct telemetry_header *segment,
+                         const struct telemetry_record *records, int count, void *arg);
+static void *blockHookArg;
+
+static struct telemetry_ring *claim_ring() {
+  int i = __atomic_fetch_add(&numRings, 1, __ATOMIC_RELAXED);
+  struct telemetry_ring *ring;
+
+  if (i >= MAX_THREADS || (ring = calloc(1, sizeof(*ring))) == NULL) {
+    return NULL;
+  }
+  __atomic_store_n(&rings[i], ring, __ATOMIC_RELEASE);
+  myRing = ring;
+  return ring;
+}
+
+void telemetry_record(enum telemetry_type type, int source, int flags,
+                      int32_t a, int32_t b, int32_t c) {
+  struct telemetry_ring *ring;
+  struct telemetry_record *record;
+  struct timespec now;
+  unsigned head;
+
+  if (!__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+    return;
+  }
+  if ((ring = myRing != NULL ? myRing : claim_ring()) == NULL) {
+    __atomic_fetch_add(&stats.dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+    __atomic_fetch_add(&stats.dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  record = &ring->records[head & (RING_SIZE - 1)];
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  record->usec = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  record->type = type;
+  record->source = source;
+  record->flags = flags;
+  record->values[0] = a;
+  record->values[1] = b;
+  record->values[2] = c;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t telemetry_command_bits(const char *command) {
+  uint32_t bits = 0;
+  int i;
+  for (i = 0; i < 10 && command[i] != '\0'; i++) {
+    bits |= (uint32_t) (command[i] == '1') << i;
+  }
+  return bits;
+}
+
+void telemetry_command_string(uint32_t bits, char *command) {
+  int i;
+  for (i = 0; i < 10; i++) {
+    command[i] = (bits >> i) & 1 ? '1' : '0';
+  }
+  command[10] = '\0';
+}
+
+
+// Writing
+
+void telemetry_segment_path(char *path, size_t size, const char *directory, uint32_t number) {
+  snprintf(path, size, "%s/telemetry-%06u.rtl", directory, number);
+}
+
+// The number of a segment file's name, or 0 if it isn't one
+static uint32_t segment_number(const char *name) {
+  unsigned number;
+  char end;
+  if (sscanf(name, "telemetry-%6u.rt%c", &number, &end) == 2 && end == 'l' &&
+      strlen(name) == strlen("telemetry-000000.rtl")) {
+    return number;
+  }
+  return 0;
+}
+
+// Finish the current segment and start the next, deleting the oldest if
+// there are too many. Returns 0 if it couldn't, and tries again next time.
+static int next_segment() {
+  char path[512];
+  struct telemetry_header *header = MAP_FAILED;
+  struct timespec realtime, monotonic;
+  int fd;
+
+  if (segment != NULL) {
+    msync(segment, TELEMETRY_SEGMENT_BYTES, MS_ASYNC);
+    munmap(segment, TELEMETRY_SEGMENT_BYTES);
+    segment = NULL;
+  }
+
+  telemetry_segment_path(path, sizeof(path), segmentDirectory, nextSegment);
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    return 0;
+  }
+  // Allocate all of it now, so a full SD card shows up here rather than as
+  // a SIGBUS when a page of it is first written
+  if (posix_fallocate(fd, 0, TELEMETRY_SEGMENT_BYTES) == 0) {
+    header = mmap(NULL, TELEMETRY_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (header == MAP_FAILED) {
+    unlink(path);
+    return 0;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &realtime);
+  clock_gettime(CLOCK_MONOTONIC, &monotonic);
+  memset(header, 0, sizeof(*header));
+  header->magic = TELEMETRY_MAGIC;
+  header->headerSize = sizeof(struct telemetry_header);
+  header->blockHeaderSize = sizeof(struct telemetry_block);
+  header->segment = nextSegment;
+  header->capacity = TELEMETRY_SEGMENT_BYTES - sizeof(struct telemetry_header);
+  header->realtimeOffsetUsec = ((int64_t) realtime.tv_sec - monotonic.tv_sec) * 1000000 +
+                               (realtime.tv_nsec - monotonic.tv_nsec) / 1000;
+  segment = header;
+  segmentBlocks = (uint8_t *) (header + 1);
+
+  if (nextSegment > TELEMETRY_MAX_SEGMENTS) {
+    telemetry_segment_path(path, sizeof(path), segmentDirectory,
+                           nextSegment - TELEMETRY_MAX_SEGMENTS);
+    unlink(path);
+  }
+  nextSegment++;
+  return 1;
+}
+
+static int compare_records(const void *a, const void *b) {
+  const struct telemetry_record *ra = a, *rb = b;
+  if (ra->usec != rb->usec) {
+    return ra->usec < rb->usec ? -1 : 1;
+  }
+  return ra < rb ? -1 : ra > rb;
+}
+
+// Write the block being added to at the end of the segment, as pending
+// unless it's finished, starting a new segment if it won't fit. Returns 0 if
+// there's no segment to write it to.
+static int write_block(int finished) {
+  size_t size = telemetry_encode_block(block, blockCount, encoded);
+  uint32_t seq;
+
+  if (segment == NULL || size > segment->capacity - segment->used) {
+    if (segment != NULL) {
+      seq = segment->pendingSeq;
+      __atomic_store_n(&segment->pendingSeq, seq + 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&segment->pending, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&segment->pendingSeq, seq + 2, __ATOMIC_RELEASE);
+    }
+    if (!next_segment()) {
+      return 0;
+    }
+  }
+
+  seq = segment->pendingSeq;
+  __atomic_store_n(&segment->pendingSeq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(segmentBlocks + segment->used, encoded, size);
+  if (finished) {
+    __atomic_store_n(&segment->pending, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&segment->used, segment->used + size, __ATOMIC_RELEASE);
+  } else {
+    __atomic_store_n(&segment->pending, size, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&segment->pendingSeq, seq + 2, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static void finish_block() {
+  if (write_block(1)) {
+    __atomic_fetch_add(&stats.written, blockCount, __ATOMIC_RELAXED);
+    if (blockHook != NULL) {
+      blockHook(segment, block, blockCount, blockHookArg);
+    }
+  } else {
+    __atomic_fetch_add(&stats.segmentFailures, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.dropped, blockCount, __ATOMIC_RELAXED);
+  }
+  blockCount = 0;
+}
+
+// Writer thread: drain every ring, sort what was in them, and add it to the
+// block, finishing that once it's full
+static void *writer_thread(void *arg) {
+  int i;
+  (void) arg;
+
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+  while (1) {
+    int count = __atomic_load_n(&numRings, __ATOMIC_RELAXED), numRecords = 0;
+    for (i = 0; i < count && i < MAX_THREADS; i++) {
+      struct telemetry_ring *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+      if (ring == NULL) {
+        continue;
+      }
+      unsigned tail = ring->tail;
+      unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      while (tail != head) {
+        batch[numRecords++] = ring->records[tail & (RING_SIZE - 1)];
+        tail++;
+      }
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    qsort(batch, numRecords, sizeof(batch[0]), compare_records);
+
+    for (i = 0; i < numRecords; i++) {
+      if (blockCount == TELEMETRY_BLOCK_RECORDS ||
+          (blockCount > 0 && batch[i].usec >= block[0].usec + TELEMETRY_BLOCK_USEC)) {
+        finish_block();
+      }
+      block[blockCount++] = batch[i];
+    }
+    // What there is of the next goes in too, in case we crash before it's done
+    if (numRecords > 0 && !write_block(0)) {
+      __atomic_fetch_add(&stats.segmentFailures, 1, __ATOMIC_RELAXED);
+    }
+    usleep(WRITER_PERIOD_USEC);
+  }
+  return NULL;
+}
+
+void telemetry_get_stats(struct telemetry_stats *s) {
+  s->written = __atomic_load_n(&stats.written, __ATOMIC_RELAXED);
+  s->dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+  s->segmentFailures = __atomic_load_n(&stats.segmentFailures, __ATOMIC_RELAXED);
+}
+
+void telemetry_set_block_hook(void (*hook)(const struct telemetry_header *segment,
+                                           const struct telemetry_record *records,
+                                           int count, void *arg), void *arg) {
+  blockHook = hook;
+  blockHookArg = arg;
+}
+
+int telemetry_start(const char *directory) {
+  DIR *dir;
+  struct dirent *entry;
+  pthread_t thread;
+
+  if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+    return 0;
+  }
+  if ((dir = opendir(directory)) == NULL) {
+    return 0;
+  }
+  nextSegment = 1;
+  while ((entry = readdir(dir)) != NULL) {
+    uint32_t number = segment_number(entry->d_name);
+    nextSegment = number >= nextSegment ? number + 1 : nextSegment;
+  }
+  closedir(dir);
+
+  segmentDirectory = strdup(directory);
+  if (!next_segment() || pthread_create(&thread, NULL, &writer_thread, NULL) != 0) {
+    return 0;
+  }
+  pthread_detach(thread);
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+
+// Encoding
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t) v | 0x80;
+    v >>= 7;
+  }
+  *p++ = (uint8_t) v;
+  return p;
+}
+
+// NULL if it runs past end
+static inline const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+  uint64_t result = 0;
+  int shift;
+  for (shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t b = *p++;
+    result |= (uint64_t) (b & 0x7f) << shift;
+    if (b < 0x80) {
+      *v = result;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+// Small changes either way to small numbers: 0, -1, 1, -2...
+static inline uint64_t zigzag(int64_t v) {
+  return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+static inline int64_t unzigzag(uint64_t v) {
+  return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+// A field of a record, times from the start of the block
+static int64_t field(const struct telemetry_record *record, int column, uint64_t base) {
+  switch (column) {
+    case 0: return (int64_t) (record->usec - base);
+    case 1: return record->flags;
+    case 2: return record->source;
+    default: return record->values[column - 3];
+  }
+}
+
+// One field of the records at positions, as an encoding then its values. The
+// first value is itself, and changes are zig-zagged varints, with a run of
+// no change as a 0 and the length of the run less 1.
+static uint8_t *encode_column(uint8_t *p, const struct telemetry_record *records,
+                              const uint16_t *positions, int n, int column, uint64_t base) {
+  int64_t first = field(&records[positions[0]], column, base), last = 0, lastDelta = 0;
+  int i, run = 0, constant = 1;
+
+  for (i = 1; i < n && constant; i++) {
+    constant = field(&records[positions[i]], column, base) == first;
+  }
+  if (constant) {
+    *p++ = COLUMN_CONSTANT;
+    return put_varint(p, zigzag(first));
+  }
+
+  *p++ = column == 0 ? COLUMN_DELTA_OF_DELTA : COLUMN_DELTA;
+  for (i = 0; i < n; i++) {
+    int64_t value = field(&records[positions[i]], column, base);
+    int64_t delta = value - last;
+    int64_t change = column == 0 ? delta - lastDelta : delta;
+    last = value;
+    lastDelta = i == 0 ? 0 : delta;
+    if (change == 0) {
+      run++;
+      continue;
+    }
+    if (run > 0) {
+      *p++ = 0;
+      p = put_varint(p, run - 1);
+      run = 0;
+    }
+    p = put_varint(p, zigzag(change));
+  }
+  if (run > 0) {
+    *p++ = 0;
+    p = put_varint(p, run - 1);
+  }
+  return p;
+}
+
+size_t telemetry_encode_block(const struct telemetry_record *records, int count, void *out) {
+  struct telemetry_block *header = out;
+  uint8_t *p = (uint8_t *) (header + 1);
+  uint16_t positions[TELEMETRY_BLOCK_RECORDS];
+  int starts[NUM_TELEMETRY_TYPES], filled[NUM_TELEMETRY_TYPES] = {0};
+  int i, j, type, column;
+  size_t size;
+
+  memset(header, 0, sizeof(*header));
+  header->magic = TELEMETRY_BLOCK_MAGIC;
+  header->count = count;
+  for (i = 0; i < count; i++) {
+    type = records[i].type < NUM_TELEMETRY_TYPES ? records[i].type : TELEMETRY_NONE;
+    header->typeCounts[type]++;
+    if (i == 0 || records[i].usec < header->firstUsec) {
+      header->firstUsec = records[i].usec;
+    }
+    if (i == 0 || records[i].usec > header->lastUsec) {
+      header->lastUsec = records[i].usec;
+    }
+  }
+
+  // The type of each record, as runs
+  for (i = 0; i < count; i = j) {
+    type = records[i].type < NUM_TELEMETRY_TYPES ? records[i].type : TELEMETRY_NONE;
+    for (j = i + 1; j < count && records[j].type == records[i].type; j++);
+    p = put_varint(p, type);
+    p = put_varint(p, j - i);
+  }
+
+  // Then the columns of each type
+  for (type = 0, i = 0; type < NUM_TELEMETRY_TYPES; type++) {
+    starts[type] = i;
+    i += header->typeCounts[type];
+  }
+  for (i = 0; i < count; i++) {
+    type = records[i].type < NUM_TELEMETRY_TYPES ? records[i].type : TELEMETRY_NONE;
+    positions[starts[type] + filled[type]++] = i;
+  }
+  for (type = 0; type < NUM_TELEMETRY_TYPES; type++) {
+    if (header->typeCounts[type] == 0) {
+      continue;
+    }
+    header->typeOffsets[type] = p - (uint8_t *) out;
+    for (column = 0; column < NUM_COLUMNS; column++) {
+      p = encode_column(p, records, positions + starts[type], header->typeCounts[type],
+                        column, header->firstUsec);
+    }
+  }
+
+  size = p - (uint8_t *) out;
+  while (size % 8 != 0) {
+    ((uint8_t *) out)[size++] = 0;
+  }
+  header->size = size;
+  return size;
+}
+
+// Decode a column into the records at positions. Returns where the next
+// column starts, or NULL if it's corrupt.
+static const uint8_t *decode_column(const uint8_t *p, const uint8_t *end,
+                                    struct telemetry_record *records, const uint16_t *positions,
+                                    int n, int column, uint64_t base) {
+  int64_t values[TELEMETRY_BLOCK_RECORDS];
+  int64_t last = 0, lastDelta = 0;
+  uint64_t v;
+  int i = 0, encoding;
+
+  if (p >= end) {
+    return NULL;
+  }
+  encoding = *p++;
+  if (encoding == COLUMN_CONSTANT) {
+    if ((p = get_varint(p, end, &v)) == NULL) {
+      return NULL;
+    }
+    for (i = 0; i < n; i++) {
+      values[i] = unzigzag(v);
+    }
+  } else if (encoding == COLUMN_DELTA || encoding == COLUMN_DELTA_OF_DELTA) {
+    int ofDelta = encoding == COLUMN_DELTA_OF_DELTA;
+    while (i < n) {
+      int64_t change = 0;
+      uint64_t run = 1;
+      if (p < end && *p < 0x80) {
+        v = *p++;
+      } else if ((p = get_varint(p, end, &v)) == NULL) {
+        return NULL;
+      }
+      if (v == 0) {
+        if ((p = get_varint(p, end, &run)) == NULL || run >= (uint64_t) (n - i)) {
+          return NULL;
+        }
+        run++;
+      } else {
+        change = unzigzag(v);
+      }
+      for (; run > 0; run--, i++) {
+        int64_t delta = ofDelta ? change + lastDelta : change;
+        last += delta;
+        lastDelta = i == 0 ? 0 : delta;
+        values[i] = last;
+      }
+    }
+  } else {
+    return NULL;
+  }
+
+  switch (column) {
+    case 0:
+      for (i = 0; i < n; i++) records[positions[i]].usec = base + (uint64_t) values[i];
+      break;
+    case 1:
+      for (i = 0; i < n; i++) records[positions[i]].flags = (uint16_t) values[i];
+      break;
+    case 2:
+      for (i = 0; i < n; i++) records[positions[i]].source = (uint8_t) values[i];
+      break;
+    default:
+      for (i = 0; i < n; i++) records[positions[i]].values[column - 3] = (int32_t) values[i];
+  }
+  return p;
+}
+
+int telemetry_decode_block(const struct telemetry_block *block, unsigned types,
+                           struct telemetry_record *records) {
+  const uint8_t *start = (const uint8_t *) block, *end = start + block->size;
+  const uint8_t *p = (const uint8_t *) (block + 1);
+  uint16_t positions[TELEMETRY_BLOCK_RECORDS];
+  int starts[NUM_TELEMETRY_TYPES], filled[NUM_TELEMETRY_TYPES] = {0};
+  int i, type, column, total = 0, n = 0;
+
+  if (block->count > TELEMETRY_BLOCK_RECORDS) {
+    return -1;
+  }
+  for (type = 0; type < NUM_TELEMETRY_TYPES; type++) {
+    total += block->typeCounts[type];
+  }
+  if (total != block->count) {
+    return -1;
+  }
+
+  // Where the wanted types' records go, from the runs
+  for (type = 0, i = 0; type < NUM_TELEMETRY_TYPES; type++) {
+    starts[type] = i;
+    i += types & (1u << type) ? block->typeCounts[type] : 0;
+  }
+  for (total = 0; total < block->count; ) {
+    uint64_t t, length;
+    if ((p = get_varint(p, end, &t)) == NULL || (p = get_varint(p, end, &length)) == NULL ||
+        t >= NUM_TELEMETRY_TYPES || length == 0 ||
+        length > (uint64_t) (block->typeCounts[t] - filled[t])) {
+      return -1;
+    }
+    type = t;
+    total += length;
+    if (!(types & (1u << type))) {
+      filled[type] += length;
+      continue;
+    }
+    for (; length > 0; length--) {
+      positions[starts[type] + filled[type]++] = n;
+      records[n].type = type;
+      records[n].source = 0;
+      records[n].flags = 0;
+      n++;
+    }
+  }
+
+  // Then fill in the rest of them from their columns
+  for (type = 0; type < NUM_TELEMETRY_TYPES; type++) {
+    if (!(types & (1u << type)) || block->typeCounts[type] == 0) {
+      continue;
+    }
+    if (block->typeOffsets[type] < sizeof(*block) || block->typeOffsets[type] >= block->size) {
+      return -1;
+    }
+    p = start + block->typeOffsets[type];
+    for (column = 0; column < NUM_COLUMNS && p != NULL; column++) {
+      p = decode_column(p, end, records, positions + starts[type], block->typeCounts[type],
+                        column, block->firstUsec);
+    }
+    if (p == NULL) {
+      return -1;
+    }
+  }
+  return n;
+}
+
+
+// Reading
+
+int telemetry_open(struct telemetry_segment *s, const char *path) {
+  struct stat st;
+  void *mapped = MAP_FAILED;
+  size_t capacity;
+  int fd, tries;
+
+  memset(s, 0, sizeof(*s));
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return 0;
+  }
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct telemetry_header)) {
+    mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return 0;
+  }
+  s->header = mapped;
+  s->blocks = (const uint8_t *) (s->header + 1);
+  s->size = st.st_size;
+  if (s->header->magic != TELEMETRY_MAGIC ||
+      s->header->headerSize != sizeof(struct telemetry_header) ||
+      s->header->blockHeaderSize != sizeof(struct telemetry_block)) {
+    telemetry_close(s);
+    return 0;
+  }
+
+  // Trust the sizes only as far as the file goes. The pending block is being
+  // rewritten while the writer is running, so copy it under the sequence
+  // lock, and if it's changing every time, leave it out.
+  capacity = s->size - sizeof(struct telemetry_header);
+  for (tries = 0; tries < 3; tries++) {
+    uint32_t seq = __atomic_load_n(&s->header->pendingSeq, __ATOMIC_ACQUIRE);
+    uint64_t used = __atomic_load_n(&s->header->used, __ATOMIC_ACQUIRE);
+    size_t pending = __atomic_load_n(&s->header->pending, __ATOMIC_RELAXED);
+    s->used = used < capacity ? used : capacity;
+    free(s->pending);
+    s->pending = NULL;
+    if (seq % 2 != 0) {
+      continue;
+    }
+    if (pending >= sizeof(struct telemetry_block) && pending <= capacity - s->used &&
+        (s->pending = malloc(pending)) != NULL) {
+      memcpy(s->pending, s->blocks + s->used, pending);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->header->pendingSeq, __ATOMIC_RELAXED) == seq) {
+      if (s->pending != NULL && s->pending->size != pending) {
+        free(s->pending);
+        s->pending = NULL;
+      }
+      return 1;
+    }
+  }
+  free(s->pending);
+  s->pending = NULL;
+  s->used = __atomic_load_n(&s->header->used, __ATOMIC_ACQUIRE);
+  s->used = s->used < capacity ? s->used : capacity;
+  return 1;
+}
+
+void telemetry_close(struct telemetry_segment *s) {
+  if (s->header != NULL) {
+    munmap((void *) s->header, s->size);
+  }
+  free(s->pending);
+  memset(s, 0, sizeof(*s));
+}
+
+const struct telemetry_block *telemetry_next_block(const struct telemetry_segment *s,
+                                                   size_t *offset) {
+  const struct telemetry_block *block;
+  size_t limit;
+
+  if (*offset < s->used) {
+    block = (const struct telemetry_block *) (s->blocks + *offset);
+    limit = s->used - *offset;
+  } else if (*offset == s->used && s->pending != NULL) {
+    block = s->pending;
+    limit = s->pending->size;
+  } else {
+    return NULL;
+  }
+  if (limit < sizeof(*block) || block->magic != TELEMETRY_BLOCK_MAGIC ||
+      block->size < sizeof(*block) || block->size > limit || block->size % 8 != 0) {
+    return NULL;
+  }
+  *offset += block->size;
+  return block;
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+int telemetry_find_segments(const char *path, char ***paths) {
+  struct stat st;
+  DIR *dir;
+  struct dirent *entry;
+  int numPaths = 0, size = 16;
+
+  if (stat(path, &st) != 0) {
+    return -1;
+  }
+  *paths = malloc(size * sizeof(char *));
+  if (!S_ISDIR(st.st_mode)) {
+    (*paths)[numPaths++] = strdup(path);
+    return numPaths;
+  }
+  if ((dir = opendir(path)) == NULL) {
+    free(*paths);
+    return -1;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (segment_number(entry->d_name) == 0) {
+      continue;
+    }
+    if (numPaths == size) {
+      size *= 2;
+      *paths = realloc(*paths, size * sizeof(char *));
+    }
+    (*paths)[numPaths] = malloc(strlen(path) + strlen(entry->d_name) + 2);
+    sprintf((*paths)[numPaths++], "%s/%s", path, entry->d_name);
+  }
+  closedir(dir);
+  // Numbers are zero padded, so sorting the names sorts them
+  qsort(*paths, numPaths, sizeof(char *), compare_paths);
+  return numPaths;
+}
+
+void telemetry_free_paths(char **paths, int numPaths) {
+  int i;
+  for (i = 0; i < numPaths; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+static uint64_t monotonic_usec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+long telemetry_replay(char **paths, int numPaths, double speed,
+                      int (*callback)(const struct telemetry_record *record, void *arg), void *arg) {
+  struct telemetry_record *records = malloc(TELEMETRY_BLOCK_RECORDS * sizeof(*records));
+  uint64_t recordedBase = 0, replayBase = 0, lastUsec = 0;
+  long replayed = 0;
+  int i, j, n, started = 0, stop = 0;
+
+  if (records == NULL) {
+    return -1;
+  }
+  for (i = 0; i < numPaths && !stop; i++) {
+    const struct telemetry_block *block;
+    struct telemetry_segment s;
+    size_t offset = 0;
+
+    if (!telemetry_open(&s, paths[i])) {
+      replayed = -1;
+      break;
+    }
+    while (!stop && (block = telemetry_next_block(&s, &offset)) != NULL) {
+      if ((n = telemetry_decode_block(block, ~0u, records)) < 0) {
+        replayed = -1;
+        stop = 1;
+      }
+      for (j = 0; j < n && !stop; j++) {
+        const struct telemetry_record *record = &records[j];
+        if (speed > 0) {
+          // Start the clock again after a gap, or the clock going backwards
+          // between runs
+          if (!started || record->usec + MAX_REPLAY_GAP_USEC < lastUsec ||
+              record->usec > lastUsec + MAX_REPLAY_GAP_USEC) {
+            recordedBase = record->usec;
+            replayBase = monotonic_usec();
+            started = 1;
+          }
+          if (record->usec > recordedBase) {
+            uint64_t due = replayBase + (uint64_t) ((record->usec - recordedBase) / speed);
+            uint64_t now = monotonic_usec();
+            if (due > now) {
+              usleep(due - now);
+            }
+          }
+          lastUsec = record->usec > lastUsec || record->usec + MAX_REPLAY_GAP_USEC < lastUsec ?
+                     record->usec : lastUsec;
+        }
+        replayed++;
+        stop = callback(record, arg) != 0;
+      }
+    }
+    telemetry_close(&s);
+  }
+  free(records);
+  return replayed;
+}
@@ -0,0 +1,199 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Telemetry log
+//
+// Every sensor sample, every frame the transmitter sends and every command
+// it's given is a record with a CLOCK_MONOTONIC timestamp, and goes into an
+// append-only binary log of compressed blocks of them, described below, so a
+// run can be looked at afterwards or played back through rt_http ("rt_http
+// -r") to reproduce what happened in the field.
+//
+// Like log_msg(), telemetry_record() never blocks: it copies the record into
+// a ring belonging to the calling thread and returns. A low priority writer
+// thread drains the rings, puts what it found in time order and adds it to
+// the current segment file, which is allocated in full when it's made and
+// mapped into memory, so writing is a memcpy and the kernel does the rest. A
+// full segment is followed by a new one, and the oldest are deleted to keep
+// at most TELEMETRY_MAX_SEGMENTS.
+//
+// Segments hold compressed blocks of up to TELEMETRY_BLOCK_RECORDS records or
+// TELEMETRY_BLOCK_USEC of them, each of which can be decoded on its own. In a
+// block, each type of record has its own columns, one for each field, since
+// a field of one type changes little from one record to the next: the frame
+// sent is mostly the same as the last, and the range a few cm different.
+// Times are stored as the change in the interval between records, which for
+// frames is only the jitter, and other fields as the change from the last
+// record's, both zig-zag encoded so small changes either way are small, as
+// varints, with runs of no change as a count. A column that doesn't change
+// at all in the block is stored once. Which type each record was, in order,
+// is a column of runs. This makes records about a tenth the size, and the
+// block headers say where each type's columns start, so that a reader can
+// skip blocks by time, or skip decoding the types it doesn't want.
+//
+// The writer adds to the block at the end of the segment every drain, and
+// the block is only counted as part of the segment once it's finished, so a
+// segment can be read while it's being written. Until then it's marked as
+// pending under a sequence lock, so that after a crash, or by a reader that
+// catches it between drains, it can still be read.
+//
+// Each drain is sorted, but a record a thread was in the middle of adding
+// during one can come out after later ones in the next, so readers shouldn't
+// count on strict order.
+//
+// A segment can have a companion file of summaries of its sensor samples
+// beside it, written and read by history.c.
+//
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TELEMETRY_MAGIC 0x52544c32            // "RTL2"
+#define TELEMETRY_BLOCK_MAGIC 0x4b4c4254      // "TBLK"
+#define TELEMETRY_SEGMENT_BYTES (1 << 20)     // A few hours
+#define TELEMETRY_MAX_SEGMENTS 64
+#define TELEMETRY_BLOCK_RECORDS 4096          // In a block, at most
+#define TELEMETRY_BLOCK_USEC 10000000         // Of records in a block, at most
+
+enum telemetry_type {
+  TELEMETRY_NONE,
+  TELEMETRY_RANGE,                // values: range (cm)
+  TELEMETRY_COMPASS,              // values: bearing (tenths of a degree), pitch, roll
+  TELEMETRY_FRAME,                // values: opcode sent
+  TELEMETRY_COMMAND,              // values: command bits, then for user commands
+                                  // the session and sequence number, for batch
+                                  // steps the frames and step number
+  NUM_TELEMETRY_TYPES
+};
+
+// Where a command came from
+enum telemetry_source {
+  TELEMETRY_USER,                 // ?set
+  TELEMETRY_BATCH,                // A step of a ?batch, when it starts
+  TELEMETRY_AUTONOMY,             // When it changes
+};
+
+#define TELEMETRY_FAILED 1        // Flag on a sensor sample that couldn't be read
+
+struct telemetry_record {
+  uint64_t usec;                  // CLOCK_MONOTONIC
+  uint8_t type;                   // enum telemetry_type
+  uint8_t source;                 // enum telemetry_source, for commands
+  uint16_t flags;
+  int32_t values[3];
+};
+
+// At the start of each segment file, followed by its blocks
+struct telemetry_header {
+  uint32_t magic;                 // TELEMETRY_MAGIC
+  uint16_t headerSize;            // sizeof(struct telemetry_header)
+  uint16_t blockHeaderSize;       // sizeof(struct telemetry_block)
+  uint32_t segment;               // Number, also in the file name
+  uint32_t capacity;              // Bytes there's room for after the header
+  uint64_t used;                  // Bytes of finished blocks
+  int64_t realtimeOffsetUsec;     // CLOCK_REALTIME less CLOCK_MONOTONIC, at the start
+  uint32_t pending;               // Bytes of the block after them that's still
+                                  // being added to, or 0
+  uint32_t pendingSeq;            // Odd while that's being written
+  uint8_t reserved[24];
+};
+
+// At the start of each block, followed by the type of each record as runs of
+// (type, number of records) varints, then each type's columns: time, flags,
+// source, then the values. Blocks are a multiple of 8 bytes.
+struct telemetry_block {
+  uint32_t magic;                 // TELEMETRY_BLOCK_MAGIC
+  uint32_t size;                  // Bytes, with this header, to the next block
+  uint64_t firstUsec, lastUsec;   // Earliest and latest of its records
+  uint16_t count;                 // Records
+  uint16_t typeCounts[NUM_TELEMETRY_TYPES];
+  uint32_t typeOffsets[NUM_TELEMETRY_TYPES];  // From the start of the block, 0 if none
+};
+
+// Most a block of TELEMETRY_BLOCK_RECORDS can take, if nothing compresses
+#define TELEMETRY_MAX_BLOCK_BYTES (sizeof(struct telemetry_block) + \
+                                   TELEMETRY_BLOCK_RECORDS * 40 + NUM_TELEMETRY_TYPES * 64)
+
+extern const char* const telemetry_type_names[NUM_TELEMETRY_TYPES];
+extern const char* const telemetry_source_names[3];
+
+// Start logging to segments in directory, making it if need be, after any
+// segments already there. Returns 1 if it could; until then, and if it
+// couldn't, records are thrown away.
+int telemetry_start(const char *directory);
+
+// Have the writer thread call hook with the records of each block once it's
+// finished and written, and the header of the segment it went into. Set it
+// before telemetry_start(). It holds up the writer, so mustn't take long.
+void telemetry_set_block_hook(void (*hook)(const struct telemetry_header *segment,
+                                           const struct telemetry_record *records,
+                                           int count, void *arg), void *arg);
+
+// Add a record from any thread, timestamped now
+void telemetry_record(enum telemetry_type type, int source, int flags,
+                      int32_t a, int32_t b, int32_t c);
+
+// Totals since it started. This has no metrics of its own, so that tools
+// can read logs without the rest of rt_http; rt_http passes these on.
+struct telemetry_stats {
+  unsigned long written;
+  unsigned long dropped;          // Because a ring was full, or a segment couldn't be made
+  unsigned long segmentFailures;  // Times a segment couldn't be made
+};
+void telemetry_get_stats(struct telemetry_stats *stats);
+
+// Commands are 10 characters of '0' and '1', kept as 10 bits, first
+// character lowest. command must have room for 11.
+uint32_t telemetry_command_bits(const char *command);
+void telemetry_command_string(uint32_t bits, char *command);
+
+// A segment mapped read-only, as far as it had been written when opened
+struct telemetry_segment {
+  const struct telemetry_header *header;
+  const uint8_t *blocks;          // Finished ones
+  size_t used;                    // Bytes of them
+  struct telemetry_block *pending;  // Copy of the block still being added to, or NULL
+  size_t size;
+};
+
+// Map a segment file. Returns 1 if it's a segment.
+int telemetry_open(struct telemetry_segment *segment, const char *path);
+void telemetry_close(struct telemetry_segment *segment);
+
+// Step through a segment's blocks, from an offset of 0. Returns the block at
+// offset and moves offset on to the next, or NULL after the last, or if
+// what's at offset isn't one.
+const struct telemetry_block *telemetry_next_block(const struct telemetry_segment *segment,
+                                                   size_t *offset);
+
+// Decode the records of a block whose type has its bit set in types (~0u for
+// all) into records, which needs room for block->count, in the order they
+// were written. Returns the number decoded, or -1 if the block is corrupt.
+int telemetry_decode_block(const struct telemetry_block *block, unsigned types,
+                           struct telemetry_record *records);
+
+// Encode up to TELEMETRY_BLOCK_RECORDS records into a block at out, which
+// needs room for TELEMETRY_MAX_BLOCK_BYTES and to be 8 byte aligned. Returns
+// its size.
+size_t telemetry_encode_block(const struct telemetry_record *records, int count, void *out);
+
+// The path of a directory's segment with the given number
+void telemetry_segment_path(char *path, size_t size, const char *directory, uint32_t number);
+
+// The segment files in a directory, oldest first, or just path if it's a
+// file. Returns how many, and sets paths to an array of them to be freed
+// with telemetry_free_paths(), or -1 if path can't be read.
+int telemetry_find_segments(const char *path, char ***paths);
+void telemetry_free_paths(char **paths, int numPaths);
+
+// Call callback with every record in the segments, in order. With speed
+// above 0 they come at that many times the rate they were recorded (gaps of
+// more than a few seconds, such as between runs, are skipped), otherwise as
+// fast as they can be read. Stops early if callback returns non-zero.
+// Returns the number of records, or -1 if a segment couldn't be read.
+long telemetry_replay(char **paths, int numPaths, double speed,
+                      int (*callback)(const struct telemetry_record *record, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,112 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Span tracing
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mongoose.h"
+#include "trace.h"
+
+// Enough for the transmitter, sensor and autonomy threads plus all of
+// mongoose's workers. Threads beyond this aren't traced.
+#define MAX_THREADS 32
+
+// Spans kept per thread. Must be a power of 2. At 50 frames a second this
+// is 20 seconds of transmitter history.
+#define SPANS_PER_THREAD 1024
+
+// When dumping, skip this many of the oldest spans, which the owning thread
+// may be overwriting while we read them.
+#define UNSAFE_SPANS 64
+
+struct span {
+  const char *name;
+  uint64_t start;           // ns, CLOCK_MONOTONIC
+  uint64_t duration;         // ns
+  long arg;
+};
+
+struct trace_ring {
+  struct span spans[SPANS_PER_THREAD];
+  unsigned head;            // Only written by the owning thread
+  char name[16];
+};
+
+static struct trace_ring *rings[MAX_THREADS];
+static int numRings;
+static __thread struct trace_ring *myRing;
+static __thread int myRingClaimed;
+
+// Claim a ring for the calling thread. This allocates, but only once per
+// thread, the first time it records anything.
+static struct trace_ring *claim_ring(const char *name) {
+  int i = __atomic_fetch_add(&numRings, 1, __ATOMIC_RELAXED);
+  struct trace_ring *ring = NULL;
+
+  myRingClaimed = 1;
+  if (i < MAX_THREADS && (ring = calloc(1, sizeof(*ring))) != NULL) {
+    strncpy(ring->name, name, sizeof(ring->name) - 1);
+    __atomic_store_n(&rings[i], ring, __ATOMIC_RELEASE);
+  }
+  myRing = ring;
+  return ring;
+}
+
+void trace_thread_init(const char *name) {
+  if (!myRingClaimed) {
+    claim_ring(name);
+  }
+}
+
+uint64_t trace_begin(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_end(const char *name, uint64_t start, long arg) {
+  struct trace_ring *ring = myRingClaimed ? myRing : claim_ring("http");
+  struct span *span;
+  uint64_t end = trace_begin();
+
+  if (ring == NULL) {
+    return;
+  }
+  span = &ring->spans[ring->head & (SPANS_PER_THREAD - 1)];
+  span->name = name;
+  span->start = start;
+  span->duration = end - start;
+  span->arg = arg;
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_write_json(struct mg_connection *conn) {
+  int i, first = 1;
+  int count = __atomic_load_n(&numRings, __ATOMIC_RELAXED);
+
+  mg_printf(conn, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (i = 0; i < count && i < MAX_THREADS; i++) {
+    struct trace_ring *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+    unsigned head, n;
+    if (ring == NULL) {
+      continue;
+    }
+    mg_printf(conn, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+              "\"args\":{\"name\":\"%s\"}}", first ? "" : ",", i, ring->name);
+    first = 0;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    n = head < SPANS_PER_THREAD - UNSAFE_SPANS ? head : SPANS_PER_THREAD - UNSAFE_SPANS;
+    for (; n > 0; n--) {
+      const struct span *span = &ring->spans[(head - n) & (SPANS_PER_THREAD - 1)];
+      mg_printf(conn, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"args\":{\"arg\":%ld}}",
+                span->name, i,
+                (unsigned long long) (span->start / 1000), (unsigned) (span->start % 1000),
+                (unsigned long long) (span->duration / 1000), (unsigned) (span->duration % 1000), span->arg);
+    }
+  }
+  mg_printf(conn, "\n]}\n");
+}
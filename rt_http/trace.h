@@ -0,0 +1,38 @@
+//
+// Raspberry Tank HTTP Remote Control script
+// Span tracing
+//
+// Each thread records spans (a name, start time and duration in nanoseconds,
+// and one number of context) into its own ring of recent spans, with no
+// locking. trace_write_json() dumps every thread's recent spans in Chrome's
+// trace event format, which chrome://tracing or Perfetto can show as a
+// timeline. The rt_http server does this at /trace.
+//
+//   uint64_t start = trace_begin();
+//   ...
+//   trace_end("sendOpCode", start, code);
+//
+// Span names must be string literals, since only their address is kept.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+struct mg_connection;
+
+// Name the calling thread in traces. Threads that don't call this are named
+// "http", which is what they will be: mongoose's workers.
+void trace_thread_init(const char *name);
+
+// Current time in nanoseconds, to pass to trace_end()
+uint64_t trace_begin(void);
+
+// Record a span from start until now
+void trace_end(const char *name, uint64_t start, long arg);
+
+// Write all threads' recent spans to an HTTP connection as trace event JSON
+void trace_write_json(struct mg_connection *conn);
+
+#endif
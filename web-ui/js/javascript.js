@@ -22,10 +22,19 @@ var CONTROL_PORT = 3000;
 // Port on which the mjpg-streamer webcam server runs
 var WEBCAM_PORT = 8080;
 
+// Every command carries this page's session ID and a sequence number, so that
+// if the requests arrive out of order the tank ignores the older ones.
+var sessionID = Math.floor(Math.random() * 4294967295) + 1;
+var sequenceNumber = 0;
+
 // Executes on page load.
 function load() {
   createImageLayer();
   setInterval(updateSensorData, 1000);
+  if (document.getElementById('history') != null) {
+    updateHistory();
+    setInterval(updateHistory, 5000);
+  }
 }
 
 // Sets a command to either true or false by name, e.g. to go forwards use
@@ -65,7 +74,9 @@ function send() {
   for (var name in command) {
     commandBits = commandBits + (command[name] ? "1" : "0");
   }
-  $.get(window.location.protocol+'//'+window.location.host + ':' + CONTROL_PORT + "?set" + commandBits);
+  sequenceNumber++;
+  $.get(window.location.protocol+'//'+window.location.hostname + ':' + CONTROL_PORT + "?set" + commandBits
+        + "&sid=" + sessionID + "&seq=" + sequenceNumber);
 }
 
 // Gets the sensor data
@@ -80,6 +91,44 @@ function updateSensorData() {
   }, "html");
 }
 
+// Draws the range readings so far this session on the history canvas, as a
+// band from the lowest to the highest reading in each pixel with the mean
+// through it. The tank summarises them to the canvas's width itself.
+function updateHistory() {
+  var canvas = document.getElementById('history');
+  $.getJSON(window.location.protocol+'//'+window.location.hostname + ':' + CONTROL_PORT
+            + "?history=range&width=" + canvas.width, function(data) {
+    var ctx = canvas.getContext('2d');
+    var span = Math.max(data.to - data.from, 0.001);
+    var top = 100;
+    for (var i = 0; i < data.points.length; i++) {
+      top = Math.max(top, data.points[i][2]);
+    }
+    var x = function(t) { return (t - data.from) / span * canvas.width; };
+    var y = function(v) { return canvas.height - v / top * canvas.height; };
+
+    ctx.clearRect(0, 0, canvas.width, canvas.height);
+    ctx.fillStyle = '#9cf';
+    for (var i = 0; i < data.points.length; i++) {
+      var p = data.points[i];
+      ctx.fillRect(Math.floor(x(p[0])), y(p[2]), 1, Math.max(y(p[1]) - y(p[2]), 1));
+    }
+    ctx.strokeStyle = '#036';
+    ctx.beginPath();
+    for (var i = 0; i < data.points.length; i++) {
+      var p = data.points[i];
+      if (i == 0) {
+        ctx.moveTo(x(p[0]), y(p[3]));
+      } else {
+        ctx.lineTo(x(p[0]), y(p[3]));
+      }
+    }
+    ctx.stroke();
+    ctx.fillStyle = '#000';
+    ctx.fillText("Range (cm), last " + Math.round(span / 60) + " min, max " + top, 4, 12);
+  });
+}
+
 // FPS mode key input
 function keydown(e) {
   keychanged(e, true);
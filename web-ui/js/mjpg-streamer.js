@@ -11,7 +11,7 @@ function createImageLayer() {
   img.style.position = "absolute";
   img.style.zIndex = -1;
   img.onload = imageOnload;
-  img.src = window.location.protocol+'//'+window.location.host + ':' + WEBCAM_PORT + "/?action=snapshot&n=" + (++imageNr);
+  img.src = window.location.protocol+'//'+window.location.hostname + ':' + WEBCAM_PORT + "/?action=snapshot&n=" + (++imageNr);
   var webcam = document.getElementById("webcam");
   webcam.insertBefore(img, webcam.firstChild);
 }